@@ -0,0 +1,1507 @@
+#include "cpusim.h"
+#include "parallel.h"
+#include "util.h"
+#include <string.h>
+#include <assert.h>
+#include <float.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__AVX2__)
+#define CPUSIM_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPUSIM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(CPUSIM_AVX2) || defined(CPUSIM_SSE2)
+#include <xmmintrin.h> // _mm_malloc
+#define cpusim_aligned_alloc(sz) _mm_malloc((sz), 64)
+#define cpusim_aligned_free(p) _mm_free(p)
+#else
+#include <stdlib.h>
+#define cpusim_aligned_alloc(sz) malloc(sz)
+#define cpusim_aligned_free(p) free(p)
+#endif
+
+using namespace math;
+
+static const int kBlocksPerTask = 64; // 512 particles per parallel_for range
+
+static const int kCompactRange = 1024; // blocks per compaction range
+
+static const int kSortRange = 4096; // particles per radix sort range
+
+static int popcount8( int x )
+{
+    x = x - ( ( x >> 1 ) & 0x55 );
+    x = ( x & 0x33 ) + ( ( x >> 2 ) & 0x33 );
+    return ( x + ( x >> 4 ) ) & 0x0f;
+}
+
+// For each 8-lane mask, the indices of the set lanes, 4 bits each, packed
+// to the bottom.
+static const unsigned kLaneTable[256] = {
+    0x00000000, 0x00000000, 0x00000001, 0x00000010, 0x00000002, 0x00000020, 0x00000021, 0x00000210,
+    0x00000003, 0x00000030, 0x00000031, 0x00000310, 0x00000032, 0x00000320, 0x00000321, 0x00003210,
+    0x00000004, 0x00000040, 0x00000041, 0x00000410, 0x00000042, 0x00000420, 0x00000421, 0x00004210,
+    0x00000043, 0x00000430, 0x00000431, 0x00004310, 0x00000432, 0x00004320, 0x00004321, 0x00043210,
+    0x00000005, 0x00000050, 0x00000051, 0x00000510, 0x00000052, 0x00000520, 0x00000521, 0x00005210,
+    0x00000053, 0x00000530, 0x00000531, 0x00005310, 0x00000532, 0x00005320, 0x00005321, 0x00053210,
+    0x00000054, 0x00000540, 0x00000541, 0x00005410, 0x00000542, 0x00005420, 0x00005421, 0x00054210,
+    0x00000543, 0x00005430, 0x00005431, 0x00054310, 0x00005432, 0x00054320, 0x00054321, 0x00543210,
+    0x00000006, 0x00000060, 0x00000061, 0x00000610, 0x00000062, 0x00000620, 0x00000621, 0x00006210,
+    0x00000063, 0x00000630, 0x00000631, 0x00006310, 0x00000632, 0x00006320, 0x00006321, 0x00063210,
+    0x00000064, 0x00000640, 0x00000641, 0x00006410, 0x00000642, 0x00006420, 0x00006421, 0x00064210,
+    0x00000643, 0x00006430, 0x00006431, 0x00064310, 0x00006432, 0x00064320, 0x00064321, 0x00643210,
+    0x00000065, 0x00000650, 0x00000651, 0x00006510, 0x00000652, 0x00006520, 0x00006521, 0x00065210,
+    0x00000653, 0x00006530, 0x00006531, 0x00065310, 0x00006532, 0x00065320, 0x00065321, 0x00653210,
+    0x00000654, 0x00006540, 0x00006541, 0x00065410, 0x00006542, 0x00065420, 0x00065421, 0x00654210,
+    0x00006543, 0x00065430, 0x00065431, 0x00654310, 0x00065432, 0x00654320, 0x00654321, 0x06543210,
+    0x00000007, 0x00000070, 0x00000071, 0x00000710, 0x00000072, 0x00000720, 0x00000721, 0x00007210,
+    0x00000073, 0x00000730, 0x00000731, 0x00007310, 0x00000732, 0x00007320, 0x00007321, 0x00073210,
+    0x00000074, 0x00000740, 0x00000741, 0x00007410, 0x00000742, 0x00007420, 0x00007421, 0x00074210,
+    0x00000743, 0x00007430, 0x00007431, 0x00074310, 0x00007432, 0x00074320, 0x00074321, 0x00743210,
+    0x00000075, 0x00000750, 0x00000751, 0x00007510, 0x00000752, 0x00007520, 0x00007521, 0x00075210,
+    0x00000753, 0x00007530, 0x00007531, 0x00075310, 0x00007532, 0x00075320, 0x00075321, 0x00753210,
+    0x00000754, 0x00007540, 0x00007541, 0x00075410, 0x00007542, 0x00075420, 0x00075421, 0x00754210,
+    0x00007543, 0x00075430, 0x00075431, 0x00754310, 0x00075432, 0x00754320, 0x00754321, 0x07543210,
+    0x00000076, 0x00000760, 0x00000761, 0x00007610, 0x00000762, 0x00007620, 0x00007621, 0x00076210,
+    0x00000763, 0x00007630, 0x00007631, 0x00076310, 0x00007632, 0x00076320, 0x00076321, 0x00763210,
+    0x00000764, 0x00007640, 0x00007641, 0x00076410, 0x00007642, 0x00076420, 0x00076421, 0x00764210,
+    0x00007643, 0x00076430, 0x00076431, 0x00764310, 0x00076432, 0x00764320, 0x00764321, 0x07643210,
+    0x00000765, 0x00007650, 0x00007651, 0x00076510, 0x00007652, 0x00076520, 0x00076521, 0x00765210,
+    0x00007653, 0x00076530, 0x00076531, 0x00765310, 0x00076532, 0x00765320, 0x00765321, 0x07653210,
+    0x00007654, 0x00076540, 0x00076541, 0x00765410, 0x00076542, 0x00765420, 0x00765421, 0x07654210,
+    0x00076543, 0x00765430, 0x00765431, 0x07654310, 0x00765432, 0x07654320, 0x07654321, 0x76543210,
+};
+
+// Writes base+lane for the lanes set in mask to out; returns how many.
+// Always writes CPUSIM_LANES entries (the ones past the count are junk), so
+// there are no data-dependent branches or loop-carried dependencies.
+static int emit_lanes( int base, int mask, int * out )
+{
+    unsigned lanes = kLaneTable[mask];
+    for ( int i = 0 ; i < CPUSIM_LANES ; i++ )
+        out[i] = base + ( ( lanes >> ( 4 * i ) ) & 0xf );
+    return popcount8( mask );
+}
+
+// Same for blocks [begin,end), which produce exactly count entries. Past
+// out[count] is the next range's output (another thread's), so once a block
+// could write that far it goes through a temp instead.
+static void emit_blocks( unsigned char const * masks, int flip, int begin, int end, int * out, int count )
+{
+    int n = 0;
+    int blk = begin;
+    for ( ; blk < end && n + CPUSIM_LANES <= count ; blk++ )
+    {
+        int mask = masks[blk] ^ flip;
+        if ( mask ) // mostly-dead and mostly-live runs are common
+            n += emit_lanes( blk * CPUSIM_LANES, mask, out + n );
+    }
+
+    for ( ; blk < end ; blk++ )
+    {
+        int tmp[CPUSIM_LANES];
+        int k = emit_lanes( blk * CPUSIM_LANES, masks[blk] ^ flip, tmp );
+        memcpy( out + n, tmp, k * sizeof( int ) );
+        n += k;
+    }
+    assert( n == count );
+}
+
+// Parallel stream compaction over [0,count): count_func(begin, end) returns
+// how many outputs items [begin,end) produce, emit_func(begin, end, offset,
+// count) writes exactly those count outputs starting at offset. Offsets are
+// the exclusive prefix sum of the per-range counts, so the output stays in
+// order. Returns the total.
+template<typename CountFunc, typename EmitFunc>
+static int parallel_compact( int count, CountFunc const & count_func, EmitFunc const & emit_func )
+{
+    int num_ranges = ( count + kCompactRange - 1 ) / kCompactRange;
+    std::vector<int> offsets( num_ranges + 1, 0 );
+
+    parallel_for( num_ranges, 1, [&]( int begin, int end ) {
+        for ( int r = begin ; r < end ; r++ )
+            offsets[r + 1] = count_func( r * kCompactRange, std::min( ( r + 1 ) * kCompactRange, count ) );
+    } );
+
+    for ( int r = 0 ; r < num_ranges ; r++ )
+        offsets[r + 1] += offsets[r];
+
+    parallel_for( num_ranges, 1, [&]( int begin, int end ) {
+        for ( int r = begin ; r < end ; r++ )
+            emit_func( r * kCompactRange, std::min( ( r + 1 ) * kCompactRange, count ), offsets[r], offsets[r + 1] - offsets[r] );
+    } );
+
+    return offsets[num_ranges];
+}
+
+static void copy_particle( cpusim_block * buf, int dst, int src )
+{
+    cpusim_block const & sb = buf[src / CPUSIM_LANES];
+    cpusim_block & db = buf[dst / CPUSIM_LANES];
+    int sl = src % CPUSIM_LANES, dl = dst % CPUSIM_LANES;
+    db.x[dl] = sb.x[sl];
+    db.y[dl] = sb.y[sl];
+    db.z[dl] = sb.z[sl];
+    db.w[dl] = sb.w[sl];
+}
+
+// Packs the live particles into [0,num_live) after an update (see cpusim.h).
+static void pack_live( cpusim * sim )
+{
+    unsigned char const * masks = sim->dead_masks;
+    int used_blocks = ( sim->extent + CPUSIM_LANES - 1 ) / CPUSIM_LANES;
+
+    // lanes past extent in the last block are dead, so they count right
+    int num_live = 0;
+    for ( int blk = 0 ; blk < used_blocks ; blk++ )
+        num_live += popcount8( masks[blk] ^ 0xff );
+
+    // holes: dead slots below num_live; movers: live slots at or past it.
+    // The block num_live falls into is split between the two.
+    int split_blk = num_live / CPUSIM_LANES;
+    int below = ( 1 << ( num_live % CPUSIM_LANES ) ) - 1;
+    int num_holes = parallel_compact( split_blk,
+        [=]( int begin, int end ) {
+            int count = 0;
+            for ( int blk = begin ; blk < end ; blk++ )
+                count += popcount8( masks[blk] );
+            return count;
+        },
+        [=]( int begin, int end, int offset, int count ) {
+            emit_blocks( masks, 0, begin, end, sim->holes + offset, count );
+        } );
+
+    int num_movers = 0;
+    if ( split_blk < used_blocks )
+    {
+        int split_mask = masks[split_blk];
+        int tmp[CPUSIM_LANES];
+        int n = emit_lanes( split_blk * CPUSIM_LANES, split_mask & below, tmp );
+        memcpy( sim->holes + num_holes, tmp, n * sizeof( int ) );
+        num_holes += n;
+
+        num_movers = emit_lanes( split_blk * CPUSIM_LANES, ~split_mask & 0xff & ~below, tmp );
+        memcpy( sim->movers, tmp, num_movers * sizeof( int ) );
+
+        int first = split_blk + 1;
+        int * movers = sim->movers + num_movers;
+        num_movers += parallel_compact( used_blocks - first,
+            [=]( int begin, int end ) {
+                int count = 0;
+                for ( int blk = first + begin ; blk < first + end ; blk++ )
+                    count += popcount8( masks[blk] ^ 0xff );
+                return count;
+            },
+            [=]( int begin, int end, int offset, int count ) {
+                emit_blocks( masks, 0xff, first + begin, first + end, movers + offset, count );
+            } );
+    }
+    assert( num_holes == num_movers );
+
+    parallel_for( num_holes, 1024, [=]( int begin, int end ) {
+        for ( int i = begin ; i < end ; i++ )
+            for ( int b = 0 ; b < 4 ; b++ )
+                copy_particle( sim->bufs[b], sim->holes[i], sim->movers[i] );
+    } );
+
+    // everything past num_live is dead in all position buffers now; that
+    // includes the movers' old slots.
+    parallel_for( sim->extent - num_live, 4096, [=]( int begin, int end ) {
+        for ( int i = begin ; i < end ; i++ )
+        {
+            int index = num_live + i;
+            for ( int b = 0 ; b < 3 ; b++ )
+                sim->bufs[b][index / CPUSIM_LANES].w[index % CPUSIM_LANES] = 0.0f;
+        }
+    } );
+
+    sim->num_live = num_live;
+    sim->extent = num_live;
+}
+
+static cull_box empty_box()
+{
+    cull_box box;
+    box.min = vec3( FLT_MAX );
+    box.max = vec3( -FLT_MAX );
+    return box;
+}
+
+// The cube VS stretches each cube by +-velocity along its axis and by +-w
+// along two unit axes perpendicular to that, so along each world axis a
+// cube reaches at most |vel| + sqrt(2) * w from its center.
+static const float kSqrt2 = 1.41421356f;
+
+#if defined(CPUSIM_AVX2)
+
+static cull_box block_range_bounds( cpusim_block const * pos, cpusim_block const * vel, int begin, int end )
+{
+    __m256 lo[3], hi[3];
+    for ( int axis = 0 ; axis < 3 ; axis++ )
+    {
+        lo[axis] = _mm256_set1_ps( FLT_MAX );
+        hi[axis] = _mm256_set1_ps( -FLT_MAX );
+    }
+
+    __m256 abs_mask = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7fffffff ) );
+    for ( int blk = begin ; blk < end ; blk++ )
+    {
+        cpusim_block const & p = pos[blk];
+        cpusim_block const & v = vel[blk];
+        float const * pc[3] = { p.x, p.y, p.z };
+        float const * vc[3] = { v.x, v.y, v.z };
+
+        __m256 w = _mm256_load_ps( p.w );
+        __m256 dead = _mm256_cmp_ps( w, _mm256_setzero_ps(), _CMP_EQ_OQ );
+        __m256 across = _mm256_mul_ps( w, _mm256_set1_ps( kSqrt2 ) );
+        for ( int axis = 0 ; axis < 3 ; axis++ )
+        {
+            __m256 c = _mm256_load_ps( pc[axis] );
+            __m256 r = _mm256_add_ps( _mm256_and_ps( _mm256_load_ps( vc[axis] ), abs_mask ), across );
+            lo[axis] = _mm256_min_ps( lo[axis], _mm256_blendv_ps( _mm256_sub_ps( c, r ), _mm256_set1_ps( FLT_MAX ), dead ) );
+            hi[axis] = _mm256_max_ps( hi[axis], _mm256_blendv_ps( _mm256_add_ps( c, r ), _mm256_set1_ps( -FLT_MAX ), dead ) );
+        }
+    }
+
+    cull_box box = empty_box();
+    for ( int axis = 0 ; axis < 3 ; axis++ )
+    {
+        float l[8], h[8];
+        _mm256_storeu_ps( l, lo[axis] );
+        _mm256_storeu_ps( h, hi[axis] );
+        for ( int i = 0 ; i < 8 ; i++ )
+        {
+            box.min[axis] = std::min( box.min[axis], l[i] );
+            box.max[axis] = std::max( box.max[axis], h[i] );
+        }
+    }
+    return box;
+}
+
+#elif defined(CPUSIM_SSE2)
+
+static cull_box block_range_bounds( cpusim_block const * pos, cpusim_block const * vel, int begin, int end )
+{
+    __m128 lo[3], hi[3];
+    for ( int axis = 0 ; axis < 3 ; axis++ )
+    {
+        lo[axis] = _mm_set1_ps( FLT_MAX );
+        hi[axis] = _mm_set1_ps( -FLT_MAX );
+    }
+
+    __m128 abs_mask = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) );
+    for ( int blk = begin ; blk < end ; blk++ )
+    {
+        cpusim_block const & p = pos[blk];
+        cpusim_block const & v = vel[blk];
+        float const * pc[3] = { p.x, p.y, p.z };
+        float const * vc[3] = { v.x, v.y, v.z };
+
+        for ( int first = 0 ; first < CPUSIM_LANES ; first += 4 )
+        {
+            __m128 w = _mm_load_ps( p.w + first );
+            __m128 dead = _mm_cmpeq_ps( w, _mm_setzero_ps() );
+            __m128 across = _mm_mul_ps( w, _mm_set1_ps( kSqrt2 ) );
+            for ( int axis = 0 ; axis < 3 ; axis++ )
+            {
+                __m128 c = _mm_load_ps( pc[axis] + first );
+                __m128 r = _mm_add_ps( _mm_and_ps( _mm_load_ps( vc[axis] + first ), abs_mask ), across );
+                __m128 l = _mm_or_ps( _mm_andnot_ps( dead, _mm_sub_ps( c, r ) ), _mm_and_ps( dead, _mm_set1_ps( FLT_MAX ) ) );
+                __m128 h = _mm_or_ps( _mm_andnot_ps( dead, _mm_add_ps( c, r ) ), _mm_and_ps( dead, _mm_set1_ps( -FLT_MAX ) ) );
+                lo[axis] = _mm_min_ps( lo[axis], l );
+                hi[axis] = _mm_max_ps( hi[axis], h );
+            }
+        }
+    }
+
+    cull_box box = empty_box();
+    for ( int axis = 0 ; axis < 3 ; axis++ )
+    {
+        float l[4], h[4];
+        _mm_storeu_ps( l, lo[axis] );
+        _mm_storeu_ps( h, hi[axis] );
+        for ( int i = 0 ; i < 4 ; i++ )
+        {
+            box.min[axis] = std::min( box.min[axis], l[i] );
+            box.max[axis] = std::max( box.max[axis], h[i] );
+        }
+    }
+    return box;
+}
+
+#else
+
+static cull_box block_range_bounds( cpusim_block const * pos, cpusim_block const * vel, int begin, int end )
+{
+    cull_box box = empty_box();
+    for ( int blk = begin ; blk < end ; blk++ )
+    {
+        cpusim_block const & p = pos[blk];
+        cpusim_block const & v = vel[blk];
+        for ( int lane = 0 ; lane < CPUSIM_LANES ; lane++ )
+        {
+            if ( p.w[lane] == 0.0f )
+                continue;
+
+            vec3 c( p.x[lane], p.y[lane], p.z[lane] );
+            vec3 r( fabsf( v.x[lane] ), fabsf( v.y[lane] ), fabsf( v.z[lane] ) );
+            r += vec3( p.w[lane] * kSqrt2 );
+            for ( int axis = 0 ; axis < 3 ; axis++ )
+            {
+                box.min[axis] = std::min( box.min[axis], c[axis] - r[axis] );
+                box.max[axis] = std::max( box.max[axis], c[axis] + r[axis] );
+            }
+        }
+    }
+    return box;
+}
+
+#endif
+
+// Per-row min/max reduction; runs after pack_live, so only the rows below
+// num_live have anything in them.
+static void update_row_bounds( cpusim * sim )
+{
+    int row_blocks = sim->chunk_size / CPUSIM_LANES;
+    int used_rows = ( sim->num_live + sim->chunk_size - 1 ) / sim->chunk_size;
+    cpusim_block const * pos = cpusim_pos_buf( sim, 0 );
+    cpusim_block const * vel = sim->bufs[3];
+
+    parallel_for( used_rows, 1, [=]( int begin, int end ) {
+        for ( int row = begin ; row < end ; row++ )
+            sim->row_bounds[row] = block_range_bounds( pos, vel, row * row_blocks, ( row + 1 ) * row_blocks );
+    } );
+
+    for ( int row = used_rows ; row < sim->num_rows ; row++ )
+        sim->row_bounds[row] = empty_box();
+}
+
+cpusim * cpusim_create( int chunk_size, int num_rows )
+{
+    assert( chunk_size % CPUSIM_LANES == 0 );
+
+    cpusim * sim = new cpusim;
+    sim->chunk_size = chunk_size;
+    sim->num_rows = num_rows;
+    sim->num_particles = chunk_size * num_rows;
+    sim->num_blocks = sim->num_particles / CPUSIM_LANES;
+    sim->cur = 0;
+
+    for ( int i = 0 ; i < 4 ; i++ )
+    {
+        size_t size = sim->num_blocks * sizeof( cpusim_block );
+        sim->bufs[i] = (cpusim_block *)cpusim_aligned_alloc( size );
+        if ( !sim->bufs[i] )
+            panic( "cpusim_create: out of memory\n" );
+        memset( sim->bufs[i], 0, size );
+    }
+
+    // everything starts out dead
+    sim->num_live = 0;
+    sim->extent = 0;
+    sim->dead_masks = new unsigned char[sim->num_blocks];
+    sim->holes = new int[sim->num_particles];
+    sim->movers = new int[sim->num_particles];
+    sim->sort_keys = new unsigned[2 * sim->num_particles];
+    sim->sort_index = new int[2 * sim->num_particles];
+    sim->sort_buf = (cpusim_block *)cpusim_aligned_alloc( sim->num_blocks * sizeof( cpusim_block ) );
+    if ( !sim->sort_buf )
+        panic( "cpusim_create: out of memory\n" );
+    sim->row_bounds = new cull_box[num_rows];
+    for ( int i = 0 ; i < num_rows ; i++ )
+        sim->row_bounds[i] = empty_box();
+
+    return sim;
+}
+
+void cpusim_destroy( cpusim * sim )
+{
+    if ( sim )
+    {
+        for ( int i = 0 ; i < 4 ; i++ )
+            cpusim_aligned_free( sim->bufs[i] );
+        delete[] sim->dead_masks;
+        delete[] sim->holes;
+        delete[] sim->movers;
+        delete[] sim->sort_keys;
+        delete[] sim->sort_index;
+        cpusim_aligned_free( sim->sort_buf );
+        delete[] sim->row_bounds;
+        delete sim;
+    }
+}
+
+cpusim_block * cpusim_pos_buf( cpusim * sim, int age )
+{
+    return sim->bufs[( sim->cur + 3 - age ) % 3];
+}
+
+static void write_particle( cpusim_block * buf, int index, vec4 const & v )
+{
+    cpusim_block * b = buf + index / CPUSIM_LANES;
+    int lane = index % CPUSIM_LANES;
+    b->x[lane] = v.x;
+    b->y[lane] = v.y;
+    b->z[lane] = v.z;
+    b->w[lane] = v.w;
+}
+
+void cpusim_spawn( cpusim * sim, int first, int count, vec4 const * pos_old, vec4 const * pos_new )
+{
+    cpusim_block * old_buf = cpusim_pos_buf( sim, 1 );
+    cpusim_block * new_buf = cpusim_pos_buf( sim, 0 );
+
+    for ( int i = 0 ; i < count ; i++ )
+    {
+        int index = ( first + i ) % sim->num_particles;
+        write_particle( old_buf, index, pos_old[i] );
+        write_particle( new_buf, index, pos_new[i] );
+    }
+
+    sim->extent = sim->num_particles;
+}
+
+int cpusim_spawn_free( cpusim * sim, int count, vec4 const * pos_old, vec4 const * pos_new )
+{
+    cpusim_block * old_buf = cpusim_pos_buf( sim, 1 );
+    cpusim_block * new_buf = cpusim_pos_buf( sim, 0 );
+
+    int avail = sim->num_particles - sim->extent;
+    if ( count > avail )
+        count = avail;
+
+    for ( int i = 0 ; i < count ; i++ )
+    {
+        write_particle( old_buf, sim->extent + i, pos_old[i] );
+        write_particle( new_buf, sim->extent + i, pos_new[i] );
+    }
+
+    sim->extent += count;
+    return count;
+}
+
+int cpusim_num_free( cpusim const * sim )
+{
+    return sim->num_particles - sim->extent;
+}
+
+void cpusim_read( cpusim_block const * buf, int first, int count, vec4 * dest )
+{
+    for ( int i = 0 ; i < count ; i++ )
+    {
+        int index = first + i;
+        cpusim_block const * b = buf + index / CPUSIM_LANES;
+        int lane = index % CPUSIM_LANES;
+        dest[i] = vec4( b->x[lane], b->y[lane], b->z[lane], b->w[lane] );
+    }
+}
+
+int cpusim_read_live( cpusim const * sim, cpusim_block const * buf, vec4 * dest )
+{
+    cpusim_read( buf, 0, sim->num_live, dest );
+    return sim->num_live;
+}
+
+static int log2_pow2( int x )
+{
+    int l = 0;
+    while ( ( 1 << l ) < x )
+        l++;
+    return l;
+}
+
+// Spreads the low 10 bits of x out to every third bit, for Morton indices.
+static int spread_bits( int x )
+{
+    unsigned v = x & 0x3ff;
+    v = ( v | ( v << 16 ) ) & 0x030000ff;
+    v = ( v | ( v << 8 ) ) & 0x0300f00f;
+    v = ( v | ( v << 4 ) ) & 0x030c30c3;
+    v = ( v | ( v << 2 ) ) & 0x09249249;
+    return (int)v;
+}
+
+static int morton_index( int x, int y, int z )
+{
+    return spread_bits( x ) | ( spread_bits( y ) << 1 ) | ( spread_bits( z ) << 2 );
+}
+
+// Texel index contributions along one axis for cell coordinate i0 (and its
+// wrapped neighbor i0+1); a tap's index is the sum over the three axes.
+static void axis_offsets( cpusim_field const & field, int field_log2, int axis, int i0, int * off0, int * off1 )
+{
+    int i1 = ( i0 + 1 ) & ( field.size - 1 );
+
+    switch ( field.layout )
+    {
+    case CPUSIM_LAYOUT_MORTON:
+        *off0 = spread_bits( i0 ) << axis;
+        *off1 = spread_bits( i1 ) << axis;
+        break;
+
+    case CPUSIM_LAYOUT_CORNERS:
+        *off0 = spread_bits( i0 ) << ( axis + 3 );
+        *off1 = *off0 + ( 1 << axis );
+        break;
+
+    default:
+        *off0 = i0 << ( axis * field_log2 );
+        *off1 = i1 << ( axis * field_log2 );
+        break;
+    }
+}
+
+cpusim_field cpusim_alloc_field( int size, fieldpack_format format, float scale, cpusim_layout layout )
+{
+    assert( size <= 1024 ); // spread_bits
+
+    size_t texel_bytes = fieldpack_texel_bytes( format );
+    size_t num_texels = (size_t)size * size * size * ( layout == CPUSIM_LAYOUT_CORNERS ? 8 : 1 );
+
+    // the samplers compute byte offsets in 32 bits
+    if ( num_texels * texel_bytes > 0x7fffffff )
+        panic( "cpusim_alloc_field: %d^3 field too big for layout %d\n", size, layout );
+
+    cpusim_field result = { size, cpusim_aligned_alloc( num_texels * texel_bytes ), format, scale, layout };
+    if ( !result.texels )
+        panic( "cpusim_alloc_field: out of memory\n" );
+    return result;
+}
+
+void cpusim_convert_field_range( cpusim_field * dst_field, cpusim_field const & src_field, int z_begin, int z_end )
+{
+    assert( src_field.layout == CPUSIM_LAYOUT_LINEAR );
+    assert( dst_field->size == src_field.size && dst_field->format == src_field.format );
+
+    int size = src_field.size, mask = size - 1, field_log2 = log2_pow2( size );
+    size_t texel_bytes = fieldpack_texel_bytes( src_field.format );
+    cpusim_layout layout = dst_field->layout;
+    unsigned char const * src = (unsigned char const *)src_field.texels;
+    unsigned char * dst = (unsigned char *)dst_field->texels;
+
+    for ( int z = z_begin ; z < z_end ; z++ )
+    for ( int y = 0 ; y < size ; y++ )
+    for ( int x = 0 ; x < size ; x++ )
+    {
+        size_t linear = x + ( y << field_log2 ) + ( (size_t)z << ( 2 * field_log2 ) );
+
+        if ( layout == CPUSIM_LAYOUT_CORNERS )
+        {
+            unsigned char * brick = dst + (size_t)morton_index( x, y, z ) * 8 * texel_bytes;
+            for ( int corner = 0 ; corner < 8 ; corner++ )
+            {
+                int cx = ( x + ( corner & 1 ) ) & mask;
+                int cy = ( y + ( ( corner >> 1 ) & 1 ) ) & mask;
+                int cz = ( z + ( corner >> 2 ) ) & mask;
+                size_t src_index = cx + ( cy << field_log2 ) + ( (size_t)cz << ( 2 * field_log2 ) );
+                memcpy( brick + corner * texel_bytes, src + src_index * texel_bytes, texel_bytes );
+            }
+        }
+        else
+        {
+            size_t dst_index = ( layout == CPUSIM_LAYOUT_MORTON ) ? (size_t)morton_index( x, y, z ) : linear;
+            memcpy( dst + dst_index * texel_bytes, src + linear * texel_bytes, texel_bytes );
+        }
+    }
+}
+
+cpusim_field cpusim_convert_field( cpusim_field const & field, cpusim_layout layout )
+{
+    cpusim_field result = cpusim_alloc_field( field.size, field.format, field.scale, layout );
+    parallel_for( field.size, 1, [&]( int begin, int end ) {
+        cpusim_convert_field_range( &result, field, begin, end );
+    } );
+    return result;
+}
+
+void cpusim_free_field( cpusim_field * field )
+{
+    cpusim_aligned_free( (void *)field->texels );
+    field->texels = NULL;
+}
+
+vec3 cpusim_sample_force( cpusim_consts const & consts, cpusim_field const & field, vec3 const & pos )
+{
+    // smoothstepped sample position, as in UpdatePosShader
+    vec3 force_pos = pos * consts.field_scale + consts.field_offs;
+    vec3 t;
+    for ( int i = 0 ; i < 3 ; i++ )
+    {
+        float fl = std::floor( force_pos[i] );
+        float frac = force_pos[i] - fl;
+        float smooth = frac * frac * ( 3.0f - 2.0f * frac );
+
+        // texture coordinate to texel space (texel centers at +0.5)
+        t[i] = ( fl + smooth ) * consts.field_sample_scale[i] * field.size - 0.5f;
+    }
+
+    // trilinear filter with wrap addressing
+    int mask = field.size - 1;
+    int field_log2 = log2_pow2( field.size );
+    int off0[3], off1[3];
+    float f[3];
+    for ( int i = 0 ; i < 3 ; i++ )
+    {
+        float fl = std::floor( t[i] );
+        f[i] = t[i] - fl;
+        axis_offsets( field, field_log2, i, (int)fl & mask, &off0[i], &off1[i] );
+    }
+
+    fieldpack pack = { field.format, field.size, field.scale, field.texels, false };
+    vec3 result( 0.0f );
+    for ( int corner = 0 ; corner < 8 ; corner++ )
+    {
+        int index = ( ( corner & 1 ) ? off1[0] : off0[0] ) +
+            ( ( corner & 2 ) ? off1[1] : off0[1] ) +
+            ( ( corner & 4 ) ? off1[2] : off0[2] );
+        float wx = ( corner & 1 ) ? f[0] : 1.0f - f[0];
+        float wy = ( corner & 2 ) ? f[1] : 1.0f - f[1];
+        float wz = ( corner & 4 ) ? f[2] : 1.0f - f[2];
+
+        result += ( wx * wy * wz ) * fieldpack_decode_texel( pack, index );
+    }
+
+    return result;
+}
+
+namespace {
+    struct update_args {
+        cpusim_consts consts;
+        cpusim_field field;
+        cpusim_field next; // texels are NULL unless blending
+        int field_log2;
+        cpusim_block const * older;
+        cpusim_block const * newer;
+        cpusim_block * out;
+        cpusim_block * vel; // NULL if no velocity update in this pass
+        unsigned char * dead_masks; // set along with vel
+    };
+}
+
+#if defined(CPUSIM_AVX2)
+
+static __m256 smooth_coord( __m256 p, float scale, float offs, float sample_scale )
+{
+    __m256 fp = _mm256_add_ps( _mm256_mul_ps( p, _mm256_set1_ps( scale ) ), _mm256_set1_ps( offs ) );
+    __m256 fl = _mm256_floor_ps( fp );
+    __m256 frac = _mm256_sub_ps( fp, fl );
+    __m256 smooth = _mm256_mul_ps( _mm256_mul_ps( frac, frac ), _mm256_sub_ps( _mm256_set1_ps( 3.0f ), _mm256_add_ps( frac, frac ) ) );
+    return _mm256_sub_ps( _mm256_mul_ps( _mm256_add_ps( fl, smooth ), _mm256_set1_ps( sample_scale ) ), _mm256_set1_ps( 0.5f ) );
+}
+
+// Same as fieldpack_half_to_float; denormals are done with an FP subtract
+// of 2^-14 so we never compute on float denormals (which is slow).
+static __m256 half_to_float( __m256i h )
+{
+    __m256i mag = _mm256_and_si256( h, _mm256_set1_epi32( 0x7fff ) );
+    __m256i shifted = _mm256_slli_epi32( mag, 13 );
+    __m256 normal = _mm256_castsi256_ps( _mm256_add_epi32( shifted, _mm256_set1_epi32( 112 << 23 ) ) );
+    __m256 denorm = _mm256_sub_ps( _mm256_castsi256_ps( _mm256_add_epi32( shifted, _mm256_set1_epi32( 113 << 23 ) ) ),
+        _mm256_castsi256_ps( _mm256_set1_epi32( 113 << 23 ) ) );
+    __m256 is_denorm = _mm256_castsi256_ps( _mm256_cmpgt_epi32( _mm256_set1_epi32( 0x400 ), mag ) );
+    __m256i sign = _mm256_slli_epi32( _mm256_xor_si256( h, mag ), 16 );
+    return _mm256_or_ps( _mm256_blendv_ps( normal, denorm, is_denorm ), _mm256_castsi256_ps( sign ) );
+}
+
+// spread_bits for values below 1024
+static __m256i spread_bits( __m256i v )
+{
+    v = _mm256_and_si256( _mm256_or_si256( v, _mm256_slli_epi32( v, 16 ) ), _mm256_set1_epi32( 0x030000ff ) );
+    v = _mm256_and_si256( _mm256_or_si256( v, _mm256_slli_epi32( v, 8 ) ), _mm256_set1_epi32( 0x0300f00f ) );
+    v = _mm256_and_si256( _mm256_or_si256( v, _mm256_slli_epi32( v, 4 ) ), _mm256_set1_epi32( 0x030c30c3 ) );
+    v = _mm256_and_si256( _mm256_or_si256( v, _mm256_slli_epi32( v, 2 ) ), _mm256_set1_epi32( 0x09249249 ) );
+    return v;
+}
+
+// Same as the scalar axis_offsets, for cell coordinates i0 (already wrapped).
+static void axis_offsets( update_args const & a, int axis, __m256i i0, __m256i * off0, __m256i * off1 )
+{
+    switch ( a.field.layout )
+    {
+    case CPUSIM_LAYOUT_MORTON:
+        {
+            // increment in the dilated representation: fill the holes with
+            // ones so the carry skips them, then mask (which also wraps).
+            __m256i bits = _mm256_set1_epi32( spread_bits( a.field.size - 1 ) << axis );
+            *off0 = _mm256_slli_epi32( spread_bits( i0 ), axis );
+            *off1 = _mm256_and_si256( _mm256_add_epi32( _mm256_or_si256( *off0, _mm256_xor_si256( bits, _mm256_set1_epi32( -1 ) ) ),
+                _mm256_set1_epi32( 1 << axis ) ), bits );
+        }
+        break;
+
+    case CPUSIM_LAYOUT_CORNERS:
+        *off0 = _mm256_slli_epi32( spread_bits( i0 ), axis + 3 );
+        *off1 = _mm256_add_epi32( *off0, _mm256_set1_epi32( 1 << axis ) );
+        break;
+
+    default:
+        {
+            __m256i i1 = _mm256_and_si256( _mm256_add_epi32( i0, _mm256_set1_epi32( 1 ) ), _mm256_set1_epi32( a.field.size - 1 ) );
+            *off0 = _mm256_slli_epi32( i0, axis * a.field_log2 );
+            *off1 = _mm256_slli_epi32( i1, axis * a.field_log2 );
+        }
+        break;
+    }
+}
+
+// Fetches the texels at indices idx (in texels) and decodes them.
+static void gather_texels( cpusim_field const & field, __m256i idx, __m256 * x, __m256 * y, __m256 * z )
+{
+    int const * words = (int const *)field.texels;
+
+    switch ( field.format )
+    {
+    case FIELDPACK_HALF:
+        {
+            __m256i lo16 = _mm256_set1_epi32( 0xffff );
+            __m256i xy = _mm256_i32gather_epi32( words + 0, idx, 8 );
+            __m256i zw = _mm256_i32gather_epi32( words + 1, idx, 8 );
+            *x = half_to_float( _mm256_and_si256( xy, lo16 ) );
+            *y = half_to_float( _mm256_srli_epi32( xy, 16 ) );
+            *z = half_to_float( _mm256_and_si256( zw, lo16 ) );
+        }
+        break;
+
+    case FIELDPACK_SHAREDEXP:
+        {
+            __m256i v = _mm256_i32gather_epi32( words, idx, 4 );
+            __m256i exp = _mm256_add_epi32( _mm256_srli_epi32( v, 27 ), _mm256_set1_epi32( 127 - FIELDPACK_SHAREDEXP_BIAS ) );
+            __m256 scale = _mm256_castsi256_ps( _mm256_slli_epi32( exp, 23 ) );
+            __m256i mant_mask = _mm256_set1_epi32( 0xff );
+            __m256i sign_mask = _mm256_set1_epi32( (int)0x80000000 );
+
+            // move each component's sign bit (bit 9*i + 8) to bit 31
+            *x = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_and_si256( v, mant_mask ) ), scale );
+            *x = _mm256_or_ps( *x, _mm256_castsi256_ps( _mm256_and_si256( _mm256_slli_epi32( v, 23 ), sign_mask ) ) );
+            *y = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_and_si256( _mm256_srli_epi32( v, 9 ), mant_mask ) ), scale );
+            *y = _mm256_or_ps( *y, _mm256_castsi256_ps( _mm256_and_si256( _mm256_slli_epi32( v, 14 ), sign_mask ) ) );
+            *z = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_and_si256( _mm256_srli_epi32( v, 18 ), mant_mask ) ), scale );
+            *z = _mm256_or_ps( *z, _mm256_castsi256_ps( _mm256_and_si256( _mm256_slli_epi32( v, 5 ), sign_mask ) ) );
+        }
+        break;
+
+    case FIELDPACK_SNORM8:
+        {
+            __m256i v = _mm256_i32gather_epi32( words, idx, 4 );
+            __m256 scale = _mm256_set1_ps( field.scale * ( 1.0f / 127.0f ) );
+            *x = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_srai_epi32( _mm256_slli_epi32( v, 24 ), 24 ) ), scale );
+            *y = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_srai_epi32( _mm256_slli_epi32( v, 16 ), 24 ) ), scale );
+            *z = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_srai_epi32( _mm256_slli_epi32( v, 8 ), 24 ) ), scale );
+        }
+        break;
+
+    default:
+        {
+            float const * base = (float const *)field.texels;
+            __m256i off = _mm256_slli_epi32( idx, 2 ); // in floats
+            *x = _mm256_i32gather_ps( base + 0, off, 4 );
+            *y = _mm256_i32gather_ps( base + 1, off, 4 );
+            *z = _mm256_i32gather_ps( base + 2, off, 4 );
+        }
+        break;
+    }
+}
+
+// Weighted sum of the texels at the 8 corner offsets.
+static void filter_texels( cpusim_field const & field, __m256i const * offs, __m256 const * weights, __m256 * fx, __m256 * fy, __m256 * fz )
+{
+    *fx = _mm256_setzero_ps();
+    *fy = _mm256_setzero_ps();
+    *fz = _mm256_setzero_ps();
+    for ( int corner = 0 ; corner < 8 ; corner++ )
+    {
+        __m256 tx, ty, tz;
+        gather_texels( field, offs[corner], &tx, &ty, &tz );
+        *fx = _mm256_add_ps( *fx, _mm256_mul_ps( weights[corner], tx ) );
+        *fy = _mm256_add_ps( *fy, _mm256_mul_ps( weights[corner], ty ) );
+        *fz = _mm256_add_ps( *fz, _mm256_mul_ps( weights[corner], tz ) );
+    }
+}
+
+static void update_block( update_args const & a, int blk )
+{
+    cpusim_block const & o = a.older[blk];
+    cpusim_block const & n = a.newer[blk];
+    cpusim_block & r = a.out[blk];
+
+    __m256 nx = _mm256_load_ps( n.x ), ny = _mm256_load_ps( n.y ), nz = _mm256_load_ps( n.z ), nw = _mm256_load_ps( n.w );
+
+    // texel-space sample positions
+    float size = (float)a.field.size;
+    __m256 t[3];
+    t[0] = smooth_coord( nx, a.consts.field_scale.x, a.consts.field_offs.x, a.consts.field_sample_scale.x * size );
+    t[1] = smooth_coord( ny, a.consts.field_scale.y, a.consts.field_offs.y, a.consts.field_sample_scale.y * size );
+    t[2] = smooth_coord( nz, a.consts.field_scale.z, a.consts.field_offs.z, a.consts.field_sample_scale.z * size );
+
+    __m256i mask = _mm256_set1_epi32( a.field.size - 1 );
+    __m256 f[3];
+    __m256i off0[3], off1[3];
+    for ( int i = 0 ; i < 3 ; i++ )
+    {
+        __m256 fl = _mm256_floor_ps( t[i] );
+        f[i] = _mm256_sub_ps( t[i], fl );
+        __m256i i0 = _mm256_and_si256( _mm256_cvttps_epi32( fl ), mask );
+
+        // texel index contributions of each axis
+        axis_offsets( a, i, i0, &off0[i], &off1[i] );
+    }
+
+    __m256 onef = _mm256_set1_ps( 1.0f );
+    __m256 wx[2] = { _mm256_sub_ps( onef, f[0] ), f[0] };
+    __m256 wy[2] = { _mm256_sub_ps( onef, f[1] ), f[1] };
+    __m256 wz[2] = { _mm256_sub_ps( onef, f[2] ), f[2] };
+
+    __m256i offs[8];
+    __m256 weights[8];
+    for ( int corner = 0 ; corner < 8 ; corner++ )
+    {
+        offs[corner] = _mm256_add_epi32( _mm256_add_epi32(
+            ( corner & 1 ) ? off1[0] : off0[0],
+            ( corner & 2 ) ? off1[1] : off0[1] ),
+            ( corner & 4 ) ? off1[2] : off0[2] );
+        weights[corner] = _mm256_mul_ps( _mm256_mul_ps( wx[corner & 1], wy[( corner >> 1 ) & 1] ), wz[corner >> 2] );
+    }
+
+    __m256 fx, fy, fz;
+    filter_texels( a.field, offs, weights, &fx, &fy, &fz );
+    if ( a.next.texels )
+    {
+        // same taps in the field we're blending to, like UpdatePosShader
+        __m256 gx, gy, gz;
+        filter_texels( a.next, offs, weights, &gx, &gy, &gz );
+        __m256 blend = _mm256_set1_ps( a.consts.field_blend );
+        fx = _mm256_add_ps( fx, _mm256_mul_ps( blend, _mm256_sub_ps( gx, fx ) ) );
+        fy = _mm256_add_ps( fy, _mm256_mul_ps( blend, _mm256_sub_ps( gy, fy ) ) );
+        fz = _mm256_add_ps( fz, _mm256_mul_ps( blend, _mm256_sub_ps( gz, fz ) ) );
+    }
+
+    // verlet integration
+    __m256 damping = _mm256_set1_ps( a.consts.damping );
+    __m256 accel = _mm256_set1_ps( a.consts.accel );
+    __m256 px = _mm256_add_ps( nx, _mm256_add_ps( _mm256_mul_ps( damping, _mm256_sub_ps( nx, _mm256_load_ps( o.x ) ) ), _mm256_mul_ps( accel, fx ) ) );
+    __m256 py = _mm256_add_ps( ny, _mm256_add_ps( _mm256_mul_ps( damping, _mm256_sub_ps( ny, _mm256_load_ps( o.y ) ) ), _mm256_mul_ps( accel, fy ) ) );
+    __m256 pz = _mm256_add_ps( nz, _mm256_add_ps( _mm256_mul_ps( damping, _mm256_sub_ps( nz, _mm256_load_ps( o.z ) ) ), _mm256_mul_ps( accel, fz ) ) );
+
+    // nuke particles if they get too far from the origin
+    __m256 dist_sq = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( px, px ), _mm256_mul_ps( py, py ) ), _mm256_mul_ps( pz, pz ) );
+    __m256 pw = _mm256_andnot_ps( _mm256_cmp_ps( dist_sq, _mm256_set1_ps( 16.0f ), _CMP_GT_OQ ), nw );
+
+    _mm256_store_ps( r.x, px );
+    _mm256_store_ps( r.y, py );
+    _mm256_store_ps( r.z, pz );
+    _mm256_store_ps( r.w, pw );
+
+    if ( a.vel )
+    {
+        cpusim_block & v = a.vel[blk];
+        _mm256_store_ps( v.x, _mm256_sub_ps( px, nx ) );
+        _mm256_store_ps( v.y, _mm256_sub_ps( py, ny ) );
+        _mm256_store_ps( v.z, _mm256_sub_ps( pz, nz ) );
+        _mm256_store_ps( v.w, _mm256_sub_ps( pw, nw ) );
+        a.dead_masks[blk] = (unsigned char)_mm256_movemask_ps( _mm256_cmp_ps( pw, _mm256_setzero_ps(), _CMP_EQ_OQ ) );
+    }
+}
+
+#elif defined(CPUSIM_SSE2)
+
+static __m128 floor_ps( __m128 x )
+{
+    __m128 t = _mm_cvtepi32_ps( _mm_cvttps_epi32( x ) );
+    return _mm_sub_ps( t, _mm_and_ps( _mm_cmplt_ps( x, t ), _mm_set1_ps( 1.0f ) ) );
+}
+
+static __m128 smooth_coord( __m128 p, float scale, float offs, float sample_scale )
+{
+    __m128 fp = _mm_add_ps( _mm_mul_ps( p, _mm_set1_ps( scale ) ), _mm_set1_ps( offs ) );
+    __m128 fl = floor_ps( fp );
+    __m128 frac = _mm_sub_ps( fp, fl );
+    __m128 smooth = _mm_mul_ps( _mm_mul_ps( frac, frac ), _mm_sub_ps( _mm_set1_ps( 3.0f ), _mm_add_ps( frac, frac ) ) );
+    return _mm_sub_ps( _mm_mul_ps( _mm_add_ps( fl, smooth ), _mm_set1_ps( sample_scale ) ), _mm_set1_ps( 0.5f ) );
+}
+
+// Same as fieldpack_half_to_float; denormals are done with an FP subtract
+// of 2^-14 so we never compute on float denormals (which is slow).
+static __m128 half_to_float( __m128i h )
+{
+    __m128i mag = _mm_and_si128( h, _mm_set1_epi32( 0x7fff ) );
+    __m128i shifted = _mm_slli_epi32( mag, 13 );
+    __m128 normal = _mm_castsi128_ps( _mm_add_epi32( shifted, _mm_set1_epi32( 112 << 23 ) ) );
+    __m128 denorm = _mm_sub_ps( _mm_castsi128_ps( _mm_add_epi32( shifted, _mm_set1_epi32( 113 << 23 ) ) ),
+        _mm_castsi128_ps( _mm_set1_epi32( 113 << 23 ) ) );
+    __m128 is_denorm = _mm_castsi128_ps( _mm_cmplt_epi32( mag, _mm_set1_epi32( 0x400 ) ) );
+    __m128 result = _mm_or_ps( _mm_and_ps( is_denorm, denorm ), _mm_andnot_ps( is_denorm, normal ) );
+    __m128i sign = _mm_slli_epi32( _mm_xor_si128( h, mag ), 16 );
+    return _mm_or_ps( result, _mm_castsi128_ps( sign ) );
+}
+
+// spread_bits for values below 1024
+static __m128i spread_bits( __m128i v )
+{
+    v = _mm_and_si128( _mm_or_si128( v, _mm_slli_epi32( v, 16 ) ), _mm_set1_epi32( 0x030000ff ) );
+    v = _mm_and_si128( _mm_or_si128( v, _mm_slli_epi32( v, 8 ) ), _mm_set1_epi32( 0x0300f00f ) );
+    v = _mm_and_si128( _mm_or_si128( v, _mm_slli_epi32( v, 4 ) ), _mm_set1_epi32( 0x030c30c3 ) );
+    v = _mm_and_si128( _mm_or_si128( v, _mm_slli_epi32( v, 2 ) ), _mm_set1_epi32( 0x09249249 ) );
+    return v;
+}
+
+// Same as the scalar axis_offsets, for cell coordinates i0 (already wrapped).
+static void axis_offsets( update_args const & a, int axis, __m128i i0, __m128i * off0, __m128i * off1 )
+{
+    switch ( a.field.layout )
+    {
+    case CPUSIM_LAYOUT_MORTON:
+        {
+            // increment in the dilated representation: fill the holes with
+            // ones so the carry skips them, then mask (which also wraps).
+            __m128i bits = _mm_set1_epi32( spread_bits( a.field.size - 1 ) << axis );
+            *off0 = _mm_slli_epi32( spread_bits( i0 ), axis );
+            *off1 = _mm_and_si128( _mm_add_epi32( _mm_or_si128( *off0, _mm_xor_si128( bits, _mm_set1_epi32( -1 ) ) ),
+                _mm_set1_epi32( 1 << axis ) ), bits );
+        }
+        break;
+
+    case CPUSIM_LAYOUT_CORNERS:
+        *off0 = _mm_slli_epi32( spread_bits( i0 ), axis + 3 );
+        *off1 = _mm_add_epi32( *off0, _mm_set1_epi32( 1 << axis ) );
+        break;
+
+    default:
+        {
+            __m128i i1 = _mm_and_si128( _mm_add_epi32( i0, _mm_set1_epi32( 1 ) ), _mm_set1_epi32( a.field.size - 1 ) );
+            *off0 = _mm_slli_epi32( i0, axis * a.field_log2 );
+            *off1 = _mm_slli_epi32( i1, axis * a.field_log2 );
+        }
+        break;
+    }
+}
+
+// Decodes texel "index" to a float4 (w is garbage).
+static __m128 fetch_texel( cpusim_field const & field, int index )
+{
+    switch ( field.format )
+    {
+    case FIELDPACK_HALF:
+        {
+            __m128i h = _mm_loadl_epi64( (__m128i const *)( (char const *)field.texels + index * 8 ) );
+            return half_to_float( _mm_unpacklo_epi16( h, _mm_setzero_si128() ) );
+        }
+
+    case FIELDPACK_SHAREDEXP:
+        {
+            // lane i masks out its component in place and scales it by an
+            // extra 2^-9i to compensate.
+            __m128i v = _mm_set1_epi32( ( (int const *)field.texels )[index] );
+            __m128i mant = _mm_and_si128( v, _mm_setr_epi32( 0xff, 0xff << 9, 0xff << 18, 0 ) );
+            __m128i sign = _mm_and_si128( v, _mm_setr_epi32( 0x100, 0x100 << 9, 0x100 << 18, 0 ) );
+            __m128i exp = _mm_add_epi32( _mm_srli_epi32( v, 27 ), _mm_setr_epi32( 127 - FIELDPACK_SHAREDEXP_BIAS, 127 - FIELDPACK_SHAREDEXP_BIAS - 9, 127 - FIELDPACK_SHAREDEXP_BIAS - 18, 127 ) );
+            __m128 mag = _mm_mul_ps( _mm_cvtepi32_ps( mant ), _mm_castsi128_ps( _mm_slli_epi32( exp, 23 ) ) );
+            __m128 positive = _mm_castsi128_ps( _mm_cmpeq_epi32( sign, _mm_setzero_si128() ) );
+            return _mm_or_ps( mag, _mm_andnot_ps( positive, _mm_set1_ps( -0.0f ) ) );
+        }
+
+    case FIELDPACK_SNORM8:
+        {
+            __m128i v = _mm_cvtsi32_si128( ( (int const *)field.texels )[index] );
+            v = _mm_unpacklo_epi8( v, v );
+            v = _mm_srai_epi32( _mm_unpacklo_epi16( v, v ), 24 );
+            return _mm_mul_ps( _mm_cvtepi32_ps( v ), _mm_set1_ps( field.scale * ( 1.0f / 127.0f ) ) );
+        }
+
+    default:
+        return _mm_loadu_ps( (float const *)field.texels + index * 4 );
+    }
+}
+
+// Updates 4 particles starting at lane "first" of block blk. Returns the
+// dead lanes as a 4-bit mask (if this pass updates velocities).
+// Trilinear filter of one sample, given the texel index contributions of
+// each axis and the fractional weights (splatted).
+static __m128 filter_texel( cpusim_field const & field, int x0, int x1, int y0, int y1, int z0, int z1, __m128 wx, __m128 wy, __m128 wz )
+{
+    #define TAP(ix, iy, iz) fetch_texel( field, (ix) + (iy) + (iz) )
+    #define LERP(a, b, w) _mm_add_ps( a, _mm_mul_ps( w, _mm_sub_ps( b, a ) ) )
+    __m128 c00 = LERP( TAP( x0, y0, z0 ), TAP( x1, y0, z0 ), wx );
+    __m128 c10 = LERP( TAP( x0, y1, z0 ), TAP( x1, y1, z0 ), wx );
+    __m128 c01 = LERP( TAP( x0, y0, z1 ), TAP( x1, y0, z1 ), wx );
+    __m128 c11 = LERP( TAP( x0, y1, z1 ), TAP( x1, y1, z1 ), wx );
+    return LERP( LERP( c00, c10, wy ), LERP( c01, c11, wy ), wz );
+    #undef TAP
+    #undef LERP
+}
+
+static int update_quad( update_args const & a, int blk, int first )
+{
+    cpusim_block const & o = a.older[blk];
+    cpusim_block const & n = a.newer[blk];
+    cpusim_block & r = a.out[blk];
+
+    __m128 nx = _mm_load_ps( n.x + first ), ny = _mm_load_ps( n.y + first ), nz = _mm_load_ps( n.z + first ), nw = _mm_load_ps( n.w + first );
+
+    float size = (float)a.field.size;
+    __m128 t[3];
+    t[0] = smooth_coord( nx, a.consts.field_scale.x, a.consts.field_offs.x, a.consts.field_sample_scale.x * size );
+    t[1] = smooth_coord( ny, a.consts.field_scale.y, a.consts.field_offs.y, a.consts.field_sample_scale.y * size );
+    t[2] = smooth_coord( nz, a.consts.field_scale.z, a.consts.field_offs.z, a.consts.field_sample_scale.z * size );
+
+    // SSE2 has no gathers, so compute weights and texel indices as vectors,
+    // then do the 8 taps per lane with the texels as float4s.
+    __m128i mask = _mm_set1_epi32( a.field.size - 1 );
+    float frac[3][4];
+    int idx0[3][4], idx1[3][4];
+    for ( int i = 0 ; i < 3 ; i++ )
+    {
+        __m128 fl = floor_ps( t[i] );
+        __m128i i0 = _mm_and_si128( _mm_cvttps_epi32( fl ), mask );
+        __m128i off0, off1;
+        axis_offsets( a, i, i0, &off0, &off1 );
+        _mm_storeu_ps( frac[i], _mm_sub_ps( t[i], fl ) );
+        _mm_storeu_si128( (__m128i *)idx0[i], off0 );
+        _mm_storeu_si128( (__m128i *)idx1[i], off1 );
+    }
+
+    float force[3][4];
+    for ( int lane = 0 ; lane < 4 ; lane++ )
+    {
+        int x0 = idx0[0][lane], x1 = idx1[0][lane];
+        int y0 = idx0[1][lane], y1 = idx1[1][lane];
+        int z0 = idx0[2][lane], z1 = idx1[2][lane];
+        __m128 wx = _mm_set1_ps( frac[0][lane] );
+        __m128 wy = _mm_set1_ps( frac[1][lane] );
+        __m128 wz = _mm_set1_ps( frac[2][lane] );
+
+        __m128 res = filter_texel( a.field, x0, x1, y0, y1, z0, z1, wx, wy, wz );
+        if ( a.next.texels )
+        {
+            // same taps in the field we're blending to, like UpdatePosShader
+            __m128 next = filter_texel( a.next, x0, x1, y0, y1, z0, z1, wx, wy, wz );
+            res = _mm_add_ps( res, _mm_mul_ps( _mm_set1_ps( a.consts.field_blend ), _mm_sub_ps( next, res ) ) );
+        }
+
+        float tmp[4];
+        _mm_storeu_ps( tmp, res );
+        force[0][lane] = tmp[0];
+        force[1][lane] = tmp[1];
+        force[2][lane] = tmp[2];
+    }
+
+    // verlet integration
+    __m128 damping = _mm_set1_ps( a.consts.damping );
+    __m128 accel = _mm_set1_ps( a.consts.accel );
+    __m128 px = _mm_add_ps( nx, _mm_add_ps( _mm_mul_ps( damping, _mm_sub_ps( nx, _mm_load_ps( o.x + first ) ) ), _mm_mul_ps( accel, _mm_loadu_ps( force[0] ) ) ) );
+    __m128 py = _mm_add_ps( ny, _mm_add_ps( _mm_mul_ps( damping, _mm_sub_ps( ny, _mm_load_ps( o.y + first ) ) ), _mm_mul_ps( accel, _mm_loadu_ps( force[1] ) ) ) );
+    __m128 pz = _mm_add_ps( nz, _mm_add_ps( _mm_mul_ps( damping, _mm_sub_ps( nz, _mm_load_ps( o.z + first ) ) ), _mm_mul_ps( accel, _mm_loadu_ps( force[2] ) ) ) );
+
+    // nuke particles if they get too far from the origin
+    __m128 dist_sq = _mm_add_ps( _mm_add_ps( _mm_mul_ps( px, px ), _mm_mul_ps( py, py ) ), _mm_mul_ps( pz, pz ) );
+    __m128 pw = _mm_andnot_ps( _mm_cmpgt_ps( dist_sq, _mm_set1_ps( 16.0f ) ), nw );
+
+    _mm_store_ps( r.x + first, px );
+    _mm_store_ps( r.y + first, py );
+    _mm_store_ps( r.z + first, pz );
+    _mm_store_ps( r.w + first, pw );
+
+    if ( a.vel )
+    {
+        cpusim_block & v = a.vel[blk];
+        _mm_store_ps( v.x + first, _mm_sub_ps( px, nx ) );
+        _mm_store_ps( v.y + first, _mm_sub_ps( py, ny ) );
+        _mm_store_ps( v.z + first, _mm_sub_ps( pz, nz ) );
+        _mm_store_ps( v.w + first, _mm_sub_ps( pw, nw ) );
+        return _mm_movemask_ps( _mm_cmpeq_ps( pw, _mm_setzero_ps() ) );
+    }
+
+    return 0;
+}
+
+static void update_block( update_args const & a, int blk )
+{
+    int dead = update_quad( a, blk, 0 );
+    dead |= update_quad( a, blk, 4 ) << 4;
+    if ( a.vel )
+        a.dead_masks[blk] = (unsigned char)dead;
+}
+
+#else
+
+static void update_block( update_args const & a, int blk )
+{
+    cpusim_block const & o = a.older[blk];
+    cpusim_block const & n = a.newer[blk];
+    cpusim_block & r = a.out[blk];
+    int dead = 0;
+
+    for ( int lane = 0 ; lane < CPUSIM_LANES ; lane++ )
+    {
+        vec3 newer( n.x[lane], n.y[lane], n.z[lane] );
+        vec3 older( o.x[lane], o.y[lane], o.z[lane] );
+        vec3 force = cpusim_sample_force( a.consts, a.field, newer );
+        if ( a.next.texels )
+            force += a.consts.field_blend * ( cpusim_sample_force( a.consts, a.next, newer ) - force );
+
+        vec3 new_pos = newer + a.consts.damping * ( newer - older );
+        new_pos += a.consts.accel * force;
+
+        float w = ( dot( new_pos, new_pos ) > 16.0f ) ? 0.0f : n.w[lane];
+
+        r.x[lane] = new_pos.x;
+        r.y[lane] = new_pos.y;
+        r.z[lane] = new_pos.z;
+        r.w[lane] = w;
+
+        if ( a.vel )
+        {
+            cpusim_block & v = a.vel[blk];
+            v.x[lane] = new_pos.x - newer.x;
+            v.y[lane] = new_pos.y - newer.y;
+            v.z[lane] = new_pos.z - newer.z;
+            v.w[lane] = w - n.w[lane];
+            dead |= ( w == 0.0f ) << lane;
+        }
+    }
+
+    if ( a.vel )
+        a.dead_masks[blk] = (unsigned char)dead;
+}
+
+#endif
+
+static void update_task( void * user, int begin, int end )
+{
+    update_args const & a = *(update_args const *)user;
+    for ( int blk = begin ; blk < end ; blk++ )
+        update_block( a, blk );
+}
+
+void cpusim_update( cpusim * sim, cpusim_consts const & consts, cpusim_field const & field, cpusim_field const * next_field, int num_steps )
+{
+    assert( field.size > 0 && ( field.size & ( field.size - 1 ) ) == 0 );
+
+    update_args args;
+    args.consts = consts;
+    args.field = field;
+    args.next = cpusim_field();
+    if ( next_field && consts.field_blend > 0.0f )
+    {
+        // the taps are shared, so only the texel format may differ
+        assert( next_field->size == field.size && next_field->layout == field.layout );
+        args.next = *next_field;
+    }
+    args.field_log2 = log2_pow2( field.size );
+    int used_blocks = ( sim->extent + CPUSIM_LANES - 1 ) / CPUSIM_LANES;
+
+    for ( int step = 0 ; step < num_steps ; step++ )
+    {
+        args.older = cpusim_pos_buf( sim, 1 );
+        args.newer = cpusim_pos_buf( sim, 0 );
+        args.out = cpusim_pos_buf( sim, 2 );
+
+        // velocity = newest minus previous position; fuse it into the last
+        // position update so we only stream the particles once. Dead
+        // particles get collected in the same pass.
+        args.vel = ( step == num_steps - 1 ) ? sim->bufs[3] : NULL;
+        args.dead_masks = sim->dead_masks;
+
+        parallel_for( used_blocks, kBlocksPerTask, update_task, &args );
+        sim->cur = ( sim->cur + 1 ) % 3;
+    }
+
+    if ( num_steps > 0 )
+    {
+        pack_live( sim );
+        update_row_bounds( sim );
+    }
+}
+
+namespace {
+    // Maps positions to the unwrapped force field cells cpusim_sort keys on,
+    // relative to lo and shifted down to at most kSortAxisBits per axis.
+    struct sort_cells {
+        vec3 scale;
+        vec3 offs;
+        vec3i lo;
+        int shift;
+        int max;
+    };
+}
+
+// Bits of cell coordinate per axis in the sort keys. 5 gives 15 bit keys
+// (two radix passes); cells of a 32^3 field are still sorted exactly, and
+// a 32x32x32 grid of cell groups is plenty to keep rows and texel reads
+// coherent.
+static const int kSortAxisBits = 5;
+
+#if defined(CPUSIM_AVX2)
+
+static void block_keys( sort_cells const & sc, cpusim_block const & b, unsigned * out )
+{
+    float const * pc[3] = { b.x, b.y, b.z };
+    __m256i key = _mm256_setzero_si256();
+    for ( int axis = 0 ; axis < 3 ; axis++ )
+    {
+        __m256 p = _mm256_add_ps( _mm256_mul_ps( _mm256_load_ps( pc[axis] ), _mm256_set1_ps( sc.scale[axis] ) ), _mm256_set1_ps( sc.offs[axis] ) );
+        __m256i c = _mm256_sub_epi32( _mm256_cvttps_epi32( _mm256_floor_ps( p ) ), _mm256_set1_epi32( sc.lo[axis] ) );
+        c = _mm256_srai_epi32( c, sc.shift );
+        c = _mm256_min_epi32( _mm256_max_epi32( c, _mm256_setzero_si256() ), _mm256_set1_epi32( sc.max ) );
+        key = _mm256_or_si256( key, _mm256_slli_epi32( spread_bits( c ), axis ) );
+    }
+    _mm256_storeu_si256( (__m256i *)out, key );
+}
+
+// dest block = the particles at the 8 given slots of src
+static void gather_block( cpusim_block const * src, int const * from, cpusim_block * dest )
+{
+    // slot -> float offset of its x: 32 floats per block, x at the lane
+    __m256i slot = _mm256_loadu_si256( (__m256i const *)from );
+    __m256i off = _mm256_add_epi32( _mm256_slli_epi32( _mm256_srli_epi32( slot, 3 ), 5 ), _mm256_and_si256( slot, _mm256_set1_epi32( 7 ) ) );
+    float const * base = (float const *)src;
+    _mm256_store_ps( dest->x, _mm256_i32gather_ps( base, off, 4 ) );
+    _mm256_store_ps( dest->y, _mm256_i32gather_ps( base + CPUSIM_LANES, off, 4 ) );
+    _mm256_store_ps( dest->z, _mm256_i32gather_ps( base + 2 * CPUSIM_LANES, off, 4 ) );
+    _mm256_store_ps( dest->w, _mm256_i32gather_ps( base + 3 * CPUSIM_LANES, off, 4 ) );
+}
+
+#elif defined(CPUSIM_SSE2)
+
+static void block_keys( sort_cells const & sc, cpusim_block const & b, unsigned * out )
+{
+    float const * pc[3] = { b.x, b.y, b.z };
+    for ( int first = 0 ; first < CPUSIM_LANES ; first += 4 )
+    {
+        __m128i key = _mm_setzero_si128();
+        for ( int axis = 0 ; axis < 3 ; axis++ )
+        {
+            __m128 p = _mm_add_ps( _mm_mul_ps( _mm_load_ps( pc[axis] + first ), _mm_set1_ps( sc.scale[axis] ) ), _mm_set1_ps( sc.offs[axis] ) );
+            __m128i c = _mm_sub_epi32( _mm_cvttps_epi32( floor_ps( p ) ), _mm_set1_epi32( sc.lo[axis] ) );
+            c = _mm_srai_epi32( c, sc.shift );
+
+            // clamp to [0,max]; no pminsd/pmaxsd in SSE2
+            c = _mm_andnot_si128( _mm_srai_epi32( c, 31 ), c );
+            __m128i over = _mm_cmpgt_epi32( c, _mm_set1_epi32( sc.max ) );
+            c = _mm_or_si128( _mm_andnot_si128( over, c ), _mm_and_si128( over, _mm_set1_epi32( sc.max ) ) );
+
+            key = _mm_or_si128( key, _mm_slli_epi32( spread_bits( c ), axis ) );
+        }
+        _mm_storeu_si128( (__m128i *)( out + first ), key );
+    }
+}
+
+#endif
+
+#if !defined(CPUSIM_AVX2)
+
+#if !defined(CPUSIM_SSE2)
+static void block_keys( sort_cells const & sc, cpusim_block const & b, unsigned * out )
+{
+    for ( int lane = 0 ; lane < CPUSIM_LANES ; lane++ )
+    {
+        vec3 p( b.x[lane], b.y[lane], b.z[lane] );
+        int c[3];
+        for ( int axis = 0 ; axis < 3 ; axis++ )
+        {
+            int cell = (int)std::floor( p[axis] * sc.scale[axis] + sc.offs[axis] );
+            c[axis] = std::min( std::max( ( cell - sc.lo[axis] ) >> sc.shift, 0 ), sc.max );
+        }
+        out[lane] = (unsigned)morton_index( c[0], c[1], c[2] );
+    }
+}
+#endif
+
+static void gather_block( cpusim_block const * src, int const * from, cpusim_block * dest )
+{
+    for ( int lane = 0 ; lane < CPUSIM_LANES ; lane++ )
+    {
+        cpusim_block const & sb = src[from[lane] / CPUSIM_LANES];
+        int sl = from[lane] % CPUSIM_LANES;
+        dest->x[lane] = sb.x[sl];
+        dest->y[lane] = sb.y[sl];
+        dest->z[lane] = sb.z[sl];
+        dest->w[lane] = sb.w[sl];
+    }
+}
+
+#endif
+
+// One stable counting sort pass on the 8-bit digit at shift: per-range
+// histograms, a digit-major scan, then every range scatters its own
+// particles. Returns false (and does nothing) if all keys share the digit.
+static bool radix_pass( unsigned const * keys_in, int const * index_in, unsigned * keys_out, int * index_out, int count, int shift )
+{
+    int num_ranges = ( count + kSortRange - 1 ) / kSortRange;
+    std::vector<int> offsets( num_ranges * 256 );
+    int * offs = offsets.data();
+
+    parallel_for( num_ranges, 1, [=]( int begin, int end ) {
+        for ( int r = begin ; r < end ; r++ )
+        {
+            int * hist = offs + r * 256;
+            for ( int i = r * kSortRange ; i < std::min( ( r + 1 ) * kSortRange, count ) ; i++ )
+                hist[( keys_in[i] >> shift ) & 0xff]++;
+        }
+    } );
+
+    int sum = 0;
+    for ( int digit = 0 ; digit < 256 ; digit++ )
+    {
+        int first = sum;
+        for ( int r = 0 ; r < num_ranges ; r++ )
+        {
+            int n = offs[r * 256 + digit];
+            offs[r * 256 + digit] = sum;
+            sum += n;
+        }
+        if ( sum - first == count )
+            return false;
+    }
+
+    parallel_for( num_ranges, 1, [=]( int begin, int end ) {
+        for ( int r = begin ; r < end ; r++ )
+        {
+            int * dest = offs + r * 256;
+            for ( int i = r * kSortRange ; i < std::min( ( r + 1 ) * kSortRange, count ) ; i++ )
+            {
+                int at = dest[( keys_in[i] >> shift ) & 0xff]++;
+                keys_out[at] = keys_in[i];
+                index_out[at] = index_in[i];
+            }
+        }
+    } );
+
+    return true;
+}
+
+void cpusim_sort( cpusim * sim, cpusim_consts const & consts )
+{
+    int count = sim->num_live;
+    if ( count == 0 )
+        return;
+
+    // Cells are force field cells, but not wrapped: particles in the same
+    // cell sample the same texels either way, and unwrapped keys also keep
+    // far-apart particles out of each other's rows. The cell range comes
+    // from the row bounds.
+    cull_box all = empty_box();
+    for ( int row = 0 ; row < sim->num_rows ; row++ )
+    {
+        for ( int axis = 0 ; axis < 3 ; axis++ )
+        {
+            all.min[axis] = std::min( all.min[axis], sim->row_bounds[row].min[axis] );
+            all.max[axis] = std::max( all.max[axis], sim->row_bounds[row].max[axis] );
+        }
+    }
+
+    sort_cells sc;
+    sc.scale = consts.field_scale;
+    sc.offs = consts.field_offs;
+    int cells = 1;
+    for ( int axis = 0 ; axis < 3 ; axis++ )
+    {
+        sc.lo[axis] = (int)std::floor( all.min[axis] * sc.scale[axis] + sc.offs[axis] );
+        int hi = (int)std::floor( all.max[axis] * sc.scale[axis] + sc.offs[axis] );
+        cells = std::max( cells, hi - sc.lo[axis] + 1 );
+    }
+
+    sc.shift = 0;
+    while ( ( ( cells - 1 ) >> sc.shift ) >= ( 1 << kSortAxisBits ) )
+        sc.shift++;
+    sc.max = ( cells - 1 ) >> sc.shift;
+    int key_bits = 3 * log2_pow2( sc.max + 1 );
+
+    // keys for whole blocks; the ones past count just don't get sorted
+    unsigned * keys[2] = { sim->sort_keys, sim->sort_keys + sim->num_particles };
+    int * index[2] = { sim->sort_index, sim->sort_index + sim->num_particles };
+    int used_blocks = ( count + CPUSIM_LANES - 1 ) / CPUSIM_LANES;
+    cpusim_block const * pos = cpusim_pos_buf( sim, 0 );
+    parallel_for( used_blocks, kBlocksPerTask, [=]( int begin, int end ) {
+        for ( int blk = begin ; blk < end ; blk++ )
+        {
+            block_keys( sc, pos[blk], keys[0] + blk * CPUSIM_LANES );
+            for ( int lane = 0 ; lane < CPUSIM_LANES ; lane++ )
+                index[0][blk * CPUSIM_LANES + lane] = blk * CPUSIM_LANES + lane;
+        }
+    } );
+
+    int cur = 0;
+    for ( int shift = 0 ; shift < key_bits ; shift += 8 )
+    {
+        if ( radix_pass( keys[cur], index[cur], keys[cur ^ 1], index[cur ^ 1], count, shift ) )
+            cur ^= 1;
+    }
+
+    // lanes past num_live in the last block stay where they are (and dead)
+    int * order = index[cur];
+    for ( int i = count ; i < used_blocks * CPUSIM_LANES ; i++ )
+        order[i] = i;
+
+    // gather every buffer through sort_buf
+    for ( int b = 0 ; b < 4 ; b++ )
+    {
+        cpusim_block const * src = sim->bufs[b];
+        cpusim_block * tmp = sim->sort_buf;
+        parallel_for( used_blocks, kBlocksPerTask, [=]( int begin, int end ) {
+            for ( int blk = begin ; blk < end ; blk++ )
+                gather_block( src, order + blk * CPUSIM_LANES, tmp + blk );
+        } );
+        memcpy( sim->bufs[b], tmp, used_blocks * sizeof( cpusim_block ) );
+    }
+
+    update_row_bounds( sim );
+}
+
+int cpusim_depth_order( cpusim * sim, mat44 const & view_from_world, unsigned const * rows, int num_rows, unsigned * order )
+{
+    // Key: the top 16 bits of the view-space depth's float bits, flipped so
+    // they sort as unsigned ints (sign, exponent, 7 bits of mantissa). That's
+    // under 1% relative depth error, plenty for ordering cubes for early-Z,
+    // and only takes two radix passes.
+    unsigned * keys[2] = { sim->sort_keys, sim->sort_keys + sim->num_particles };
+    int * index[2] = { sim->sort_index, sim->sort_index + sim->num_particles };
+
+    int count = 0;
+    for ( int r = 0 ; r < num_rows ; r++ )
+    {
+        int first = rows[r] * sim->chunk_size;
+        int n = std::min( sim->chunk_size, sim->num_live - first );
+        if ( n <= 0 )
+            continue;
+
+        // rows start on a block boundary; view space per block, depth is z
+        cpusim_block const * pos = cpusim_pos_buf( sim, 0 ) + first / CPUSIM_LANES;
+        unsigned * row_keys = keys[0] + count;
+        int * row_index = index[0] + count;
+        parallel_for( ( n + CPUSIM_LANES - 1 ) / CPUSIM_LANES, 512, [=]( int begin, int end ) {
+            for ( int blk = begin ; blk < end ; blk++ )
+            {
+                cpusim_block const & b = pos[blk];
+                float vx[CPUSIM_LANES], vy[CPUSIM_LANES], depth[CPUSIM_LANES];
+                transform_points( view_from_world, b.x, b.y, b.z, vx, vy, depth, NULL, CPUSIM_LANES );
+
+                int lanes = std::min( CPUSIM_LANES, n - blk * CPUSIM_LANES );
+                for ( int lane = 0 ; lane < lanes ; lane++ )
+                {
+                    int i = blk * CPUSIM_LANES + lane;
+                    unsigned bits;
+                    memcpy( &bits, &depth[lane], sizeof( bits ) );
+                    bits ^= ( bits & 0x80000000u ) ? 0xffffffffu : 0x80000000u;
+                    row_keys[i] = bits >> 16;
+                    row_index[i] = first + i;
+                }
+            }
+        } );
+        count += n;
+    }
+
+    int cur = 0;
+    for ( int shift = 0 ; shift < 16 ; shift += 8 )
+    {
+        if ( radix_pass( keys[cur], index[cur], keys[cur ^ 1], index[cur ^ 1], count, shift ) )
+            cur ^= 1;
+    }
+
+    memcpy( order, index[cur], count * sizeof( unsigned ) );
+    return count;
+}
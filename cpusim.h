@@ -0,0 +1,160 @@
+#ifndef CPUSIM_H
+#define CPUSIM_H
+
+#include "math.h"
+#include "fieldpack.h"
+#include "cull.h"
+
+// CPU version of the particle update passes (UpdatePosShader and
+// UpdateVelShader in shaders.hlsl), for machines without a GPU.
+//
+// Particle state uses the same arrangement as part_tex[] in main.cpp: three
+// position buffers (triple-buffered for Verlet integration) plus a velocity
+// buffer, each num_rows rows of chunk_size particles. Within a buffer,
+// particles are stored as AoSoA: blocks of CPUSIM_LANES particles with x/y/z/w
+// in separate arrays, so the kernels can work on a whole block per iteration.
+//
+// Updates are split across all cores (see parallel.h) and use AVX2 when the
+// compiler targets it, SSE2 otherwise.
+
+#define CPUSIM_LANES 8
+
+struct cpusim_block {
+    float x[CPUSIM_LANES];
+    float y[CPUSIM_LANES];
+    float z[CPUSIM_LANES];
+    float w[CPUSIM_LANES];
+};
+
+// Same layout and meaning as UpdateConsts in shaders.hlsl, minus the decode
+// scales (those are in cpusim_field).
+struct cpusim_consts {
+    math::vec3 field_scale;
+    float damping;
+    math::vec3 field_offs;
+    float accel;
+    math::vec3 field_sample_scale;
+    float vel_scale;
+    float field_blend; // between field and next_field in cpusim_update
+};
+
+// Texel layouts for the CPU sampler. The 8 taps of a trilinear sample are
+// 2x2x2 neighbors; in the linear layout they're spread over 4 rows in (for
+// big fields) 4 different pages.
+enum cpusim_layout {
+    CPUSIM_LAYOUT_LINEAR,   // x fastest, then y, then z (same as the texture)
+    CPUSIM_LAYOUT_MORTON,   // Z-order: texel index interleaves the x, y and z bits (x lowest)
+    CPUSIM_LAYOUT_CORNERS,  // per cell, its 8 corner texels (2x2x2, x fastest), cells in Z-order.
+                            // 8x the memory, but each sample reads one brick.
+};
+
+// Force field: size^3 texels (size must be a pow2), addressed with wrapping.
+// Sampled like tex_force with a MIN_MAG_LINEAR sampler. The texels can be in
+// any fieldpack format; scale is only used for FIELDPACK_SNORM8.
+struct cpusim_field {
+    int size;
+    void const * texels;
+    fieldpack_format format;
+    float scale;
+    cpusim_layout layout;
+};
+
+struct cpusim {
+    int chunk_size; // particles per row (multiple of CPUSIM_LANES)
+    int num_rows;
+    int num_particles;
+    int num_blocks;
+
+    // bufs[0..2] are positions, bufs[3] is velocity (newest minus previous position).
+    cpusim_block * bufs[4];
+    int cur; // index of newest position buffer
+
+    // Live particles are kept packed: after an update, slots [0,num_live)
+    // are live and everything from there on is dead (w == 0) in the
+    // position buffers. The update pass records which lanes died, a prefix-sum
+    // compaction lists the holes below num_live and the live particles past
+    // it, and those get moved into the holes. Spawns append at "extent";
+    // updates only touch slots below it.
+    int num_live;
+    int extent;
+    unsigned char * dead_masks; // per block, from the last update
+    int * holes;                // scratch for the compaction
+    int * movers;
+
+    // scratch for cpusim_sort and cpusim_depth_order
+    unsigned * sort_keys;   // 2 * num_particles
+    int * sort_index;       // 2 * num_particles
+    cpusim_block * sort_buf;
+
+    // World-space bounds of the cubes the renderer makes from each row (see
+    // RenderCubeVertexShader), as of the last update. Rows without live
+    // particles are empty.
+    cull_box * row_bounds;
+};
+
+// Creates a simulation with all particles zeroed (i.e. dead).
+cpusim * cpusim_create( int chunk_size, int num_rows );
+void cpusim_destroy( cpusim * sim );
+
+// Position buffer "age" steps older than the newest one (age = 0..2).
+cpusim_block * cpusim_pos_buf( cpusim * sim, int age );
+
+// Sets particles [first, first+count) to the given previous/current positions,
+// the same way main.cpp spawns particles into part_tex.
+void cpusim_spawn( cpusim * sim, int first, int count, math::vec4 const * pos_old, math::vec4 const * pos_new );
+
+// Spawns up to count particles into free (dead) slots, so live particles
+// are never overwritten. Returns how many were spawned; the rest of the
+// batch is dropped if the pool is full. (cpusim_spawn can overwrite
+// anything, so after it the next update walks the whole pool again.)
+int cpusim_spawn_free( cpusim * sim, int count, math::vec4 const * pos_old, math::vec4 const * pos_new );
+
+// Number of free slots left for cpusim_spawn_free.
+int cpusim_num_free( cpusim const * sim );
+
+// Runs num_steps position updates followed by the velocity update, then
+// packs the live particles (which moves them to different slots) and
+// updates row_bounds. With a next_field (NULL for none) and a nonzero
+// consts.field_blend, forces are blended between the two samples like the
+// GPU path does; next_field needs the same size and layout as field.
+void cpusim_update( cpusim * sim, cpusim_consts const & consts, cpusim_field const & field, cpusim_field const * next_field, int num_steps );
+
+// Sorts the live particles by the Morton index of the force field cell
+// they're in (cells as mapped by consts, but not wrapped), so particles
+// close in memory sample close texels and rows get tight bounds. Stable
+// LSD radix sort, 8 bits per pass; permutes all four buffers the same way
+// and updates row_bounds. The order decays as particles move and die, so
+// call it every few frames.
+void cpusim_sort( cpusim * sim, cpusim_consts const & consts );
+
+// Writes the slots of the live particles in the given rows (e.g. the rows
+// that survived culling) to order, nearest first by depth along
+// view_from_world, so they can be drawn front to back. Returns how many
+// there were. Shares the scratch buffers with cpusim_sort.
+int cpusim_depth_order( cpusim * sim, math::mat44 const & view_from_world, unsigned const * rows, int num_rows, unsigned * order );
+
+// Converts particles [first, first+count) of a buffer to float4s (e.g. for
+// texture upload).
+void cpusim_read( cpusim_block const * buf, int first, int count, math::vec4 * dest );
+
+// Same for just the live particles (as of the last update). Returns how
+// many there were (sim->num_live).
+int cpusim_read_live( cpusim const * sim, cpusim_block const * buf, math::vec4 * dest );
+
+// Copies a CPUSIM_LAYOUT_LINEAR field into the given layout. The result owns
+// its texels; free them with cpusim_free_field.
+cpusim_field cpusim_convert_field( cpusim_field const & field, cpusim_layout layout );
+void cpusim_free_field( cpusim_field * field );
+
+// The same in pieces, to spread a conversion over several frames:
+// cpusim_alloc_field makes an uninitialized field, and
+// cpusim_convert_field_range fills in the texels that come from z slices
+// [z_begin,z_end) of src (which has to be complete: CORNERS bricks read
+// the next slice too).
+cpusim_field cpusim_alloc_field( int size, fieldpack_format format, float scale, cpusim_layout layout );
+void cpusim_convert_field_range( cpusim_field * dst, cpusim_field const & src, int z_begin, int z_end );
+
+// Scalar reference for the force lookup in UpdatePosShader.
+math::vec3 cpusim_sample_force( cpusim_consts const & consts, cpusim_field const & field, math::vec3 const & pos );
+
+#endif
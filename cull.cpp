@@ -0,0 +1,63 @@
+#include "cull.h"
+#include <math.h>
+
+using namespace math;
+
+static const int kCullBatch = 64; // boxes per batch (SoA)
+
+int cull_boxes(mat44 const& clip_from_world, cull_box const* boxes, int count, unsigned int* visible)
+{
+    // a point is inside iff dot(plane, (p, 1)) >= 0 for all six planes; in
+    // clip space those dot products are w+x, w-x, w+y, w-y, z and w-z.
+    vec4 r0 = clip_from_world.get_row(0);
+    vec4 r1 = clip_from_world.get_row(1);
+    vec4 r2 = clip_from_world.get_row(2);
+    vec4 r3 = clip_from_world.get_row(3);
+    vec4 planes[6] = { r3 + r0, r3 - r0, r3 + r1, r3 - r1, r2, r3 - r2 };
+
+    // how far a box reaches along each plane normal: abs(normal) . extent
+    mat44 reach[2] = { mat44::diag(0.0f, 0.0f, 0.0f, 0.0f), mat44::diag(0.0f, 0.0f, 0.0f, 0.0f) };
+    for (int p = 0; p < 6; p++)
+        reach[p / 4].set_row(p % 4, vec4(fabsf(planes[p].x), fabsf(planes[p].y), fabsf(planes[p].z), 0.0f));
+
+    float center[3][kCullBatch], extent[3][kCullBatch];
+    float clip[4][kCullBatch], radius[8][kCullBatch];
+    int index[kCullBatch];
+
+    int num_visible = 0;
+    int i = 0;
+    while (i < count) {
+        int n = 0;
+        for (; i < count && n < kCullBatch; i++) {
+            cull_box const& box = boxes[i];
+            if (box.min.x > box.max.x || box.min.y > box.max.y || box.min.z > box.max.z)
+                continue;
+
+            for (int c = 0; c < 3; c++) {
+                center[c][n] = 0.5f * (box.min[c] + box.max[c]);
+                extent[c][n] = 0.5f * (box.max[c] - box.min[c]);
+            }
+            index[n++] = i;
+        }
+
+        // center/half-extent test: the box is out if even its corner
+        // furthest along the plane normal is behind the plane.
+        transform_points(clip_from_world, center[0], center[1], center[2], clip[0], clip[1], clip[2], clip[3], n);
+        transform_points(reach[0], extent[0], extent[1], extent[2], radius[0], radius[1], radius[2], radius[3], n);
+        transform_points(reach[1], extent[0], extent[1], extent[2], radius[4], radius[5], radius[6], NULL, n);
+
+        for (int k = 0; k < n; k++) {
+            float x = clip[0][k], y = clip[1][k], z = clip[2][k], w = clip[3][k];
+            bool inside = w + x + radius[0][k] >= 0.0f
+                && w - x + radius[1][k] >= 0.0f
+                && w + y + radius[2][k] >= 0.0f
+                && w - y + radius[3][k] >= 0.0f
+                && z + radius[4][k] >= 0.0f
+                && w - z + radius[5][k] >= 0.0f;
+            if (inside)
+                visible[num_visible++] = index[k];
+        }
+    }
+
+    return num_visible;
+}
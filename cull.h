@@ -0,0 +1,19 @@
+#ifndef CULL_H
+#define CULL_H
+
+#include "math.h"
+
+// Axis-aligned box; empty if min > max on any axis.
+struct cull_box {
+    math::vec3 min;
+    math::vec3 max;
+};
+
+// Tests boxes against the view frustum of clip_from_world (D3D clip space,
+// -w <= x,y <= w and 0 <= z <= w) and writes the indices of the ones that
+// may be visible to visible[], in order. Returns how many there were.
+// Conservative: a box near a frustum edge can pass without being visible,
+// empty boxes never pass.
+int cull_boxes(math::mat44 const& clip_from_world, cull_box const* boxes, int count, unsigned int* visible);
+
+#endif
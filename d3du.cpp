@@ -1,7 +1,11 @@
+// D3D11 backend for d3du. (Elsewhere, d3du_null.cpp provides a headless one.)
+#ifdef _WIN32
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <d3d11.h>
 #include <d3dcompiler.h>
+#include <stdio.h>
 #include <string.h>
 #include "d3du.h"
 #include "util.h"
@@ -192,12 +196,16 @@ int d3du_handle_events( d3du_context * ctx )
         DispatchMessage( &msg );
     }
 
+    if ( ctx->frame_limit && ctx->frames_done >= ctx->frame_limit )
+        ok = 0;
+
     return ok;
 }
 
 void d3du_swap_buffers( d3du_context * ctx, bool vsync )
 {
    ctx->swap->Present( vsync ? 1 : 0, 0 );
+   ctx->frames_done++;
 }
 
 D3D11_VIEWPORT d3du_full_tex2d_viewport( ID3D11Texture2D * tex )
@@ -633,7 +641,7 @@ d3du_timer * d3du_timer_create( d3du_context * ctx, size_t warmup_frames )
     timer->issue_idx = 0;
     timer->retire_idx = 0;
     timer->warmup_frames = warmup_frames;
-    timer->stats = run_stats_create();
+    timer->stats = run_stats_create_streaming();
     return timer;
 }
 
@@ -679,6 +687,127 @@ void d3du_timer_report( d3du_context * ctx, d3du_timer * timer, char const * lab
     run_stats_report( timer->stats, label );
 }
 
+struct d3du_pixel_counter_group
+{
+    ID3D11Query * stats;
+    ID3D11Query * occlusion;
+};
+
+struct d3du_pixel_counter
+{
+    d3du_pixel_counter_group grp[TIMER_SLOTS];
+    size_t issue_idx;
+    size_t retire_idx;
+    size_t warmup_frames;
+    double num_pixels;
+    run_stats * shaded; // pixel shader invocations per screen pixel
+    run_stats * passed; // samples that passed the depth test per screen pixel
+};
+
+static d3du_pixel_counter_group * pixel_counter_get( d3du_pixel_counter * counter, size_t index )
+{
+    return &counter->grp[ index & ( TIMER_SLOTS - 1 ) ];
+}
+
+static void pixel_counter_ensure_max_in_flight( d3du_context * ctx, d3du_pixel_counter * counter, size_t max_in_flight )
+{
+    while ( ( counter->issue_idx - counter->retire_idx ) > max_in_flight )
+    {
+        // retire oldest query pair in flight
+        d3du_pixel_counter_group * grp = pixel_counter_get( counter, counter->retire_idx );
+        D3D11_QUERY_DATA_PIPELINE_STATISTICS stats;
+        UINT64 passed;
+        HRESULT hr;
+
+        while ( ( hr = ctx->ctx->GetData( grp->stats, &stats, sizeof( stats ), 0 ) ) != S_OK );
+        while ( ( hr = ctx->ctx->GetData( grp->occlusion, &passed, sizeof( passed ), 0 ) ) != S_OK );
+
+        if ( counter->retire_idx >= counter->warmup_frames )
+        {
+            run_stats_record( counter->shaded, (float) ( stats.PSInvocations / counter->num_pixels ) );
+            run_stats_record( counter->passed, (float) ( passed / counter->num_pixels ) );
+        }
+
+        counter->retire_idx++;
+    }
+}
+
+d3du_pixel_counter * d3du_pixel_counter_create( d3du_context * ctx, size_t warmup_frames )
+{
+    d3du_pixel_counter * counter = new d3du_pixel_counter;
+
+    for ( size_t i = 0 ; i < TIMER_SLOTS ; i++ )
+    {
+        D3D11_QUERY_DESC desc = {};
+        HRESULT hr;
+        desc.Query = D3D11_QUERY_PIPELINE_STATISTICS;
+        hr = ctx->dev->CreateQuery( &desc, &counter->grp[i].stats );
+        if ( FAILED( hr ) ) panic( "CreateQuery failed.\n" );
+
+        desc.Query = D3D11_QUERY_OCCLUSION;
+        hr = ctx->dev->CreateQuery( &desc, &counter->grp[i].occlusion );
+        if ( FAILED( hr ) ) panic( "CreateQuery failed.\n" );
+    }
+
+    counter->issue_idx = 0;
+    counter->retire_idx = 0;
+    counter->warmup_frames = warmup_frames;
+    counter->num_pixels = (double) ctx->default_vp.Width * ctx->default_vp.Height;
+    counter->shaded = run_stats_create_streaming();
+    counter->passed = run_stats_create_streaming();
+    return counter;
+}
+
+void d3du_pixel_counter_destroy( d3du_pixel_counter * counter )
+{
+    if ( counter )
+    {
+        for ( size_t i = 0 ; i < TIMER_SLOTS ; i++ )
+        {
+            safe_release( &counter->grp[i].stats );
+            safe_release( &counter->grp[i].occlusion );
+        }
+
+        run_stats_destroy( counter->shaded );
+        run_stats_destroy( counter->passed );
+        delete counter;
+    }
+}
+
+void d3du_pixel_counter_bracket_begin( d3du_context * ctx, d3du_pixel_counter * counter )
+{
+    pixel_counter_ensure_max_in_flight( ctx, counter, TIMER_SLOTS - 1 );
+
+    d3du_pixel_counter_group * grp = pixel_counter_get( counter, counter->issue_idx );
+
+    ctx->ctx->Begin( grp->stats );
+    ctx->ctx->Begin( grp->occlusion );
+    counter->issue_idx++;
+}
+
+void d3du_pixel_counter_bracket_end( d3du_context * ctx, d3du_pixel_counter * counter )
+{
+    d3du_pixel_counter_group * grp = pixel_counter_get( counter, counter->issue_idx - 1 );
+
+    ctx->ctx->End( grp->occlusion );
+    ctx->ctx->End( grp->stats );
+}
+
+void d3du_pixel_counter_report( d3du_context * ctx, d3du_pixel_counter * counter, char const * label )
+{
+    char desc[256];
+    pixel_counter_ensure_max_in_flight( ctx, counter, 0 );
+
+    _snprintf( desc, sizeof( desc ), "%s shaded/pixel", label );
+    desc[sizeof( desc ) - 1] = 0;
+    run_stats_report( counter->shaded, desc );
+
+    _snprintf( desc, sizeof( desc ), "%s depth passed/pixel", label );
+    desc[sizeof( desc ) - 1] = 0;
+    run_stats_report( counter->passed, desc );
+}
+
 // @cdep pre $set(c8sysincludes, -I$dxPath/include $c8sysincludes)
 // @cdep pre $set(csysincludes64EMT, -I$dxPath/include $csysincludes64EMT)
 
+#endif
@@ -1,10 +1,10 @@
 #ifndef D3DU_H
 #define D3DU_H
 
-// you need to include windows.h and d3d11.h first.
+// you need to include d3du_platform.h (or windows.h and d3d11.h) first.
 
 struct d3du_context {
-   HWND hwnd;
+   HWND hwnd; // NULL when headless
    ID3D11Device * dev;
    ID3D11DeviceContext * ctx;
    IDXGISwapChain * swap;
@@ -16,9 +16,17 @@ struct d3du_context {
    ID3D11DepthStencilView * depthbuf_dsv;
 
    D3D11_VIEWPORT default_vp;
+
+   int frame_limit; // if nonzero, d3du_handle_events requests exit after this many frames
+   int frames_done; // d3du_swap_buffers calls so far
 };
 
-// Creates a D3DU context and opens a window with given title and width/height
+// Default frame limit of the headless backend.
+#define D3DU_HEADLESS_FRAMES 1000
+
+// Creates a D3DU context and opens a window with given title and width/height.
+// The headless backend opens no window, never waits for vsync and starts
+// with frame_limit = D3DU_HEADLESS_FRAMES.
 d3du_context * d3du_init( char const * title, int w, int h, D3D_FEATURE_LEVEL feature_level );
 
 // Shuts down a D3DU context and frees it.
@@ -102,5 +110,19 @@ void d3du_timer_bracket_begin( d3du_context * ctx, d3du_timer * timer );
 void d3du_timer_bracket_end( d3du_context * ctx, d3du_timer * timer );
 void d3du_timer_report( d3du_context * ctx, d3du_timer * timer, char const * label );
 
+// D3DU pixel counter measures overdraw: for the D3D calls in a bracket, how
+// many pixel shader invocations there were and how many samples passed the
+// depth test, both per screen pixel (of the default viewport). Fragments
+// rejected by early-Z don't get shaded, so the gap between the two counts
+// is late depth rejections, and shaded/pixel above the fraction of the
+// screen covered is overdraw that depth testing didn't save.
+typedef struct d3du_pixel_counter d3du_pixel_counter;
+
+d3du_pixel_counter * d3du_pixel_counter_create( d3du_context * ctx, size_t warmup_frames );
+void d3du_pixel_counter_destroy( d3du_pixel_counter * counter );
+void d3du_pixel_counter_bracket_begin( d3du_context * ctx, d3du_pixel_counter * counter );
+void d3du_pixel_counter_bracket_end( d3du_context * ctx, d3du_pixel_counter * counter );
+void d3du_pixel_counter_report( d3du_context * ctx, d3du_pixel_counter * counter, char const * label );
+
 #endif
 
@@ -0,0 +1,682 @@
+// Headless null backend for d3du: no window, no GPU. See d3du_null.h.
+#ifndef _WIN32
+
+#include "d3du_platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "d3du.h"
+#include "util.h"
+
+BOOL QueryPerformanceCounter( LARGE_INTEGER * count )
+{
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    count->QuadPart = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return TRUE;
+}
+
+BOOL QueryPerformanceFrequency( LARGE_INTEGER * freq )
+{
+    freq->QuadPart = 1000000000;
+    return TRUE;
+}
+
+UINT d3du_null_format_bytes( DXGI_FORMAT fmt )
+{
+    switch ( fmt )
+    {
+    case DXGI_FORMAT_R8_UNORM:
+        return 1;
+
+    case DXGI_FORMAT_R16_UINT:
+        return 2;
+
+    case DXGI_FORMAT_R8G8B8A8_UNORM:
+    case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+    case DXGI_FORMAT_R8G8B8A8_SNORM:
+    case DXGI_FORMAT_D32_FLOAT:
+    case DXGI_FORMAT_R32_FLOAT:
+    case DXGI_FORMAT_R32_UINT:
+        return 4;
+
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+        return 8;
+
+    case DXGI_FORMAT_R32G32B32A32_FLOAT:
+        return 16;
+
+    default:
+        panic( "unsupported DXGI format %d\n", fmt );
+        return 0;
+    }
+}
+
+ID3D11Resource::ID3D11Resource( UINT w, UINT h, UINT d, DXGI_FORMAT fmt, UINT bind_flags )
+    : width( w ), height( h ), depth( d ), format( fmt ), bind_flags( bind_flags )
+{
+    row_pitch = w * d3du_null_format_bytes( fmt );
+    depth_pitch = row_pitch * h;
+    data = (unsigned char *)calloc( (size_t)depth_pitch * d, 1 );
+    if ( !data )
+        panic( "out of memory for %ux%ux%u resource\n", w, h, d );
+}
+
+ID3D11Resource::~ID3D11Resource()
+{
+    free( data );
+}
+
+d3du_null_shader::d3du_null_shader( char const * profile_in, char const * entrypt_in )
+{
+    snprintf( profile, sizeof( profile ), "%s", profile_in );
+    snprintf( entrypt, sizeof( entrypt ), "%s", entrypt_in );
+}
+
+ID3DBlob::ID3DBlob( void const * data_in, size_t size_in )
+    : data( malloc( size_in ) ), size( size_in )
+{
+    memcpy( data, data_in, size );
+}
+
+ID3DBlob::~ID3DBlob()
+{
+    free( data );
+}
+
+// Copies the box (whole resource if NULL) between resource memory and a
+// linear layout with the given pitches.
+static void copy_box( ID3D11Resource * res, D3D11_BOX const * box, unsigned char * mem, UINT row_pitch, UINT depth_pitch, bool to_res )
+{
+    D3D11_BOX full = { 0, 0, 0, res->width, res->height, res->depth };
+    if ( !box )
+        box = &full;
+
+    if ( box->right > res->width || box->bottom > res->height || box->back > res->depth )
+        panic( "d3du_null: box out of range\n" );
+
+    UINT texel_bytes = d3du_null_format_bytes( res->format );
+    size_t row_bytes = (size_t)( box->right - box->left ) * texel_bytes;
+    if ( !row_pitch )
+        row_pitch = (UINT)row_bytes;
+    if ( !depth_pitch )
+        depth_pitch = row_pitch * ( box->bottom - box->top );
+
+    for ( UINT z = box->front ; z < box->back ; z++ )
+    {
+        for ( UINT y = box->top ; y < box->bottom ; y++ )
+        {
+            unsigned char * r = res->data + z * res->depth_pitch + y * res->row_pitch + box->left * texel_bytes;
+            unsigned char * m = mem + (size_t)( z - box->front ) * depth_pitch + (size_t)( y - box->top ) * row_pitch;
+            if ( to_res )
+                memcpy( r, m, row_bytes );
+            else
+                memcpy( m, r, row_bytes );
+        }
+    }
+}
+
+ID3D11DeviceContext::ID3D11DeviceContext()
+{
+    ClearState();
+    num_draws = 0;
+    num_instances = 0;
+    ps_invocations = 0;
+    samples_passed = 0;
+}
+
+void ID3D11DeviceContext::ClearState()
+{
+    topology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
+    index_buf = NULL;
+    index_format = DXGI_FORMAT_UNKNOWN;
+    index_offset = 0;
+    vs = NULL;
+    ps = NULL;
+    raster = NULL;
+    memset( &viewport, 0, sizeof( viewport ) );
+    rtv = NULL;
+    dsv = NULL;
+
+    for ( UINT i = 0 ; i < D3DU_NULL_SLOTS ; i++ )
+    {
+        vs_srvs[i] = ps_srvs[i] = NULL;
+        vs_cbufs[i] = ps_cbufs[i] = NULL;
+        ps_samplers[i] = NULL;
+    }
+}
+
+HRESULT ID3D11DeviceContext::Map( ID3D11Resource * res, UINT subres, D3D11_MAP /*type*/, UINT /*flags*/, D3D11_MAPPED_SUBRESOURCE * mapped )
+{
+    if ( subres != 0 )
+        return E_INVALIDARG;
+
+    mapped->pData = res->data;
+    mapped->RowPitch = res->row_pitch;
+    mapped->DepthPitch = res->depth_pitch;
+    return S_OK;
+}
+
+void ID3D11DeviceContext::Unmap( ID3D11Resource * /*res*/, UINT /*subres*/ )
+{
+}
+
+void ID3D11DeviceContext::UpdateSubresource( ID3D11Resource * res, UINT subres, D3D11_BOX const * box, void const * data, UINT row_pitch, UINT depth_pitch )
+{
+    if ( subres != 0 )
+        panic( "d3du_null: only mip 0 is stored\n" );
+
+    copy_box( res, box, (unsigned char *)data, row_pitch, depth_pitch, true );
+}
+
+void ID3D11DeviceContext::CopyResource( ID3D11Resource * dest, ID3D11Resource * src )
+{
+    if ( dest->format != src->format || dest->width != src->width || dest->height != src->height || dest->depth != src->depth )
+        panic( "d3du_null: CopyResource between different resources\n" );
+
+    memcpy( dest->data, src->data, (size_t)src->depth_pitch * src->depth );
+}
+
+void ID3D11DeviceContext::IASetPrimitiveTopology( D3D11_PRIMITIVE_TOPOLOGY topo )
+{
+    topology = topo;
+}
+
+void ID3D11DeviceContext::IASetIndexBuffer( ID3D11Buffer * buf, DXGI_FORMAT fmt, UINT offset )
+{
+    index_buf = buf;
+    index_format = fmt;
+    index_offset = offset;
+}
+
+template<typename T>
+static void set_slots( T * * slots, UINT start, UINT count, T * const * items )
+{
+    if ( start + count > D3DU_NULL_SLOTS )
+        panic( "d3du_null: slot %u out of range\n", start + count - 1 );
+
+    for ( UINT i = 0 ; i < count ; i++ )
+        slots[start + i] = items[i];
+}
+
+void ID3D11DeviceContext::VSSetShader( ID3D11VertexShader * shader, void * const * /*class_insts*/, UINT /*num_class_insts*/ )
+{
+    vs = shader;
+}
+
+void ID3D11DeviceContext::VSSetShaderResources( UINT start, UINT count, ID3D11ShaderResourceView * const * srvs )
+{
+    set_slots( vs_srvs, start, count, srvs );
+}
+
+void ID3D11DeviceContext::VSSetConstantBuffers( UINT start, UINT count, ID3D11Buffer * const * bufs )
+{
+    set_slots( vs_cbufs, start, count, bufs );
+}
+
+void ID3D11DeviceContext::RSSetState( ID3D11RasterizerState * state )
+{
+    raster = state;
+}
+
+void ID3D11DeviceContext::RSSetViewports( UINT count, D3D11_VIEWPORT const * vps )
+{
+    if ( count )
+        viewport = vps[0];
+}
+
+void ID3D11DeviceContext::PSSetShader( ID3D11PixelShader * shader, void * const * /*class_insts*/, UINT /*num_class_insts*/ )
+{
+    ps = shader;
+}
+
+void ID3D11DeviceContext::PSSetShaderResources( UINT start, UINT count, ID3D11ShaderResourceView * const * srvs )
+{
+    set_slots( ps_srvs, start, count, srvs );
+}
+
+void ID3D11DeviceContext::PSSetConstantBuffers( UINT start, UINT count, ID3D11Buffer * const * bufs )
+{
+    set_slots( ps_cbufs, start, count, bufs );
+}
+
+void ID3D11DeviceContext::PSSetSamplers( UINT start, UINT count, ID3D11SamplerState * const * samplers )
+{
+    set_slots( ps_samplers, start, count, samplers );
+}
+
+void ID3D11DeviceContext::OMSetRenderTargets( UINT count, ID3D11RenderTargetView * const * rtvs, ID3D11DepthStencilView * dsv_in )
+{
+    rtv = count ? rtvs[0] : NULL;
+    dsv = dsv_in;
+}
+
+void ID3D11DeviceContext::ClearRenderTargetView( ID3D11RenderTargetView * view, float const color[4] )
+{
+    ID3D11Resource * res = view->resource;
+    UINT texel_bytes = d3du_null_format_bytes( res->format );
+    unsigned char texel[16];
+
+    switch ( res->format )
+    {
+    case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+        linear_to_srgb8( texel, 4, color, 16, 1, 1 );
+        break;
+
+    case DXGI_FORMAT_R32G32B32A32_FLOAT:
+        memcpy( texel, color, 16 );
+        break;
+
+    default:
+        panic( "d3du_null: can't clear format %d\n", res->format );
+    }
+
+    size_t count = (size_t)res->width * res->height * res->depth;
+    for ( size_t i = 0 ; i < count ; i++ )
+        memcpy( res->data + i * texel_bytes, texel, texel_bytes );
+}
+
+void ID3D11DeviceContext::ClearDepthStencilView( ID3D11DepthStencilView * view, UINT flags, float depth, UINT8 /*stencil*/ )
+{
+    // no stencil stored
+    if ( !( flags & D3D11_CLEAR_DEPTH ) )
+        return;
+
+    ID3D11Resource * res = view->resource;
+    float * texels = (float *)res->data;
+    size_t count = (size_t)res->width * res->height;
+    for ( size_t i = 0 ; i < count ; i++ )
+        texels[i] = depth;
+}
+
+struct d3du_null_draw_handler
+{
+    char vs_entrypt[64];
+    char ps_entrypt[64];
+    d3du_null_draw_func * func;
+    void * user;
+};
+
+static const int D3DU_NULL_MAX_DRAW_HANDLERS = 16;
+static d3du_null_draw_handler s_draw_handlers[D3DU_NULL_MAX_DRAW_HANDLERS];
+static int s_num_draw_handlers;
+
+static d3du_null_draw_handler * find_draw_handler( char const * vs_entrypt, char const * ps_entrypt )
+{
+    for ( int i = 0 ; i < s_num_draw_handlers ; i++ )
+    {
+        d3du_null_draw_handler * h = &s_draw_handlers[i];
+        if ( strcmp( h->vs_entrypt, vs_entrypt ) == 0 && strcmp( h->ps_entrypt, ps_entrypt ) == 0 )
+            return h;
+    }
+
+    return NULL;
+}
+
+void d3du_null_set_draw_handler( char const * vs_entrypt, char const * ps_entrypt, d3du_null_draw_func * func, void * user )
+{
+    d3du_null_draw_handler * h = find_draw_handler( vs_entrypt, ps_entrypt );
+    if ( !h )
+    {
+        if ( s_num_draw_handlers == D3DU_NULL_MAX_DRAW_HANDLERS )
+            panic( "d3du_null: too many draw handlers\n" );
+
+        h = &s_draw_handlers[s_num_draw_handlers++];
+        strncpy( h->vs_entrypt, vs_entrypt, sizeof( h->vs_entrypt ) - 1 );
+        h->vs_entrypt[sizeof( h->vs_entrypt ) - 1] = 0;
+        strncpy( h->ps_entrypt, ps_entrypt, sizeof( h->ps_entrypt ) - 1 );
+        h->ps_entrypt[sizeof( h->ps_entrypt ) - 1] = 0;
+    }
+
+    h->func = func;
+    h->user = user;
+}
+
+static void execute_draw( ID3D11DeviceContext * ctx, UINT index_count_per_instance, UINT instance_count, UINT start_index, INT base_vertex, UINT start_instance )
+{
+    if ( !ctx->vs || !ctx->ps )
+        return;
+
+    d3du_null_draw_handler * h = find_draw_handler( ctx->vs->entrypt, ctx->ps->entrypt );
+    if ( h && h->func )
+        h->func( h->user, ctx, index_count_per_instance, instance_count, start_index, base_vertex, start_instance );
+}
+
+void ID3D11DeviceContext::Draw( UINT vertex_count, UINT start_vertex )
+{
+    num_draws++;
+    num_instances++;
+    execute_draw( this, vertex_count, 1, start_vertex, 0, 0 );
+}
+
+void ID3D11DeviceContext::DrawIndexedInstanced( UINT index_count_per_instance, UINT instance_count, UINT start_index, INT base_vertex, UINT start_instance )
+{
+    num_draws++;
+    num_instances += instance_count;
+    execute_draw( this, index_count_per_instance, instance_count, start_index, base_vertex, start_instance );
+}
+
+bool d3du_null_write_tga( ID3D11Resource * tex, char const * filename )
+{
+    if ( tex->format != DXGI_FORMAT_R8G8B8A8_UNORM && tex->format != DXGI_FORMAT_R8G8B8A8_UNORM_SRGB )
+        panic( "d3du_null_write_tga: need an RGBA8 texture\n" );
+
+    FILE * f = fopen( filename, "wb" );
+    if ( !f )
+        return false;
+
+    // uncompressed true-color, 8 bits of alpha, top-down rows
+    unsigned char header[18] = {};
+    header[2] = 2;
+    header[12] = (unsigned char) ( tex->width & 0xff );
+    header[13] = (unsigned char) ( tex->width >> 8 );
+    header[14] = (unsigned char) ( tex->height & 0xff );
+    header[15] = (unsigned char) ( tex->height >> 8 );
+    header[16] = 32;
+    header[17] = 0x28;
+    fwrite( header, sizeof( header ), 1, f );
+
+    // TGA is BGRA
+    unsigned char * row = new unsigned char[tex->width * 4];
+    for ( UINT y = 0 ; y < tex->height ; y++ )
+    {
+        unsigned char const * src = tex->data + (size_t)y * tex->row_pitch;
+        for ( UINT x = 0 ; x < tex->width ; x++ )
+        {
+            row[x*4 + 0] = src[x*4 + 2];
+            row[x*4 + 1] = src[x*4 + 1];
+            row[x*4 + 2] = src[x*4 + 0];
+            row[x*4 + 3] = src[x*4 + 3];
+        }
+        fwrite( row, tex->width * 4, 1, f );
+    }
+    delete[] row;
+
+    bool ok = !ferror( f );
+    return ( fclose( f ) == 0 ) && ok;
+}
+
+// ---- d3du API
+
+d3du_context * d3du_init( char const * title, int w, int h, D3D_FEATURE_LEVEL /*feature_level*/ )
+{
+    d3du_context * ctx = new d3du_context;
+    memset( ctx, 0, sizeof( *ctx ) );
+
+    ctx->dev = new ID3D11Device;
+    ctx->ctx = new ID3D11DeviceContext;
+    ctx->swap = new IDXGISwapChain;
+
+    ctx->backbuf = new ID3D11Texture2D( w, h, DXGI_FORMAT_R8G8B8A8_UNORM_SRGB, D3D11_BIND_RENDER_TARGET );
+    ctx->depthbuf = new ID3D11Texture2D( w, h, DXGI_FORMAT_D32_FLOAT, D3D11_BIND_DEPTH_STENCIL );
+    ctx->backbuf_rtv = new ID3D11RenderTargetView( ctx->backbuf );
+    ctx->depthbuf_dsv = new ID3D11DepthStencilView( ctx->depthbuf );
+
+    ctx->default_vp = d3du_full_tex2d_viewport( ctx->backbuf );
+    ctx->ctx->OMSetRenderTargets( 1, &ctx->backbuf_rtv, ctx->depthbuf_dsv );
+    ctx->ctx->RSSetViewports( 1, &ctx->default_vp );
+
+    ctx->frame_limit = D3DU_HEADLESS_FRAMES;
+
+    printf( "%s: headless, %dx%d\n", title, w, h );
+    return ctx;
+}
+
+void d3du_shutdown( d3du_context * ctx )
+{
+    ctx->ctx->ClearState();
+    ctx->backbuf_rtv->Release();
+    ctx->depthbuf_dsv->Release();
+    ctx->backbuf->Release();
+    ctx->depthbuf->Release();
+    ctx->swap->Release();
+    ctx->ctx->Release();
+    ctx->dev->Release();
+    delete ctx;
+}
+
+int d3du_handle_events( d3du_context * ctx )
+{
+    return !ctx->frame_limit || ctx->frames_done < ctx->frame_limit;
+}
+
+void d3du_swap_buffers( d3du_context * ctx, bool /*vsync*/ )
+{
+    ctx->frames_done++;
+}
+
+D3D11_VIEWPORT d3du_full_tex2d_viewport( ID3D11Texture2D * tex )
+{
+    D3D11_VIEWPORT vp;
+    vp.TopLeftX = 0.0f;
+    vp.TopLeftY = 0.0f;
+    vp.Width = (float)tex->width;
+    vp.Height = (float)tex->height;
+    vp.MinDepth = 0.0f;
+    vp.MaxDepth = 1.0f;
+
+    return vp;
+}
+
+ID3D11Buffer * d3du_make_buffer( ID3D11Device * /*dev*/, UINT size, D3D11_USAGE /*use*/, UINT bind_flags, const void * initial )
+{
+    ID3D11Buffer * buf = new ID3D11Buffer( size, bind_flags );
+    if ( initial )
+        memcpy( buf->data, initial, size );
+
+    return buf;
+}
+
+unsigned char * d3du_get_buffer( d3du_context * /*ctx*/, ID3D11Buffer * buf, int * size_in_bytes )
+{
+    unsigned char * result = new unsigned char[buf->width];
+    memcpy( result, buf->data, buf->width );
+
+    if ( size_in_bytes )
+        *size_in_bytes = buf->width;
+
+    return result;
+}
+
+unsigned char * d3du_read_texture_level( d3du_context * /*ctx*/, ID3D11ShaderResourceView * srv, int level )
+{
+    ID3D11Resource * res = srv->resource;
+    if ( level != 0 || res->depth != 1 )
+        panic( "d3du_read_texture_level: only mip 0 of 2D textures in headless mode\n" );
+
+    size_t size = (size_t)res->row_pitch * res->height;
+    unsigned char * result = new unsigned char[size];
+    memcpy( result, res->data, size );
+    return result;
+}
+
+ID3D11RasterizerState * d3du_simple_raster( ID3D11Device * /*dev*/, D3D11_CULL_MODE cull, bool front_ccw, bool scissor_enable )
+{
+    ID3D11RasterizerState * state = new ID3D11RasterizerState;
+    state->cull = cull;
+    state->front_ccw = front_ccw;
+    state->scissor_enable = scissor_enable;
+    return state;
+}
+
+ID3D11BlendState * d3du_simple_blend( ID3D11Device * /*dev*/, D3D11_BLEND src_blend, D3D11_BLEND dest_blend )
+{
+    ID3D11BlendState * state = new ID3D11BlendState;
+    state->src_blend = src_blend;
+    state->dest_blend = dest_blend;
+    return state;
+}
+
+ID3D11SamplerState * d3du_simple_sampler( ID3D11Device * /*dev*/, D3D11_FILTER filter, D3D11_TEXTURE_ADDRESS_MODE addr )
+{
+    ID3D11SamplerState * state = new ID3D11SamplerState;
+    state->filter = filter;
+    state->addr = addr;
+    return state;
+}
+
+// Nothing gets compiled; the "code" is the entry point name.
+ID3DBlob * d3du_compile_source_or_die( char const * /*source*/, char const * /*profile*/, char const * entrypt )
+{
+    return new ID3DBlob( entrypt, strlen( entrypt ) + 1 );
+}
+
+d3du_shader d3du_compile_and_create_shader( ID3D11Device * /*dev*/, char const * /*source*/, char const * profile, char const * entrypt )
+{
+    d3du_shader sh;
+    sh.generic = NULL;
+
+    switch ( profile[0] )
+    {
+    case 'p':   sh.ps = new ID3D11PixelShader( profile, entrypt ); break;
+    case 'v':   sh.vs = new ID3D11VertexShader( profile, entrypt ); break;
+    case 'c':   sh.cs = new ID3D11ComputeShader( profile, entrypt ); break;
+    default:    panic( "Unsupported shader profile '%s'\n", profile );
+    }
+
+    return sh;
+}
+
+d3du_tex::d3du_tex( ID3D11Resource * resrc, ID3D11ShaderResourceView * srv, ID3D11RenderTargetView * rtv )
+    : resrc(resrc), srv(srv), rtv(rtv)
+{
+}
+
+d3du_tex::~d3du_tex()
+{
+    if ( srv ) srv->Release();
+    if ( rtv ) rtv->Release();
+    if ( resrc ) resrc->Release();
+}
+
+d3du_tex * d3du_tex::make2d( ID3D11Device * /*dev*/, UINT w, UINT h, UINT /*num_mips*/, DXGI_FORMAT fmt, D3D11_USAGE /*usage*/, UINT bind_flags, void const * initial, UINT initial_pitch )
+{
+    ID3D11Texture2D * tex = new ID3D11Texture2D( w, h, fmt, bind_flags );
+    if ( initial )
+        copy_box( tex, NULL, (unsigned char *)initial, initial_pitch, 0, true );
+
+    ID3D11ShaderResourceView * srv = ( bind_flags & D3D11_BIND_SHADER_RESOURCE ) ? new ID3D11ShaderResourceView( tex ) : NULL;
+    ID3D11RenderTargetView * rtv = ( bind_flags & D3D11_BIND_RENDER_TARGET ) ? new ID3D11RenderTargetView( tex ) : NULL;
+    return new d3du_tex( tex, srv, rtv );
+}
+
+d3du_tex * d3du_tex::make3d( ID3D11Device * /*dev*/, UINT w, UINT h, UINT d, UINT /*num_mips*/, DXGI_FORMAT fmt, D3D11_USAGE /*usage*/, UINT bind_flags, void const * initial, UINT init_row_pitch, UINT init_depth_pitch )
+{
+    ID3D11Texture3D * tex = new ID3D11Texture3D( w, h, d, fmt, bind_flags );
+    if ( initial )
+        copy_box( tex, NULL, (unsigned char *)initial, init_row_pitch, init_depth_pitch, true );
+
+    ID3D11ShaderResourceView * srv = ( bind_flags & D3D11_BIND_SHADER_RESOURCE ) ? new ID3D11ShaderResourceView( tex ) : NULL;
+    return new d3du_tex( tex, srv, NULL );
+}
+
+// Timers measure CPU time between the brackets: that's where the work of a
+// draw happens, if it executes at all.
+struct d3du_timer
+{
+    LARGE_INTEGER begin;
+    size_t num_brackets;
+    size_t warmup_frames;
+    run_stats * stats;
+};
+
+d3du_timer * d3du_timer_create( d3du_context * /*ctx*/, size_t warmup_frames )
+{
+    d3du_timer * timer = new d3du_timer;
+    timer->num_brackets = 0;
+    timer->warmup_frames = warmup_frames;
+    timer->stats = run_stats_create_streaming();
+    return timer;
+}
+
+void d3du_timer_destroy( d3du_timer * timer )
+{
+    if ( timer )
+    {
+        run_stats_destroy( timer->stats );
+        delete timer;
+    }
+}
+
+void d3du_timer_bracket_begin( d3du_context * /*ctx*/, d3du_timer * timer )
+{
+    QueryPerformanceCounter( &timer->begin );
+}
+
+void d3du_timer_bracket_end( d3du_context * /*ctx*/, d3du_timer * timer )
+{
+    LARGE_INTEGER end;
+    QueryPerformanceCounter( &end );
+
+    if ( timer->num_brackets++ >= timer->warmup_frames )
+        run_stats_record( timer->stats, (float) ( 1e-6 * ( end.QuadPart - timer->begin.QuadPart ) ) );
+}
+
+void d3du_timer_report( d3du_context * /*ctx*/, d3du_timer * timer, char const * label )
+{
+    run_stats_report( timer->stats, label );
+}
+
+// Counts what the draw handlers report; draws without one count nothing.
+struct d3du_pixel_counter
+{
+    UINT64 begin_invocations;
+    UINT64 begin_passed;
+    size_t num_brackets;
+    size_t warmup_frames;
+    double num_pixels;
+    run_stats * shaded; // pixel shader invocations per screen pixel
+    run_stats * passed; // samples that passed the depth test per screen pixel
+};
+
+d3du_pixel_counter * d3du_pixel_counter_create( d3du_context * ctx, size_t warmup_frames )
+{
+    d3du_pixel_counter * counter = new d3du_pixel_counter;
+    counter->begin_invocations = 0;
+    counter->begin_passed = 0;
+    counter->num_brackets = 0;
+    counter->warmup_frames = warmup_frames;
+    counter->num_pixels = (double) ctx->default_vp.Width * ctx->default_vp.Height;
+    counter->shaded = run_stats_create_streaming();
+    counter->passed = run_stats_create_streaming();
+    return counter;
+}
+
+void d3du_pixel_counter_destroy( d3du_pixel_counter * counter )
+{
+    if ( counter )
+    {
+        run_stats_destroy( counter->shaded );
+        run_stats_destroy( counter->passed );
+        delete counter;
+    }
+}
+
+void d3du_pixel_counter_bracket_begin( d3du_context * ctx, d3du_pixel_counter * counter )
+{
+    counter->begin_invocations = ctx->ctx->ps_invocations;
+    counter->begin_passed = ctx->ctx->samples_passed;
+}
+
+void d3du_pixel_counter_bracket_end( d3du_context * ctx, d3du_pixel_counter * counter )
+{
+    if ( counter->num_brackets++ >= counter->warmup_frames )
+    {
+        run_stats_record( counter->shaded, (float) ( ( ctx->ctx->ps_invocations - counter->begin_invocations ) / counter->num_pixels ) );
+        run_stats_record( counter->passed, (float) ( ( ctx->ctx->samples_passed - counter->begin_passed ) / counter->num_pixels ) );
+    }
+}
+
+void d3du_pixel_counter_report( d3du_context * /*ctx*/, d3du_pixel_counter * counter, char const * label )
+{
+    char desc[256];
+
+    snprintf( desc, sizeof( desc ), "%s shaded/pixel", label );
+    run_stats_report( counter->shaded, desc );
+
+    snprintf( desc, sizeof( desc ), "%s depth passed/pixel", label );
+    run_stats_report( counter->passed, desc );
+}
+
+#endif
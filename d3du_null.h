@@ -0,0 +1,345 @@
+#ifndef D3DU_NULL_H
+#define D3DU_NULL_H
+
+// Stand-ins for the Win32 and D3D11 types d3du.h and main.cpp use, for the
+// headless null backend (include d3du_platform.h instead of this).
+//
+// Enum values match the real headers. Objects are plain C++ classes with
+// the same method names; resources keep their contents in CPU memory, so
+// Map/UpdateSubresource/Clear behave like on a device, and the context
+// records the bound pipeline state. Draw calls are counted; they only
+// execute if a CPU implementation was registered for the bound shaders
+// (see d3du_null_set_draw_handler).
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned int UINT;
+typedef unsigned short USHORT;
+typedef unsigned char UINT8;
+typedef unsigned long ULONG;
+typedef uint64_t UINT64;
+typedef int INT;
+typedef int BOOL;
+typedef int32_t HRESULT;
+typedef void * HWND;
+
+#define TRUE 1
+#define FALSE 0
+#define S_OK ((HRESULT)0)
+#define E_INVALIDARG ((HRESULT)0x80070057)
+#define FAILED(hr) ((HRESULT)(hr) < 0)
+#define SUCCEEDED(hr) ((HRESULT)(hr) >= 0)
+
+union LARGE_INTEGER {
+    int64_t QuadPart;
+};
+
+// monotonic clock, in nanoseconds
+BOOL QueryPerformanceCounter( LARGE_INTEGER * count );
+BOOL QueryPerformanceFrequency( LARGE_INTEGER * freq );
+
+enum D3D_FEATURE_LEVEL {
+    D3D_FEATURE_LEVEL_10_0 = 0xa000,
+    D3D_FEATURE_LEVEL_10_1 = 0xa100,
+    D3D_FEATURE_LEVEL_11_0 = 0xb000,
+};
+
+enum DXGI_FORMAT {
+    DXGI_FORMAT_UNKNOWN = 0,
+    DXGI_FORMAT_R32G32B32A32_FLOAT = 2,
+    DXGI_FORMAT_R16G16B16A16_FLOAT = 10,
+    DXGI_FORMAT_R8G8B8A8_UNORM = 28,
+    DXGI_FORMAT_R8G8B8A8_UNORM_SRGB = 29,
+    DXGI_FORMAT_R8G8B8A8_SNORM = 31,
+    DXGI_FORMAT_D32_FLOAT = 40,
+    DXGI_FORMAT_R32_FLOAT = 41,
+    DXGI_FORMAT_R32_UINT = 42,
+    DXGI_FORMAT_R16_UINT = 57,
+    DXGI_FORMAT_R8_UNORM = 61,
+};
+
+enum D3D11_USAGE {
+    D3D11_USAGE_DEFAULT = 0,
+    D3D11_USAGE_IMMUTABLE = 1,
+    D3D11_USAGE_DYNAMIC = 2,
+    D3D11_USAGE_STAGING = 3,
+};
+
+enum D3D11_BIND_FLAG {
+    D3D11_BIND_VERTEX_BUFFER = 0x1,
+    D3D11_BIND_INDEX_BUFFER = 0x2,
+    D3D11_BIND_CONSTANT_BUFFER = 0x4,
+    D3D11_BIND_SHADER_RESOURCE = 0x8,
+    D3D11_BIND_RENDER_TARGET = 0x20,
+    D3D11_BIND_DEPTH_STENCIL = 0x40,
+};
+
+enum D3D11_MAP {
+    D3D11_MAP_READ = 1,
+    D3D11_MAP_WRITE = 2,
+    D3D11_MAP_READ_WRITE = 3,
+    D3D11_MAP_WRITE_DISCARD = 4,
+    D3D11_MAP_WRITE_NO_OVERWRITE = 5,
+};
+
+enum D3D11_CLEAR_FLAG {
+    D3D11_CLEAR_DEPTH = 0x1,
+    D3D11_CLEAR_STENCIL = 0x2,
+};
+
+enum D3D11_CULL_MODE {
+    D3D11_CULL_NONE = 1,
+    D3D11_CULL_FRONT = 2,
+    D3D11_CULL_BACK = 3,
+};
+
+enum D3D11_BLEND {
+    D3D11_BLEND_ZERO = 1,
+    D3D11_BLEND_ONE = 2,
+    D3D11_BLEND_SRC_ALPHA = 5,
+    D3D11_BLEND_INV_SRC_ALPHA = 6,
+};
+
+enum D3D11_FILTER {
+    D3D11_FILTER_MIN_MAG_MIP_POINT = 0,
+    D3D11_FILTER_MIN_MAG_LINEAR_MIP_POINT = 0x14,
+    D3D11_FILTER_MIN_MAG_MIP_LINEAR = 0x15,
+};
+
+enum D3D11_TEXTURE_ADDRESS_MODE {
+    D3D11_TEXTURE_ADDRESS_WRAP = 1,
+    D3D11_TEXTURE_ADDRESS_MIRROR = 2,
+    D3D11_TEXTURE_ADDRESS_CLAMP = 3,
+    D3D11_TEXTURE_ADDRESS_BORDER = 4,
+};
+
+enum D3D11_PRIMITIVE_TOPOLOGY {
+    D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED = 0,
+    D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST = 4,
+    D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP = 5,
+};
+
+struct D3D11_VIEWPORT {
+    float TopLeftX;
+    float TopLeftY;
+    float Width;
+    float Height;
+    float MinDepth;
+    float MaxDepth;
+};
+
+struct D3D11_BOX {
+    UINT left;
+    UINT top;
+    UINT front;
+    UINT right;
+    UINT bottom;
+    UINT back;
+};
+
+struct D3D11_MAPPED_SUBRESOURCE {
+    void * pData;
+    UINT RowPitch;
+    UINT DepthPitch;
+};
+
+// Bytes per texel (or index) of a format; panics on ones we don't support.
+UINT d3du_null_format_bytes( DXGI_FORMAT fmt );
+
+// Objects. Reference counted like COM objects; created with a count of 1.
+struct d3du_null_object {
+    d3du_null_object() : refs( 1 ) {}
+    virtual ~d3du_null_object() {}
+
+    ULONG AddRef()      { return ++refs; }
+    ULONG Release()     { ULONG r = --refs; if ( !r ) delete this; return r; }
+
+private:
+    ULONG refs;
+    d3du_null_object( d3du_null_object const & );
+    d3du_null_object & operator =( d3du_null_object const & );
+};
+
+struct ID3D11DeviceChild : d3du_null_object {
+};
+
+// Buffers and textures (a buffer is width bytes of R8). Mip 0 only.
+struct ID3D11Resource : ID3D11DeviceChild {
+    UINT width, height, depth;
+    DXGI_FORMAT format;
+    UINT bind_flags;
+    UINT row_pitch;
+    UINT depth_pitch;
+    unsigned char * data;
+
+    ID3D11Resource( UINT w, UINT h, UINT d, DXGI_FORMAT fmt, UINT bind_flags );
+    ~ID3D11Resource();
+};
+
+struct ID3D11Buffer : ID3D11Resource {
+    ID3D11Buffer( UINT size, UINT bind_flags ) : ID3D11Resource( size, 1, 1, DXGI_FORMAT_R8_UNORM, bind_flags ) {}
+};
+
+struct ID3D11Texture2D : ID3D11Resource {
+    ID3D11Texture2D( UINT w, UINT h, DXGI_FORMAT fmt, UINT bind_flags ) : ID3D11Resource( w, h, 1, fmt, bind_flags ) {}
+};
+
+struct ID3D11Texture3D : ID3D11Resource {
+    ID3D11Texture3D( UINT w, UINT h, UINT d, DXGI_FORMAT fmt, UINT bind_flags ) : ID3D11Resource( w, h, d, fmt, bind_flags ) {}
+};
+
+// Views keep a reference to their resource.
+struct ID3D11View : ID3D11DeviceChild {
+    ID3D11Resource * resource;
+
+    explicit ID3D11View( ID3D11Resource * res ) : resource( res ) { res->AddRef(); }
+    ~ID3D11View() { resource->Release(); }
+};
+
+struct ID3D11ShaderResourceView : ID3D11View {
+    explicit ID3D11ShaderResourceView( ID3D11Resource * res ) : ID3D11View( res ) {}
+};
+
+struct ID3D11RenderTargetView : ID3D11View {
+    explicit ID3D11RenderTargetView( ID3D11Resource * res ) : ID3D11View( res ) {}
+};
+
+struct ID3D11DepthStencilView : ID3D11View {
+    explicit ID3D11DepthStencilView( ID3D11Resource * res ) : ID3D11View( res ) {}
+};
+
+// Shaders only remember what they were compiled from.
+struct d3du_null_shader : ID3D11DeviceChild {
+    char profile[16];
+    char entrypt[64];
+
+    d3du_null_shader( char const * profile, char const * entrypt );
+};
+
+struct ID3D11VertexShader : d3du_null_shader {
+    ID3D11VertexShader( char const * profile, char const * entrypt ) : d3du_null_shader( profile, entrypt ) {}
+};
+
+struct ID3D11PixelShader : d3du_null_shader {
+    ID3D11PixelShader( char const * profile, char const * entrypt ) : d3du_null_shader( profile, entrypt ) {}
+};
+
+struct ID3D11ComputeShader : d3du_null_shader {
+    ID3D11ComputeShader( char const * profile, char const * entrypt ) : d3du_null_shader( profile, entrypt ) {}
+};
+
+struct ID3DBlob : d3du_null_object {
+    void * data;
+    size_t size;
+
+    ID3DBlob( void const * data, size_t size );
+    ~ID3DBlob();
+
+    void * GetBufferPointer()   { return data; }
+    size_t GetBufferSize()      { return size; }
+};
+
+struct ID3D11RasterizerState : ID3D11DeviceChild {
+    D3D11_CULL_MODE cull;
+    bool front_ccw;
+    bool scissor_enable;
+};
+
+struct ID3D11BlendState : ID3D11DeviceChild {
+    D3D11_BLEND src_blend;
+    D3D11_BLEND dest_blend;
+};
+
+struct ID3D11SamplerState : ID3D11DeviceChild {
+    D3D11_FILTER filter;
+    D3D11_TEXTURE_ADDRESS_MODE addr;
+};
+
+struct ID3D11Device : d3du_null_object {
+};
+
+struct IDXGISwapChain : d3du_null_object {
+};
+
+static const UINT D3DU_NULL_SLOTS = 16;
+
+struct ID3D11DeviceContext : d3du_null_object {
+    // bound state
+    D3D11_PRIMITIVE_TOPOLOGY topology;
+    ID3D11Buffer * index_buf;
+    DXGI_FORMAT index_format;
+    UINT index_offset;
+
+    ID3D11VertexShader * vs;
+    ID3D11ShaderResourceView * vs_srvs[D3DU_NULL_SLOTS];
+    ID3D11Buffer * vs_cbufs[D3DU_NULL_SLOTS];
+
+    ID3D11RasterizerState * raster;
+    D3D11_VIEWPORT viewport;
+
+    ID3D11PixelShader * ps;
+    ID3D11ShaderResourceView * ps_srvs[D3DU_NULL_SLOTS];
+    ID3D11Buffer * ps_cbufs[D3DU_NULL_SLOTS];
+    ID3D11SamplerState * ps_samplers[D3DU_NULL_SLOTS];
+
+    ID3D11RenderTargetView * rtv;
+    ID3D11DepthStencilView * dsv;
+
+    // work submitted
+    UINT64 num_draws;
+    UINT64 num_instances;
+
+    // pixel shader invocations and samples that passed the depth test, as
+    // reported by draw handlers
+    UINT64 ps_invocations;
+    UINT64 samples_passed;
+
+    ID3D11DeviceContext();
+
+    void ClearState();
+
+    HRESULT Map( ID3D11Resource * res, UINT subres, D3D11_MAP type, UINT flags, D3D11_MAPPED_SUBRESOURCE * mapped );
+    void Unmap( ID3D11Resource * res, UINT subres );
+    void UpdateSubresource( ID3D11Resource * res, UINT subres, D3D11_BOX const * box, void const * data, UINT row_pitch, UINT depth_pitch );
+    void CopyResource( ID3D11Resource * dest, ID3D11Resource * src );
+
+    void IASetPrimitiveTopology( D3D11_PRIMITIVE_TOPOLOGY topo );
+    void IASetIndexBuffer( ID3D11Buffer * buf, DXGI_FORMAT fmt, UINT offset );
+
+    void VSSetShader( ID3D11VertexShader * shader, void * const * class_insts, UINT num_class_insts );
+    void VSSetShaderResources( UINT start, UINT count, ID3D11ShaderResourceView * const * srvs );
+    void VSSetConstantBuffers( UINT start, UINT count, ID3D11Buffer * const * bufs );
+
+    void RSSetState( ID3D11RasterizerState * state );
+    void RSSetViewports( UINT count, D3D11_VIEWPORT const * vps );
+
+    void PSSetShader( ID3D11PixelShader * shader, void * const * class_insts, UINT num_class_insts );
+    void PSSetShaderResources( UINT start, UINT count, ID3D11ShaderResourceView * const * srvs );
+    void PSSetConstantBuffers( UINT start, UINT count, ID3D11Buffer * const * bufs );
+    void PSSetSamplers( UINT start, UINT count, ID3D11SamplerState * const * samplers );
+
+    void OMSetRenderTargets( UINT count, ID3D11RenderTargetView * const * rtvs, ID3D11DepthStencilView * dsv );
+
+    void ClearRenderTargetView( ID3D11RenderTargetView * rtv, float const color[4] );
+    void ClearDepthStencilView( ID3D11DepthStencilView * dsv, UINT flags, float depth, UINT8 stencil );
+
+    void Draw( UINT vertex_count, UINT start_vertex );
+    void DrawIndexedInstanced( UINT index_count_per_instance, UINT instance_count, UINT start_index, INT base_vertex, UINT start_instance );
+};
+
+// CPU implementation of a draw with a particular pair of shaders. Gets the
+// DrawIndexedInstanced arguments (Draw has index_count_per_instance =
+// vertex_count, instance_count = 1 and no index buffer) and reads
+// everything else from the bound state.
+typedef void d3du_null_draw_func( void * user, ID3D11DeviceContext * ctx, UINT index_count_per_instance, UINT instance_count, UINT start_index, INT base_vertex, UINT start_instance );
+
+// Draws with shaders compiled from vs_entrypt and ps_entrypt call func from
+// then on (NULL func to remove).
+void d3du_null_set_draw_handler( char const * vs_entrypt, char const * ps_entrypt, d3du_null_draw_func * func, void * user );
+
+// Writes an R8G8B8A8 2D texture to an uncompressed TGA file. Returns false
+// if the file couldn't be written.
+bool d3du_null_write_tga( ID3D11Resource * tex, char const * filename );
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef D3DU_PLATFORM_H
+#define D3DU_PLATFORM_H
+
+// Platform headers for d3du.h. On Windows that's Win32 and D3D11 (d3du.cpp).
+// Everywhere else it's the headless null backend (d3du_null.cpp), which
+// defines stand-ins for the subset of those APIs we use.
+//
+// D3DU_HEADLESS is 1 for the null backend: no window, no GPU, resources
+// live in CPU memory and draws only execute if there's a CPU
+// implementation for their shaders.
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#include <d3d11.h>
+#define D3DU_HEADLESS 0
+#else
+#include "d3du_null.h"
+#define D3DU_HEADLESS 1
+#endif
+
+#endif
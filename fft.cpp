@@ -0,0 +1,204 @@
+#include "fft.h"
+#include "parallel.h"
+#include <assert.h>
+#include <math.h>
+#include <complex>
+#include <vector>
+
+typedef std::complex<float> cpx;
+
+struct fft_plan {
+    int n;
+    std::vector<int> bitrev;
+    std::vector<cpx> twiddle; // exp(-2 pi i k/n), k <= n/2
+};
+
+fft_plan* fft_plan_create(int n)
+{
+    assert(n > 0 && (n & (n - 1)) == 0);
+
+    fft_plan* plan = new fft_plan;
+    plan->n = n;
+
+    int bits = 0;
+    while ((1 << bits) < n)
+        bits++;
+
+    plan->bitrev.resize(n);
+    for (int i = 0; i < n; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        plan->bitrev[i] = r;
+    }
+
+    static const double kPi = 3.14159265358979323846;
+    plan->twiddle.resize(n / 2 + 1);
+    for (int k = 0; k <= n / 2; k++) {
+        double a = -2.0 * kPi * k / n;
+        plan->twiddle[k] = cpx((float)cos(a), (float)sin(a));
+    }
+
+    return plan;
+}
+
+void fft_plan_destroy(fft_plan* plan)
+{
+    delete plan;
+}
+
+void fft_complex(fft_plan const* plan, float* data, bool inverse)
+{
+    int n = plan->n;
+    cpx* x = (cpx*)data;
+
+    for (int i = 0; i < n; i++) {
+        int j = plan->bitrev[i];
+        if (i < j)
+            std::swap(x[i], x[j]);
+    }
+
+    for (int len = 2; len <= n; len *= 2) {
+        int half = len / 2;
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int j = 0; j < half; j++) {
+                cpx w = plan->twiddle[j * step];
+                if (inverse)
+                    w = std::conj(w);
+
+                // spelled out; operator* on std::complex checks for inf/nan
+                cpx a = x[i + j];
+                cpx c = x[i + j + half];
+                cpx b(c.real() * w.real() - c.imag() * w.imag(), c.real() * w.imag() + c.imag() * w.real());
+                x[i + j] = a + b;
+                x[i + j + half] = a - b;
+            }
+        }
+    }
+}
+
+namespace {
+    // Plans for one 3D transform: half-length for the real rows, full length for y/z.
+    struct fft3d_plans {
+        fft_plan* half;
+        fft_plan* full;
+        std::vector<cpx> row_twiddle; // exp(-2 pi i k/n), k <= n/2
+
+        explicit fft3d_plans(int n)
+        {
+            half = fft_plan_create(n / 2);
+            full = fft_plan_create(n);
+            row_twiddle = full->twiddle;
+        }
+
+        ~fft3d_plans()
+        {
+            fft_plan_destroy(half);
+            fft_plan_destroy(full);
+        }
+    };
+}
+
+// Real FFT of one row of n floats via a complex FFT of length n/2.
+static void rfft_row(fft3d_plans const& plans, cpx* out, float const* in, cpx* scratch)
+{
+    int m = plans.half->n;
+
+    // pack even/odd samples as real/imaginary parts
+    for (int j = 0; j < m; j++)
+        scratch[j] = cpx(in[2*j], in[2*j + 1]);
+    fft_complex(plans.half, (float*)scratch, false);
+
+    for (int k = 0; k <= m; k++) {
+        cpx zk = scratch[k % m];
+        cpx zc = std::conj(scratch[(m - k) % m]);
+        cpx even = 0.5f * (zk + zc);
+        cpx odd = cpx(0.0f, -0.5f) * (zk - zc);
+        out[k] = even + plans.row_twiddle[k] * odd;
+    }
+}
+
+// Inverse of rfft_row, scaled by "scale" on top of the unnormalized n.
+static void irfft_row(fft3d_plans const& plans, float* out, cpx const* in, cpx* scratch, float scale)
+{
+    int m = plans.half->n;
+
+    for (int k = 0; k < m; k++) {
+        cpx xk = in[k];
+        cpx xc = std::conj(in[m - k]);
+        cpx even = 0.5f * (xk + xc);
+        cpx odd = 0.5f * (xk - xc) * std::conj(plans.row_twiddle[k]);
+        scratch[k] = even + cpx(0.0f, 1.0f) * odd;
+    }
+    fft_complex(plans.half, (float*)scratch, true);
+
+    // the half-length inverse gives m*x; we want n*x times scale
+    float s = 2.0f * scale;
+    for (int j = 0; j < m; j++) {
+        out[2*j] = scratch[j].real() * s;
+        out[2*j + 1] = scratch[j].imag() * s;
+    }
+}
+
+// Complex FFTs along y (axis=1) or z (axis=2) of the half spectrum.
+static void fft_columns(fft3d_plans const& plans, cpx* spec, int n, int axis, bool inverse)
+{
+    int h = n / 2 + 1;
+    int stride = (axis == 1) ? h : h * n;      // between consecutive column elements
+    int slab_stride = (axis == 1) ? h * n : h; // between slabs we split the work over
+
+    parallel_for(n, 1, [&](int begin, int end) {
+        std::vector<cpx> col(n);
+        for (int slab = begin; slab < end; slab++) {
+            for (int kx = 0; kx < h; kx++) {
+                cpx* base = spec + slab * slab_stride + kx;
+                for (int i = 0; i < n; i++)
+                    col[i] = base[i * stride];
+                fft_complex(plans.full, (float*)&col[0], inverse);
+                for (int i = 0; i < n; i++)
+                    base[i * stride] = col[i];
+            }
+        }
+    });
+}
+
+void fft_3d_r2c(float* out, float const* in, int n)
+{
+    assert(n >= 2);
+
+    fft3d_plans plans(n);
+    cpx* spec = (cpx*)out;
+    int h = n / 2 + 1;
+
+    // x rows, one z slab per task
+    parallel_for(n, 1, [&](int begin, int end) {
+        std::vector<cpx> scratch(n / 2);
+        for (int z = begin; z < end; z++)
+            for (int y = 0; y < n; y++)
+                rfft_row(plans, spec + (z * n + y) * h, in + (z * n + y) * n, &scratch[0]);
+    });
+
+    fft_columns(plans, spec, n, 1, false);
+    fft_columns(plans, spec, n, 2, false);
+}
+
+void fft_3d_c2r(float* out, float* in, int n)
+{
+    assert(n >= 2);
+
+    fft3d_plans plans(n);
+    cpx* spec = (cpx*)in;
+    int h = n / 2 + 1;
+    float scale = 1.0f / ((float)n * n * n);
+
+    fft_columns(plans, spec, n, 2, true);
+    fft_columns(plans, spec, n, 1, true);
+
+    parallel_for(n, 1, [&](int begin, int end) {
+        std::vector<cpx> scratch(n / 2);
+        for (int z = begin; z < end; z++)
+            for (int y = 0; y < n; y++)
+                irfft_row(plans, out + (z * n + y) * n, spec + (z * n + y) * h, &scratch[0], scale);
+    });
+}
@@ -0,0 +1,26 @@
+#ifndef FFT_H
+#define FFT_H
+
+// Radix-2 FFTs for pow2 sizes, used for spectral solves on periodic grids.
+//
+// Complex data is interleaved (re, im) floats. Forward transforms use
+// exp(-2 pi i jk/n) and are unnormalized; the inverse 3D transform divides
+// by n^3 so that a forward/inverse round trip is the identity.
+
+struct fft_plan;
+
+fft_plan* fft_plan_create(int n);
+void fft_plan_destroy(fft_plan* plan);
+
+// In-place complex FFT of length n (the plan's size).
+void fft_complex(fft_plan const* plan, float* data, bool inverse);
+
+// 3D real-to-complex FFT of an n^3 grid (x fastest). out receives the
+// non-redundant half of the spectrum: (n/2+1) x n x n complex values, kx
+// fastest. Split into slabs across all cores.
+void fft_3d_r2c(float* out, float const* in, int n);
+
+// Inverse of fft_3d_r2c (including the 1/n^3). Overwrites the spectrum in.
+void fft_3d_c2r(float* out, float* in, int n);
+
+#endif
@@ -0,0 +1,367 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "fieldcache.h"
+#include "profile.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define snprintf _snprintf
+#endif
+
+using namespace math;
+
+// Bump whenever the file layout or the generator's output changes.
+static const uint32_t kMagic = 0x444c464d; // "MFLD"
+static const uint32_t kVersion = 1;
+static const uint32_t kDataOffset = 64;
+
+namespace {
+    // Everything that determines the field. Fixed-size fields, compared
+    // with memcmp, so keep it free of padding.
+    struct file_key {
+        int32_t size;
+        uint32_t seed;
+        float strength;
+        float post_scale;
+        int32_t solver;
+        int32_t max_iters;
+        float tolerance;
+    };
+
+    struct file_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t data_offset;
+        uint32_t checksum;      // of the texel data
+        file_key key;
+        int32_t iterations;     // forcefield_stats
+        float residual;
+        float div_before;
+        float div_after;
+    };
+}
+
+struct fieldcache_entry {
+    vec4 const* texels;
+    forcefield_stats stats;
+    vec4* owned;                // set if not mapped
+
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+    void const* view;
+#else
+    void* view;
+    size_t view_size;
+#endif
+};
+
+static file_key make_key(forcefield_desc const& desc)
+{
+    file_key key;
+    memset(&key, 0, sizeof(key));
+    key.size = desc.size;
+    key.seed = desc.seed;
+    key.strength = desc.strength;
+    key.post_scale = desc.post_scale;
+    key.solver = desc.solver;
+    key.max_iters = desc.max_iters;
+    key.tolerance = desc.tolerance;
+    return key;
+}
+
+static uint32_t fnv1a(void const* data, size_t size)
+{
+    unsigned char const* bytes = (unsigned char const*)data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+// Fletcher-style sum over 32-bit words; the second sum makes it
+// position-dependent, which is all we need to spot truncated or
+// half-written files.
+static uint32_t texel_checksum(vec4 const* texels, size_t count)
+{
+    uint32_t const* words = (uint32_t const*)texels;
+    size_t num_words = count * 4;
+    uint64_t s1 = 0, s2 = 0;
+
+    for (size_t i = 0; i < num_words; i++) {
+        s1 += words[i];
+        s2 += s1;
+    }
+
+    return (uint32_t)(s1 ^ (s1 >> 32) ^ s2 ^ (s2 >> 32));
+}
+
+static size_t data_size(int size)
+{
+    return (size_t)size * size * size * sizeof(vec4);
+}
+
+static void file_name(char* out, size_t out_size, char const* dir, file_key const& key)
+{
+    snprintf(out, out_size, "%s/forcefield_%d_%08x.fld", dir ? dir : ".", key.size, fnv1a(&key, sizeof(key)));
+}
+
+// Maps a whole file read-only; returns its contents, or NULL.
+static void const* map_file(fieldcache_entry* entry, char const* name, size_t* size)
+{
+#ifdef _WIN32
+    entry->file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (entry->file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(entry->file, &file_size) || file_size.QuadPart == 0)
+        return NULL;
+    *size = (size_t)file_size.QuadPart;
+
+    entry->mapping = CreateFileMappingA(entry->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!entry->mapping)
+        return NULL;
+
+    entry->view = MapViewOfFile(entry->mapping, FILE_MAP_READ, 0, 0, 0);
+    return entry->view;
+#else
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void* view = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (view == MAP_FAILED)
+        return NULL;
+
+    entry->view = view;
+    entry->view_size = *size = (size_t)st.st_size;
+    return view;
+#endif
+}
+
+static fieldcache_entry* new_entry()
+{
+    fieldcache_entry* entry = new fieldcache_entry;
+    memset(entry, 0, sizeof(*entry));
+#ifdef _WIN32
+    entry->file = INVALID_HANDLE_VALUE;
+#endif
+    return entry;
+}
+
+fieldcache_entry* fieldcache_open(char const* dir, forcefield_desc const& desc)
+{
+    file_key key = make_key(desc);
+    char name[1024];
+    file_name(name, sizeof(name), dir, key);
+
+    fieldcache_entry* entry = new_entry();
+    size_t size = 0;
+    unsigned char const* bytes = (unsigned char const*)map_file(entry, name, &size);
+    if (!bytes) {
+        fieldcache_close(entry);
+        return NULL;
+    }
+
+    file_header const* header = (file_header const*)bytes;
+    bool valid = size >= sizeof(file_header) &&
+        header->magic == kMagic &&
+        header->version == kVersion &&
+        header->data_offset == kDataOffset &&
+        memcmp(&header->key, &key, sizeof(key)) == 0 &&
+        size == kDataOffset + data_size(desc.size);
+
+    if (valid) {
+        entry->texels = (vec4 const*)(bytes + kDataOffset);
+        valid = texel_checksum(entry->texels, (size_t)desc.size * desc.size * desc.size) == header->checksum;
+    }
+
+    if (!valid) {
+        fieldcache_close(entry);
+        return NULL;
+    }
+
+    entry->stats.iterations = header->iterations;
+    entry->stats.residual = header->residual;
+    entry->stats.div_before = header->div_before;
+    entry->stats.div_after = header->div_after;
+    return entry;
+}
+
+bool fieldcache_store(char const* dir, forcefield_desc const& desc, forcefield_stats const& stats, vec4 const* texels)
+{
+    assert(sizeof(file_header) <= kDataOffset);
+
+    file_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.data_offset = kDataOffset;
+    header.checksum = texel_checksum(texels, (size_t)desc.size * desc.size * desc.size);
+    header.key = make_key(desc);
+    header.iterations = stats.iterations;
+    header.residual = stats.residual;
+    header.div_before = stats.div_before;
+    header.div_after = stats.div_after;
+
+    char name[1024], temp_name[1040];
+    file_name(name, sizeof(name), dir, header.key);
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp", name);
+
+    // write to a temp file and rename it, so readers never see a partial file
+    FILE* f = fopen(temp_name, "wb");
+    if (!f)
+        return false;
+
+    unsigned char pad[kDataOffset] = {};
+    memcpy(pad, &header, sizeof(header));
+    bool ok = fwrite(pad, kDataOffset, 1, f) == 1 &&
+        fwrite(texels, data_size(desc.size), 1, f) == 1;
+    ok = (fclose(f) == 0) && ok;
+
+#ifdef _WIN32
+    ok = ok && MoveFileExA(temp_name, name, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    ok = ok && rename(temp_name, name) == 0;
+#endif
+
+    if (!ok)
+        remove(temp_name);
+    return ok;
+}
+
+fieldcache_entry* fieldcache_get(char const* dir, forcefield_desc const& desc, bool* was_cached)
+{
+    fieldcache_entry* entry = fieldcache_open(dir, desc);
+    if (was_cached)
+        *was_cached = entry != NULL;
+    if (entry)
+        return entry;
+
+    forcefield_stats stats;
+    vec4* texels = forcefield_make(desc, &stats);
+
+    // use the mapped copy if we could write it; that way the first run
+    // behaves exactly like the later ones.
+    if (fieldcache_store(dir, desc, stats, texels)) {
+        entry = fieldcache_open(dir, desc);
+        if (entry) {
+            delete[] texels;
+            return entry;
+        }
+    }
+
+    entry = new_entry();
+    entry->texels = entry->owned = texels;
+    entry->stats = stats;
+    return entry;
+}
+
+void fieldcache_close(fieldcache_entry* entry)
+{
+    if (!entry)
+        return;
+
+#ifdef _WIN32
+    if (entry->view)
+        UnmapViewOfFile(entry->view);
+    if (entry->mapping)
+        CloseHandle(entry->mapping);
+    if (entry->file != INVALID_HANDLE_VALUE)
+        CloseHandle(entry->file);
+#else
+    if (entry->view)
+        munmap(entry->view, entry->view_size);
+#endif
+
+    delete[] entry->owned;
+    delete entry;
+}
+
+vec4 const* fieldcache_texels(fieldcache_entry const* entry)
+{
+    return entry->texels;
+}
+
+forcefield_stats const& fieldcache_stats(fieldcache_entry const* entry)
+{
+    return entry->stats;
+}
+
+struct fieldcache_job {
+    std::string dir;
+    bool has_dir;
+    forcefield_desc desc;
+    fieldcache_done_func* done;
+    void* user;
+
+    fieldcache_entry* entry;
+    bool was_cached;
+    std::atomic<bool> ready;
+    std::thread thread;
+};
+
+static void run_job(fieldcache_job* job)
+{
+    profile_thread_name("field job");
+    PROFILE_ZONE("field generation");
+    job->entry = fieldcache_get(job->has_dir ? job->dir.c_str() : NULL, job->desc, &job->was_cached);
+    if (job->done)
+        job->done(job->user, job->entry);
+    job->ready = true;
+}
+
+fieldcache_job* fieldcache_get_async(char const* dir, forcefield_desc const& desc, fieldcache_done_func* done, void* user)
+{
+    fieldcache_job* job = new fieldcache_job;
+    job->has_dir = dir != NULL;
+    if (dir)
+        job->dir = dir;
+    job->desc = desc;
+    job->done = done;
+    job->user = user;
+    job->entry = NULL;
+    job->was_cached = false;
+    job->ready = false;
+    job->thread = std::thread(run_job, job);
+    return job;
+}
+
+bool fieldcache_job_ready(fieldcache_job const* job)
+{
+    return job->ready;
+}
+
+fieldcache_entry* fieldcache_job_wait(fieldcache_job* job, bool* was_cached)
+{
+    job->thread.join();
+
+    fieldcache_entry* entry = job->entry;
+    if (was_cached)
+        *was_cached = job->was_cached;
+
+    delete job;
+    return entry;
+}
@@ -0,0 +1,46 @@
+#ifndef FIELDCACHE_H
+#define FIELDCACHE_H
+
+#include "forcefield.h"
+
+// On-disk cache of generated force fields.
+//
+// Each field is stored in its own file, named after a hash of its
+// forcefield_desc: a small header (magic, format version, the full desc,
+// the generator stats and a checksum of the texels) followed by the texels.
+// Files are memory-mapped, so the texels can be handed straight to the
+// texture upload or the CPU sampler without a copy. Files with a different
+// version or desc, the wrong size or a bad checksum are ignored (and get
+// overwritten by the next store).
+
+struct fieldcache_entry;
+
+// Maps the cached field for desc from dir (NULL for the current directory).
+// Returns NULL if there's no valid cached copy.
+fieldcache_entry* fieldcache_open(char const* dir, forcefield_desc const& desc);
+
+// Writes a field made by forcefield_make with desc. Returns false on failure.
+bool fieldcache_store(char const* dir, forcefield_desc const& desc, forcefield_stats const& stats, math::vec4 const* texels);
+
+// Opens the cached field or makes (and stores) it if there's none. Always
+// succeeds; if the cache dir isn't writable the entry just owns the memory.
+// was_cached may be NULL.
+fieldcache_entry* fieldcache_get(char const* dir, forcefield_desc const& desc, bool* was_cached);
+
+void fieldcache_close(fieldcache_entry* entry);
+
+// size^3 texels as returned by forcefield_make; valid until the entry is closed.
+math::vec4 const* fieldcache_texels(fieldcache_entry const* entry);
+forcefield_stats const& fieldcache_stats(fieldcache_entry const* entry);
+
+// Background builds: fieldcache_get on its own thread. done (may be NULL) is
+// called on that thread with the entry once it's ready. Every job has to be
+// waited on exactly once, which hands over the entry and frees the job.
+struct fieldcache_job;
+typedef void fieldcache_done_func(void* user, fieldcache_entry* entry);
+
+fieldcache_job* fieldcache_get_async(char const* dir, forcefield_desc const& desc, fieldcache_done_func* done, void* user);
+bool fieldcache_job_ready(fieldcache_job const* job); // doesn't block
+fieldcache_entry* fieldcache_job_wait(fieldcache_job* job, bool* was_cached);
+
+#endif
@@ -0,0 +1,194 @@
+#include "fieldpack.h"
+#include "parallel.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace math;
+
+int fieldpack_texel_bytes(fieldpack_format format)
+{
+    switch (format) {
+    case FIELDPACK_HALF:        return 8;
+    case FIELDPACK_SHAREDEXP:   return 4;
+    case FIELDPACK_SNORM8:      return 4;
+    default:                    return 16;
+    }
+}
+
+char const* fieldpack_format_name(fieldpack_format format)
+{
+    switch (format) {
+    case FIELDPACK_HALF:        return "half";
+    case FIELDPACK_SHAREDEXP:   return "sharedexp";
+    case FIELDPACK_SNORM8:      return "snorm8";
+    default:                    return "float32";
+    }
+}
+
+// Round to nearest even; values too large for a half become inf.
+static uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+
+    if (x >= 0x47800000) // 65536 or more, inf, NaN
+        return (uint16_t)(sign | (x > 0x7f800000 ? 0x7e00 : 0x7c00));
+
+    if (x < 0x38800000) {
+        // result is a half denormal: let an FP add do the rounding
+        float t;
+        memcpy(&t, &x, sizeof(t));
+        t += 0.5f;
+        uint32_t tb;
+        memcpy(&tb, &t, sizeof(tb));
+        return (uint16_t)(sign | (tb - 0x3f000000));
+    }
+
+    // rebias the exponent and round the mantissa
+    uint32_t mant_odd = (x >> 13) & 1;
+    x += 0xc8000fffu + mant_odd;
+    return (uint16_t)(sign | (x >> 13));
+}
+
+static uint32_t encode_sharedexp(vec4 const& v)
+{
+    float max_comp = std::max(std::max(fabsf(v.x), fabsf(v.y)), fabsf(v.z));
+    if (max_comp == 0.0f)
+        return 0;
+
+    // pick the exponent so the largest mantissa is in [128,255]
+    int e;
+    frexpf(max_comp, &e);
+    int biased = std::min(std::max(e - 8 + FIELDPACK_SHAREDEXP_BIAS, 0), 31);
+    if (biased < 31 && floorf(ldexpf(max_comp, FIELDPACK_SHAREDEXP_BIAS - biased) + 0.5f) > 255.0f)
+        biased++;
+
+    uint32_t result = (uint32_t)biased << 27;
+    for (int i = 0; i < 3; i++) {
+        float mag = floorf(ldexpf(fabsf(v[i]), FIELDPACK_SHAREDEXP_BIAS - biased) + 0.5f);
+        uint32_t bits = (uint32_t)std::min(mag, 255.0f);
+        if (v[i] < 0.0f && bits != 0)
+            bits |= 0x100;
+        result |= bits << (9 * i);
+    }
+
+    return result;
+}
+
+static int8_t encode_snorm8(float x, float inv_scale)
+{
+    float s = floorf(x * inv_scale * 127.0f + 0.5f);
+    return (int8_t)std::min(std::max(s, -127.0f), 127.0f);
+}
+
+float fieldpack_max_component(vec4 const* texels, int begin, int end)
+{
+    float max_comp = 0.0f;
+    for (int i = begin; i < end; i++)
+        max_comp = std::max(max_comp, std::max(std::max(fabsf(texels[i].x), fabsf(texels[i].y)), fabsf(texels[i].z)));
+    return max_comp;
+}
+
+void fieldpack_init(fieldpack* out, vec4 const* texels, int size, fieldpack_format format, float max_comp)
+{
+    out->format = format;
+    out->size = size;
+    out->scale = (format == FIELDPACK_SNORM8 && max_comp > 0.0f) ? max_comp : 1.0f;
+    out->owns_texels = format != FIELDPACK_FLOAT32;
+    if (out->owns_texels)
+        out->texels = malloc((size_t)size * size * size * fieldpack_texel_bytes(format));
+    else
+        out->texels = texels;
+}
+
+void fieldpack_encode_range(fieldpack* pack, vec4 const* texels, int begin, int end)
+{
+    void* dst = (void*)pack->texels;
+    float inv_scale = 1.0f / pack->scale;
+
+    for (int i = begin; i < end; i++) {
+        vec4 const& t = texels[i];
+
+        switch (pack->format) {
+        case FIELDPACK_HALF:
+            {
+                uint16_t* h = (uint16_t*)dst + i * 4;
+                h[0] = float_to_half(t.x);
+                h[1] = float_to_half(t.y);
+                h[2] = float_to_half(t.z);
+                h[3] = 0;
+            }
+            break;
+
+        case FIELDPACK_SHAREDEXP:
+            ((uint32_t*)dst)[i] = encode_sharedexp(t);
+            break;
+
+        case FIELDPACK_SNORM8:
+            {
+                int8_t* s = (int8_t*)dst + i * 4;
+                s[0] = encode_snorm8(t.x, inv_scale);
+                s[1] = encode_snorm8(t.y, inv_scale);
+                s[2] = encode_snorm8(t.z, inv_scale);
+                s[3] = 0;
+            }
+            break;
+
+        default: // FLOAT32 packs are the source texels
+            return;
+        }
+    }
+}
+
+void fieldpack_encode(fieldpack* out, vec4 const* texels, int size, fieldpack_format format)
+{
+    int nelem = size * size * size;
+    float max_comp = (format == FIELDPACK_SNORM8) ? fieldpack_max_component(texels, 0, nelem) : 0.0f;
+
+    fieldpack_init(out, texels, size, format, max_comp);
+    if (out->owns_texels) {
+        parallel_for(nelem, 4096, [&](int begin, int end) {
+            fieldpack_encode_range(out, texels, begin, end);
+        });
+    }
+}
+
+void fieldpack_free(fieldpack* pack)
+{
+    if (pack->owns_texels)
+        free((void*)pack->texels);
+    pack->texels = NULL;
+    pack->owns_texels = false;
+}
+
+void fieldpack_decode(vec4* out, fieldpack const& pack)
+{
+    int nelem = pack.size * pack.size * pack.size;
+    for (int i = 0; i < nelem; i++)
+        out[i] = vec4(fieldpack_decode_texel(pack, i), 0.0f);
+}
+
+fieldpack_error fieldpack_measure_error(fieldpack const& pack, vec4 const* reference)
+{
+    int nelem = pack.size * pack.size * pack.size;
+    double sum_sq = 0.0, ref_sum_sq = 0.0;
+    float max_sq = 0.0f;
+
+    for (int i = 0; i < nelem; i++) {
+        vec3 ref(reference[i].x, reference[i].y, reference[i].z);
+        float err_sq = len_sq(fieldpack_decode_texel(pack, i) - ref);
+        max_sq = std::max(max_sq, err_sq);
+        sum_sq += err_sq;
+        ref_sum_sq += len_sq(ref);
+    }
+
+    fieldpack_error err;
+    err.max_abs = sqrtf(max_sq);
+    err.rms = (float)sqrt(sum_sq / nelem);
+    err.ref_rms = (float)sqrt(ref_sum_sq / nelem);
+    return err;
+}
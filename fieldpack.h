@@ -0,0 +1,134 @@
+#ifndef FIELDPACK_H
+#define FIELDPACK_H
+
+#include "math.h"
+#include <stdint.h>
+#include <string.h>
+
+// Compact storage formats for force fields.
+//
+// The float4 texels forcefield_make returns have an unused w and far more
+// precision than the sampler needs. These formats trade some of that for
+// size and bandwidth; all of them map to a texture format the GPU can sample
+// (see the comments) and the CPU sampler in cpusim reads them directly.
+
+enum fieldpack_format {
+    FIELDPACK_FLOAT32,      // 16 bytes: float4, w=0 (R32G32B32A32_FLOAT)
+    FIELDPACK_HALF,         // 8 bytes: half4, w=0 (R16G16B16A16_FLOAT)
+    FIELDPACK_SHAREDEXP,    // 4 bytes: sign+8 bit mantissa per axis, 5 bit shared exponent (R32_UINT, decoded in the shader)
+    FIELDPACK_SNORM8,       // 4 bytes: snorm8 x4 times a per-field scale (R8G8B8A8_SNORM)
+};
+
+struct fieldpack {
+    fieldpack_format format;
+    int size;
+    float scale;            // SNORM8: what +1.0 decodes to; 1 otherwise
+    void const* texels;     // size^3, x fastest
+    bool owns_texels;       // false for FLOAT32: texels is the source field
+};
+
+// SHAREDEXP layout: x in bits 0-8, y in 9-17, z in 18-26 (each 8 bits of
+// magnitude then a sign bit), exponent in 27-31. A component decodes to
+// +-mantissa * 2^(exponent - FIELDPACK_SHAREDEXP_BIAS).
+#define FIELDPACK_SHAREDEXP_BIAS 23
+
+int fieldpack_texel_bytes(fieldpack_format format);
+char const* fieldpack_format_name(fieldpack_format format);
+
+// Encodes size^3 texels (w must be 0); free the result with fieldpack_free.
+// FLOAT32 doesn't encode anything: the pack points at texels, which have to
+// outlive it. That keeps a memory-mapped cached field zero-copy.
+void fieldpack_encode(fieldpack* out, math::vec4 const* texels, int size, fieldpack_format format);
+void fieldpack_free(fieldpack* pack);
+
+// The same in pieces, to spread an encode over several frames:
+// fieldpack_init sets up the pack (max_comp is the largest |x|, |y| or |z|
+// in the field, which SNORM8 needs for its scale), then
+// fieldpack_encode_range encodes texels [begin,end), with the same texels
+// every call.
+float fieldpack_max_component(math::vec4 const* texels, int begin, int end);
+void fieldpack_init(fieldpack* out, math::vec4 const* texels, int size, fieldpack_format format, float max_comp);
+void fieldpack_encode_range(fieldpack* pack, math::vec4 const* texels, int begin, int end);
+
+// Decodes the whole field to float4s (w=0).
+void fieldpack_decode(math::vec4* out, fieldpack const& pack);
+
+struct fieldpack_error {
+    float max_abs;          // max length of (decoded - reference)
+    float rms;              // rms length of (decoded - reference)
+    float ref_rms;          // rms length of the reference, to put those in scale
+};
+
+fieldpack_error fieldpack_measure_error(fieldpack const& pack, math::vec4 const* reference);
+
+// Per-texel decoding, for the samplers.
+
+// Finite values only (there are no infs/NaNs in force fields). Written
+// without branches; signs of force components are random.
+static inline float fieldpack_half_to_float(uint16_t h)
+{
+    uint32_t mag = h & 0x7fff;
+
+    // normal: rebias the exponent. zero/denormal: build 2^-14 * (1 + mag/1024)
+    // and subtract the 2^-14.
+    uint32_t normal_bits = (mag << 13) + (112 << 23);
+    uint32_t denorm_bits = (mag << 13) + (113 << 23);
+    float normal, denorm;
+    memcpy(&normal, &normal_bits, sizeof(normal));
+    memcpy(&denorm, &denorm_bits, sizeof(denorm));
+    denorm -= 6.103515625e-05f;
+
+    float f = (mag < 0x400) ? denorm : normal;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    bits |= (uint32_t)(h & 0x8000) << 16;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline math::vec3 fieldpack_decode_sharedexp(uint32_t v)
+{
+    uint32_t scale_bits = ((v >> 27) + 127 - FIELDPACK_SHAREDEXP_BIAS) << 23;
+    float scale;
+    memcpy(&scale, &scale_bits, sizeof(scale));
+
+    math::vec3 r;
+    for (int i = 0; i < 3; i++) {
+        uint32_t c = v >> (9 * i);
+        float mag = (float)(c & 0xff) * scale;
+        uint32_t bits;
+        memcpy(&bits, &mag, sizeof(bits));
+        bits |= (c & 0x100) << 23;
+        memcpy(&r[i], &bits, sizeof(bits));
+    }
+    return r;
+}
+
+static inline math::vec3 fieldpack_decode_texel(fieldpack const& pack, int index)
+{
+    switch (pack.format) {
+    case FIELDPACK_HALF:
+        {
+            uint16_t const* h = (uint16_t const*)pack.texels + index * 4;
+            return math::vec3(fieldpack_half_to_float(h[0]), fieldpack_half_to_float(h[1]), fieldpack_half_to_float(h[2]));
+        }
+
+    case FIELDPACK_SHAREDEXP:
+        return fieldpack_decode_sharedexp(((uint32_t const*)pack.texels)[index]);
+
+    case FIELDPACK_SNORM8:
+        {
+            int8_t const* s = (int8_t const*)pack.texels + index * 4;
+            float scale = pack.scale * (1.0f / 127.0f);
+            return math::vec3(s[0] * scale, s[1] * scale, s[2] * scale);
+        }
+
+    default:
+        {
+            math::vec4 const& t = ((math::vec4 const*)pack.texels)[index];
+            return math::vec3(t.x, t.y, t.z);
+        }
+    }
+}
+
+#endif
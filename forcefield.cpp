@@ -0,0 +1,476 @@
+#include "forcefield.h"
+#include "poisson.h"
+#include "fft.h"
+#include "parallel.h"
+#include "random.h"
+#include <assert.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+using namespace math;
+
+static bool is_pow2(int x)
+{
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+static int step_idx(int base, int step, int mask)
+{
+    return (base & ~mask) | ((base + step) & mask);
+}
+
+forcefield_desc forcefield_default_desc(int size, float strength, float post_scale)
+{
+    forcefield_desc desc;
+    desc.size = size;
+    desc.seed = 1;
+    desc.strength = strength;
+    desc.post_scale = post_scale;
+    desc.solver = FORCEFIELD_MULTIGRID;
+    desc.max_iters = 20;
+    desc.tolerance = 1e-4f;
+    return desc;
+}
+
+// rms of the central-difference divergence (in units of 1/cell, grid spacing 1/size)
+static float rms_divergence(vec4 const* forces, int size)
+{
+    int stepx = 1, maskx = size - 1;
+    int stepy = size, masky = (size - 1) * size;
+    int stepz = size*size, maskz = (size - 1) * size * size;
+    double sum_sq = 0.0;
+
+    for (int o = 0; o < size*size*size; o++) {
+        float d = 0.5f * (float)size *
+            (
+                forces[step_idx(o, stepx, maskx)].x - forces[step_idx(o, -stepx, maskx)].x +
+                forces[step_idx(o, stepy, masky)].y - forces[step_idx(o, -stepy, masky)].y +
+                forces[step_idx(o, stepz, maskz)].z - forces[step_idx(o, -stepz, maskz)].z
+            );
+        sum_sq += (double)d * d;
+    }
+
+    return (float)sqrt(sum_sq / (size*size*size));
+}
+
+// The original solver: 40 (or max_iters) lexicographic Gauss-Seidel sweeps.
+static void project_gauss_seidel(vec4* forces, int size, int sweeps, forcefield_stats* stats)
+{
+    int stepx = 1, maskx = size - 1;
+    int stepy = size, masky = (size - 1) * size;
+    int stepz = size*size, maskz = (size - 1) * size * size;
+    int nelem = size * size * size;
+
+    // calc divergences
+    float* div = new float[nelem];
+    float* high = new float[nelem];
+
+    float div_scale = -0.5f / (float)size;
+
+    for (int zo = 0; zo <= maskz; zo += stepz) {
+        for (int yo = 0; yo <= masky; yo += stepy) {
+            for (int xo = 0; xo <= maskx; xo += stepx) {
+                int o = xo + yo + zo;
+
+                div[o] = div_scale *
+                    (
+                        forces[step_idx(o, stepx, maskx)].x - forces[step_idx(o, -stepx, maskx)].x +
+                        forces[step_idx(o, stepy, masky)].y - forces[step_idx(o, -stepy, masky)].y +
+                        forces[step_idx(o, stepz, maskz)].z - forces[step_idx(o, -stepz, maskz)].z
+                    );
+                high[o] = 0.0f;
+            }
+        }
+    }
+
+    // gauss-seidel iteration to calc density field
+    for (int step = 0; step < sweeps; step++) {
+        for (int zo = 0; zo <= maskz; zo += stepz) {
+            for (int yo = 0; yo <= masky; yo += stepy) {
+                for (int xo = 0; xo <= maskx; xo += stepx) {
+                    int o = xo + yo + zo;
+                    high[o] =
+                        (
+                            high[step_idx(o, -stepx, maskx)] + high[step_idx(o, stepx, maskx)] +
+                            high[step_idx(o, -stepy, masky)] + high[step_idx(o, stepy, masky)] +
+                            high[step_idx(o, -stepz, maskz)] + high[step_idx(o, stepz, maskz)]
+                        ) * (1.0f / 6.0f) - div[o];
+                }
+            }
+        }
+    }
+
+    // remove gradients from vector field
+    float grad_scale = 0.5f * (float)size;
+    for (int zo = 0; zo <= maskz; zo += stepz) {
+        for (int yo = 0; yo <= masky; yo += stepy) {
+            for (int xo = 0; xo <= maskx; xo += stepx) {
+                int o = xo + yo + zo;
+                vec4* f = forces + o;
+
+                f->x = f->x - grad_scale * (high[step_idx(o, stepx, maskx)] - high[step_idx(o, -stepx, maskx)]);
+                f->y = f->y - grad_scale * (high[step_idx(o, stepy, masky)] - high[step_idx(o, -stepy, masky)]);
+                f->z = f->z - grad_scale * (high[step_idx(o, stepz, maskz)] - high[step_idx(o, -stepz, maskz)]);
+            }
+        }
+    }
+
+    delete[] div;
+    delete[] high;
+
+    stats->iterations = sweeps;
+}
+
+// Central-difference divergence (scaled to the potential's units) of cells [begin,end).
+static void compute_divergence(float* div, vec4 const* forces, int size, int begin, int end)
+{
+    int stepx = 1, maskx = size - 1;
+    int stepy = size, masky = (size - 1) * size;
+    int stepz = size*size, maskz = (size - 1) * size * size;
+    float grad_scale = 0.5f * (float)size;
+
+    for (int o = begin; o < end; o++) {
+        div[o] = grad_scale *
+            (
+                forces[step_idx(o, stepx, maskx)].x - forces[step_idx(o, -stepx, maskx)].x +
+                forces[step_idx(o, stepy, masky)].y - forces[step_idx(o, -stepy, masky)].y +
+                forces[step_idx(o, stepz, maskz)].z - forces[step_idx(o, -stepz, maskz)].z
+            );
+    }
+}
+
+// Subtracts the central-difference gradient of pot from cells [begin,end).
+static void subtract_gradient(vec4* forces, float const* pot, int size, int begin, int end)
+{
+    int stepx = 1, maskx = size - 1;
+    int stepy = size, masky = (size - 1) * size;
+    int stepz = size*size, maskz = (size - 1) * size * size;
+    float grad_scale = 0.5f * (float)size;
+
+    for (int o = begin; o < end; o++) {
+        vec4* f = forces + o;
+        f->x -= grad_scale * (pot[step_idx(o, stepx, maskx)] - pot[step_idx(o, -stepx, maskx)]);
+        f->y -= grad_scale * (pot[step_idx(o, stepy, masky)] - pot[step_idx(o, -stepy, masky)]);
+        f->z -= grad_scale * (pot[step_idx(o, stepz, maskz)] - pot[step_idx(o, -stepz, maskz)]);
+    }
+}
+
+// Copies the (size/2)^3 cells with the given parity between the full grid and a subgrid.
+static void extract_parity(float* sub, float const* full, int size, int parity)
+{
+    int half = size / 2;
+    int px = parity & 1, py = (parity >> 1) & 1, pz = parity >> 2;
+
+    for (int z = 0; z < half; z++)
+        for (int y = 0; y < half; y++)
+            for (int x = 0; x < half; x++)
+                sub[(z * half + y) * half + x] = full[((2*z + pz) * size + 2*y + py) * size + 2*x + px];
+}
+
+static void insert_parity(float* full, float const* sub, int size, int parity)
+{
+    int half = size / 2;
+    int px = parity & 1, py = (parity >> 1) & 1, pz = parity >> 2;
+
+    for (int z = 0; z < half; z++)
+        for (int y = 0; y < half; y++)
+            for (int x = 0; x < half; x++)
+                full[((2*z + pz) * size + 2*y + py) * size + 2*x + px] = sub[(z * half + y) * half + x];
+}
+
+static void random_field(vec4* forces, forcefield_desc const& desc, int begin, int end)
+{
+    for (int o = begin; o < end; o++)
+        forces[o] = vec4(desc.strength * rand_unit_vec3_counter(desc.seed, o), 0.0f);
+}
+
+static void apply_post_scale(vec4* forces, float post_scale, int begin, int end)
+{
+    for (int o = begin; o < end; o++) {
+        forces[o].x *= post_scale;
+        forces[o].y *= post_scale;
+        forces[o].z *= post_scale;
+    }
+}
+
+// Exact discrete projection with respect to the central-difference divergence.
+//
+// div(grad(p)) with central differences on both sides is the 7-point Laplacian
+// with spacing 2h, which only couples cells with the same (x&1, y&1, z&1), so
+// it splits into 8 independent periodic problems on (size/2)^3 grids. Those
+// get solved with multigrid or plain red-black relaxation.
+static void project_subgrids(vec4* forces, int size, forcefield_desc const& desc, forcefield_stats* stats)
+{
+    int nelem = size * size * size;
+
+    float* div = new float[nelem];
+    float* pot = new float[nelem];
+
+    compute_divergence(div, forces, size, 0, nelem);
+
+    int half = size / 2;
+    poisson_result results[8];
+
+    parallel_for(8, 1, [&](int begin, int end) {
+        std::vector<float> sub_rhs(half * half * half), sub_pot(half * half * half);
+
+        for (int parity = begin; parity < end; parity++) {
+            extract_parity(&sub_rhs[0], div, size, parity);
+
+            float h = 2.0f / (float)size;
+            if (desc.solver == FORCEFIELD_MULTIGRID)
+                results[parity] = poisson_solve_multigrid(&sub_pot[0], &sub_rhs[0], half, h, desc.tolerance, desc.max_iters);
+            else {
+                std::fill(sub_pot.begin(), sub_pot.end(), 0.0f);
+                poisson_relax(&sub_pot[0], &sub_rhs[0], half, h, desc.max_iters);
+                results[parity].iterations = desc.max_iters;
+                results[parity].residual = poisson_relative_residual(&sub_pot[0], &sub_rhs[0], half, h);
+            }
+
+            insert_parity(pot, &sub_pot[0], size, parity);
+        }
+    });
+
+    stats->iterations = 0;
+    stats->residual = 0.0f;
+    for (int i = 0; i < 8; i++) {
+        stats->iterations = std::max(stats->iterations, results[i].iterations);
+        stats->residual = std::max(stats->residual, results[i].residual);
+    }
+
+    // remove gradients from vector field
+    subtract_gradient(forces, pot, size, 0, nelem);
+
+    delete[] div;
+    delete[] pot;
+}
+
+// Spectral version of the same projection: with central differences, the
+// divergence of mode k is i*dot(s, F(k)) with s = sin(2 pi k / size), so
+// removing the component of F(k) along s makes it exactly divergence-free.
+// Modes with s = 0 (all k at 0 or size/2) have no divergence to begin with.
+static void project_fft(vec4* forces, int size)
+{
+    static const double kPi = 3.14159265358979323846;
+    int nelem = size * size * size;
+    int h = size / 2 + 1;
+    size_t spec_floats = 2 * (size_t)h * size * size;
+
+    std::vector<float> comp(nelem);
+    std::vector<float> spec[3];
+    for (int c = 0; c < 3; c++) {
+        for (int o = 0; o < nelem; o++)
+            comp[o] = forces[o][c];
+
+        spec[c].resize(spec_floats);
+        fft_3d_r2c(&spec[c][0], &comp[0], size);
+    }
+
+    std::vector<float> sins(size);
+    for (int k = 0; k < size; k++)
+        sins[k] = (float)sin(2.0 * kPi * k / size);
+
+    // remove longitudinal component, one kz slab per task
+    parallel_for(size, 1, [&](int begin, int end) {
+        for (int kz = begin; kz < end; kz++) {
+            for (int ky = 0; ky < size; ky++) {
+                for (int kx = 0; kx < h; kx++) {
+                    vec3 s(sins[kx], sins[ky], sins[kz]);
+                    float s_sq = len_sq(s);
+                    if (s_sq < 1e-12f)
+                        continue;
+
+                    size_t o = 2 * (((size_t)kz * size + ky) * h + kx);
+                    float dot_re = s.x * spec[0][o] + s.y * spec[1][o] + s.z * spec[2][o];
+                    float dot_im = s.x * spec[0][o + 1] + s.y * spec[1][o + 1] + s.z * spec[2][o + 1];
+                    for (int c = 0; c < 3; c++) {
+                        spec[c][o] -= s[c] * dot_re / s_sq;
+                        spec[c][o + 1] -= s[c] * dot_im / s_sq;
+                    }
+                }
+            }
+        }
+    });
+
+    for (int c = 0; c < 3; c++) {
+        fft_3d_c2r(&comp[0], &spec[c][0], size);
+        for (int o = 0; o < nelem; o++)
+            forces[o][c] = comp[o];
+    }
+}
+
+vec4* forcefield_make(forcefield_desc const& desc, forcefield_stats* stats)
+{
+    int size = desc.size;
+    assert(is_pow2(size));
+
+    forcefield_stats dummy_stats;
+    if (!stats)
+        stats = &dummy_stats;
+
+    stats->iterations = 0;
+    stats->residual = 0.0f;
+
+    int nelem = size * size * size;
+    vec4* forces = new vec4[nelem];
+
+    // create a random vector field; every voxel gets its own counter-based
+    // random numbers, so the result doesn't depend on the thread count.
+    parallel_for(nelem, 4096, [&](int begin, int end) {
+        random_field(forces, desc, begin, end);
+    });
+
+    stats->div_before = rms_divergence(forces, size);
+
+    switch (desc.solver) {
+    case FORCEFIELD_GAUSS_SEIDEL:
+        project_gauss_seidel(forces, size, desc.max_iters, stats);
+        break;
+
+    case FORCEFIELD_MULTIGRID:
+    case FORCEFIELD_RED_BLACK:
+        if (size >= 2)
+            project_subgrids(forces, size, desc, stats);
+        break;
+
+    case FORCEFIELD_FFT:
+        if (size >= 2)
+            project_fft(forces, size);
+        break;
+    }
+
+    stats->div_after = rms_divergence(forces, size);
+
+    apply_post_scale(forces, desc.post_scale, 0, nelem);
+    return forces;
+}
+
+struct forcefield_builder {
+    enum stage {
+        STAGE_RANDOM,       // units: slabs
+        STAGE_DIVERGENCE,   // units: slabs
+        STAGE_RELAX,        // units: one sweep of one parity subgrid
+        STAGE_GRADIENT,     // units: slabs (includes post_scale)
+        STAGE_DONE,
+    };
+
+    forcefield_desc desc;
+    int slab_cells;         // cells per slab unit
+    stage cur_stage;
+    int pos;                // next slab / parity*max_iters+sweep within the stage
+
+    std::vector<vec4> forces;
+    std::vector<float> div;
+    std::vector<float> pot;
+    std::vector<float> sub_rhs;
+    std::vector<float> sub_pot;
+};
+
+forcefield_builder* forcefield_builder_create(forcefield_desc const& desc)
+{
+    assert(is_pow2(desc.size) && desc.size >= 2);
+
+    int nelem = desc.size * desc.size * desc.size;
+    int sub_cells = nelem / 8;
+
+    forcefield_builder* builder = new forcefield_builder;
+    builder->desc = desc;
+    builder->slab_cells = sub_cells; // about as much work as a sweep
+    builder->forces.resize(nelem);
+    builder->div.resize(nelem);
+    builder->pot.resize(nelem);
+    builder->sub_rhs.resize(sub_cells);
+    builder->sub_pot.resize(sub_cells);
+    forcefield_builder_restart(builder, desc.seed);
+    return builder;
+}
+
+void forcefield_builder_destroy(forcefield_builder* builder)
+{
+    delete builder;
+}
+
+void forcefield_builder_restart(forcefield_builder* builder, unsigned int seed)
+{
+    builder->desc.seed = seed;
+    builder->cur_stage = forcefield_builder::STAGE_RANDOM;
+    builder->pos = 0;
+}
+
+// Runs one unit of slab-wise work; returns true when the stage is done.
+static bool builder_slab(forcefield_builder* b, int* begin, int* end)
+{
+    int nelem = (int)b->forces.size();
+    *begin = b->pos;
+    *end = std::min(nelem, b->pos + b->slab_cells);
+    b->pos = *end;
+    return *end == nelem;
+}
+
+bool forcefield_builder_step(forcefield_builder* b, int max_units)
+{
+    int size = b->desc.size;
+    int half = size / 2;
+    float h = 2.0f / (float)size;
+    int begin, end;
+
+    for (int unit = 0; unit < max_units && b->cur_stage != forcefield_builder::STAGE_DONE; unit++) {
+        bool stage_done = false;
+
+        switch (b->cur_stage) {
+        case forcefield_builder::STAGE_RANDOM:
+            stage_done = builder_slab(b, &begin, &end);
+            random_field(&b->forces[0], b->desc, begin, end);
+            break;
+
+        case forcefield_builder::STAGE_DIVERGENCE:
+            stage_done = builder_slab(b, &begin, &end);
+            compute_divergence(&b->div[0], &b->forces[0], size, begin, end);
+            break;
+
+        case forcefield_builder::STAGE_RELAX:
+            {
+                int sweeps = std::max(b->desc.max_iters, 1);
+                int parity = b->pos / sweeps;
+                int sweep = b->pos % sweeps;
+
+                if (sweep == 0) {
+                    extract_parity(&b->sub_rhs[0], &b->div[0], size, parity);
+                    std::fill(b->sub_pot.begin(), b->sub_pot.end(), 0.0f);
+                }
+
+                if (b->desc.max_iters > 0)
+                    poisson_relax(&b->sub_pot[0], &b->sub_rhs[0], half, h, 1);
+
+                if (sweep == sweeps - 1)
+                    insert_parity(&b->pot[0], &b->sub_pot[0], size, parity);
+
+                stage_done = ++b->pos == 8 * sweeps;
+            }
+            break;
+
+        case forcefield_builder::STAGE_GRADIENT:
+            stage_done = builder_slab(b, &begin, &end);
+            subtract_gradient(&b->forces[0], &b->pot[0], size, begin, end);
+            apply_post_scale(&b->forces[0], b->desc.post_scale, begin, end);
+            break;
+
+        case forcefield_builder::STAGE_DONE:
+            break;
+        }
+
+        if (stage_done) {
+            b->cur_stage = (forcefield_builder::stage)(b->cur_stage + 1);
+            b->pos = 0;
+        }
+    }
+
+    return b->cur_stage == forcefield_builder::STAGE_DONE;
+}
+
+math::vec4 const* forcefield_builder_result(forcefield_builder const* builder)
+{
+    assert(builder->cur_stage == forcefield_builder::STAGE_DONE);
+    return &builder->forces[0];
+}
@@ -0,0 +1,63 @@
+#ifndef FORCEFIELD_H
+#define FORCEFIELD_H
+
+#include "math.h"
+
+// Random divergence-free force fields for the particle system.
+//
+// We start from a random unit vector per voxel, compute its divergence with
+// central differences, solve a periodic Poisson equation for a potential and
+// subtract the potential's gradient. All grids wrap (like the sampler does);
+// size must be a pow2.
+
+enum forcefield_solver {
+    FORCEFIELD_GAUSS_SEIDEL,    // original: fixed number of lexicographic sweeps
+    FORCEFIELD_MULTIGRID,       // FMG + V-cycles down to a residual tolerance
+    FORCEFIELD_FFT,             // exact spectral projection, no iterations
+    FORCEFIELD_RED_BLACK,       // fixed number of parallel red-black sweeps
+};
+
+struct forcefield_desc {
+    int size;
+    unsigned int seed;          // same seed gives the same field
+    float strength;             // length of the random vectors
+    float post_scale;           // applied after projection
+    forcefield_solver solver;
+    int max_iters;              // relaxation sweeps / max V-cycles (unused for FFT)
+    float tolerance;            // multigrid: relative residual to stop at
+};
+
+struct forcefield_stats {
+    int iterations;             // sweeps or V-cycles actually run
+    float residual;             // relative residual of the Poisson solve (not for GS/FFT)
+    float div_before;           // rms divergence of the random field
+    float div_after;            // rms divergence of the result (before post_scale)
+};
+
+// Fills in the defaults for everything but size/strength/post_scale (seed=1).
+forcefield_desc forcefield_default_desc(int size, float strength, float post_scale);
+
+// Returns a size^3 field (x fastest) as float4s with w=0; free with delete[].
+// stats may be NULL.
+math::vec4* forcefield_make(forcefield_desc const& desc, forcefield_stats* stats);
+
+// Incremental construction, for regenerating fields while the simulation
+// runs. Does the same work as forcefield_make with FORCEFIELD_RED_BLACK (and
+// gets the same result, whatever desc.solver says) in small units of about
+// size^3/8 cells each: slabs of the random field / divergence / gradient
+// removal, or one relaxation sweep of one of the 8 subgrids.
+struct forcefield_builder;
+
+forcefield_builder* forcefield_builder_create(forcefield_desc const& desc);
+void forcefield_builder_destroy(forcefield_builder* builder);
+
+// Starts over on a field with a different seed.
+void forcefield_builder_restart(forcefield_builder* builder, unsigned int seed);
+
+// Does up to max_units units of work; returns true once the field is done.
+bool forcefield_builder_step(forcefield_builder* builder, int max_units);
+
+// The finished field; valid until the next restart.
+math::vec4 const* forcefield_builder_result(forcefield_builder const* builder);
+
+#endif
@@ -1,14 +1,23 @@
-#define WIN32_LEAN_AND_MEAN
-#define NOMINMAX
-#include <Windows.h>
-#include <d3d11.h>
+#include "d3du_platform.h"
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <cmath>
 #include <algorithm>
 
 #include "d3du.h"
 #include "util.h"
 #include "math.h"
+#include "cpusim.h"
+#include "forcefield.h"
+#include "fieldcache.h"
+#include "fieldpack.h"
+#include "random.h"
+#include "cull.h"
+#include "softrast.h"
+#include "profile.h"
+#include "perfcount.h"
 
 static union {
     ID3D11Buffer* buffers[16];
@@ -16,11 +25,7 @@ static union {
     ID3D11RenderTargetView* rtvs[16];
 } s_no;
 
-struct CubeConstBuf {
-    math::mat44 clip_from_world;
-    math::vec3 world_down_vector;
-    float time_offs;
-
+struct CubeLights {
     math::vec3 light_color_ambient;
     float pad1;
     math::vec3 light_color_key;
@@ -33,6 +38,14 @@ struct CubeConstBuf {
     float pad5;
 };
 
+struct CubeConstBuf {
+    math::mat44 clip_from_world;
+    math::vec3 world_down_vector;
+    float time_offs;
+
+    CubeLights lights;
+};
+
 struct UpdateConstBuf {
     math::vec3 field_scale;
     float damping;
@@ -40,26 +53,51 @@ struct UpdateConstBuf {
     float accel;
     math::vec3 field_sample_scale;
     float vel_scale;
+    float field_blend;
+    float field_decode_scale;
+    float field_next_decode_scale;
+    float pad;
 };
 
-static float srgb2lin(float x)
+// sRGB8 -> linear in constant expressions (kSrgbToLinear is only known at
+// link time). x^2.4 = x^2 * (x^2)^(1/5), the fifth root by Newton iteration;
+// in double this gives exactly the table's floats.
+static constexpr double const_root5_iter(double a, double y, int iters)
+{
+    return iters ? const_root5_iter(a, (4.0 * y + a / (y * y * y * y)) / 5.0, iters - 1) : y;
+}
+
+static constexpr double const_pow24(double x)
 {
-    static const float lin_thresh = 0.04045f;
-    if (x < lin_thresh)
-        return x * (1.0f / 12.92f);
-    else
-        return std::pow((x + 0.055f) / 1.055f, 2.4f);
+    return x * x * const_root5_iter(x * x, 1.0, 64);
 }
 
-static math::vec3 srgb_color(int col)
+static constexpr float const_srgb8_to_linear(int code)
+{
+    return float(code <= 10 ? code / (255.0 * 12.92) : const_pow24((code / 255.0 + 0.055) / 1.055));
+}
+
+static constexpr math::vec3 srgb_color(int col)
 {
     return math::vec3(
-        srgb2lin(((col >> 16) & 0xff) / 255.0f),
-        srgb2lin(((col >>  8) & 0xff) / 255.0f),
-        srgb2lin(((col >>  0) & 0xff) / 255.0f)
+        const_srgb8_to_linear((col >> 16) & 0xff),
+        const_srgb8_to_linear((col >>  8) & 0xff),
+        const_srgb8_to_linear((col >>  0) & 0xff)
     );
 }
 
+static constexpr math::vec3 kLightDir(0.0f, -0.7f, -0.3f);
+
+static constexpr CubeLights kCubeLights = {
+    srgb_color(0x202020), 0.0f,                             // ambient
+    srgb_color(0xc0c0c0), 0.0f,                             // key
+    srgb_color(0x602020), 0.0f,                             // fill
+    srgb_color(0x101040), 0.0f,                             // back
+    kLightDir * (1.0f / math::const_sqrt(math::len_sq(kLightDir))), 0.0f,
+};
+
+static constexpr math::mat44 kClipFromView = math::mat44::perspectiveD3D(1280.0f / 720.0f, 1.0f, 0.01f, 50.0f);
+
 static void* map_cbuf_typeless(d3du_context* ctx, ID3D11Buffer* buf)
 {
     D3D11_MAPPED_SUBRESOURCE mapped;
@@ -103,134 +141,197 @@ static ID3D11Buffer* make_cube_inds(ID3D11Device* dev, int num_cubes)
     return ind_buf;
 }
 
-static bool is_pow2(int x)
+// DEFAULT usage, so animated fields can be uploaded into it a slab at a
+// time. texels may be NULL.
+static d3du_tex* make_force_tex(ID3D11Device* dev, int size, fieldpack_format format, void const* texels)
 {
-    return x != 0 && (x & (x - 1)) == 0;
-}
+    static const DXGI_FORMAT formats[] = {
+        DXGI_FORMAT_R32G32B32A32_FLOAT,     // FIELDPACK_FLOAT32
+        DXGI_FORMAT_R16G16B16A16_FLOAT,     // FIELDPACK_HALF
+        DXGI_FORMAT_R32_UINT,               // FIELDPACK_SHAREDEXP
+        DXGI_FORMAT_R8G8B8A8_SNORM,         // FIELDPACK_SNORM8
+    };
 
-static float randf()
-{
-    return 1.0f * rand() / RAND_MAX;
+    int texel_bytes = fieldpack_texel_bytes(format);
+    return d3du_tex::make3d(dev, size, size, size, 1, formats[format],
+        D3D11_USAGE_DEFAULT, D3D11_BIND_SHADER_RESOURCE, texels, size * texel_bytes, size * size * texel_bytes);
 }
 
-static math::vec3 rand_vec3_unit_sphere(float* len_sq_out = nullptr)
+// Hands a finished animated field over to the samplers a few z slices at a
+// time, so no single frame pays for a whole field: copy it out of the
+// builder (which then gets restarted), encode it and upload it, then (for
+// the CPU sim) convert it. Each unit is about as much work as a builder unit.
+struct field_handoff {
+    int size;
+    int slab;                   // z slices per unit
+    int unit;                   // next unit, -1 when idle
+    float max_comp;             // of the slices copied so far
+    math::vec4* texels;         // the copy
+    fieldpack pack;             // texels encoded
+    cpusim_field sim_field;     // pack in the CPU sim's layout
+};
+
+// Does one unit; returns true when everything's handed over.
+static bool field_handoff_step(field_handoff* h, forcefield_builder const* builder, fieldpack_format format,
+    ID3D11DeviceContext* ctx, d3du_tex* tex, bool use_sim, cpusim_layout sim_layout)
 {
-    math::vec3 v;
-    float l;
+    int size = h->size;
+    int num_slabs = (size + h->slab - 1) / h->slab;
+    int stage = h->unit / num_slabs;
+    int z0 = (h->unit % num_slabs) * h->slab;
+    int z1 = std::min(z0 + h->slab, size);
+    int begin = z0 * size * size, end = z1 * size * size;
+    bool last_slab = z1 == size;
+    h->unit++;
+
+    switch (stage) {
+    case 0: // copy
+        std::copy(forcefield_builder_result(builder) + begin, forcefield_builder_result(builder) + end, h->texels + begin);
+        h->max_comp = std::max(h->max_comp, fieldpack_max_component(h->texels, begin, end));
+        if (last_slab)
+            fieldpack_init(&h->pack, h->texels, size, format, h->max_comp);
+        return false;
+
+    case 1: // encode and upload
+        {
+            fieldpack_encode_range(&h->pack, h->texels, begin, end);
 
-    do
-    {
-        v.x = 2.0f * randf() - 1.0f;
-        v.y = 2.0f * randf() - 1.0f;
-        v.z = 2.0f * randf() - 1.0f;
-        l = math::len_sq(v);
-    } while (l > 1.0f);
-
-    if (len_sq_out)
-        *len_sq_out = l;
-    return v;
-}
+            int texel_bytes = fieldpack_texel_bytes(format);
+            D3D11_BOX box = { 0, 0, (UINT)z0, (UINT)size, (UINT)size, (UINT)z1 };
+            ctx->UpdateSubresource(tex->resrc, 0, &box, (unsigned char const*)h->pack.texels + (size_t)begin * texel_bytes,
+                size * texel_bytes, size * size * texel_bytes);
 
-static math::vec3 rand_unit_vec3()
-{
-    math::vec3 v;
-    float l;
+            if (last_slab && use_sim)
+                h->sim_field = cpusim_alloc_field(size, format, h->pack.scale, sim_layout);
+            return last_slab && !use_sim;
+        }
 
-    do v = rand_vec3_unit_sphere(&l); while (l == 0.0f);
-    return math::rsqrt(l) * v;
+    default: // convert for the CPU sim
+        {
+            cpusim_field linear = { size, h->pack.texels, format, h->pack.scale, CPUSIM_LAYOUT_LINEAR };
+            cpusim_convert_field_range(&h->sim_field, linear, z0, z1);
+            return last_slab;
+        }
+    }
 }
 
-static int step_idx(int base, int step, int mask)
+static double ms_between(LARGE_INTEGER freq, LARGE_INTEGER start, LARGE_INTEGER end)
 {
-    return (base & ~mask) | ((base + step) & mask);
+    return 1000.0 * (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
 }
 
-static d3du_tex* make_force_tex(ID3D11Device* dev, int size, float strength, float post_scale)
+// runs on the field build thread
+static void field_done(void* user, fieldcache_entry* /*entry*/)
 {
-    using namespace math;
-    assert(is_pow2(size));
-
-    int stepx = 1, maskx = size - 1;
-    int stepy = size, masky = (size - 1) * size;
-    int stepz = size*size, maskz = (size - 1) * size * size;
-    int nelem = size * size * size;
-    vec4* forces = new vec4[nelem];
-    
-    // create a random vector field
-    for (int zo = 0; zo <= maskz; zo += stepz) {
-        for (int yo = 0; yo <= masky; yo += stepy) {
-            for (int xo = 0; xo <= maskx; xo += stepx) {
-                forces[xo + yo + zo] = math::vec4(strength * rand_unit_vec3(), 0.0f);
-            }
-        }
-    }
-
-    // calc divergences
-    float* div = new float[nelem];
-    float* high = new float[nelem];
-
-    float div_scale = -0.5f / (float)size;
-
-    for (int zo = 0; zo <= maskz; zo += stepz) {
-        for (int yo = 0; yo <= masky; yo += stepy) {
-            for (int xo = 0; xo <= maskx; xo += stepx) {
-                int o = xo + yo + zo;
-
-                div[o] = div_scale * 
-                    (
-                        forces[step_idx(o, stepx, maskx)].x - forces[step_idx(o, -stepx, maskx)].x +
-                        forces[step_idx(o, stepy, masky)].y - forces[step_idx(o, -stepy, masky)].y +
-                        forces[step_idx(o, stepz, maskz)].z - forces[step_idx(o, -stepz, maskz)].z
-                    );
-                high[o] = 0.0f;
-            }
-        }
-    }
-
-    // gauss-seidel iteration to calc density field
-    for (int step = 0; step < 40; step++) {
-        for (int zo = 0; zo <= maskz; zo += stepz) {
-            for (int yo = 0; yo <= masky; yo += stepy) {
-                for (int xo = 0; xo <= maskx; xo += stepx) {
-                    int o = xo + yo + zo;
-                    high[o] =
-                        (
-                            high[step_idx(o, -stepx, maskx)] + high[step_idx(o, stepx, maskx)] +
-                            high[step_idx(o, -stepy, masky)] + high[step_idx(o, stepy, masky)] +
-                            high[step_idx(o, -stepz, maskz)] + high[step_idx(o, stepz, maskz)]
-                        ) * (1.0f / 6.0f) - div[o];
-                }
-            }
-        }
-    }
+    QueryPerformanceCounter((LARGE_INTEGER*)user);
+}
 
-    // remove gradients from vector field
-    float grad_scale = 0.5f * (float)size;
-    for (int zo = 0; zo <= maskz; zo += stepz) {
-        for (int yo = 0; yo <= masky; yo += stepy) {
-            for (int xo = 0; xo <= maskx; xo += stepx) {
-                int o = xo + yo + zo;
-                vec4* f = forces + o;
-                
-                f->x = (f->x - grad_scale * (high[step_idx(o, stepx, maskx)] - high[step_idx(o, -stepx, maskx)])) * post_scale;
-                f->y = (f->y - grad_scale * (high[step_idx(o, stepy, masky)] - high[step_idx(o, -stepy, masky)])) * post_scale;
-                f->z = (f->z - grad_scale * (high[step_idx(o, stepz, maskz)] - high[step_idx(o, -stepz, maskz)])) * post_scale;
-            }
-        }
-    }
-    
-    d3du_tex* tex = d3du_tex::make3d(dev, size, size, size, 1, DXGI_FORMAT_R32G32B32A32_FLOAT,
-        D3D11_USAGE_IMMUTABLE, D3D11_BIND_SHADER_RESOURCE, forces, stepy * sizeof(*forces), stepz * sizeof(*forces));
-
-    delete[] div;
-    delete[] high;
-    delete[] forces;
-    return tex;
+#if D3DU_HEADLESS
+// Headless, the cube pass runs on softrast: this does what the GPU would
+// with the state the render loop binds for it.
+static void draw_cubes_cpu(void* user, ID3D11DeviceContext* ctx, UINT index_count, UINT instance_count,
+    UINT start_index, INT base_vertex, UINT /*start_instance*/)
+{
+    softrast* rast = (softrast*)user;
+
+    if (ctx->topology != D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP || !ctx->index_buf
+        || ctx->index_format != DXGI_FORMAT_R16_UINT || base_vertex != 0)
+        panic("draw_cubes_cpu: expected 16-bit indexed triangle strips\n");
+    if (!ctx->rtv || !ctx->dsv || ctx->rtv->resource->format != DXGI_FORMAT_R8G8B8A8_UNORM_SRGB)
+        panic("draw_cubes_cpu: expected an sRGB8 render target and a depth buffer\n");
+
+    softrast_cube_mesh mesh;
+    uint16_t const* inds = (uint16_t const*)(ctx->index_buf->data + ctx->index_offset) + start_index;
+    if (!softrast_cube_mesh_from_strips(&mesh, inds, (int)index_count))
+        panic("draw_cubes_cpu: index buffer isn't laid out like make_cube_inds'\n");
+
+    ID3D11Resource* pos = ctx->vs_srvs[0]->resource;
+    ID3D11Resource* inst = ctx->vs_srvs[2]->resource;
+    softrast_cube_source src;
+    src.pos = (math::vec4 const*)pos->data;
+    src.fwd = (math::vec4 const*)ctx->vs_srvs[1]->resource->data;
+    src.tex_width = (int)pos->width;
+    src.tex_height = (int)pos->height;
+    src.inst = (UINT const*)inst->data;
+    src.inst_width = (int)inst->width;
+    src.inst_height = (int)inst->height;
+    src.fetch = (strcmp(ctx->vs->entrypt, "RenderCubeSortedVertexShader") == 0) ? SOFTRAST_FETCH_ORDER : SOFTRAST_FETCH_ROWS;
+
+    CubeConstBuf const* vs_consts = (CubeConstBuf const*)ctx->vs_cbufs[0]->data;
+    CubeConstBuf const* ps_consts = (CubeConstBuf const*)ctx->ps_cbufs[0]->data;
+    softrast_cube_consts consts;
+    consts.clip_from_world = vs_consts->clip_from_world;
+    consts.world_down_vector = vs_consts->world_down_vector;
+    consts.light_color_ambient = ps_consts->lights.light_color_ambient;
+    consts.light_color_key = ps_consts->lights.light_color_key;
+    consts.light_color_fill = ps_consts->lights.light_color_fill;
+    consts.light_color_back = ps_consts->lights.light_color_back;
+    consts.light_dir = ps_consts->lights.light_dir;
+
+    ID3D11Resource* color = ctx->rtv->resource;
+    ID3D11Resource* depth = ctx->dsv->resource;
+    softrast_target target;
+    target.width = (int)std::min(color->width, depth->width);
+    target.height = (int)std::min(color->height, depth->height);
+    target.color = (uint32_t*)color->data;
+    target.color_pitch = (int)color->row_pitch;
+    target.depth = (float*)depth->data;
+    target.depth_pitch = (int)depth->row_pitch;
+    target.vp_x = ctx->viewport.TopLeftX;
+    target.vp_y = ctx->viewport.TopLeftY;
+    target.vp_w = ctx->viewport.Width;
+    target.vp_h = ctx->viewport.Height;
+
+    // no rasterizer state = D3D defaults
+    D3D11_CULL_MODE cull = ctx->raster ? ctx->raster->cull : D3D11_CULL_BACK;
+    target.cull = (cull == D3D11_CULL_BACK) ? SOFTRAST_CULL_BACK : (cull == D3D11_CULL_FRONT) ? SOFTRAST_CULL_FRONT : SOFTRAST_CULL_NONE;
+    target.front_ccw = ctx->raster ? ctx->raster->front_ccw : false;
+
+    softrast_stats stats;
+    softrast_draw_cubes(rast, target, src, consts, mesh, (int)instance_count, &stats);
+
+    // invocations as if the pixel shader ran on every covered pixel (no
+    // early-Z), so the shaded/passed ratio shows what the depth test saves
+    ctx->ps_invocations += stats.pixels_covered;
+    ctx->samples_passed += stats.pixels_passed;
 }
+#endif
 
-int main()
+int main(int argc, char** argv)
 {
+    LARGE_INTEGER timer_freq, start_time, first_frame_time, field_done_time;
+    QueryPerformanceFrequency(&timer_freq);
+    QueryPerformanceCounter(&start_time);
+
     d3du_context* d3d = d3du_init("Momentous", 1280, 720, D3D_FEATURE_LEVEL_10_0);
+    if (!d3d)
+        panic("d3du_init failed!\n");
+
+    // -frames N: exit after N frames (0 = run until closed)
+    // -dump file.tga: headless, write the last frame to file.tga
+    // -trace file.json: write a Chrome trace of the CPU zones at exit
+    // -perf 1: hardware counters on the CPU kernels (Linux)
+    // -deterministic 0/1: wait for the force field before the first frame,
+    //   so the same args always render the same frames (default: headless)
+    char const* dump_filename = NULL;
+    char const* trace_filename = NULL;
+    bool use_perf = false;
+    bool deterministic = D3DU_HEADLESS != 0;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-frames") == 0)
+            d3d->frame_limit = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-dump") == 0)
+            dump_filename = argv[++i];
+        else if (strcmp(argv[i], "-trace") == 0)
+            trace_filename = argv[++i];
+        else if (strcmp(argv[i], "-perf") == 0)
+            use_perf = atoi(argv[++i]) != 0;
+        else if (strcmp(argv[i], "-deterministic") == 0)
+            deterministic = atoi(argv[++i]) != 0;
+    }
+
+    profile_thread_name("main");
+    profile_set_tracing(trace_filename != NULL);
 
     char* shader_source = read_file("shaders.hlsl");
 
@@ -238,19 +339,47 @@ int main()
         "vs_4_0", "UpdateVertShader").vs;
     ID3D11PixelShader *update_pos_ps = d3du_compile_and_create_shader(d3d->dev, shader_source,
         "ps_4_0", "UpdatePosShader").ps;
+    ID3D11PixelShader *update_pos_sharedexp_ps = d3du_compile_and_create_shader(d3d->dev, shader_source,
+        "ps_4_0", "UpdatePosSharedExpShader").ps;
     ID3D11PixelShader *update_vel_ps = d3du_compile_and_create_shader(d3d->dev, shader_source,
         "ps_4_0", "UpdateVelShader").ps;
 
     ID3D11VertexShader *cube_vs = d3du_compile_and_create_shader(d3d->dev, shader_source,
         "vs_4_0", "RenderCubeVertexShader").vs;
+    ID3D11VertexShader *cube_sorted_vs = d3du_compile_and_create_shader(d3d->dev, shader_source,
+        "vs_4_0", "RenderCubeSortedVertexShader").vs;
     ID3D11PixelShader *cube_ps = d3du_compile_and_create_shader(d3d->dev, shader_source,
         "ps_4_0", "RenderCubePixelShader").ps;
 
     free(shader_source);
 
+#if D3DU_HEADLESS
+    softrast* cube_rast = softrast_create();
+    d3du_null_set_draw_handler("RenderCubeVertexShader", "RenderCubePixelShader", draw_cubes_cpu, cube_rast);
+    d3du_null_set_draw_handler("RenderCubeSortedVertexShader", "RenderCubePixelShader", draw_cubes_cpu, cube_rast);
+#endif
+
     static const UINT kChunkSize = 1024;
     static const UINT kNumCubes = 48 * 1024;
     static const UINT kTexHeight = (kNumCubes + kChunkSize - 1) / kChunkSize;
+    static const int kForceFieldSize = 32;
+    static const int kPlaceholderFieldSize = 8;
+    static const forcefield_solver kForceFieldSolver = FORCEFIELD_MULTIGRID; // or _GAUSS_SEIDEL, _FFT, _RED_BLACK
+    static const fieldpack_format kForceFieldFormat = FIELDPACK_FLOAT32; // or _HALF, _SHAREDEXP, _SNORM8
+
+    // animated field: keep building new fields (with red-black relaxation),
+    // a bounded amount of work per frame, and blend over to each one in turn.
+    static const bool kAnimateField = false;
+    static const int kFieldBuildUnitsPerFrame = 2;
+    static const int kFieldBlendFrames = 600;
+
+    // run the particle update on the CPU and upload the results instead of
+    // using the update shaders. Headless, only the cube pass executes (on
+    // softrast), so there's no other way to get particles moving.
+    static const bool kUseCpuSim = false || D3DU_HEADLESS;
+    static const cpusim_layout kCpuFieldLayout = CPUSIM_LAYOUT_MORTON; // or _LINEAR, _CORNERS
+    static const int kCpuSortInterval = 16; // frames between spatial re-sorts; 0 = never
+    static const bool kDepthSortCubes = true; // CPU sim: draw cubes front to back (for early-Z)
 
     ID3D11Buffer* update_const_buf = d3du_make_buffer(d3d->dev, sizeof(UpdateConstBuf),
         D3D11_USAGE_DYNAMIC, D3D11_BIND_CONSTANT_BUFFER, NULL);
@@ -269,7 +398,56 @@ int main()
         part_tex[i] = d3du_tex::make2d(d3d->dev, kChunkSize, kTexHeight, 1, DXGI_FORMAT_R32G32B32A32_FLOAT,
             D3D11_USAGE_DEFAULT, D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET, NULL, 0);
 
-    d3du_tex* force_tex = make_force_tex(d3d->dev, 32, 1.0f, 0.001f);
+    // the texture row each cube instance draws. The GPU sim draws all rows
+    // in order; the CPU sim also gives us row bounds, and uploads just the
+    // rows that pass frustum culling.
+    UINT visible_rows[kTexHeight];
+    for (UINT i=0; i < kTexHeight; i++)
+        visible_rows[i] = i;
+    d3du_tex* row_tex = d3du_tex::make2d(d3d->dev, kTexHeight, 1, 1, DXGI_FORMAT_R32_UINT,
+        D3D11_USAGE_DEFAULT, D3D11_BIND_SHADER_RESOURCE, visible_rows, kTexHeight * sizeof(UINT));
+
+    // with kDepthSortCubes, the particle texel indices in draw order
+    d3du_tex* order_tex = d3du_tex::make2d(d3d->dev, kChunkSize, kTexHeight, 1, DXGI_FORMAT_R32_UINT,
+        D3D11_USAGE_DEFAULT, D3D11_BIND_SHADER_RESOURCE, NULL, 0);
+    UINT* depth_order = new UINT[kChunkSize * kTexHeight];
+
+    // overdraw of the cube pass
+    d3du_pixel_counter* cube_pixels = d3du_pixel_counter_create(d3d, 10);
+
+    // the real force field gets built in the background (or mapped from the
+    // cache in the working directory); until it's done, we use a coarse one.
+    forcefield_desc field_desc = forcefield_default_desc(kForceFieldSize, 1.0f, 0.001f);
+    field_desc.solver = kForceFieldSolver;
+    fieldcache_job* field_job = fieldcache_get_async(NULL, field_desc, field_done, &field_done_time);
+    fieldcache_entry* field_entry = NULL;
+
+    forcefield_desc placeholder_desc = forcefield_default_desc(kPlaceholderFieldSize, 1.0f, 0.001f);
+    placeholder_desc.solver = FORCEFIELD_FFT;
+    math::vec4* placeholder_field = forcefield_make(placeholder_desc, NULL);
+
+    // force_field has the float texels, force_pack the encoded ones the
+    // samplers use.
+    int field_size = kPlaceholderFieldSize;
+    math::vec4 const* force_field = placeholder_field;
+    fieldpack force_pack;
+    fieldpack_encode(&force_pack, force_field, field_size, kForceFieldFormat);
+    d3du_tex* force_tex = make_force_tex(d3d->dev, field_size, kForceFieldFormat, force_pack.texels);
+
+    forcefield_builder* field_builder = NULL;
+    unsigned int anim_seed = field_desc.seed;
+    math::vec4* anim_field = NULL;      // current field once we've blended away from the first
+    math::vec4* next_field = NULL;      // field we're blending to, if any
+    fieldpack next_pack = fieldpack();
+    d3du_tex* force_next_tex = NULL;    // next_pack; made along with field_builder
+    float field_blend = 0.0f;
+    field_handoff handoff = field_handoff();
+    handoff.unit = -1;
+
+    cpusim* sim = kUseCpuSim ? cpusim_create(kChunkSize, kTexHeight) : NULL;
+    math::vec4* sim_upload = kUseCpuSim ? new math::vec4[kChunkSize * kTexHeight] : NULL;
+    cpusim_field sim_field = cpusim_field(); // force_pack in kCpuFieldLayout, made on demand
+    cpusim_field sim_next_field = cpusim_field(); // same for next_pack
 
     D3D11_VIEWPORT part_vp = d3du_full_tex2d_viewport(part_tex[0]->tex2d);
 
@@ -277,10 +455,124 @@ int main()
     unsigned int cur_part = 0;
     int num_cubes = kNumCubes;
     unsigned int spawn_counter = 0;
+    rand_stream spawn_rng;
+    rand_stream_seed(&spawn_rng, 1);
+    bool startup_reported = false;
+
+    // CPU time per frame, vsync wait excluded; streaming since runs can be
+    // arbitrarily long. Reports min, quartiles, p99, p99.9, max.
+    static const float kFramePercentiles[] = { 0.0f, 25.0f, 50.0f, 75.0f, 99.0f, 99.9f, 100.0f };
+    run_stats* frame_cpu_ms = run_stats_create_streaming();
+    run_stats_set_percentiles(frame_cpu_ms, kFramePercentiles, 7);
+
+    // NULL (no-op) without -perf
+    perfcount* perf_update = use_perf ? perfcount_create("cpusim_update") : NULL;
+    perfcount* perf_sort = use_perf ? perfcount_create("cpusim_sort") : NULL;
+    perfcount* perf_field = use_perf ? perfcount_create("field build") : NULL;
+    perfcount* perf_draw = use_perf ? perfcount_create("draw cubes") : NULL;
 
     while (d3du_handle_events(d3d)) {
+        // last frame's zones; a ring holds a few thousand per thread
+        profile_flush();
+
+        LARGE_INTEGER frame_start, frame_end;
+        QueryPerformanceCounter(&frame_start);
+
+        PROFILE_ZONE("frame"); // includes present
         using namespace math;
 
+        // hot-swap the real force field in when it's ready. Deterministic
+        // runs wait for it on the first frame instead: when it's ready
+        // depends on timing, and so would every frame after the swap.
+        if (field_job && (deterministic || fieldcache_job_ready(field_job))) {
+            PROFILE_ZONE("field swap");
+            bool field_cached;
+            field_entry = fieldcache_job_wait(field_job, &field_cached);
+            field_job = NULL;
+
+            forcefield_stats const& field_stats = fieldcache_stats(field_entry);
+            printf("force field: %d^3%s, %d iterations, residual %.2g, rms divergence %.3g -> %.3g\n",
+                kForceFieldSize, field_cached ? " (cached)" : "", field_stats.iterations, field_stats.residual,
+                field_stats.div_before, field_stats.div_after);
+
+            delete force_tex;
+            delete[] placeholder_field;
+            placeholder_field = NULL;
+
+            field_size = kForceFieldSize;
+            force_field = fieldcache_texels(field_entry);
+            fieldpack_free(&force_pack);
+            fieldpack_encode(&force_pack, force_field, field_size, kForceFieldFormat);
+            cpusim_free_field(&sim_field);
+            force_tex = make_force_tex(d3d->dev, field_size, kForceFieldFormat, force_pack.texels);
+
+            fieldpack_error pack_err = fieldpack_measure_error(force_pack, force_field);
+            printf("force field format: %s, %d bytes/texel, max error %.3g, rms error %.3g (rms force %.3g)\n",
+                fieldpack_format_name(force_pack.format), fieldpack_texel_bytes(force_pack.format),
+                pack_err.max_abs, pack_err.rms, pack_err.ref_rms);
+        }
+
+        if (kAnimateField && field_entry) {
+            PROFILE_ZONE("field animate");
+            int nelem = kForceFieldSize * kForceFieldSize * kForceFieldSize;
+
+            if (!field_builder) {
+                forcefield_desc anim_desc = field_desc;
+                anim_desc.solver = FORCEFIELD_RED_BLACK;
+                anim_desc.seed = ++anim_seed;
+                field_builder = forcefield_builder_create(anim_desc);
+                force_next_tex = make_force_tex(d3d->dev, kForceFieldSize, kForceFieldFormat, NULL);
+            }
+
+            // when the next field is ready and we're not busy blending,
+            // hand it over (out of the same per-frame budget), then start
+            // blending to it and building the one after.
+            perfcount_begin(perf_field);
+            if (handoff.unit < 0) {
+                bool built = forcefield_builder_step(field_builder, kFieldBuildUnitsPerFrame);
+                if (built && !next_field) {
+                    handoff.size = kForceFieldSize;
+                    handoff.slab = std::max(kForceFieldSize / 8, 1);
+                    handoff.unit = 0;
+                    handoff.max_comp = 0.0f;
+                    handoff.texels = new vec4[nelem];
+                }
+            } else {
+                for (int unit = 0; unit < kFieldBuildUnitsPerFrame; unit++) {
+                    if (field_handoff_step(&handoff, field_builder, kForceFieldFormat, d3d->ctx, force_next_tex, sim != NULL, kCpuFieldLayout)) {
+                        next_field = handoff.texels;
+                        next_pack = handoff.pack;
+                        sim_next_field = handoff.sim_field;
+                        handoff = field_handoff();
+                        handoff.unit = -1;
+                        forcefield_builder_restart(field_builder, ++anim_seed);
+                        break;
+                    }
+                }
+            }
+            perfcount_end(perf_field, (double)nelem);
+
+            if (next_field) {
+                field_blend += 1.0f / kFieldBlendFrames;
+                if (field_blend >= 1.0f) {
+                    // force_tex's storage gets the field after next
+                    std::swap(force_tex, force_next_tex);
+
+                    delete[] anim_field;
+                    force_field = anim_field = next_field;
+                    next_field = NULL;
+
+                    fieldpack_free(&force_pack);
+                    force_pack = next_pack;
+                    next_pack = fieldpack();
+                    cpusim_free_field(&sim_field);
+                    sim_field = sim_next_field;
+                    sim_next_field = cpusim_field();
+                    field_blend = 0.0f;
+                }
+            }
+        }
+
         static const float part_size = 0.001f;
 
         vec3 emit_pos(0.0f);
@@ -288,78 +580,150 @@ int main()
 
         // spawn new particles
         {
+            PROFILE_ZONE("spawn");
             static const int kSpawnCount = 256;
             vec4 pos_old[kSpawnCount];
             vec4 pos_new[kSpawnCount];
 
+            float ofs_x[kSpawnCount], ofs_y[kSpawnCount], ofs_z[kSpawnCount];
+            float vel_x[kSpawnCount], vel_y[kSpawnCount], vel_z[kSpawnCount];
+            rand_ball_batch(&spawn_rng, ofs_x, ofs_y, ofs_z, kSpawnCount, 0.002f);
+            rand_ball_batch(&spawn_rng, vel_x, vel_y, vel_z, kSpawnCount, 0.003f);
+
             for (int i = 0; i < kSpawnCount; i++) {
-                vec3 pos = emit_pos + rand_vec3_unit_sphere() * 0.002f;
-                vec3 vel = rand_vec3_unit_sphere() * 0.003f;
+                vec3 pos = emit_pos + vec3(ofs_x[i], ofs_y[i], ofs_z[i]);
+                vec3 vel(vel_x[i], vel_y[i], vel_z[i]);
 
                 pos_old[i] = vec4(pos - vel, part_size);
                 pos_new[i] = vec4(pos, part_size);
             }
 
-            // upload
-            D3D11_BOX box = { };
-            box.left = spawn_counter % kChunkSize;
-            box.right = box.left + kSpawnCount;
-            box.top = spawn_counter / kChunkSize;
-            box.bottom = box.top + 1;
-            box.front = 0;
-            box.back = 1;
-            d3d->ctx->UpdateSubresource(part_tex[(cur_part + 2) % 3]->tex2d, 0, &box, pos_old, 0, 0);
-            d3d->ctx->UpdateSubresource(part_tex[cur_part]->tex2d, 0, &box, pos_new, 0, 0);
+            // the CPU sim finds dead slots during its update and spawns
+            // into those; the GPU path would need a readback for that, so it
+            // keeps cycling through the texture.
+            if (sim)
+                cpusim_spawn_free(sim, kSpawnCount, pos_old, pos_new);
+            else {
+                // upload
+                D3D11_BOX box = { };
+                box.left = spawn_counter % kChunkSize;
+                box.right = box.left + kSpawnCount;
+                box.top = spawn_counter / kChunkSize;
+                box.bottom = box.top + 1;
+                box.front = 0;
+                box.back = 1;
+                d3d->ctx->UpdateSubresource(part_tex[(cur_part + 2) % 3]->tex2d, 0, &box, pos_old, 0, 0);
+                d3d->ctx->UpdateSubresource(part_tex[cur_part]->tex2d, 0, &box, pos_new, 0, 0);
+            }
 
             spawn_counter = (spawn_counter + kSpawnCount) % num_cubes;
         }
 
-        // set up update constant buffer
-        auto update_consts = map_cbuf<UpdateConstBuf>(d3d, update_const_buf);
-        update_consts->field_scale = math::vec3(32.0f);
-        update_consts->damping = 0.99f;
-        update_consts->field_offs = math::vec3(0.0f);
-        update_consts->accel = 0.75f;
-        update_consts->field_sample_scale = math::vec3(1.0f / 32.0f);
-        update_consts->vel_scale = part_size * 6.0f;
-        unmap_cbuf(d3d, update_const_buf);
-
-        // update position (potentially several time steps)
-        d3d->ctx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
+        // instances are whole texture rows, listed in row_tex
+        UINT draw_rows = (num_cubes + kChunkSize - 1) / kChunkSize;
+        if (sim) {
+            PROFILE_ZONE("cpu sim");
+            cpusim_consts consts;
+            consts.field_scale = math::vec3((float)field_size);
+            consts.damping = 0.99f;
+            consts.field_offs = math::vec3(0.0f);
+            consts.accel = 0.75f;
+            consts.field_sample_scale = math::vec3(1.0f / field_size);
+            consts.vel_scale = part_size * 6.0f;
+            consts.field_blend = next_field ? field_blend : 0.0f;
+
+            // while blending, the sampler does the taps in both fields (same
+            // as the GPU path), so the cost stays per particle. The next
+            // field comes converted from the handoff.
+            if (!sim_field.texels) {
+                cpusim_field linear = { field_size, force_pack.texels, force_pack.format, force_pack.scale, CPUSIM_LAYOUT_LINEAR };
+                sim_field = cpusim_convert_field(linear, kCpuFieldLayout);
+            }
 
-        d3d->ctx->VSSetShader(update_vs, NULL, 0);
-        d3d->ctx->RSSetViewports(1, &part_vp);
+            {
+                PROFILE_ZONE("cpusim_update");
+                int num_particles = sim->extent;
+                perfcount_begin(perf_update);
+                cpusim_update(sim, consts, sim_field, next_field ? &sim_next_field : NULL, 1);
+                perfcount_end(perf_update, num_particles);
+            }
+            if (kCpuSortInterval && frame % kCpuSortInterval == 0) {
+                PROFILE_ZONE("cpusim_sort");
+                perfcount_begin(perf_sort);
+                cpusim_sort(sim, consts);
+                perfcount_end(perf_sort, sim->num_live);
+            }
 
-        d3d->ctx->PSSetShader(update_pos_ps, NULL, 0);
-        d3d->ctx->PSSetSamplers(0, 1, &force_sampler);
-        d3d->ctx->PSSetConstantBuffers(1, 1, &update_const_buf);
-        d3d->ctx->PSSetShaderResources(2, 1, &force_tex->srv);
-        for (int step=0; step < 1; step++) {
+            // the renderer only needs the newest positions and the velocities,
+            // and only the rows holding live particles (they're packed at the
+            // front). The rest of the last row has to read as dead.
+            PROFILE_ZONE("sim upload");
             cur_part = (cur_part + 1) % 3;
+            int num_live = cpusim_read_live(sim, cpusim_pos_buf(sim, 0), sim_upload);
+            draw_rows = (UINT)(num_live + kChunkSize - 1) / kChunkSize;
+            for (UINT i = (UINT)num_live; i < draw_rows * kChunkSize; i++)
+                sim_upload[i] = vec4(0.0f);
+
+            if (draw_rows) {
+                D3D11_BOX box = { 0, 0, 0, kChunkSize, draw_rows, 1 };
+                d3d->ctx->UpdateSubresource(part_tex[cur_part]->tex2d, 0, &box, sim_upload, kChunkSize * sizeof(vec4), 0);
+                cpusim_read_live(sim, sim->bufs[3], sim_upload);
+                d3d->ctx->UpdateSubresource(part_tex[3]->tex2d, 0, &box, sim_upload, kChunkSize * sizeof(vec4), 0);
+            }
+        } else {
+            PROFILE_ZONE("gpu update");
+
+            // set up update constant buffer
+            auto update_consts = map_cbuf<UpdateConstBuf>(d3d, update_const_buf);
+            update_consts->field_scale = math::vec3((float)field_size);
+            update_consts->damping = 0.99f;
+            update_consts->field_offs = math::vec3(0.0f);
+            update_consts->accel = 0.75f;
+            update_consts->field_sample_scale = math::vec3(1.0f / field_size);
+            update_consts->vel_scale = part_size * 6.0f;
+            update_consts->field_blend = next_field ? field_blend : 0.0f;
+            update_consts->field_decode_scale = force_pack.scale;
+            update_consts->field_next_decode_scale = next_field ? next_pack.scale : force_pack.scale;
+            unmap_cbuf(d3d, update_const_buf);
+
+            // update position (potentially several time steps)
+            d3d->ctx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
+
+            d3d->ctx->VSSetShader(update_vs, NULL, 0);
+            d3d->ctx->RSSetViewports(1, &part_vp);
+
+            d3d->ctx->PSSetShader(force_pack.format == FIELDPACK_SHAREDEXP ? update_pos_sharedexp_ps : update_pos_ps, NULL, 0);
+            d3d->ctx->PSSetSamplers(0, 1, &force_sampler);
+            d3d->ctx->PSSetConstantBuffers(1, 1, &update_const_buf);
+            ID3D11ShaderResourceView* force_srvs[2] = { force_tex->srv, (next_field ? force_next_tex : force_tex)->srv };
+            d3d->ctx->PSSetShaderResources(2, 2, force_srvs);
+            for (int step=0; step < 1; step++) {
+                cur_part = (cur_part + 1) % 3;
+
+                ID3D11ShaderResourceView* srvs[2];
+                for (int i=0; i < 2; i++)
+                    srvs[i] = part_tex[(cur_part + 1 + i) % 3]->srv;
+
+                d3d->ctx->PSSetShaderResources(0, 2, srvs);
+                d3d->ctx->OMSetRenderTargets(1, &part_tex[cur_part]->rtv, NULL);
+                d3d->ctx->Draw(3, 0);
+                d3d->ctx->PSSetShaderResources(0, 2, s_no.srvs);
+                d3d->ctx->OMSetRenderTargets(1, s_no.rtvs, NULL);
+            }
 
-            ID3D11ShaderResourceView* srvs[2];
-            for (int i=0; i < 2; i++)
-                srvs[i] = part_tex[(cur_part + 1 + i) % 3]->srv;
-
-            d3d->ctx->PSSetShaderResources(0, 2, srvs);
-            d3d->ctx->OMSetRenderTargets(1, &part_tex[cur_part]->rtv, NULL);
-            d3d->ctx->Draw(3, 0);
-            d3d->ctx->PSSetShaderResources(0, 2, s_no.srvs);
-            d3d->ctx->OMSetRenderTargets(1, s_no.rtvs, NULL);
-        }
-
-        // update velocities
-        {
-            ID3D11ShaderResourceView* srvs[2];
-            for (int i=0; i < 2; i++)
-                srvs[i] = part_tex[(cur_part + 2 + i) % 3]->srv;
-
-            d3d->ctx->PSSetShader(update_vel_ps, NULL, 0);
-            d3d->ctx->PSSetShaderResources(0, 2, srvs);
-            d3d->ctx->OMSetRenderTargets(1, &part_tex[3]->rtv, NULL);
-            d3d->ctx->Draw(3, 0);
-            d3d->ctx->PSSetShaderResources(0, 2, s_no.srvs);
-            d3d->ctx->OMSetRenderTargets(1, s_no.rtvs, NULL);
+            // update velocities
+            {
+                ID3D11ShaderResourceView* srvs[2];
+                for (int i=0; i < 2; i++)
+                    srvs[i] = part_tex[(cur_part + 2 + i) % 3]->srv;
+
+                d3d->ctx->PSSetShader(update_vel_ps, NULL, 0);
+                d3d->ctx->PSSetShaderResources(0, 2, srvs);
+                d3d->ctx->OMSetRenderTargets(1, &part_tex[3]->rtv, NULL);
+                d3d->ctx->Draw(3, 0);
+                d3d->ctx->PSSetShaderResources(0, 2, s_no.srvs);
+                d3d->ctx->OMSetRenderTargets(1, s_no.rtvs, NULL);
+            }
         }
 
         static const float clear_color[4] = { 0.2f, 0.4f, 0.6f, 1.0f };
@@ -375,31 +739,55 @@ int main()
         vec3 world_cam_target = emit_pos;
         mat44 view_from_world = mat44::look_at(world_cam_pos, world_cam_target, vec3(0,1,0));
 
-        // projection
-        mat44 clip_from_view = mat44::perspectiveD3D(1280.0f / 720.0f, 1.0f, 0.01f, 50.0f);
-        mat44 clip_from_world = clip_from_view * view_from_world;
-
-        auto cube_consts = map_cbuf<CubeConstBuf>(d3d, cube_const_buf);
-        cube_consts->clip_from_world = clip_from_world;
-        cube_consts->world_down_vector = math::vec3(0.0f, 1.0f, 0.0f);
-        cube_consts->time_offs = frame * 0.0001f;
-        cube_consts->light_color_ambient = srgb_color(0x202020);
-        cube_consts->light_color_key = srgb_color(0xc0c0c0);
-        cube_consts->light_color_back = srgb_color(0x101040);
-        cube_consts->light_color_fill = srgb_color(0x602020);
-        cube_consts->light_dir = normalize(vec3(0.0f, -0.7f, -0.3f));
-        unmap_cbuf(d3d, cube_const_buf);
+        mat44 clip_from_world = kClipFromView * view_from_world;
+
+        {
+            PROFILE_ZONE("cbuffer map");
+            auto cube_consts = map_cbuf<CubeConstBuf>(d3d, cube_const_buf);
+            cube_consts->clip_from_world = clip_from_world;
+            cube_consts->world_down_vector = math::vec3(0.0f, 1.0f, 0.0f);
+            cube_consts->time_offs = frame * 0.0001f;
+            cube_consts->lights = kCubeLights;
+            unmap_cbuf(d3d, cube_const_buf);
+        }
+
+        // cull rows
+        ID3D11VertexShader* draw_vs = cube_vs;
+        ID3D11ShaderResourceView* instance_srv = row_tex->srv;
+        if (sim) {
+            PROFILE_ZONE("cull and sort");
+            draw_rows = (UINT)cull_boxes(clip_from_world, sim->row_bounds, (int)draw_rows, visible_rows);
+
+            if (kDepthSortCubes) {
+                // draw the cubes in the visible rows front to back instead
+                UINT num_sorted = (UINT)cpusim_depth_order(sim, view_from_world, visible_rows, (int)draw_rows, depth_order);
+                draw_rows = (num_sorted + kChunkSize - 1) / kChunkSize;
+                for (UINT i = num_sorted; i < draw_rows * kChunkSize; i++)
+                    depth_order[i] = ~0u;
+
+                if (draw_rows) {
+                    D3D11_BOX box = { 0, 0, 0, kChunkSize, draw_rows, 1 };
+                    d3d->ctx->UpdateSubresource(order_tex->tex2d, 0, &box, depth_order, kChunkSize * sizeof(UINT), 0);
+                }
+                draw_vs = cube_sorted_vs;
+                instance_srv = order_tex->srv;
+            } else if (draw_rows) {
+                D3D11_BOX box = { 0, 0, 0, draw_rows, 1, 1 };
+                d3d->ctx->UpdateSubresource(row_tex->tex2d, 0, &box, visible_rows, 0, 0);
+            }
+        }
 
         // render cubes
-        ID3D11ShaderResourceView* part_pos_srvs[2];
+        ID3D11ShaderResourceView* part_pos_srvs[3];
         part_pos_srvs[0] = part_tex[cur_part]->srv;
         part_pos_srvs[1] = part_tex[3]->srv;
+        part_pos_srvs[2] = instance_srv;
 
         d3d->ctx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
         d3d->ctx->IASetIndexBuffer(cube_index_buf, DXGI_FORMAT_R16_UINT, 0);
 
-        d3d->ctx->VSSetShader(cube_vs, NULL, 0);
-        d3d->ctx->VSSetShaderResources(0, 2, part_pos_srvs);
+        d3d->ctx->VSSetShader(draw_vs, NULL, 0);
+        d3d->ctx->VSSetShaderResources(0, 3, part_pos_srvs);
         d3d->ctx->VSSetConstantBuffers(0, 1, &cube_const_buf);
 
         d3d->ctx->RSSetState(raster_state);
@@ -407,25 +795,97 @@ int main()
         d3d->ctx->PSSetShader(cube_ps, NULL, 0);
         d3d->ctx->PSSetConstantBuffers(0, 1, &cube_const_buf);
 
-        d3d->ctx->DrawIndexedInstanced(kChunkSize * 15, (num_cubes + kChunkSize - 1) / kChunkSize, 0, 0, 0);
+        d3du_pixel_counter_bracket_begin(d3d, cube_pixels);
+        {
+            PROFILE_ZONE("draw cubes");
+            perfcount_begin(perf_draw);
+            d3d->ctx->DrawIndexedInstanced(kChunkSize * 15, draw_rows, 0, 0, 0);
+            perfcount_end(perf_draw, (double)draw_rows * kChunkSize);
+        }
+        d3du_pixel_counter_bracket_end(d3d, cube_pixels);
+
+        d3d->ctx->VSSetShaderResources(0, 3, s_no.srvs);
 
-        d3d->ctx->VSSetShaderResources(0, 2, s_no.srvs);
+        QueryPerformanceCounter(&frame_end);
+        if (frame >= 10)
+            run_stats_record(frame_cpu_ms, (float)ms_between(timer_freq, frame_start, frame_end));
 
-        d3du_swap_buffers(d3d, true);
+        {
+            PROFILE_ZONE("present");
+            d3du_swap_buffers(d3d, true);
+        }
+        if (frame == 0)
+            QueryPerformanceCounter(&first_frame_time);
         frame++;
+
+        if (!startup_reported && field_entry) {
+            printf("startup: first frame after %.1f ms, final field after %.1f ms\n",
+                ms_between(timer_freq, start_time, first_frame_time),
+                ms_between(timer_freq, start_time, field_done_time));
+            startup_reported = true;
+        }
     }
 
+#if D3DU_HEADLESS
+    if (dump_filename && !d3du_null_write_tga(d3d->backbuf, dump_filename))
+        printf("couldn't write %s\n", dump_filename);
+    d3du_null_set_draw_handler("RenderCubeVertexShader", "RenderCubePixelShader", NULL, NULL);
+    d3du_null_set_draw_handler("RenderCubeSortedVertexShader", "RenderCubePixelShader", NULL, NULL);
+    softrast_destroy(cube_rast);
+#else
+    (void)dump_filename;
+#endif
+
     for (int i=0; i < 4; i++)
         delete part_tex[i];
+    delete row_tex;
+    delete order_tex;
+    delete[] depth_order;
+    run_stats_report(frame_cpu_ms, "frame cpu ms");
+    run_stats_destroy(frame_cpu_ms);
+    d3du_pixel_counter_report(d3d, cube_pixels, "cubes");
+    d3du_pixel_counter_destroy(cube_pixels);
+    profile_report();
+
+    // per field texel per build step; the Gauss-Seidel sweeps are in there
+    perfcount_report(perf_update, "particle");
+    perfcount_report(perf_sort, "particle");
+    perfcount_report(perf_field, "texel");
+    perfcount_report(perf_draw, "cube");
+    perfcount_destroy(perf_update);
+    perfcount_destroy(perf_sort);
+    perfcount_destroy(perf_field);
+    perfcount_destroy(perf_draw);
+    if (trace_filename && !profile_write_trace(trace_filename))
+        printf("couldn't write %s\n", trace_filename);
     delete force_tex;
+    delete force_next_tex;
+    fieldpack_free(&force_pack);
+    fieldpack_free(&next_pack);
+    delete[] anim_field;
+    delete[] next_field;
+    delete[] handoff.texels;
+    fieldpack_free(&handoff.pack);
+    cpusim_free_field(&handoff.sim_field);
+    forcefield_builder_destroy(field_builder);
+    if (field_job)
+        field_entry = fieldcache_job_wait(field_job, NULL);
+    fieldcache_close(field_entry);
+    delete[] placeholder_field;
+    delete[] sim_upload;
+    cpusim_destroy(sim);
+    cpusim_free_field(&sim_field);
+    cpusim_free_field(&sim_next_field);
 
     update_const_buf->Release();
     cube_const_buf->Release();
     cube_index_buf->Release();
     cube_ps->Release();
     cube_vs->Release();
+    cube_sorted_vs->Release();
     update_vs->Release();
     update_pos_ps->Release();
+    update_pos_sharedexp_ps->Release();
     update_vel_ps->Release();
     raster_state->Release();
     force_sampler->Release();
@@ -0,0 +1,163 @@
+#include "math.h"
+
+#if defined(__AVX__)
+#define MATH_AVX 1
+#include <immintrin.h>
+#endif
+
+namespace math {
+
+#if defined(MATH_AVX)
+    static const size_t kWidth = 8;
+#elif defined(MATH_SSE2)
+    static const size_t kWidth = 4;
+#endif
+
+    // Number of leading elements the SIMD loops handle.
+    static size_t simd_part(size_t count)
+    {
+#if defined(MATH_AVX) || defined(MATH_SSE2)
+        return count - count % kWidth;
+#else
+        (void)count;
+        return 0;
+#endif
+    }
+
+    // Lanes [begin, end) without SIMD; the tail of every kernel.
+    static void transform_points_scalar(const mat44& m, const float* x, const float* y, const float* z,
+        float* out_x, float* out_y, float* out_z, float* out_w, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++) {
+            vec4 p = m * vec4(x[i], y[i], z[i], 1.0f);
+            out_x[i] = p.x;
+            out_y[i] = p.y;
+            out_z[i] = p.z;
+            if (out_w)
+                out_w[i] = p.w;
+        }
+    }
+
+    void transform_points(const mat44& m, const float* x, const float* y, const float* z,
+        float* out_x, float* out_y, float* out_z, float* out_w, size_t count)
+    {
+        size_t simd_count = simd_part(count);
+
+#if defined(MATH_AVX)
+        __m256 mc[4][4];
+        for (int j = 0; j < 4; j++)
+            for (int i = 0; i < 4; i++)
+                mc[j][i] = _mm256_set1_ps(m(i, j));
+
+        for (size_t i = 0; i < simd_count; i += kWidth) {
+            __m256 px = _mm256_loadu_ps(x + i);
+            __m256 py = _mm256_loadu_ps(y + i);
+            __m256 pz = _mm256_loadu_ps(z + i);
+            __m256 r[4];
+            for (int k = 0; k < 4; k++)
+                r[k] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(mc[0][k], px), _mm256_mul_ps(mc[1][k], py)),
+                    _mm256_add_ps(_mm256_mul_ps(mc[2][k], pz), mc[3][k]));
+
+            _mm256_storeu_ps(out_x + i, r[0]);
+            _mm256_storeu_ps(out_y + i, r[1]);
+            _mm256_storeu_ps(out_z + i, r[2]);
+            if (out_w)
+                _mm256_storeu_ps(out_w + i, r[3]);
+        }
+#elif defined(MATH_SSE2)
+        __m128 mc[4][4];
+        for (int j = 0; j < 4; j++)
+            for (int i = 0; i < 4; i++)
+                mc[j][i] = _mm_set1_ps(m(i, j));
+
+        for (size_t i = 0; i < simd_count; i += kWidth) {
+            __m128 px = _mm_loadu_ps(x + i);
+            __m128 py = _mm_loadu_ps(y + i);
+            __m128 pz = _mm_loadu_ps(z + i);
+            __m128 r[4];
+            for (int k = 0; k < 4; k++)
+                r[k] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mc[0][k], px), _mm_mul_ps(mc[1][k], py)),
+                    _mm_add_ps(_mm_mul_ps(mc[2][k], pz), mc[3][k]));
+
+            _mm_storeu_ps(out_x + i, r[0]);
+            _mm_storeu_ps(out_y + i, r[1]);
+            _mm_storeu_ps(out_z + i, r[2]);
+            if (out_w)
+                _mm_storeu_ps(out_w + i, r[3]);
+        }
+#endif
+
+        transform_points_scalar(m, x, y, z, out_x, out_y, out_z, out_w, simd_count, count);
+    }
+
+    // Uses a full-precision sqrt and divide, same as normalize() on a vec3.
+    void normalize_batch(float* x, float* y, float* z, size_t count)
+    {
+        size_t simd_count = simd_part(count);
+
+#if defined(MATH_AVX)
+        __m256 one = _mm256_set1_ps(1.0f);
+        for (size_t i = 0; i < simd_count; i += kWidth) {
+            __m256 vx = _mm256_loadu_ps(x + i);
+            __m256 vy = _mm256_loadu_ps(y + i);
+            __m256 vz = _mm256_loadu_ps(z + i);
+            __m256 len_sq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)), _mm256_mul_ps(vz, vz));
+            __m256 scale = _mm256_div_ps(one, _mm256_sqrt_ps(len_sq));
+            _mm256_storeu_ps(x + i, _mm256_mul_ps(vx, scale));
+            _mm256_storeu_ps(y + i, _mm256_mul_ps(vy, scale));
+            _mm256_storeu_ps(z + i, _mm256_mul_ps(vz, scale));
+        }
+#elif defined(MATH_SSE2)
+        __m128 one = _mm_set1_ps(1.0f);
+        for (size_t i = 0; i < simd_count; i += kWidth) {
+            __m128 vx = _mm_loadu_ps(x + i);
+            __m128 vy = _mm_loadu_ps(y + i);
+            __m128 vz = _mm_loadu_ps(z + i);
+            __m128 len_sq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+            __m128 scale = _mm_div_ps(one, _mm_sqrt_ps(len_sq));
+            _mm_storeu_ps(x + i, _mm_mul_ps(vx, scale));
+            _mm_storeu_ps(y + i, _mm_mul_ps(vy, scale));
+            _mm_storeu_ps(z + i, _mm_mul_ps(vz, scale));
+        }
+#endif
+
+        for (size_t i = simd_count; i < count; i++) {
+            vec3 v = normalize(vec3(x[i], y[i], z[i]));
+            x[i] = v.x;
+            y[i] = v.y;
+            z[i] = v.z;
+        }
+    }
+
+    void cross_batch(const float* ax, const float* ay, const float* az, const float* bx, const float* by, const float* bz,
+        float* out_x, float* out_y, float* out_z, size_t count)
+    {
+        size_t simd_count = simd_part(count);
+
+#if defined(MATH_AVX)
+        for (size_t i = 0; i < simd_count; i += kWidth) {
+            __m256 a0 = _mm256_loadu_ps(ax + i), a1 = _mm256_loadu_ps(ay + i), a2 = _mm256_loadu_ps(az + i);
+            __m256 b0 = _mm256_loadu_ps(bx + i), b1 = _mm256_loadu_ps(by + i), b2 = _mm256_loadu_ps(bz + i);
+            _mm256_storeu_ps(out_x + i, _mm256_sub_ps(_mm256_mul_ps(a1, b2), _mm256_mul_ps(a2, b1)));
+            _mm256_storeu_ps(out_y + i, _mm256_sub_ps(_mm256_mul_ps(a2, b0), _mm256_mul_ps(a0, b2)));
+            _mm256_storeu_ps(out_z + i, _mm256_sub_ps(_mm256_mul_ps(a0, b1), _mm256_mul_ps(a1, b0)));
+        }
+#elif defined(MATH_SSE2)
+        for (size_t i = 0; i < simd_count; i += kWidth) {
+            __m128 a0 = _mm_loadu_ps(ax + i), a1 = _mm_loadu_ps(ay + i), a2 = _mm_loadu_ps(az + i);
+            __m128 b0 = _mm_loadu_ps(bx + i), b1 = _mm_loadu_ps(by + i), b2 = _mm_loadu_ps(bz + i);
+            _mm_storeu_ps(out_x + i, _mm_sub_ps(_mm_mul_ps(a1, b2), _mm_mul_ps(a2, b1)));
+            _mm_storeu_ps(out_y + i, _mm_sub_ps(_mm_mul_ps(a2, b0), _mm_mul_ps(a0, b2)));
+            _mm_storeu_ps(out_z + i, _mm_sub_ps(_mm_mul_ps(a0, b1), _mm_mul_ps(a1, b0)));
+        }
+#endif
+
+        for (size_t i = simd_count; i < count; i++) {
+            vec3 r = cross(vec3(ax[i], ay[i], az[i]), vec3(bx[i], by[i], bz[i]));
+            out_x[i] = r.x;
+            out_y[i] = r.y;
+            out_z[i] = r.z;
+        }
+    }
+
+}
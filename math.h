@@ -2,6 +2,12 @@
 #define MATH_H_INCLUDED
 
 #include <cmath>
+#include <stddef.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MATH_SSE2 1
+#include <emmintrin.h>
+#endif
 
 // Matrices are column-major.
 //
@@ -28,16 +34,34 @@
     template<typename T> type<T> operator *(const type<T>& a, const type<T>& b) { type<T> x = a; x *= b; return x; } \
     template<typename T> type<T> operator *(T s, const type<T>& b) { type<T> x = b; x *= s; return x; }
 
-#define IMPL_VECTOR_OPS(type, dot_expr) \
-    IMPL_LINEAR_OPS(type) \
-    template<typename T> T dot(const type<T>& a, const type<T>& b) { return dot_expr; } \
-    template<typename T> T len_sq(const type<T>& a) { return dot(a, a); } \
+// Vector ops are written out per component so they're usable in constant
+// expressions. comps is one of the VEC_COMPS macros below.
+#define VEC_COMPS2(f) f(x), f(y)
+#define VEC_COMPS3(f) f(x), f(y), f(z)
+#define VEC_COMPS4(f) f(x), f(y), f(z), f(w)
+
+#define VEC_NEG(c) -v.c
+#define VEC_ADD(c) a.c + b.c
+#define VEC_SUB(c) a.c - b.c
+#define VEC_MUL(c) a.c * b.c
+#define VEC_MUL_S(c) a.c * s
+#define VEC_S_MUL(c) s * b.c
+
+#define IMPL_VECTOR_OPS(type, comps, dot_expr) \
+    template<typename T> constexpr type<T> operator -(const type<T>& v) { return type<T>(comps(VEC_NEG)); } \
+    template<typename T> constexpr type<T> operator +(const type<T>& a, const type<T>& b) { return type<T>(comps(VEC_ADD)); } \
+    template<typename T> constexpr type<T> operator -(const type<T>& a, const type<T>& b) { return type<T>(comps(VEC_SUB)); } \
+    template<typename T> constexpr type<T> operator *(const type<T>& a, T s) { return type<T>(comps(VEC_MUL_S)); } \
+    template<typename T> constexpr type<T> operator *(const type<T>& a, const type<T>& b) { return type<T>(comps(VEC_MUL)); } \
+    template<typename T> constexpr type<T> operator *(T s, const type<T>& b) { return type<T>(comps(VEC_S_MUL)); } \
+    template<typename T> constexpr T dot(const type<T>& a, const type<T>& b) { return dot_expr; } \
+    template<typename T> constexpr T len_sq(const type<T>& a) { return dot(a, a); } \
     template<typename T> T len(const type<T>& a) { return std::sqrt(len_sq(a)); } \
     template<typename T> type<T> normalize(const type<T>& a) { return rsqrt(len_sq(a)) * a; }
 
 #define IMPL_MATRIX_OPS(mat_type, vec_type, mul_expr) \
     IMPL_LINEAR_OPS(mat_type) \
-    template<typename T> vec_type<T> operator *(const mat_type<T>& m, const vec_type<T>& v) { return mul_expr; }
+    template<typename T> constexpr vec_type<T> operator *(const mat_type<T>& m, const vec_type<T>& v) { return mul_expr; }
 
 namespace math {
     template<typename T>
@@ -46,6 +70,20 @@ namespace math {
         return T(1) / std::sqrt(x);
     }
 
+    // Newton iteration for sqrt in constant expressions, where std::sqrt
+    // isn't allowed. x >= 0.
+    template<typename T>
+    constexpr T const_sqrt_iter(T x, T guess, int iters)
+    {
+        return iters ? const_sqrt_iter(x, (guess + x / guess) / T(2), iters - 1) : guess;
+    }
+
+    template<typename T>
+    constexpr T const_sqrt(T x)
+    {
+        return x > T(0) ? const_sqrt_iter(x, x > T(1) ? x : T(1), 64) : T(0);
+    }
+
     template<typename T>
     struct vec2T {
         typedef vec2T<T> this_type;
@@ -58,8 +96,8 @@ namespace math {
         };
 
         vec2T() {}
-        explicit vec2T(T s) : x(s), y(s) {}
-        vec2T(T x, T y) : x(x), y(y) {}
+        explicit constexpr vec2T(T s) : x(s), y(s) {}
+        constexpr vec2T(T x, T y) : x(x), y(y) {}
 
         T operator[](int i) const { return v[i]; }
         T& operator[](int i) { return v[i]; }
@@ -70,7 +108,7 @@ namespace math {
         this_type& operator *=(T s)                 { x *= s; y *= s; return *this; }
     };
 
-    IMPL_VECTOR_OPS(vec2T, a.x*b.x + a.y*b.y)
+    IMPL_VECTOR_OPS(vec2T, VEC_COMPS2, a.x*b.x + a.y*b.y)
 
     template<typename T>
     struct vec3T {
@@ -84,8 +122,8 @@ namespace math {
         };
 
         vec3T() {}
-        explicit vec3T(T s) : x(s), y(s), z(s) {}
-        vec3T(T x, T y, T z) : x(x), y(y), z(z) {}
+        explicit constexpr vec3T(T s) : x(s), y(s), z(s) {}
+        constexpr vec3T(T x, T y, T z) : x(x), y(y), z(z) {}
 
         T operator[](int i) const { return v[i]; }
         T& operator[](int i) { return v[i]; }
@@ -96,9 +134,9 @@ namespace math {
         this_type& operator *=(T s)                 { x *= s; y *= s; z *= s; return *this; }
     };
 
-    IMPL_VECTOR_OPS(vec3T, a.x*b.x + a.y*b.y + a.z*b.z)
+    IMPL_VECTOR_OPS(vec3T, VEC_COMPS3, a.x*b.x + a.y*b.y + a.z*b.z)
     template<typename T>
-    vec3T<T> cross(const vec3T<T>& a, const vec3T<T>& b)
+    constexpr vec3T<T> cross(const vec3T<T>& a, const vec3T<T>& b)
     {
         return vec3T<T>(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
     }
@@ -115,9 +153,9 @@ namespace math {
         };
 
         vec4T() {}
-        explicit vec4T(T s) : x(s), y(s), z(s), w(s) {}
-        vec4T(const vec3T<T>& v, T w) : x(v.x), y(v.y), z(v.z), w(w) {}
-        vec4T(T x, T y, T z, T w) : x(x), y(y), z(z), w(w) {}
+        explicit constexpr vec4T(T s) : x(s), y(s), z(s), w(s) {}
+        constexpr vec4T(const vec3T<T>& v, T w) : x(v.x), y(v.y), z(v.z), w(w) {}
+        constexpr vec4T(T x, T y, T z, T w) : x(x), y(y), z(z), w(w) {}
 
         T operator[](int i) const { return v[i]; }
         T& operator[](int i) { return v[i]; }
@@ -128,7 +166,7 @@ namespace math {
         this_type& operator *=(T s)                 { x *= s; y *= s; z *= s; w *= s; return *this; }
     };
 
-    IMPL_VECTOR_OPS(vec4T, a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w)
+    IMPL_VECTOR_OPS(vec4T, VEC_COMPS4, a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w)
 
     template<typename T>
     struct mat33T {
@@ -138,8 +176,8 @@ namespace math {
         vec_type x, y, z; // columns
 
         mat33T() {}
-        mat33T(const vec_type& colX, const vec_type& colY, const vec_type& colZ) : x(colX), y(colY), z(colZ) {}
-        mat33T(
+        constexpr mat33T(const vec_type& colX, const vec_type& colY, const vec_type& colZ) : x(colX), y(colY), z(colZ) {}
+        constexpr mat33T(
             T _00, T _01, T _02,
             T _10, T _11, T _12,
             T _20, T _21, T _22
@@ -158,9 +196,9 @@ namespace math {
         this_type& operator *=(T s)             { x *= s; y *= s; z *= s; return *this; }
         this_type& operator *=(const this_type& b);
 
-        static this_type diag(T x, T y, T z)    { return mat33T(x, T(0), T(0), T(0), y, T(0), T(0), T(0), z); }
-        static this_type identity()             { return diag(T(1), T(1), T(1)); }
-        static this_type uniform_scale(T s)     { return diag(s, s, s); }
+        static constexpr this_type diag(T x, T y, T z)    { return mat33T(x, T(0), T(0), T(0), y, T(0), T(0), T(0), z); }
+        static constexpr this_type identity()             { return diag(T(1), T(1), T(1)); }
+        static constexpr this_type uniform_scale(T s)     { return diag(s, s, s); }
 
         static this_type rotation(const vec_type& axis, T angle)
         {
@@ -186,7 +224,6 @@ namespace math {
         x = M * b.x;
         y = M * b.y;
         z = M * b.z;
-        w = M * b.w;
         return *this;
     }
 
@@ -205,9 +242,9 @@ namespace math {
         vec_type x, y, z, w; // columns
 
         mat44T() {}
-        mat44T(const vec_type& colX, const vec_type& colY, const vec_type& colZ, const vec_type& colW) : x(colX), y(colY), z(colZ), w(colW) {}
-        mat44T(const mat33T<T>& mat3x3, const vec3_type& translate) : x(mat3x3.x, T(0)), y(mat3x3.y, T(0)), z(mat3x3.z, T(0)), w(translate, T(1)) {}
-        mat44T(
+        constexpr mat44T(const vec_type& colX, const vec_type& colY, const vec_type& colZ, const vec_type& colW) : x(colX), y(colY), z(colZ), w(colW) {}
+        constexpr mat44T(const mat33T<T>& mat3x3, const vec3_type& translate) : x(mat3x3.x, T(0)), y(mat3x3.y, T(0)), z(mat3x3.z, T(0)), w(translate, T(1)) {}
+        constexpr mat44T(
             T _00, T _01, T _02, T _03,
             T _10, T _11, T _12, T _13,
             T _20, T _21, T _22, T _23,
@@ -227,8 +264,8 @@ namespace math {
         this_type& operator *=(T s)             { x *= s; y *= s; z *= s; w *= s; return *this; }
         this_type& operator *=(const this_type& b);
 
-        static this_type diag(T x, T y, T z, T w) { return mat44T(x, T(0), T(0), T(0), T(0), y, T(0), T(0), T(0), T(0), z, T(0), T(0), T(0), T(0), w); }
-        static this_type identity()             { return diag(T(1), T(1), T(1), T(1)); }
+        static constexpr this_type diag(T x, T y, T z, T w) { return mat44T(x, T(0), T(0), T(0), T(0), y, T(0), T(0), T(0), T(0), z, T(0), T(0), T(0), T(0), w); }
+        static constexpr this_type identity()             { return diag(T(1), T(1), T(1), T(1)); }
 
         static this_type look_at(const vec3_type& pos, const vec3_type& look_at, const vec3_type& down)
         {
@@ -254,24 +291,20 @@ namespace math {
         }
 
         // NOTE: this takes lft/rgt/bot/top at z=1 plane, not near plane!
-        static this_type frustumD3D(T lft, T rgt, T top, T bot, T nearv, T farv)
+        static constexpr this_type frustumD3D(T lft, T rgt, T top, T bot, T nearv, T farv)
         {
-            T Q = farv / (farv - nearv);
-
             return this_type(
                 T(2) / (rgt - lft), 0,                  (rgt + lft) / (rgt - lft), T(0),
                 T(0),               T(2) / (top - bot), (top + bot) / (top - bot), T(0),
-                T(0),               T(0),               Q,                         -nearv * Q,
+                T(0),               T(0),               farv / (farv - nearv),     -nearv * (farv / (farv - nearv)),
                 T(0),               T(0),               T(1),                      T(0)
             );
         }
 
         // w/h at z=1 plane, not near plane!
-        static this_type perspectiveD3D(T w, T h, T nearv, T farv)
+        static constexpr this_type perspectiveD3D(T w, T h, T nearv, T farv)
         {
-            T wh = w / T(2);
-            T hh = h / T(2);
-            return frustumD3D(-wh, wh, -hh, hh, nearv, farv);
+            return frustumD3D(-w / T(2), w / T(2), -h / T(2), h / T(2), nearv, farv);
         }
     };
 
@@ -294,6 +327,49 @@ namespace math {
         return mat44T<T>(m.get_row(0), m.get_row(1), m.get_row(2), m.get_row(3));
     }
 
+    // General inverse (Laplace expansion by 2x2 minors). m must be invertible.
+    template<typename T>
+    mat44T<T> inverse(const mat44T<T>& m)
+    {
+        T s0 = m(0,0)*m(1,1) - m(1,0)*m(0,1);
+        T s1 = m(0,0)*m(1,2) - m(1,0)*m(0,2);
+        T s2 = m(0,0)*m(1,3) - m(1,0)*m(0,3);
+        T s3 = m(0,1)*m(1,2) - m(1,1)*m(0,2);
+        T s4 = m(0,1)*m(1,3) - m(1,1)*m(0,3);
+        T s5 = m(0,2)*m(1,3) - m(1,2)*m(0,3);
+
+        T c0 = m(2,0)*m(3,1) - m(3,0)*m(2,1);
+        T c1 = m(2,0)*m(3,2) - m(3,0)*m(2,2);
+        T c2 = m(2,0)*m(3,3) - m(3,0)*m(2,3);
+        T c3 = m(2,1)*m(3,2) - m(3,1)*m(2,2);
+        T c4 = m(2,1)*m(3,3) - m(3,1)*m(2,3);
+        T c5 = m(2,2)*m(3,3) - m(3,2)*m(2,3);
+
+        T inv_det = T(1) / (s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0);
+
+        return mat44T<T>(
+            ( m(1,1)*c5 - m(1,2)*c4 + m(1,3)*c3) * inv_det,
+            (-m(0,1)*c5 + m(0,2)*c4 - m(0,3)*c3) * inv_det,
+            ( m(3,1)*s5 - m(3,2)*s4 + m(3,3)*s3) * inv_det,
+            (-m(2,1)*s5 + m(2,2)*s4 - m(2,3)*s3) * inv_det,
+
+            (-m(1,0)*c5 + m(1,2)*c2 - m(1,3)*c1) * inv_det,
+            ( m(0,0)*c5 - m(0,2)*c2 + m(0,3)*c1) * inv_det,
+            (-m(3,0)*s5 + m(3,2)*s2 - m(3,3)*s1) * inv_det,
+            ( m(2,0)*s5 - m(2,2)*s2 + m(2,3)*s1) * inv_det,
+
+            ( m(1,0)*c4 - m(1,1)*c2 + m(1,3)*c0) * inv_det,
+            (-m(0,0)*c4 + m(0,1)*c2 - m(0,3)*c0) * inv_det,
+            ( m(3,0)*s4 - m(3,1)*s2 + m(3,3)*s0) * inv_det,
+            (-m(2,0)*s4 + m(2,1)*s2 - m(2,3)*s0) * inv_det,
+
+            (-m(1,0)*c3 + m(1,1)*c1 - m(1,2)*c0) * inv_det,
+            ( m(0,0)*c3 - m(0,1)*c1 + m(0,2)*c0) * inv_det,
+            (-m(3,0)*s3 + m(3,1)*s1 - m(3,2)*s0) * inv_det,
+            ( m(2,0)*s3 - m(2,1)*s1 + m(2,2)*s0) * inv_det
+        );
+    }
+
     typedef vec2T<int> vec2i;
     typedef vec2T<float> vec2;
 
@@ -306,6 +382,157 @@ namespace math {
     typedef mat33T<float> mat33;
 
     typedef mat44T<float> mat44;
+
+#ifdef MATH_SSE2
+    // SSE2 versions of the vec4 arithmetic, mat44 products, transpose and
+    // inverse. Columns are 16 contiguous floats, loaded unaligned.
+    // look_at/perspectiveD3D and the like go through these too.
+    //
+    // The vec4 ops take over from the constexpr templates for float, so
+    // float vec4 math isn't a constant expression on SSE2 builds (vec3 math
+    // and constructing vectors and matrices still are).
+    inline __m128 load_vec(const vec4& v)           { return _mm_loadu_ps(&v.x); }
+    inline vec4 store_vec(__m128 v)                 { vec4 r; _mm_storeu_ps(&r.x, v); return r; }
+
+    inline vec4 operator +(const vec4& a, const vec4& b)   { return store_vec(_mm_add_ps(load_vec(a), load_vec(b))); }
+    inline vec4 operator -(const vec4& a, const vec4& b)   { return store_vec(_mm_sub_ps(load_vec(a), load_vec(b))); }
+    inline vec4 operator *(const vec4& a, const vec4& b)   { return store_vec(_mm_mul_ps(load_vec(a), load_vec(b))); }
+    inline vec4 operator *(const vec4& a, float s)         { return store_vec(_mm_mul_ps(load_vec(a), _mm_set1_ps(s))); }
+    inline vec4 operator *(float s, const vec4& b)         { return store_vec(_mm_mul_ps(_mm_set1_ps(s), load_vec(b))); }
+
+    inline float dot(const vec4& a, const vec4& b)
+    {
+        __m128 p = _mm_mul_ps(load_vec(a), load_vec(b));
+        p = _mm_add_ps(p, _mm_movehl_ps(p, p));
+        p = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1,1,1,1)));
+        return _mm_cvtss_f32(p);
+    }
+
+    inline __m128 load_col(const mat44& m, int i)    { return _mm_loadu_ps(&m.get_col(i).x); }
+
+    inline __m128 mul_cols(const mat44& m, __m128 v)
+    {
+        __m128 r = _mm_mul_ps(load_col(m, 0), _mm_shuffle_ps(v, v, _MM_SHUFFLE(0,0,0,0)));
+        r = _mm_add_ps(r, _mm_mul_ps(load_col(m, 1), _mm_shuffle_ps(v, v, _MM_SHUFFLE(1,1,1,1))));
+        r = _mm_add_ps(r, _mm_mul_ps(load_col(m, 2), _mm_shuffle_ps(v, v, _MM_SHUFFLE(2,2,2,2))));
+        r = _mm_add_ps(r, _mm_mul_ps(load_col(m, 3), _mm_shuffle_ps(v, v, _MM_SHUFFLE(3,3,3,3))));
+        return r;
+    }
+
+    inline vec4 operator *(const mat44& m, const vec4& v)
+    {
+        return store_vec(mul_cols(m, load_vec(v)));
+    }
+
+    template<>
+    inline mat44& mat44::operator *=(const mat44& b)
+    {
+        __m128 c0 = mul_cols(*this, _mm_loadu_ps(&b.x.x));
+        __m128 c1 = mul_cols(*this, _mm_loadu_ps(&b.y.x));
+        __m128 c2 = mul_cols(*this, _mm_loadu_ps(&b.z.x));
+        __m128 c3 = mul_cols(*this, _mm_loadu_ps(&b.w.x));
+        _mm_storeu_ps(&x.x, c0);
+        _mm_storeu_ps(&y.x, c1);
+        _mm_storeu_ps(&z.x, c2);
+        _mm_storeu_ps(&w.x, c3);
+        return *this;
+    }
+
+    inline mat44 transpose(const mat44& m)
+    {
+        __m128 c0 = load_col(m, 0), c1 = load_col(m, 1), c2 = load_col(m, 2), c3 = load_col(m, 3);
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+        mat44 r;
+        _mm_storeu_ps(&r.x.x, c0);
+        _mm_storeu_ps(&r.y.x, c1);
+        _mm_storeu_ps(&r.z.x, c2);
+        _mm_storeu_ps(&r.w.x, c3);
+        return r;
+    }
+
+    // Block inverse: split M into 2x2 blocks A B / C D, each held in one
+    // register (row-major within the block), and build the inverse from
+    // 2x2 adjugates and determinants. Works on either storage order, since
+    // inverse(transpose(M)) = transpose(inverse(M)).
+    inline __m128 mat2_mul(__m128 a, __m128 b) // a*b
+    {
+        return _mm_add_ps(_mm_mul_ps(a, _mm_shuffle_ps(b, b, _MM_SHUFFLE(3,0,3,0))),
+            _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2,3,0,1)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(1,2,1,2))));
+    }
+
+    inline __m128 mat2_adj_mul(__m128 a, __m128 b) // adj(a)*b
+    {
+        return _mm_sub_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(0,0,3,3)), b),
+            _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2,2,1,1)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(1,0,3,2))));
+    }
+
+    inline __m128 mat2_mul_adj(__m128 a, __m128 b) // a*adj(b)
+    {
+        return _mm_sub_ps(_mm_mul_ps(a, _mm_shuffle_ps(b, b, _MM_SHUFFLE(0,3,0,3))),
+            _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2,3,0,1)), _mm_shuffle_ps(b, b, _MM_SHUFFLE(1,2,1,2))));
+    }
+
+    inline mat44 inverse(const mat44& m)
+    {
+        __m128 r0 = load_col(m, 0), r1 = load_col(m, 1), r2 = load_col(m, 2), r3 = load_col(m, 3);
+
+        __m128 a = _mm_movelh_ps(r0, r1);
+        __m128 b = _mm_movehl_ps(r1, r0);
+        __m128 c = _mm_movelh_ps(r2, r3);
+        __m128 d = _mm_movehl_ps(r3, r2);
+
+        // (|A| |B| |C| |D|)
+        __m128 det_sub = _mm_sub_ps(
+            _mm_mul_ps(_mm_shuffle_ps(r0, r2, _MM_SHUFFLE(2,0,2,0)), _mm_shuffle_ps(r1, r3, _MM_SHUFFLE(3,1,3,1))),
+            _mm_mul_ps(_mm_shuffle_ps(r0, r2, _MM_SHUFFLE(3,1,3,1)), _mm_shuffle_ps(r1, r3, _MM_SHUFFLE(2,0,2,0))));
+        __m128 det_a = _mm_shuffle_ps(det_sub, det_sub, _MM_SHUFFLE(0,0,0,0));
+        __m128 det_b = _mm_shuffle_ps(det_sub, det_sub, _MM_SHUFFLE(1,1,1,1));
+        __m128 det_c = _mm_shuffle_ps(det_sub, det_sub, _MM_SHUFFLE(2,2,2,2));
+        __m128 det_d = _mm_shuffle_ps(det_sub, det_sub, _MM_SHUFFLE(3,3,3,3));
+
+        __m128 d_c = mat2_adj_mul(d, c);
+        __m128 a_b = mat2_adj_mul(a, b);
+        __m128 x_ = _mm_sub_ps(_mm_mul_ps(det_d, a), mat2_mul(b, d_c));
+        __m128 w_ = _mm_sub_ps(_mm_mul_ps(det_a, d), mat2_mul(c, a_b));
+        __m128 y_ = _mm_sub_ps(_mm_mul_ps(det_b, c), mat2_mul_adj(d, a_b));
+        __m128 z_ = _mm_sub_ps(_mm_mul_ps(det_c, b), mat2_mul_adj(a, d_c));
+
+        // |M| = |A||D| + |B||C| - tr(adj(A)B adj(D)C)
+        __m128 tr = _mm_mul_ps(a_b, _mm_shuffle_ps(d_c, d_c, _MM_SHUFFLE(3,1,2,0)));
+        tr = _mm_add_ps(tr, _mm_movehl_ps(tr, tr));
+        tr = _mm_add_ps(tr, _mm_shuffle_ps(tr, tr, _MM_SHUFFLE(1,1,1,1)));
+        tr = _mm_shuffle_ps(tr, tr, _MM_SHUFFLE(0,0,0,0));
+        __m128 det = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(det_a, det_d), _mm_mul_ps(det_b, det_c)), tr);
+
+        __m128 rdet = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), det);
+        x_ = _mm_mul_ps(x_, rdet);
+        y_ = _mm_mul_ps(y_, rdet);
+        z_ = _mm_mul_ps(z_, rdet);
+        w_ = _mm_mul_ps(w_, rdet);
+
+        mat44 r;
+        _mm_storeu_ps(&r.x.x, _mm_shuffle_ps(x_, y_, _MM_SHUFFLE(1,3,1,3)));
+        _mm_storeu_ps(&r.y.x, _mm_shuffle_ps(x_, y_, _MM_SHUFFLE(0,2,0,2)));
+        _mm_storeu_ps(&r.z.x, _mm_shuffle_ps(z_, w_, _MM_SHUFFLE(1,3,1,3)));
+        _mm_storeu_ps(&r.w.x, _mm_shuffle_ps(z_, w_, _MM_SHUFFLE(0,2,0,2)));
+        return r;
+    }
+#endif
+
+    // Batch kernels on SoA arrays (math.cpp). Any alignment, any count;
+    // outputs may alias the inputs.
+
+    // out = m * (x, y, z, 1). out_w may be NULL.
+    void transform_points(const mat44& m, const float* x, const float* y, const float* z,
+        float* out_x, float* out_y, float* out_z, float* out_w, size_t count);
+
+    // (x, y, z) = normalize((x, y, z))
+    void normalize_batch(float* x, float* y, float* z, size_t count);
+
+    // out = cross(a, b)
+    void cross_batch(const float* ax, const float* ay, const float* az, const float* bx, const float* by, const float* bz,
+        float* out_x, float* out_y, float* out_z, size_t count);
 }
 
 #undef IMPL_COMPONENT_OP2
@@ -314,5 +541,15 @@ namespace math {
 
 #undef IMPL_LINEAR_OPS
 #undef IMPL_VECTOR_OPS
+#undef IMPL_MATRIX_OPS
+#undef VEC_COMPS2
+#undef VEC_COMPS3
+#undef VEC_COMPS4
+#undef VEC_NEG
+#undef VEC_ADD
+#undef VEC_SUB
+#undef VEC_MUL
+#undef VEC_MUL_S
+#undef VEC_S_MUL
 
 #endif // MATH_H_INCLUDED
\ No newline at end of file
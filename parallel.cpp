@@ -0,0 +1,153 @@
+#include "parallel.h"
+#include "profile.h"
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+struct parallel_job
+{
+    parallel_func * func;
+    void * user;
+    int count;
+    int granularity;
+    std::atomic<int> next; // next item to hand out
+    int active_workers; // pool threads currently using the job (protected by pool lock)
+};
+
+struct parallel_pool
+{
+    std::mutex lock;
+    std::condition_variable work_cv; // signaled when jobs get added
+    std::condition_variable done_cv; // signaled when a worker lets go of a job
+    std::vector<parallel_job *> jobs; // jobs that still have ranges to hand out
+    std::vector<std::thread> workers;
+};
+
+static parallel_pool * s_pool;
+static std::once_flag s_pool_once;
+
+// Grabs ranges from job until there are none left.
+static void run_ranges( parallel_job * job )
+{
+    for ( ;; )
+    {
+        int begin = job->next.fetch_add( job->granularity );
+        if ( begin >= job->count )
+            break;
+
+        int end = std::min( begin + job->granularity, job->count );
+        job->func( job->user, begin, end );
+    }
+}
+
+// Removes job from the list of jobs with work left. Call with the pool lock held.
+static void unlist_job( parallel_pool * pool, parallel_job * job )
+{
+    std::vector<parallel_job *>::iterator it = std::find( pool->jobs.begin(), pool->jobs.end(), job );
+    if ( it != pool->jobs.end() )
+        pool->jobs.erase( it );
+}
+
+static void worker_main( parallel_pool * pool, int index )
+{
+    char name[32];
+    snprintf( name, sizeof( name ), "parallel worker %d", index );
+    profile_thread_name( name );
+
+    for ( ;; )
+    {
+        parallel_job * job;
+        {
+            std::unique_lock<std::mutex> guard( pool->lock );
+            while ( pool->jobs.empty() )
+                pool->work_cv.wait( guard );
+
+            job = pool->jobs.front();
+            job->active_workers++;
+        }
+
+        // The submitting thread keeps the job alive until active_workers
+        // drops back to zero.
+        {
+            PROFILE_ZONE( "parallel job" );
+            run_ranges( job );
+        }
+
+        {
+            std::lock_guard<std::mutex> guard( pool->lock );
+            unlist_job( pool, job );
+            if ( --job->active_workers == 0 )
+                pool->done_cv.notify_all();
+        }
+    }
+}
+
+static void init_pool()
+{
+    s_pool = new parallel_pool;
+
+    unsigned int num_cores = std::thread::hardware_concurrency();
+    if ( num_cores < 1 )
+        num_cores = 1;
+
+    // workers are never joined; they live as long as the process does.
+    for ( unsigned int i = 1 ; i < num_cores ; i++ )
+    {
+        s_pool->workers.push_back( std::thread( worker_main, s_pool, (int)i ) );
+        s_pool->workers.back().detach();
+    }
+}
+
+static parallel_pool * get_pool()
+{
+    std::call_once( s_pool_once, init_pool );
+    return s_pool;
+}
+
+int parallel_num_threads( void )
+{
+    return (int)get_pool()->workers.size() + 1;
+}
+
+void parallel_for( int count, int granularity, parallel_func * func, void * user )
+{
+    if ( count <= 0 )
+        return;
+
+    if ( granularity < 1 )
+        granularity = 1;
+
+    // Don't bother the pool for single-range jobs.
+    parallel_pool * pool = get_pool();
+    if ( count <= granularity || pool->workers.empty() )
+    {
+        func( user, 0, count );
+        return;
+    }
+
+    parallel_job job;
+    job.func = func;
+    job.user = user;
+    job.count = count;
+    job.granularity = granularity;
+    job.next = 0;
+    job.active_workers = 0;
+
+    {
+        std::lock_guard<std::mutex> guard( pool->lock );
+        pool->jobs.push_back( &job );
+    }
+    pool->work_cv.notify_all();
+
+    run_ranges( &job );
+
+    // wait for stragglers
+    std::unique_lock<std::mutex> guard( pool->lock );
+    unlist_job( pool, &job );
+    while ( job.active_workers != 0 )
+        pool->done_cv.wait( guard );
+}
@@ -0,0 +1,33 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Minimal fork-join helper for the CPU-side kernels.
+//
+// parallel_for splits [0,count) into ranges of at most "granularity" items and
+// hands them out to a pool of worker threads (one per core, created on first
+// use). The calling thread works on its own job too, so it's fine to call
+// parallel_for from several threads at once, or from inside another
+// parallel_for task.
+
+typedef void parallel_func( void * user, int begin, int end );
+
+// Number of threads that can work on a job (workers plus the caller).
+int parallel_num_threads( void );
+
+// Runs func on all ranges of [0,count) and returns once they're all done.
+void parallel_for( int count, int granularity, parallel_func * func, void * user );
+
+// Convenience version for lambdas: f(begin, end).
+template<typename F>
+static void parallel_for_trampoline( void * user, int begin, int end )
+{
+    (*(F const *)user)( begin, end );
+}
+
+template<typename F>
+void parallel_for( int count, int granularity, F const & f )
+{
+    parallel_for( count, granularity, parallel_for_trampoline<F>, (void *)&f );
+}
+
+#endif
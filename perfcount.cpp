@@ -0,0 +1,511 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "perfcount.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define PERFCOUNT_LINUX 1
+#endif
+
+enum perf_event_id
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NUM_EVENTS
+};
+
+// One counter reading: value, and how long the counter was enabled and
+// actually running (less if the PMU was multiplexed).
+struct perf_reading
+{
+    uint64_t value, enabled, running;
+};
+
+// Count between two readings of the same counter, extrapolated to the
+// whole time it was enabled in between if it was multiplexed.
+static double scaled_delta( perf_reading const & end, perf_reading const & begin )
+{
+    uint64_t running = end.running - begin.running;
+    return running ? (double)( end.value - begin.value ) * (double)( end.enabled - begin.enabled ) / (double)running : 0.0;
+}
+
+struct perfcount
+{
+    std::string name;
+    std::vector<perf_reading> begin; // per thread and event
+    std::vector<unsigned> begin_threads; // perf_thread::serial of each thread in begin
+    double retired[PERF_NUM_EVENTS]; // counts of threads that exited since begin
+    std::chrono::steady_clock::time_point begin_time;
+    bool active;
+
+    run_stats * ipc;
+    run_stats * cycles;         // per item
+    run_stats * instructions;   // per item
+    run_stats * llc_misses;     // per item
+    run_stats * branch_misses;  // per item
+    run_stats * llc_gbps;       // estimated from LLC misses
+};
+
+#ifdef PERFCOUNT_LINUX
+
+static const int kNoFd = -1;
+
+struct perf_thread
+{
+    int tid;
+    unsigned long long start_time; // tids get reused; this tells the threads apart
+    unsigned serial;
+    int fds[PERF_NUM_EVENTS];
+    bool grouped; // fds are one group led by fds[PERF_CYCLES]
+};
+
+static void close_counters( perf_thread & thread )
+{
+    for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+    {
+        if ( thread.fds[e] != kNoFd )
+            close( thread.fds[e] );
+        thread.fds[e] = kNoFd;
+    }
+}
+
+// Counters are opened once per thread and left running; begin/end read them.
+// Threads that have exited get theirs closed on the next scan.
+struct perf_state
+{
+    std::mutex lock;
+    bool available;
+    char reason[128];
+    bool has_event[PERF_NUM_EVENTS];
+    std::vector<perf_thread> threads; // in the order they were found
+    unsigned next_serial;
+    std::vector<perfcount *> open; // between begin and end
+
+    ~perf_state()
+    {
+        for ( size_t i = 0 ; i < threads.size() ; i++ )
+            close_counters( threads[i] );
+    }
+};
+
+static int open_counter( int tid, perf_event_id id, int group_fd )
+{
+    static const uint64_t kConfig[PERF_NUM_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, // "last level" on all PMUs we care about
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+
+    perf_event_attr attr;
+    memset( &attr, 0, sizeof( attr ) );
+    attr.size = sizeof( attr );
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = kConfig[id];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING | PERF_FORMAT_GROUP;
+
+    return (int)syscall( SYS_perf_event_open, &attr, tid, -1, group_fd, 0 );
+}
+
+// Opens a thread's counters as one group led by cycles, so the PMU
+// schedules (and multiplexes) them together and they all count over the
+// same time slices; otherwise IPC would divide counts from different ones.
+// If the group can't be opened, each counter on its own.
+static void open_counters( perf_state const & state, perf_thread & thread )
+{
+    thread.grouped = false;
+    for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+        thread.fds[e] = kNoFd;
+
+    if ( state.has_event[PERF_CYCLES] )
+    {
+        int leader = open_counter( thread.tid, PERF_CYCLES, -1 );
+        thread.fds[PERF_CYCLES] = leader;
+        bool ok = leader >= 0;
+        for ( int e = PERF_CYCLES + 1 ; ok && e < PERF_NUM_EVENTS ; e++ )
+        {
+            if ( state.has_event[e] )
+            {
+                thread.fds[e] = open_counter( thread.tid, (perf_event_id)e, leader );
+                ok = thread.fds[e] >= 0;
+            }
+        }
+
+        thread.grouped = ok;
+        if ( ok )
+            return;
+        close_counters( thread );
+    }
+
+    for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+        thread.fds[e] = state.has_event[e] ? open_counter( thread.tid, (perf_event_id)e, -1 ) : kNoFd;
+}
+
+// Reads all of a thread's counters; the ones it doesn't have read as 0.
+static void read_counters( perf_thread const & thread, perf_reading * out )
+{
+    memset( out, 0, PERF_NUM_EVENTS * sizeof( *out ) );
+
+    // PERF_FORMAT_GROUP: count, time enabled, time running, then one value
+    // per counter (just one without a group)
+    uint64_t buf[3 + PERF_NUM_EVENTS];
+    if ( thread.grouped )
+    {
+        ssize_t got = read( thread.fds[PERF_CYCLES], buf, sizeof( buf ) );
+        int n = 0;
+        for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+        {
+            if ( thread.fds[e] == kNoFd )
+                continue;
+            if ( got >= (ssize_t)( ( 4 + n ) * sizeof( uint64_t ) ) && (uint64_t)n < buf[0] )
+            {
+                out[e].value = buf[3 + n];
+                out[e].enabled = buf[1];
+                out[e].running = buf[2];
+            }
+            n++;
+        }
+        return;
+    }
+
+    for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+    {
+        if ( thread.fds[e] != kNoFd && read( thread.fds[e], buf, sizeof( buf ) ) == (ssize_t)( 4 * sizeof( uint64_t ) ) )
+        {
+            out[e].value = buf[3];
+            out[e].enabled = buf[1];
+            out[e].running = buf[2];
+        }
+    }
+}
+
+// Start time of a thread (field 22 of its stat, in clock ticks since boot);
+// 0 if it's gone.
+static unsigned long long thread_start_time( int tid )
+{
+    char path[64], buf[512];
+    snprintf( path, sizeof( path ), "/proc/self/task/%d/stat", tid );
+    FILE * f = fopen( path, "r" );
+    if ( !f )
+        return 0;
+    size_t len = fread( buf, 1, sizeof( buf ) - 1, f );
+    fclose( f );
+    buf[len] = 0;
+
+    // the name (field 2) can contain anything, so count from its closing paren
+    char const * p = strrchr( buf, ')' );
+    for ( int field = 2 ; p && field < 22 ; field++ )
+        p = strchr( p + 1, ' ' );
+    return p ? strtoull( p + 1, NULL, 10 ) : 0;
+}
+
+// Closes the counters of threads that have exited and opens counters on
+// new ones. Call with the lock held.
+static void scan_threads( perf_state & state )
+{
+    DIR * dir = opendir( "/proc/self/task" );
+    if ( !dir )
+        return;
+
+    std::vector<perf_thread> live;
+    while ( dirent * ent = readdir( dir ) )
+    {
+        int tid = atoi( ent->d_name );
+        if ( tid <= 0 )
+            continue;
+
+        perf_thread thread;
+        thread.tid = tid;
+        thread.start_time = thread_start_time( tid );
+        if ( thread.start_time )
+            live.push_back( thread );
+    }
+    closedir( dir );
+
+    size_t kept = 0;
+    for ( size_t i = 0 ; i < state.threads.size() ; i++ )
+    {
+        perf_thread & thread = state.threads[i];
+        bool alive = false;
+        for ( size_t j = 0 ; j < live.size() && !alive ; j++ )
+            alive = live[j].tid == thread.tid && live[j].start_time == thread.start_time;
+
+        if ( alive )
+        {
+            state.threads[kept++] = thread;
+            continue;
+        }
+
+        // keep what it counted for intervals that are still open, the same
+        // way perfcount_end counts live threads: from their begin reading,
+        // or from zero if it started after their begin
+        perf_reading last[PERF_NUM_EVENTS];
+        read_counters( thread, last );
+        for ( size_t o = 0 ; o < state.open.size() ; o++ )
+        {
+            perfcount * pc = state.open[o];
+            std::vector<unsigned>::const_iterator it = std::lower_bound( pc->begin_threads.begin(), pc->begin_threads.end(), thread.serial );
+            bool in_begin = it != pc->begin_threads.end() && *it == thread.serial;
+            for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+            {
+                perf_reading b = { 0, 0, 0 };
+                if ( in_begin )
+                    b = pc->begin[( it - pc->begin_threads.begin() ) * PERF_NUM_EVENTS + e];
+                pc->retired[e] += scaled_delta( last[e], b );
+            }
+        }
+        close_counters( thread );
+    }
+    state.threads.resize( kept );
+
+    for ( size_t j = 0 ; j < live.size() ; j++ )
+    {
+        bool known = false;
+        for ( size_t i = 0 ; i < state.threads.size() && !known ; i++ )
+            known = state.threads[i].tid == live[j].tid && state.threads[i].start_time == live[j].start_time;
+        if ( known )
+            continue;
+
+        perf_thread thread = live[j];
+        thread.serial = state.next_serial++;
+        open_counters( state, thread );
+        state.threads.push_back( thread );
+    }
+}
+
+static perf_state & get_state()
+{
+    static perf_state state;
+    static std::once_flag once;
+    std::call_once( once, [] {
+        // find out what this PMU (and this sandbox) lets us count
+        state.available = false;
+        state.next_serial = 0;
+        strcpy( state.reason, "no counters" );
+        for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+        {
+            int fd = open_counter( 0, (perf_event_id)e, -1 );
+            state.has_event[e] = fd >= 0;
+            if ( fd >= 0 )
+            {
+                state.available = true;
+                close( fd );
+            }
+            else if ( e == PERF_CYCLES )
+                snprintf( state.reason, sizeof( state.reason ), "perf_event_open: %s", strerror( errno ) );
+        }
+
+        if ( state.available )
+            scan_threads( state );
+    } );
+    return state;
+}
+
+// Current totals for all threads known so far, and which threads those
+// are. Call with the lock held.
+static void read_all( perf_state & state, std::vector<perf_reading> * out, std::vector<unsigned> * serials )
+{
+    out->resize( state.threads.size() * PERF_NUM_EVENTS );
+    serials->resize( state.threads.size() );
+    for ( size_t t = 0 ; t < state.threads.size() ; t++ )
+    {
+        (*serials)[t] = state.threads[t].serial;
+        read_counters( state.threads[t], &(*out)[t * PERF_NUM_EVENTS] );
+    }
+}
+
+bool perfcount_available( char const ** reason )
+{
+    perf_state & state = get_state();
+    if ( reason )
+        *reason = state.available ? "" : state.reason;
+    return state.available;
+}
+
+// Call with the lock held.
+static void close_interval( perf_state & state, perfcount * pc )
+{
+    state.open.erase( std::find( state.open.begin(), state.open.end(), pc ) );
+}
+
+void perfcount_begin( perfcount * pc )
+{
+    if ( !pc )
+        return;
+
+    perf_state & state = get_state();
+    if ( !state.available )
+        return;
+
+    std::lock_guard<std::mutex> guard( state.lock );
+    if ( pc->active ) // begin without end: start over
+        close_interval( state, pc );
+    pc->active = true;
+
+    scan_threads( state );
+    read_all( state, &pc->begin, &pc->begin_threads );
+    for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+        pc->retired[e] = 0.0;
+    state.open.push_back( pc );
+    pc->begin_time = std::chrono::steady_clock::now();
+}
+
+void perfcount_end( perfcount * pc, double items )
+{
+    if ( !pc || !pc->active )
+        return;
+    pc->active = false;
+
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - pc->begin_time ).count();
+
+    perf_state & state = get_state();
+    std::vector<perf_reading> end;
+    std::vector<unsigned> end_threads;
+    double total[PERF_NUM_EVENTS];
+    {
+        std::lock_guard<std::mutex> guard( state.lock );
+        read_all( state, &end, &end_threads );
+        close_interval( state, pc );
+
+        // threads that exited since our begin (another begin's scan closed
+        // their counters) were counted then
+        for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+            total[e] = pc->retired[e];
+    }
+
+    // sum over the live threads, scaling each for multiplexing. Serials
+    // increase in list order, so begin and end line up in one pass. Threads
+    // new since our begin count from when their counters were opened.
+    size_t bt = 0, num_begin = pc->begin_threads.size();
+    for ( size_t t = 0 ; t < end_threads.size() ; t++ )
+    {
+        while ( bt < num_begin && pc->begin_threads[bt] < end_threads[t] )
+            bt++;
+
+        bool in_begin = bt < num_begin && pc->begin_threads[bt] == end_threads[t];
+        for ( int e = 0 ; e < PERF_NUM_EVENTS ; e++ )
+        {
+            perf_reading b = { 0, 0, 0 };
+            if ( in_begin )
+                b = pc->begin[bt * PERF_NUM_EVENTS + e];
+            total[e] += scaled_delta( end[t * PERF_NUM_EVENTS + e], b );
+        }
+    }
+
+    if ( state.has_event[PERF_CYCLES] && state.has_event[PERF_INSTRUCTIONS] && total[PERF_CYCLES] > 0.0 )
+        run_stats_record( pc->ipc, (float)( total[PERF_INSTRUCTIONS] / total[PERF_CYCLES] ) );
+    if ( state.has_event[PERF_LLC_MISSES] && seconds > 0.0 )
+        run_stats_record( pc->llc_gbps, (float)( total[PERF_LLC_MISSES] * 64.0 / seconds * 1e-9 ) );
+
+    if ( items > 0.0 )
+    {
+        if ( state.has_event[PERF_CYCLES] )
+            run_stats_record( pc->cycles, (float)( total[PERF_CYCLES] / items ) );
+        if ( state.has_event[PERF_INSTRUCTIONS] )
+            run_stats_record( pc->instructions, (float)( total[PERF_INSTRUCTIONS] / items ) );
+        if ( state.has_event[PERF_LLC_MISSES] )
+            run_stats_record( pc->llc_misses, (float)( total[PERF_LLC_MISSES] / items ) );
+        if ( state.has_event[PERF_BRANCH_MISSES] )
+            run_stats_record( pc->branch_misses, (float)( total[PERF_BRANCH_MISSES] / items ) );
+    }
+}
+
+#else
+
+bool perfcount_available( char const ** reason )
+{
+    if ( reason )
+        *reason = "perf_event_open is Linux only";
+    return false;
+}
+
+void perfcount_begin( perfcount * /*pc*/ )
+{
+}
+
+void perfcount_end( perfcount * /*pc*/, double /*items*/ )
+{
+}
+
+#endif
+
+perfcount * perfcount_create( char const * name )
+{
+    perfcount * pc = new perfcount;
+    pc->name = name;
+    pc->active = false;
+    pc->ipc = run_stats_create_streaming();
+    pc->cycles = run_stats_create_streaming();
+    pc->instructions = run_stats_create_streaming();
+    pc->llc_misses = run_stats_create_streaming();
+    pc->branch_misses = run_stats_create_streaming();
+    pc->llc_gbps = run_stats_create_streaming();
+    return pc;
+}
+
+void perfcount_destroy( perfcount * pc )
+{
+    if ( pc )
+    {
+#ifdef PERFCOUNT_LINUX
+        if ( pc->active )
+        {
+            perf_state & state = get_state();
+            std::lock_guard<std::mutex> guard( state.lock );
+            close_interval( state, pc );
+        }
+#endif
+        run_stats_destroy( pc->ipc );
+        run_stats_destroy( pc->cycles );
+        run_stats_destroy( pc->instructions );
+        run_stats_destroy( pc->llc_misses );
+        run_stats_destroy( pc->branch_misses );
+        run_stats_destroy( pc->llc_gbps );
+        delete pc;
+    }
+}
+
+void perfcount_report( perfcount * pc, char const * item_name )
+{
+    if ( !pc )
+        return;
+
+    char const * reason;
+    if ( !perfcount_available( &reason ) )
+    {
+        printf( "%s: no hardware counters (%s)\n", pc->name.c_str(), reason );
+        return;
+    }
+
+    // run_stats_report skips the ones that never got recorded
+    char desc[256];
+    snprintf( desc, sizeof( desc ), "%s IPC", pc->name.c_str() );
+    run_stats_report( pc->ipc, desc );
+    snprintf( desc, sizeof( desc ), "%s cycles/%s", pc->name.c_str(), item_name );
+    run_stats_report( pc->cycles, desc );
+    snprintf( desc, sizeof( desc ), "%s instructions/%s", pc->name.c_str(), item_name );
+    run_stats_report( pc->instructions, desc );
+    snprintf( desc, sizeof( desc ), "%s LLC misses/%s", pc->name.c_str(), item_name );
+    run_stats_report( pc->llc_misses, desc );
+    snprintf( desc, sizeof( desc ), "%s branch misses/%s", pc->name.c_str(), item_name );
+    run_stats_report( pc->branch_misses, desc );
+    snprintf( desc, sizeof( desc ), "%s LLC miss GB/s (est)", pc->name.c_str() );
+    run_stats_report( pc->llc_gbps, desc );
+}
@@ -0,0 +1,36 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+// Hardware performance counters around CPU kernels, via perf_event_open on
+// Linux:
+//
+//     perfcount_begin( pc );
+//     cpusim_update( ... );
+//     perfcount_end( pc, num_particles );
+//
+// Counts user-mode cycles, instructions, last-level cache misses and branch
+// misses over all threads of the process between begin and end, so
+// parallel_for workers are included (and so is anything else running at the
+// time, like the field job). Threads started after a begin are only picked up
+// by the next one. The report gives IPC and events per item as
+// run_stats. Memory bandwidth is estimated from LLC misses at 64 bytes each;
+// the memory controller counters would need system-wide access.
+//
+// Each thread's counters are one perf_event group led by cycles, so they are
+// multiplexed together and IPC compares counts from the same time slices
+// (separate counters if the group can't be opened). Counters the PMU
+// doesn't have are left out, and multiplexed counts are scaled up. If no
+// counters can be opened at all (not Linux, containers, seccomp,
+// perf_event_paranoid), begin/end do nothing and the report says why. All
+// functions taking a perfcount accept NULL and do nothing.
+
+typedef struct perfcount perfcount;
+
+bool perfcount_available( char const ** reason ); // reason (may be NULL) says why not
+perfcount * perfcount_create( char const * name );
+void perfcount_destroy( perfcount * pc );
+void perfcount_begin( perfcount * pc );
+void perfcount_end( perfcount * pc, double items ); // items processed, for the per-item rates
+void perfcount_report( perfcount * pc, char const * item_name ); // item_name like "particle"
+
+#endif
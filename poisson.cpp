@@ -0,0 +1,340 @@
+#include "poisson.h"
+#include "parallel.h"
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+namespace {
+    struct mg_level {
+        int n;
+        float h;
+        float* p;   // solution
+        float* f;   // right-hand side
+        float* r;   // residual scratch
+    };
+}
+
+static const int kPreSmooth = 2;
+static const int kPostSmooth = 2;
+static const int kCoarseSweeps = 16;
+
+// blocked relaxation parameters
+static const int kMinBlockedSize = 16;  // smaller grids just use relax_serial
+static const int kSlabPlanes = 16;      // z planes per task
+static const int kSweepsPerPass = 4;    // at most kSlabPlanes/4
+
+static int wrap_idx(int n, int x, int y, int z)
+{
+    int m = n - 1;
+    return ((z & m) * n + (y & m)) * n + (x & m);
+}
+
+// Gauss-Seidel update of the cells in one row with (x + row_parity) even,
+// i.e. one color of a red-black sweep. Only the two end cells wrap; the
+// interior loop has no index masking so the compiler can unroll it.
+static void relax_row(float* row, float const* rym, float const* ryp, float const* rzm, float const* rzp,
+    float const* rf, int n, float h2, int row_parity)
+{
+    int m = n - 1;
+
+    if ((row_parity & 1) == 0) {
+        float sum = row[m] + row[1 & m] + rym[0] + ryp[0] + rzm[0] + rzp[0];
+        row[0] = (sum - h2 * rf[0]) * (1.0f / 6.0f);
+    }
+
+    for (int x = 2 - (row_parity & 1); x < m; x += 2) {
+        float sum = row[x - 1] + row[x + 1] + rym[x] + ryp[x] + rzm[x] + rzp[x];
+        row[x] = (sum - h2 * rf[x]) * (1.0f / 6.0f);
+    }
+
+    if (m > 0 && ((m + row_parity) & 1) == 0) {
+        float sum = row[m - 1] + row[0] + rym[m] + ryp[m] + rzm[m] + rzp[m];
+        row[m] = (sum - h2 * rf[m]) * (1.0f / 6.0f);
+    }
+}
+
+// One color of one z plane.
+static void relax_plane(float* p, float const* f, int n, float h2, int z, int color)
+{
+    int m = n - 1;
+    z &= m;
+
+    for (int y = 0; y < n; y++) {
+        relax_row(p + (z * n + y) * n,
+            p + (z * n + ((y - 1) & m)) * n, p + (z * n + ((y + 1) & m)) * n,
+            p + (((z - 1) & m) * n + y) * n, p + (((z + 1) & m) * n + y) * n,
+            f + (z * n + y) * n, n, h2, y + z + color);
+    }
+}
+
+// Red-black Gauss-Seidel, the straightforward way: updates all cells with
+// (x+y+z) even, then all odd ones.
+static void relax_serial(float* p, float const* f, int n, float h, int sweeps)
+{
+    float h2 = h * h;
+
+    for (int sweep = 0; sweep < sweeps; sweep++)
+        for (int color = 0; color < 2; color++)
+            for (int z = 0; z < n; z++)
+                relax_plane(p, f, n, h2, z, color);
+}
+
+// Half-sweeps [0,halves) on planes z0 + [lo(k), hi(k)), where the range for
+// half-sweep k is given by lo + k*dlo and hi + k*dhi. Done as a wavefront:
+// at step s, half-sweep k does plane s-k, so each plane's z neighbors have
+// had exactly k half-sweeps by the time it gets its (k+1)th, and only a few
+// planes are being touched at any time.
+static void relax_wavefront(float* p, float const* f, int n, float h2, int z0,
+    int lo, int dlo, int hi, int dhi, int halves)
+{
+    int first = std::min(lo, lo + (halves - 1) * dlo);
+    int last = std::max(hi, hi + (halves - 1) * dhi);
+
+    for (int step = first; step < last + halves; step++) {
+        for (int k = 0; k < halves; k++) {
+            int i = step - k;
+            if (i >= lo + k * dlo && i < hi + k * dhi)
+                relax_plane(p, f, n, h2, z0 + i, k & 1);
+        }
+    }
+}
+
+// Same result as relax_serial, but in place, in parallel and cache-friendly.
+//
+// z is cut into slabs, and half-sweep k does one plane less on either end of
+// each slab than half-sweep k-1 did (a trapezoid), which only needs planes
+// from the slab itself. That leaves a triangle of updates around each slab
+// boundary, which are independent of each other and get done second.
+void poisson_relax(float* p, float const* rhs, int n, float h, int sweeps)
+{
+    if (n < kMinBlockedSize) {
+        relax_serial(p, rhs, n, h, sweeps);
+        return;
+    }
+
+    int slab = std::min(n, kSlabPlanes);
+    int num_slabs = n / slab;
+    float h2 = h * h;
+
+    while (sweeps > 0) {
+        int halves = 2 * std::min(sweeps, kSweepsPerPass);
+
+        parallel_for(num_slabs, 1, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+                relax_wavefront(p, rhs, n, h2, i * slab, 0, 1, slab, -1, halves);
+        });
+
+        parallel_for(num_slabs, 1, [&](int begin, int end) {
+            for (int i = begin; i < end; i++)
+                relax_wavefront(p, rhs, n, h2, i * slab, 0, -1, 0, 1, halves);
+        });
+
+        sweeps -= halves / 2;
+    }
+}
+
+static void smooth(mg_level& l, int sweeps)
+{
+    poisson_relax(l.p, l.f, l.n, l.h, sweeps);
+}
+
+// r = f - A p; returns sum of squared residuals.
+static double residual(mg_level& l)
+{
+    int n = l.n, m = n - 1;
+    float inv_h2 = 1.0f / (l.h * l.h);
+    double sum_sq = 0.0;
+
+    for (int z = 0; z < n; z++) {
+        for (int y = 0; y < n; y++) {
+            int o = (z * n + y) * n;
+            float const* row = l.p + o;
+            float const* rym = l.p + (z * n + ((y - 1) & m)) * n;
+            float const* ryp = l.p + (z * n + ((y + 1) & m)) * n;
+            float const* rzm = l.p + (((z - 1) & m) * n + y) * n;
+            float const* rzp = l.p + (((z + 1) & m) * n + y) * n;
+
+            for (int x = 0; x < n; x++) {
+                float sum = row[(x - 1) & m] + row[(x + 1) & m] + rym[x] + ryp[x] + rzm[x] + rzp[x];
+                float r = l.f[o + x] - (sum - 6.0f * row[x]) * inv_h2;
+                l.r[o + x] = r;
+                sum_sq += (double)r * r;
+            }
+        }
+    }
+
+    return sum_sq;
+}
+
+// Full-weighting restriction of fine src onto the coarse grid (vertex-centered:
+// coarse i sits on fine 2i).
+static void restrict_full_weight(float* dst, int nc, float const* src)
+{
+    static const float w[3] = { 0.25f, 0.5f, 0.25f };
+    int nf = nc * 2;
+
+    for (int z = 0; z < nc; z++) {
+        for (int y = 0; y < nc; y++) {
+            for (int x = 0; x < nc; x++) {
+                float sum = 0.0f;
+                for (int dz = -1; dz <= 1; dz++)
+                    for (int dy = -1; dy <= 1; dy++)
+                        for (int dx = -1; dx <= 1; dx++)
+                            sum += w[dx + 1] * w[dy + 1] * w[dz + 1] * src[wrap_idx(nf, 2*x + dx, 2*y + dy, 2*z + dz)];
+
+                dst[(z * nc + y) * nc + x] = sum;
+            }
+        }
+    }
+}
+
+// Trilinear interpolation of coarse src, added to fine dst.
+static void prolong_add(float* dst, int nf, float const* src)
+{
+    int nc = nf / 2, mc = nc - 1;
+
+    for (int z = 0; z < nf; z++) {
+        int z0 = z >> 1, z1 = (z0 + (z & 1)) & mc;
+        for (int y = 0; y < nf; y++) {
+            int y0 = y >> 1, y1 = (y0 + (y & 1)) & mc;
+            float const* r00 = src + (z0 * nc + y0) * nc;
+            float const* r01 = src + (z0 * nc + y1) * nc;
+            float const* r10 = src + (z1 * nc + y0) * nc;
+            float const* r11 = src + (z1 * nc + y1) * nc;
+            float* out = dst + (z * nf + y) * nf;
+
+            for (int x = 0; x < nf; x++) {
+                int x0 = x >> 1, x1 = (x0 + (x & 1)) & mc;
+                float sum = r00[x0] + r00[x1] + r01[x0] + r01[x1] + r10[x0] + r10[x1] + r11[x0] + r11[x1];
+                out[x] += sum * 0.125f;
+            }
+        }
+    }
+}
+
+static void remove_mean(float* p, int count)
+{
+    double sum = 0.0;
+    for (int i = 0; i < count; i++)
+        sum += p[i];
+
+    float mean = (float)(sum / count);
+    for (int i = 0; i < count; i++)
+        p[i] -= mean;
+}
+
+static void vcycle(mg_level* levels, int num_levels, int i)
+{
+    mg_level& l = levels[i];
+    int count = l.n * l.n * l.n;
+
+    if (i == num_levels - 1) {
+        // coarsest level (n <= 2): just relax it to death.
+        smooth(l, kCoarseSweeps);
+        remove_mean(l.p, count);
+        return;
+    }
+
+    mg_level& c = levels[i + 1];
+    smooth(l, kPreSmooth);
+    residual(l);
+    restrict_full_weight(c.f, c.n, l.r);
+    memset(c.p, 0, c.n * c.n * c.n * sizeof(float));
+    vcycle(levels, num_levels, i + 1);
+    prolong_add(l.p, l.n, c.p);
+    smooth(l, kPostSmooth);
+}
+
+poisson_result poisson_solve_multigrid(float* p, float const* rhs, int n, float h, float tolerance, int max_cycles)
+{
+    assert(n > 0 && (n & (n - 1)) == 0);
+
+    poisson_result result = { 0, 0.0f };
+    int count = n * n * n;
+
+    // build level hierarchy down to 2^3 (or 1^3 for tiny grids)
+    std::vector<mg_level> levels;
+    std::vector<float> storage;
+    size_t total = 0;
+    for (int ln = n; ; ln /= 2) {
+        total += 3 * (size_t)ln * ln * ln;
+        if (ln <= 2)
+            break;
+    }
+    storage.resize(total);
+
+    float* mem = &storage[0];
+    for (int ln = n, lh = 0; ; ln /= 2, lh++) {
+        mg_level l;
+        size_t lcount = (size_t)ln * ln * ln;
+        l.n = ln;
+        l.h = h * (float)(1 << lh);
+        l.p = (ln == n) ? p : mem; mem += lcount;
+        l.f = mem; mem += lcount;
+        l.r = mem; mem += lcount;
+        levels.push_back(l);
+        if (ln <= 2)
+            break;
+    }
+
+    int num_levels = (int)levels.size();
+
+    // fine-level rhs, made zero-mean so the periodic problem is solvable
+    memcpy(levels[0].f, rhs, count * sizeof(float));
+    remove_mean(levels[0].f, count);
+
+    double rhs_sq = 0.0;
+    for (int i = 0; i < count; i++)
+        rhs_sq += (double)levels[0].f[i] * levels[0].f[i];
+
+    if (n == 1 || rhs_sq == 0.0) {
+        memset(p, 0, count * sizeof(float));
+        return result;
+    }
+
+    // full multigrid: restrict rhs all the way down, solve there, then work
+    // back up, interpolating each solution as the next level's initial guess.
+    for (int i = 1; i < num_levels; i++)
+        restrict_full_weight(levels[i].f, levels[i].n, levels[i - 1].f);
+
+    for (int i = num_levels - 1; i >= 0; i--) {
+        mg_level& l = levels[i];
+        memset(l.p, 0, (size_t)l.n * l.n * l.n * sizeof(float));
+        if (i < num_levels - 1)
+            prolong_add(l.p, l.n, levels[i + 1].p);
+        vcycle(&levels[0], num_levels, i);
+    }
+
+    // V-cycles until converged
+    double rel_sq = residual(levels[0]) / rhs_sq;
+    while (result.iterations < max_cycles && rel_sq > (double)tolerance * tolerance) {
+        vcycle(&levels[0], num_levels, 0);
+        rel_sq = residual(levels[0]) / rhs_sq;
+        result.iterations++;
+    }
+
+    remove_mean(p, count);
+    result.residual = (float)sqrt(rel_sq);
+    return result;
+}
+
+float poisson_relative_residual(float const* p, float const* rhs, int n, float h)
+{
+    std::vector<float> r((size_t)n * n * n), f(rhs, rhs + (size_t)n * n * n);
+    remove_mean(&f[0], n * n * n);
+
+    mg_level l;
+    l.n = n;
+    l.h = h;
+    l.p = (float*)p; // residual() doesn't write p
+    l.f = &f[0];
+    l.r = &r[0];
+
+    double rhs_sq = 0.0;
+    for (size_t i = 0; i < f.size(); i++)
+        rhs_sq += (double)f[i] * f[i];
+
+    return (rhs_sq > 0.0) ? (float)sqrt(residual(l) / rhs_sq) : 0.0f;
+}
@@ -0,0 +1,31 @@
+#ifndef POISSON_H
+#define POISSON_H
+
+// Solvers for the periodic Poisson equation
+//
+//   (sum of the 6 neighbors of p - 6*p) / h^2 = rhs
+//
+// on n^3 grids (n a pow2, x fastest, wrapping at all boundaries). The
+// solution is only defined up to a constant; we return the zero-mean one, and
+// the mean of rhs is ignored.
+
+struct poisson_result {
+    int iterations;     // V-cycles run (not counting the FMG pass)
+    float residual;     // final rms residual relative to rms(rhs)
+};
+
+// Full multigrid pass, then V(2,2) cycles with red-black Gauss-Seidel
+// smoothing until the relative residual drops below tolerance or max_cycles
+// is reached. p receives the solution; its initial contents are ignored.
+poisson_result poisson_solve_multigrid(float* p, float const* rhs, int n, float h, float tolerance, int max_cycles);
+
+// Red-black Gauss-Seidel sweeps (red = (x+y+z) even first), in place. The
+// grid is split into z slabs that are processed in parallel, each doing
+// several sweeps while it's in cache, with the same result as sweeping the
+// whole grid at a time.
+void poisson_relax(float* p, float const* rhs, int n, float h, int sweeps);
+
+// rms of (rhs - A p) relative to rms(rhs), with rhs made zero-mean.
+float poisson_relative_residual(float const* p, float const* rhs, int n, float h);
+
+#endif
@@ -0,0 +1,238 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "profile.h"
+
+#if PROFILE_ENABLED
+
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static const uint32_t kRingSize = 4096; // zones per thread between flushes; power of 2
+static const size_t kMaxTraceEvents = 4 << 20;
+
+struct profile_event
+{
+    char const * name;
+    uint64_t begin, end; // ns
+};
+
+// Single producer (the owning thread), single consumer (profile_flush,
+// under the profiler lock).
+struct profile_ring
+{
+    profile_event events[kRingSize];
+    std::atomic<uint32_t> head; // next to write
+    std::atomic<uint32_t> tail; // next to read
+    std::atomic<uint32_t> dropped;
+    int tid;
+    char name[64];
+};
+
+struct profile_trace_event
+{
+    char const * name;
+    uint64_t begin, end;
+    int tid;
+};
+
+struct profile_state
+{
+    std::mutex lock;
+    std::vector<profile_ring *> rings; // never freed; threads come and go rarely
+    std::map<std::string, run_stats *> zones;
+    bool tracing;
+    std::vector<profile_trace_event> trace;
+    uint64_t dropped;
+};
+
+static uint64_t now_ns()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// trace time 0
+static const uint64_t s_epoch = now_ns();
+
+static profile_state & get_state()
+{
+    static profile_state state;
+    static std::once_flag once;
+    std::call_once( once, [] {
+        state.tracing = false;
+        state.dropped = 0;
+    } );
+    return state;
+}
+
+static thread_local profile_ring * t_ring;
+
+static profile_ring * get_ring()
+{
+    if ( !t_ring )
+    {
+        profile_state & state = get_state();
+        std::lock_guard<std::mutex> guard( state.lock );
+
+        profile_ring * ring = new profile_ring;
+        ring->head = 0;
+        ring->tail = 0;
+        ring->dropped = 0;
+        ring->tid = (int)state.rings.size();
+        snprintf( ring->name, sizeof( ring->name ), "thread %d", ring->tid );
+        state.rings.push_back( ring );
+        t_ring = ring;
+    }
+    return t_ring;
+}
+
+profile_scope::profile_scope( char const * name )
+    : name( name ), begin( now_ns() )
+{
+}
+
+profile_scope::~profile_scope()
+{
+    uint64_t end = now_ns();
+    profile_ring * ring = get_ring();
+
+    uint32_t head = ring->head.load( std::memory_order_relaxed );
+    if ( head - ring->tail.load( std::memory_order_acquire ) >= kRingSize )
+    {
+        ring->dropped.fetch_add( 1, std::memory_order_relaxed );
+        return;
+    }
+
+    profile_event & e = ring->events[head & ( kRingSize - 1 )];
+    e.name = name;
+    e.begin = begin;
+    e.end = end;
+    ring->head.store( head + 1, std::memory_order_release );
+}
+
+void profile_thread_name( char const * name )
+{
+    profile_ring * ring = get_ring();
+    std::lock_guard<std::mutex> guard( get_state().lock );
+    snprintf( ring->name, sizeof( ring->name ), "%s", name );
+}
+
+void profile_set_tracing( bool enabled )
+{
+    profile_state & state = get_state();
+    std::lock_guard<std::mutex> guard( state.lock );
+    state.tracing = enabled;
+}
+
+// Call with the lock held.
+static void flush_locked( profile_state & state )
+{
+    for ( size_t r = 0 ; r < state.rings.size() ; r++ )
+    {
+        profile_ring * ring = state.rings[r];
+        uint32_t head = ring->head.load( std::memory_order_acquire );
+        uint32_t tail = ring->tail.load( std::memory_order_relaxed );
+
+        for ( ; tail != head ; tail++ )
+        {
+            profile_event const & e = ring->events[tail & ( kRingSize - 1 )];
+
+            run_stats *& stats = state.zones[e.name];
+            if ( !stats )
+                stats = run_stats_create_streaming();
+            run_stats_record( stats, (float)( 1e-6 * (double)( e.end - e.begin ) ) );
+
+            if ( state.tracing )
+            {
+                if ( state.trace.size() < kMaxTraceEvents )
+                {
+                    profile_trace_event t = { e.name, e.begin, e.end, ring->tid };
+                    state.trace.push_back( t );
+                }
+                else
+                    state.dropped++;
+            }
+        }
+
+        ring->tail.store( head, std::memory_order_release );
+        state.dropped += ring->dropped.exchange( 0, std::memory_order_relaxed );
+    }
+}
+
+void profile_flush( void )
+{
+    profile_state & state = get_state();
+    std::lock_guard<std::mutex> guard( state.lock );
+    flush_locked( state );
+}
+
+void profile_report( void )
+{
+    profile_state & state = get_state();
+    std::lock_guard<std::mutex> guard( state.lock );
+    flush_locked( state );
+
+    char desc[256];
+    for ( std::map<std::string, run_stats *>::const_iterator it = state.zones.begin() ; it != state.zones.end() ; ++it )
+    {
+        snprintf( desc, sizeof( desc ), "zone %s ms", it->first.c_str() );
+        run_stats_report( it->second, desc );
+    }
+
+    if ( state.dropped )
+        printf( "profile: dropped %llu zones (flush more often)\n", (unsigned long long)state.dropped );
+}
+
+// JSON string contents; zone and thread names are plain text
+static void write_json_string( FILE * f, char const * s )
+{
+    for ( ; *s ; s++ )
+    {
+        if ( *s == '"' || *s == '\\' )
+            fputc( '\\', f );
+        if ( (unsigned char)*s >= 0x20 )
+            fputc( *s, f );
+    }
+}
+
+bool profile_write_trace( char const * filename )
+{
+    profile_state & state = get_state();
+    std::lock_guard<std::mutex> guard( state.lock );
+    flush_locked( state );
+
+    FILE * f = fopen( filename, "w" );
+    if ( !f )
+        return false;
+
+    // complete ("X") events nest by time on each thread's timeline
+    fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+    for ( size_t r = 0 ; r < state.rings.size() ; r++ )
+    {
+        fprintf( f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"", state.rings[r]->tid );
+        write_json_string( f, state.rings[r]->name );
+        fprintf( f, "\"}},\n" );
+    }
+    for ( size_t i = 0 ; i < state.trace.size() ; i++ )
+    {
+        profile_trace_event const & e = state.trace[i];
+        fprintf( f, "{\"name\":\"" );
+        write_json_string( f, e.name );
+        fprintf( f, "\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n", e.tid,
+            1e-3 * (double)(int64_t)( e.begin - s_epoch ), 1e-3 * (double)( e.end - e.begin ) );
+    }
+    fprintf( f, "{\"name\":\"trace end\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":0,\"ts\":%.3f}\n]}\n",
+        1e-3 * (double)( now_ns() - s_epoch ) );
+
+    bool ok = !ferror( f );
+    fclose( f );
+    return ok;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// Scoped CPU zone profiler, the CPU-side counterpart to d3du_timer:
+//
+//     void update()
+//     {
+//         PROFILE_ZONE( "update" );
+//         ...
+//     }
+//
+// Zones nest. Each thread writes the zones it closes (name, begin and end
+// time) to its own lock-free ring; profile_flush drains all rings into one
+// streaming run_stats per zone name (ms per zone instance) and, with
+// tracing on, into a trace that profile_write_trace exports as Chrome
+// trace JSON (chrome://tracing or Perfetto), one timeline per thread.
+//
+// Call profile_flush regularly (once a frame); zones that don't fit in a
+// full ring get dropped and counted. Zone names must be string literals
+// (or otherwise outlive the profiler).
+//
+// Build with PROFILE_ENABLED=0 and all of this compiles to nothing.
+
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED 1
+#endif
+
+#if PROFILE_ENABLED
+
+struct profile_scope
+{
+    char const * name;
+    unsigned long long begin;
+
+    explicit profile_scope( char const * name );
+    ~profile_scope();
+};
+
+#define PROFILE_CONCAT2( a, b ) a##b
+#define PROFILE_CONCAT( a, b ) PROFILE_CONCAT2( a, b )
+#define PROFILE_ZONE( name ) profile_scope PROFILE_CONCAT( profile_zone_, __LINE__ )( name )
+
+void profile_thread_name( char const * name ); // for the calling thread's timeline; copied
+void profile_set_tracing( bool enabled ); // keep zones for profile_write_trace (off by default)
+void profile_flush( void );
+void profile_report( void ); // flushes, then prints per-zone stats
+bool profile_write_trace( char const * filename ); // flushes, then writes the trace
+
+#else
+
+#define PROFILE_ZONE( name ) ((void)0)
+
+inline void profile_thread_name( char const * ) {}
+inline void profile_set_tracing( bool ) {}
+inline void profile_flush( void ) {}
+inline void profile_report( void ) {}
+inline bool profile_write_trace( char const * ) { return false; }
+
+#endif
+
+#endif
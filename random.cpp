@@ -0,0 +1,332 @@
+#include "random.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#define RANDOM_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RANDOM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Below this, directions get too imprecise to normalize; rejecting these
+// biases nothing measurable.
+static const float kMinSphereLenSq = 1e-6f;
+
+static uint64_t splitmix64(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t xoshiro_next(uint32_t s[4])
+{
+    uint32_t result = s[0] + s[3];
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+    return result;
+}
+
+// Advances by 2^64 steps.
+static void xoshiro_jump(uint32_t s[4])
+{
+    static const uint32_t kJump[4] = { 0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b };
+    uint32_t t[4] = { 0, 0, 0, 0 };
+
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 32; b++) {
+            if (kJump[i] & (1u << b)) {
+                for (int j = 0; j < 4; j++)
+                    t[j] ^= s[j];
+            }
+            xoshiro_next(s);
+        }
+    }
+
+    memcpy(s, t, sizeof(t));
+}
+
+void rand_stream_seed(rand_stream* rs, uint64_t seed)
+{
+    uint32_t s[4];
+    uint64_t sm = seed;
+    uint64_t a = splitmix64(&sm), b = splitmix64(&sm);
+    s[0] = (uint32_t)a;
+    s[1] = (uint32_t)(a >> 32);
+    s[2] = (uint32_t)b;
+    s[3] = (uint32_t)(b >> 32);
+    if ((s[0] | s[1] | s[2] | s[3]) == 0) // the one state xoshiro can't leave
+        s[0] = 1;
+
+    for (int lane = 0; lane < RAND_STREAM_LANES; lane++) {
+        for (int i = 0; i < 4; i++)
+            rs->s[i][lane] = s[i];
+        xoshiro_jump(s);
+    }
+}
+
+#if defined(RANDOM_AVX2)
+
+// For each 8-bit lane mask: the indices of the set lanes, 3 bits each,
+// packed to the bottom, and their count in bits 24 and up.
+static const uint32_t kPackTable[256] = {
+    0x00000000, 0x01000000, 0x01000001, 0x02000008, 0x01000002, 0x02000010, 0x02000011, 0x03000088,
+    0x01000003, 0x02000018, 0x02000019, 0x030000c8, 0x0200001a, 0x030000d0, 0x030000d1, 0x04000688,
+    0x01000004, 0x02000020, 0x02000021, 0x03000108, 0x02000022, 0x03000110, 0x03000111, 0x04000888,
+    0x02000023, 0x03000118, 0x03000119, 0x040008c8, 0x0300011a, 0x040008d0, 0x040008d1, 0x05004688,
+    0x01000005, 0x02000028, 0x02000029, 0x03000148, 0x0200002a, 0x03000150, 0x03000151, 0x04000a88,
+    0x0200002b, 0x03000158, 0x03000159, 0x04000ac8, 0x0300015a, 0x04000ad0, 0x04000ad1, 0x05005688,
+    0x0200002c, 0x03000160, 0x03000161, 0x04000b08, 0x03000162, 0x04000b10, 0x04000b11, 0x05005888,
+    0x03000163, 0x04000b18, 0x04000b19, 0x050058c8, 0x04000b1a, 0x050058d0, 0x050058d1, 0x0602c688,
+    0x01000006, 0x02000030, 0x02000031, 0x03000188, 0x02000032, 0x03000190, 0x03000191, 0x04000c88,
+    0x02000033, 0x03000198, 0x03000199, 0x04000cc8, 0x0300019a, 0x04000cd0, 0x04000cd1, 0x05006688,
+    0x02000034, 0x030001a0, 0x030001a1, 0x04000d08, 0x030001a2, 0x04000d10, 0x04000d11, 0x05006888,
+    0x030001a3, 0x04000d18, 0x04000d19, 0x050068c8, 0x04000d1a, 0x050068d0, 0x050068d1, 0x06034688,
+    0x02000035, 0x030001a8, 0x030001a9, 0x04000d48, 0x030001aa, 0x04000d50, 0x04000d51, 0x05006a88,
+    0x030001ab, 0x04000d58, 0x04000d59, 0x05006ac8, 0x04000d5a, 0x05006ad0, 0x05006ad1, 0x06035688,
+    0x030001ac, 0x04000d60, 0x04000d61, 0x05006b08, 0x04000d62, 0x05006b10, 0x05006b11, 0x06035888,
+    0x04000d63, 0x05006b18, 0x05006b19, 0x060358c8, 0x05006b1a, 0x060358d0, 0x060358d1, 0x071ac688,
+    0x01000007, 0x02000038, 0x02000039, 0x030001c8, 0x0200003a, 0x030001d0, 0x030001d1, 0x04000e88,
+    0x0200003b, 0x030001d8, 0x030001d9, 0x04000ec8, 0x030001da, 0x04000ed0, 0x04000ed1, 0x05007688,
+    0x0200003c, 0x030001e0, 0x030001e1, 0x04000f08, 0x030001e2, 0x04000f10, 0x04000f11, 0x05007888,
+    0x030001e3, 0x04000f18, 0x04000f19, 0x050078c8, 0x04000f1a, 0x050078d0, 0x050078d1, 0x0603c688,
+    0x0200003d, 0x030001e8, 0x030001e9, 0x04000f48, 0x030001ea, 0x04000f50, 0x04000f51, 0x05007a88,
+    0x030001eb, 0x04000f58, 0x04000f59, 0x05007ac8, 0x04000f5a, 0x05007ad0, 0x05007ad1, 0x0603d688,
+    0x030001ec, 0x04000f60, 0x04000f61, 0x05007b08, 0x04000f62, 0x05007b10, 0x05007b11, 0x0603d888,
+    0x04000f63, 0x05007b18, 0x05007b19, 0x0603d8c8, 0x05007b1a, 0x0603d8d0, 0x0603d8d1, 0x071ec688,
+    0x0200003e, 0x030001f0, 0x030001f1, 0x04000f88, 0x030001f2, 0x04000f90, 0x04000f91, 0x05007c88,
+    0x030001f3, 0x04000f98, 0x04000f99, 0x05007cc8, 0x04000f9a, 0x05007cd0, 0x05007cd1, 0x0603e688,
+    0x030001f4, 0x04000fa0, 0x04000fa1, 0x05007d08, 0x04000fa2, 0x05007d10, 0x05007d11, 0x0603e888,
+    0x04000fa3, 0x05007d18, 0x05007d19, 0x0603e8c8, 0x05007d1a, 0x0603e8d0, 0x0603e8d1, 0x071f4688,
+    0x030001f5, 0x04000fa8, 0x04000fa9, 0x05007d48, 0x04000faa, 0x05007d50, 0x05007d51, 0x0603ea88,
+    0x04000fab, 0x05007d58, 0x05007d59, 0x0603eac8, 0x05007d5a, 0x0603ead0, 0x0603ead1, 0x071f5688,
+    0x04000fac, 0x05007d60, 0x05007d61, 0x0603eb08, 0x05007d62, 0x0603eb10, 0x0603eb11, 0x071f5888,
+    0x05007d63, 0x0603eb18, 0x0603eb19, 0x071f58c8, 0x0603eb1a, 0x071f58d0, 0x071f58d1, 0x08fac688,
+};
+
+static inline __m256i xoshiro_next(__m256i s[4])
+{
+    __m256i result = _mm256_add_epi32(s[0], s[3]);
+    __m256i t = _mm256_slli_epi32(s[1], 9);
+
+    s[2] = _mm256_xor_si256(s[2], s[0]);
+    s[3] = _mm256_xor_si256(s[3], s[1]);
+    s[1] = _mm256_xor_si256(s[1], s[2]);
+    s[0] = _mm256_xor_si256(s[0], s[3]);
+    s[2] = _mm256_xor_si256(s[2], t);
+    s[3] = _mm256_or_si256(_mm256_slli_epi32(s[3], 11), _mm256_srli_epi32(s[3], 21));
+    return result;
+}
+
+static inline __m256 bits_to_coord(__m256i bits)
+{
+    __m256 f = _mm256_cvtepi32_ps(_mm256_srli_epi32(bits, 8));
+    return _mm256_sub_ps(_mm256_mul_ps(f, _mm256_set1_ps(2.0f / 16777216.0f)), _mm256_set1_ps(1.0f));
+}
+
+static void batch(rand_stream* rs, float* x, float* y, float* z, int count, bool sphere, float radius)
+{
+    __m256i s[4];
+    for (int i = 0; i < 4; i++)
+        s[i] = _mm256_loadu_si256((__m256i const*)rs->s[i]);
+
+    __m256i shifts = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    int n = 0;
+    while (n < count) {
+        __m256 cx = bits_to_coord(xoshiro_next(s));
+        __m256 cy = bits_to_coord(xoshiro_next(s));
+        __m256 cz = bits_to_coord(xoshiro_next(s));
+
+        __m256 l = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cx, cx), _mm256_mul_ps(cy, cy)), _mm256_mul_ps(cz, cz));
+        __m256 ok = _mm256_cmp_ps(l, _mm256_set1_ps(1.0f), _CMP_LE_OQ);
+        __m256 scale = _mm256_set1_ps(radius);
+        if (sphere) {
+            ok = _mm256_and_ps(ok, _mm256_cmp_ps(l, _mm256_set1_ps(kMinSphereLenSq), _CMP_GT_OQ));
+            scale = _mm256_div_ps(scale, _mm256_sqrt_ps(l));
+        }
+
+        // pack the accepted lanes to the front
+        uint32_t packed = kPackTable[_mm256_movemask_ps(ok)];
+        __m256i perm = _mm256_srlv_epi32(_mm256_set1_epi32((int)packed), shifts);
+        cx = _mm256_permutevar8x32_ps(_mm256_mul_ps(cx, scale), perm);
+        cy = _mm256_permutevar8x32_ps(_mm256_mul_ps(cy, scale), perm);
+        cz = _mm256_permutevar8x32_ps(_mm256_mul_ps(cz, scale), perm);
+        int num = (int)(packed >> 24);
+
+        if (count - n >= 8) {
+            // the junk past the accepted lanes gets overwritten next time
+            _mm256_storeu_ps(x + n, cx);
+            _mm256_storeu_ps(y + n, cy);
+            _mm256_storeu_ps(z + n, cz);
+        } else {
+            float tx[8], ty[8], tz[8];
+            _mm256_storeu_ps(tx, cx);
+            _mm256_storeu_ps(ty, cy);
+            _mm256_storeu_ps(tz, cz);
+            num = (num < count - n) ? num : count - n;
+            for (int i = 0; i < num; i++) {
+                x[n + i] = tx[i];
+                y[n + i] = ty[i];
+                z[n + i] = tz[i];
+            }
+        }
+        n += num;
+    }
+
+    for (int i = 0; i < 4; i++)
+        _mm256_storeu_si256((__m256i*)rs->s[i], s[i]);
+}
+
+#elif defined(RANDOM_SSE2)
+
+static inline __m128i xoshiro_next(__m128i s[4])
+{
+    __m128i result = _mm_add_epi32(s[0], s[3]);
+    __m128i t = _mm_slli_epi32(s[1], 9);
+
+    s[2] = _mm_xor_si128(s[2], s[0]);
+    s[3] = _mm_xor_si128(s[3], s[1]);
+    s[1] = _mm_xor_si128(s[1], s[2]);
+    s[0] = _mm_xor_si128(s[0], s[3]);
+    s[2] = _mm_xor_si128(s[2], t);
+    s[3] = _mm_or_si128(_mm_slli_epi32(s[3], 11), _mm_srli_epi32(s[3], 21));
+    return result;
+}
+
+static inline __m128 bits_to_coord(__m128i bits)
+{
+    __m128 f = _mm_cvtepi32_ps(_mm_srli_epi32(bits, 8));
+    return _mm_sub_ps(_mm_mul_ps(f, _mm_set1_ps(2.0f / 16777216.0f)), _mm_set1_ps(1.0f));
+}
+
+static void batch(rand_stream* rs, float* x, float* y, float* z, int count, bool sphere, float radius)
+{
+    // two halves of 4 lanes each; SSE2 has no variable shuffles, so the
+    // accepted lanes get copied out one at a time. Always step both halves to
+    // stay in sync with the 8-wide version.
+    __m128i s[2][4];
+    for (int h = 0; h < 2; h++)
+        for (int i = 0; i < 4; i++)
+            s[h][i] = _mm_loadu_si128((__m128i const*)(rs->s[i] + h * 4));
+
+    int n = 0;
+    while (n < count) {
+        for (int h = 0; h < 2; h++) {
+            __m128 cx = bits_to_coord(xoshiro_next(s[h]));
+            __m128 cy = bits_to_coord(xoshiro_next(s[h]));
+            __m128 cz = bits_to_coord(xoshiro_next(s[h]));
+
+            __m128 l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_mul_ps(cz, cz));
+            __m128 ok = _mm_cmple_ps(l, _mm_set1_ps(1.0f));
+            __m128 scale = _mm_set1_ps(radius);
+            if (sphere) {
+                ok = _mm_and_ps(ok, _mm_cmpgt_ps(l, _mm_set1_ps(kMinSphereLenSq)));
+                scale = _mm_div_ps(scale, _mm_sqrt_ps(l));
+            }
+
+            float tx[4], ty[4], tz[4];
+            _mm_storeu_ps(tx, _mm_mul_ps(cx, scale));
+            _mm_storeu_ps(ty, _mm_mul_ps(cy, scale));
+            _mm_storeu_ps(tz, _mm_mul_ps(cz, scale));
+
+            // without branches while there's room: write every lane, only
+            // advance past accepted ones. (The mask is unpredictable.)
+            int mask = _mm_movemask_ps(ok);
+            if (count - n >= 4) {
+                for (int lane = 0; lane < 4; lane++) {
+                    x[n] = tx[lane];
+                    y[n] = ty[lane];
+                    z[n] = tz[lane];
+                    n += (mask >> lane) & 1;
+                }
+            } else {
+                for (int lane = 0; lane < 4 && n < count; lane++) {
+                    if (mask & (1 << lane)) {
+                        x[n] = tx[lane];
+                        y[n] = ty[lane];
+                        z[n] = tz[lane];
+                        n++;
+                    }
+                }
+            }
+        }
+    }
+
+    for (int h = 0; h < 2; h++)
+        for (int i = 0; i < 4; i++)
+            _mm_storeu_si128((__m128i*)(rs->s[i] + h * 4), s[h][i]);
+}
+
+#else
+
+// Candidate coordinate in [-1,1) from the top 24 bits.
+static inline float bits_to_coord(uint32_t bits)
+{
+    return (float)(bits >> 8) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+// Scalar version of one step of all lanes: writes the accepted points (in
+// lane order) to x/y/z and returns how many there were.
+static int step_scalar(rand_stream* rs, float* x, float* y, float* z, bool sphere, float radius)
+{
+    int n = 0;
+    for (int lane = 0; lane < RAND_STREAM_LANES; lane++) {
+        uint32_t s[4] = { rs->s[0][lane], rs->s[1][lane], rs->s[2][lane], rs->s[3][lane] };
+        float cx = bits_to_coord(xoshiro_next(s));
+        float cy = bits_to_coord(xoshiro_next(s));
+        float cz = bits_to_coord(xoshiro_next(s));
+        for (int i = 0; i < 4; i++)
+            rs->s[i][lane] = s[i];
+
+        float l = cx*cx + cy*cy + cz*cz;
+        if (l > 1.0f || (sphere && l <= kMinSphereLenSq))
+            continue;
+
+        float scale = sphere ? radius / sqrtf(l) : radius;
+        x[n] = cx * scale;
+        y[n] = cy * scale;
+        z[n] = cz * scale;
+        n++;
+    }
+    return n;
+}
+
+static void batch(rand_stream* rs, float* x, float* y, float* z, int count, bool sphere, float radius)
+{
+    int n = 0;
+    while (n < count) {
+        float tx[RAND_STREAM_LANES], ty[RAND_STREAM_LANES], tz[RAND_STREAM_LANES];
+        int num = step_scalar(rs, tx, ty, tz, sphere, radius);
+        for (int i = 0; i < num && n < count; i++, n++) {
+            x[n] = tx[i];
+            y[n] = ty[i];
+            z[n] = tz[i];
+        }
+    }
+}
+
+#endif
+
+void rand_ball_batch(rand_stream* rs, float* x, float* y, float* z, int count, float radius)
+{
+    batch(rs, x, y, z, count, false, radius);
+}
+
+void rand_sphere_batch(rand_stream* rs, float* x, float* y, float* z, int count, float radius)
+{
+    batch(rs, x, y, z, count, true, radius);
+}
@@ -0,0 +1,131 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+#include "math.h"
+
+// Random number helpers. Three generators, for different jobs:
+//
+// - randf() and friends use the CRT rand(): global state, one value at a
+//   time, fine for setup code.
+// - philox4x32_10 is counter-based: random words from (index, seed) with no
+//   state, for per-element numbers that don't depend on thread or lane.
+// - rand_stream is SIMD-interleaved xoshiro128+ (random.cpp), for spawning
+//   batches of particles.
+
+// CRT rand() based.
+
+static inline float randf()
+{
+    return 1.0f * rand() / RAND_MAX;
+}
+
+static inline math::vec3 rand_vec3_unit_sphere(float* len_sq_out = nullptr)
+{
+    math::vec3 v;
+    float l;
+
+    do
+    {
+        v.x = 2.0f * randf() - 1.0f;
+        v.y = 2.0f * randf() - 1.0f;
+        v.z = 2.0f * randf() - 1.0f;
+        l = math::len_sq(v);
+    } while (l > 1.0f);
+
+    if (len_sq_out)
+        *len_sq_out = l;
+    return v;
+}
+
+static inline math::vec3 rand_unit_vec3()
+{
+    math::vec3 v;
+    float l;
+
+    do v = rand_vec3_unit_sphere(&l); while (l == 0.0f);
+    return math::rsqrt(l) * v;
+}
+
+// Counter-based generator: Philox4x32-10 (Salmon et al., "Parallel Random
+// Numbers: As Easy as 1, 2, 3", SC11). Maps a (counter, key) pair to 4 random
+// words with no state, so e.g. every voxel of a grid can get its numbers
+// from its index, independent of which thread or SIMD lane computes it.
+
+static inline uint32_t philox_mulhilo(uint32_t a, uint32_t b, uint32_t* hi)
+{
+    uint64_t prod = (uint64_t)a * b;
+    *hi = (uint32_t)(prod >> 32);
+    return (uint32_t)prod;
+}
+
+static inline void philox4x32_10(uint32_t out[4], uint32_t const ctr[4], uint32_t key0, uint32_t key1)
+{
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+
+    for (int round = 0; round < 10; round++) {
+        uint32_t hi0, hi1;
+        uint32_t lo0 = philox_mulhilo(0xD2511F53u, c0, &hi0);
+        uint32_t lo1 = philox_mulhilo(0xCD9E8D57u, c2, &hi1);
+
+        c0 = hi1 ^ c1 ^ key0;
+        c1 = lo1;
+        c2 = hi0 ^ c3 ^ key1;
+        c3 = lo0;
+
+        key0 += 0x9E3779B9u;
+        key1 += 0xBB67AE85u;
+    }
+
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// Uniform float in [0,1) from the top 24 bits of a random word.
+static inline float rand_bits_to_unit_float(uint32_t bits)
+{
+    return (float)(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+// Unit vector for the given seed/index, without rejection sampling (so the
+// cost is the same for every index): z uniform in [-1,1], angle uniform.
+static inline math::vec3 rand_unit_vec3_counter(uint32_t seed, uint32_t index)
+{
+    uint32_t ctr[4] = { index, 0, 0, 0 };
+    uint32_t bits[4];
+    philox4x32_10(bits, ctr, seed, 0x6D6F6D65u);
+
+    float z = 2.0f * rand_bits_to_unit_float(bits[0]) - 1.0f;
+    float angle = 6.28318530718f * rand_bits_to_unit_float(bits[1]);
+    float r = std::sqrt(std::max(0.0f, 1.0f - z*z));
+    return math::vec3(r * std::cos(angle), r * std::sin(angle), z);
+}
+
+// Batch sampling for particle spawning: xoshiro128+ (Blackman & Vigna,
+// "Scrambled Linear Pseudorandom Number Generators", 2018), run as
+// RAND_STREAM_LANES interleaved streams so a whole SIMD register of
+// candidates comes out per step. Lanes are 2^64 steps apart (jump()), so the
+// streams never overlap. Points are rejection-sampled from the cube, with the
+// accepted lanes packed into the output; the sequence for a given seed is the
+// same with or without SIMD.
+
+#define RAND_STREAM_LANES 8
+
+struct rand_stream {
+    uint32_t s[4][RAND_STREAM_LANES];   // xoshiro128+ state, SoA
+};
+
+void rand_stream_seed(rand_stream* rs, uint64_t seed);
+
+// Fills x/y/z[0..count) with points uniformly distributed in the ball of
+// the given radius around the origin.
+void rand_ball_batch(rand_stream* rs, float* x, float* y, float* z, int count, float radius);
+
+// Same, for points on the sphere (i.e. random directions times radius).
+void rand_sphere_batch(rand_stream* rs, float* x, float* y, float* z, int count, float radius);
+
+#endif
@@ -25,6 +25,9 @@ cbuffer UpdateConsts : register(b1) {
     float  accel;
     float3 field_sample_scale;
     float  vel_scale;
+    float  field_blend; // between tex_force and tex_force_next
+    float  field_decode_scale; // fieldpack scales for tex_force and tex_force_next
+    float  field_next_decode_scale;
 };
 
 float4 UpdateVertShader(
@@ -34,38 +37,112 @@ float4 UpdateVertShader(
     return float4(float(vertex_id >> 1) * 4.0 - 1.0, 1.0 - float(vertex_id & 1) * 4.0, 0.5, 1.0);
 }
 
+// force field sample pos (in texels) for a particle position
+float3 ForceSamplePos(float3 pos)
+{
+    float3 force_pos = pos * field_scale + field_offs;
+    float3 force_frac = frac(force_pos);
+    float3 force_smooth = force_frac * force_frac * (3.0 - 2.0 * force_frac);
+    return (force_pos - force_frac) + force_smooth;
+}
+
+float4 IntegratePos(float4 older_pos, float4 newer_pos, float3 force)
+{
+    // verlet integration
+    float3 new_pos = newer_pos.xyz + damping * (newer_pos.xyz - older_pos.xyz);
+    new_pos += accel * force;
+
+    float4 output = float4(new_pos, newer_pos.w);
+
+    // nuke particles if they get too far from the origin
+    if (dot(new_pos, new_pos) > 16.0)
+        output.w = 0.0;
+
+    return output;
+}
+
 float4 UpdatePosShader(
     float4 pos : SV_Position,
     SamplerState force_smp : register(s0),
     Texture2D tex_older_pos : register(t0),
     Texture2D tex_newer_pos : register(t1),
-    Texture3D tex_force : register(t2)
+    Texture3D tex_force : register(t2),
+    Texture3D tex_force_next : register(t3)
 ) : SV_Target
 {
     int3 coord_pos = int3(int2(pos.xy), 0);
     float4 older_pos = tex_older_pos.Load(coord_pos);
     float4 newer_pos = tex_newer_pos.Load(coord_pos);
-
-    // determine force field sample pos
-    float3 force_pos = newer_pos.xyz * field_scale + field_offs;
-    float3 force_frac = frac(force_pos);
-    float3 force_smooth = force_frac * force_frac * (3.0 - 2.0 * force_frac);
-    force_pos = (force_pos - force_frac) + force_smooth;
+    float3 force_pos = ForceSamplePos(newer_pos.xyz);
 
     // sample force from texture
-    float3 force = tex_force.Sample(force_smp, force_pos * field_sample_scale).xyz;
+    float3 force = field_decode_scale * tex_force.Sample(force_smp, force_pos * field_sample_scale).xyz;
+    if (field_blend > 0.0) {
+        float3 force_next = field_next_decode_scale * tex_force_next.Sample(force_smp, force_pos * field_sample_scale).xyz;
+        force = lerp(force, force_next, field_blend);
+    }
 
-    // verlet integration
-    float3 new_pos = newer_pos.xyz + damping * (newer_pos.xyz - older_pos.xyz);
-    new_pos += accel * force;
+    return IntegratePos(older_pos, newer_pos, force);
+}
 
-    float4 output = float4(new_pos, newer_pos.w);
+// FIELDPACK_SHAREDEXP texels: 3x (8 bit magnitude, sign), 5 bit exponent
+float3 DecodeSharedExp(uint v)
+{
+    float scale = exp2(float(v >> 27) - 23.0);
+    uint3 c = uint3(v, v >> 9, v >> 18);
+    float3 mag = float3(c & 0xff) * scale;
+    return (c & 0x100) ? -mag : mag;
+}
 
-    // nuke particles if they get too far from the origin
-    if (dot(new_pos, new_pos) > 16.0)
-        output.w = 0.0;
+// Integer textures can't be filtered, so do the trilinear filtering by hand,
+// the same way the sampler would (wrap addressing, texel centers at +0.5).
+float3 SampleSharedExp(Texture3D<uint> tex, float3 force_pos)
+{
+    uint3 dim;
+    tex.GetDimensions(dim.x, dim.y, dim.z);
+
+    float3 t = force_pos - 0.5;
+    float3 base = floor(t);
+    float3 f = t - base;
+    uint3 i0 = uint3(int3(base) + int3(dim)) & (dim - 1);
+    uint3 i1 = (i0 + 1) & (dim - 1);
+
+    float3 c000 = DecodeSharedExp(tex.Load(int4(i0.x, i0.y, i0.z, 0)));
+    float3 c100 = DecodeSharedExp(tex.Load(int4(i1.x, i0.y, i0.z, 0)));
+    float3 c010 = DecodeSharedExp(tex.Load(int4(i0.x, i1.y, i0.z, 0)));
+    float3 c110 = DecodeSharedExp(tex.Load(int4(i1.x, i1.y, i0.z, 0)));
+    float3 c001 = DecodeSharedExp(tex.Load(int4(i0.x, i0.y, i1.z, 0)));
+    float3 c101 = DecodeSharedExp(tex.Load(int4(i1.x, i0.y, i1.z, 0)));
+    float3 c011 = DecodeSharedExp(tex.Load(int4(i0.x, i1.y, i1.z, 0)));
+    float3 c111 = DecodeSharedExp(tex.Load(int4(i1.x, i1.y, i1.z, 0)));
+
+    float3 c00 = lerp(c000, c100, f.x);
+    float3 c10 = lerp(c010, c110, f.x);
+    float3 c01 = lerp(c001, c101, f.x);
+    float3 c11 = lerp(c011, c111, f.x);
+    return lerp(lerp(c00, c10, f.y), lerp(c01, c11, f.y), f.z);
+}
 
-    return output;
+float4 UpdatePosSharedExpShader(
+    float4 pos : SV_Position,
+    Texture2D tex_older_pos : register(t0),
+    Texture2D tex_newer_pos : register(t1),
+    Texture3D<uint> tex_force : register(t2),
+    Texture3D<uint> tex_force_next : register(t3)
+) : SV_Target
+{
+    int3 coord_pos = int3(int2(pos.xy), 0);
+    float4 older_pos = tex_older_pos.Load(coord_pos);
+    float4 newer_pos = tex_newer_pos.Load(coord_pos);
+    float3 force_pos = ForceSamplePos(newer_pos.xyz);
+
+    float3 force = field_decode_scale * SampleSharedExp(tex_force, force_pos);
+    if (field_blend > 0.0) {
+        float3 force_next = field_next_decode_scale * SampleSharedExp(tex_force_next, force_pos);
+        force = lerp(force, force_next, field_blend);
+    }
+
+    return IntegratePos(older_pos, newer_pos, force);
 }
 
 float4 UpdateVelShader(
@@ -81,17 +158,11 @@ float4 UpdateVelShader(
     return newer_pos - older_pos;
 }
 
-CubeVert RenderCubeVertexShader(
-    uint vertex_id : SV_VertexID,
-    uint instance_id : SV_InstanceID,
-    Texture2D tex_pos : register(t0),
-    Texture2D tex_fwd : register(t1)
-)
+CubeVert MakeCubeVert(uint vertex_id, int3 fetch_coord, Texture2D tex_pos, Texture2D tex_fwd)
 {
     CubeVert v;
 
     // fetch cube position and velocity from textures
-    int3 fetch_coord = int3(vertex_id >> 3, instance_id, 0);
     float4 cube_pos = tex_pos.Load(fetch_coord);
     float4 cube_fwd = tex_fwd.Load(fetch_coord);
 
@@ -121,6 +192,34 @@ CubeVert RenderCubeVertexShader(
     return v;
 }
 
+CubeVert RenderCubeVertexShader(
+    uint vertex_id : SV_VertexID,
+    uint instance_id : SV_InstanceID,
+    Texture2D tex_pos : register(t0),
+    Texture2D tex_fwd : register(t1),
+    Texture2D<uint> tex_rows : register(t2) // texture row for each instance
+)
+{
+    uint row = tex_rows.Load(int3(instance_id, 0, 0));
+    return MakeCubeVert(vertex_id, int3(vertex_id >> 3, row, 0), tex_pos, tex_fwd);
+}
+
+// Same, but cubes come in the order given by tex_order (particle texel
+// indices, TEX_WIDTH_LOG2 bits of x). Out-of-range indices load w=0, so
+// they draw nothing.
+CubeVert RenderCubeSortedVertexShader(
+    uint vertex_id : SV_VertexID,
+    uint instance_id : SV_InstanceID,
+    Texture2D tex_pos : register(t0),
+    Texture2D tex_fwd : register(t1),
+    Texture2D<uint> tex_order : register(t2)
+)
+{
+    uint index = tex_order.Load(int3(vertex_id >> 3, instance_id, 0));
+    int3 fetch_coord = int3(index & ((1 << TEX_WIDTH_LOG2) - 1), index >> TEX_WIDTH_LOG2, 0);
+    return MakeCubeVert(vertex_id, fetch_coord, tex_pos, tex_fwd);
+}
+
 float4 RenderCubePixelShader(
     CubeVert v
 ) : SV_Target
@@ -0,0 +1,972 @@
+#include "softrast.h"
+#include "parallel.h"
+#include "util.h"
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__AVX2__)
+#define SOFTRAST_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SOFTRAST_SSE2 1
+#include <emmintrin.h>
+#endif
+
+using namespace math;
+
+static const int kTileSizeLog2 = 6;     // 64x64 pixel tiles
+static const int kTileSize = 1 << kTileSizeLog2;
+static const int kBlockSizeLog2 = 3;    // 8x8 pixel max-depth blocks
+static const int kBlocksPerRow = kTileSize >> kBlockSizeLog2;
+
+static const int kSubpixelBits = 4;
+static const int kSubpixel = 1 << kSubpixelBits;
+static const float kMaxCubeExtent = 1024.0f; // pixels; keeps the edge functions in 32 bits
+
+static const int kCubesPerTask = 1024;
+static const int kSetupBatch = 64;      // cubes whose frames are built together (SoA)
+
+#if defined(SOFTRAST_AVX2)
+static const int kLanes = 8;
+#elif defined(SOFTRAST_SSE2)
+static const int kLanes = 4;
+#else
+static const int kLanes = 1;
+#endif
+
+// Edge functions are in 1/kSubpixel^2 pixel^2 units and >= 0 inside
+// (with the fill rule bias applied); triangles have a 4th edge that's 0
+// everywhere. Depth is a plane in pixels.
+struct poly_setup {
+    int x0, y0, x1, y1;         // covered pixel bounds, x1/y1 exclusive
+    int e[4];                   // edge functions at pixel center (x0, y0)
+    int dedx[4], dedy[4];       // per pixel steps
+    float z, dzdx, dzdy;        // depth at pixel center (x0, y0) and per pixel steps
+    uint32_t color;
+};
+
+struct cube_setup {
+    int first_poly;
+    int num_polys;
+    int x0, y0, x1, y1;         // union of the polygon bounds
+    float zmin;
+};
+
+// One parallel range of cubes: their setup and which tiles they touch.
+struct softrast_task {
+    std::vector<poly_setup> polys; // only grows; the first num_polys are this draw's
+    int num_polys;
+    std::vector<cube_setup> cubes;
+    std::vector<std::vector<uint32_t> > bins; // per tile, indices into cubes
+    uint64_t cubes_dropped;
+
+    // Room for n more polygons, at polys[num_polys].
+    poly_setup* alloc_polys(int n)
+    {
+        if (polys.size() < (size_t)(num_polys + n))
+            polys.resize(std::max(polys.size() * 2, (size_t)(num_polys + n)));
+        return &polys[num_polys];
+    }
+};
+
+struct softrast_tile_stats {
+    uint64_t hiz_culled;
+    uint64_t pixels_covered;
+    uint64_t pixels_passed;
+};
+
+struct softrast {
+    std::vector<softrast_task> tasks;
+    std::vector<softrast_tile_stats> tile_stats;
+};
+
+// What the setup and raster passes of one draw share.
+struct draw_state {
+    softrast_target const* target;
+    softrast_cube_source const* src;
+    softrast_cube_consts const* consts;
+    softrast_cube_mesh const* mesh;
+    int clip_x0, clip_y0, clip_x1, clip_y1; // viewport and target, in pixels
+    int tiles_x, tiles_y;
+};
+
+softrast* softrast_create()
+{
+    return new softrast;
+}
+
+void softrast_destroy(softrast* rast)
+{
+    delete rast;
+}
+
+// Cube space position of corner k: +-1 along each axis by its bits (x = bit 0).
+static int corner_pos(int k, int axis)
+{
+    return ((k >> axis) & 1) ? 1 : -1;
+}
+
+// cross(p1 - p0, p2 - p1) of three corners in cube space.
+static void corner_cross(int c0, int c1, int c2, int n[3])
+{
+    int e1[3], e2[3];
+    for (int axis = 0; axis < 3; axis++) {
+        e1[axis] = corner_pos(c1, axis) - corner_pos(c0, axis);
+        e2[axis] = corner_pos(c2, axis) - corner_pos(c1, axis);
+    }
+
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+// Merges triangle pairs that share an edge and have the same normal into
+// quads, if the quad is convex. Triangles are in mesh->corners.
+static void merge_quads(softrast_cube_mesh* mesh)
+{
+    bool merged[SOFTRAST_MAX_CUBE_TRIS] = {};
+    int num_polys = 0;
+
+    for (int t = 0; t < mesh->num_tris; t++) {
+        if (merged[t])
+            continue;
+
+        unsigned char const* tri = mesh->corners[t];
+        unsigned char poly[4] = { tri[0], tri[1], tri[2], 0 };
+        int num_corners = 3;
+
+        for (int u = t + 1; u < mesh->num_tris && num_corners == 3; u++) {
+            if (merged[u] || memcmp(mesh->normals[t], mesh->normals[u], 3) != 0)
+                continue;
+
+            // u has edge a->b of t the other way around: quad is b, c, a, (u's third corner)
+            unsigned char const* other = mesh->corners[u];
+            for (int i = 0; i < 3 && num_corners == 3; i++) {
+                int a = tri[i], b = tri[(i + 1) % 3], c = tri[(i + 2) % 3];
+                for (int j = 0; j < 3; j++) {
+                    if (other[j] != b || other[(j + 1) % 3] != a)
+                        continue;
+
+                    unsigned char quad[4] = { (unsigned char)b, (unsigned char)c, (unsigned char)a, other[(j + 2) % 3] };
+                    bool convex = true;
+                    for (int k = 0; k < 4; k++) {
+                        int n[3];
+                        corner_cross(quad[k], quad[(k + 1) & 3], quad[(k + 2) & 3], n);
+                        convex &= n[0] * mesh->normals[t][0] + n[1] * mesh->normals[t][1] + n[2] * mesh->normals[t][2] > 0;
+                    }
+                    if (convex) {
+                        memcpy(poly, quad, 4);
+                        num_corners = 4;
+                        merged[u] = true;
+                    }
+                    break;
+                }
+            }
+        }
+
+        // num_polys <= t, so this doesn't overwrite triangles still to come
+        signed char normal[3];
+        memcpy(normal, mesh->normals[t], 3);
+        memcpy(mesh->corners[num_polys], poly, 4);
+        memcpy(mesh->normals[num_polys], normal, 3);
+        mesh->num_corners[num_polys] = (unsigned char)num_corners;
+        num_polys++;
+    }
+
+    mesh->num_polys = num_polys;
+}
+
+bool softrast_cube_mesh_from_strips(softrast_cube_mesh* mesh, uint16_t const* inds, int count)
+{
+    mesh->cubes_per_instance = 0;
+    mesh->num_tris = 0;
+    mesh->num_polys = 0;
+
+    int strip_len = 0;
+    int prev[2] = { 0, 0 };
+    int num_tris = 0; // over all cubes
+
+    for (int i = 0; i < count; i++) {
+        int v = inds[i];
+        if (v == 0xffff) {
+            strip_len = 0;
+            continue;
+        }
+
+        if (strip_len >= 2) {
+            // odd triangles of a strip are flipped to keep the winding
+            int tri[3] = { prev[0], prev[1], v };
+            if (strip_len & 1)
+                std::swap(tri[0], tri[1]);
+
+            if (tri[0] != tri[1] && tri[1] != tri[2] && tri[0] != tri[2]) {
+                int cube = tri[0] >> 3;
+                if ((tri[1] >> 3) != cube || (tri[2] >> 3) != cube)
+                    return false;
+
+                if (cube == 0) {
+                    if (mesh->num_tris == SOFTRAST_MAX_CUBE_TRIS)
+                        return false;
+
+                    int t = mesh->num_tris++;
+                    int n[3];
+                    corner_cross(tri[0], tri[1], tri[2], n);
+                    for (int j = 0; j < 3; j++) {
+                        mesh->corners[t][j] = (unsigned char)tri[j];
+                        mesh->normals[t][j] = (signed char)n[j];
+                    }
+                } else {
+                    // must repeat cube 0's triangles, in order
+                    int t = num_tris - cube * mesh->num_tris;
+                    if (t < 0 || t >= mesh->num_tris)
+                        return false;
+                    for (int j = 0; j < 3; j++) {
+                        if (mesh->corners[t][j] != (tri[j] & 7))
+                            return false;
+                    }
+                }
+
+                num_tris++;
+                mesh->cubes_per_instance = std::max(mesh->cubes_per_instance, cube + 1);
+            }
+        }
+
+        prev[0] = prev[1];
+        prev[1] = v;
+        strip_len++;
+    }
+
+    if (num_tris != mesh->cubes_per_instance * mesh->num_tris)
+        return false;
+
+    merge_quads(mesh);
+    return true;
+}
+
+// Texel coordinate of cube c in instance i, like the vertex shaders'
+// Loads. Returns false for cubes that come out w=0 (out of range).
+static bool fetch_coord(softrast_cube_source const& src, int inst, int c, int* x, int* y)
+{
+    if (src.fetch == SOFTRAST_FETCH_ROWS) {
+        *x = c;
+        *y = (inst < src.inst_width) ? (int)src.inst[inst] : 0;
+    } else {
+        unsigned int index = (c < src.inst_width && inst < src.inst_height) ? src.inst[inst * src.inst_width + c] : 0;
+        *x = (int)(index & ((1u << SOFTRAST_TEX_WIDTH_LOG2) - 1));
+        *y = (int)(index >> SOFTRAST_TEX_WIDTH_LOG2);
+    }
+
+    return *x < src.tex_width && *y < src.tex_height;
+}
+
+#if defined(SOFTRAST_AVX2) || defined(SOFTRAST_SSE2)
+static int popcount8(int x)
+{
+    x = x - ((x >> 1) & 0x55);
+    x = (x & 0x33) + ((x >> 2) & 0x33);
+    return (x + (x >> 4)) & 0x0f;
+}
+#endif
+
+// First pixel whose center is at or right of fixed-point coordinate v.
+static int first_pixel(int v)
+{
+    return (v - kSubpixel / 2 + kSubpixel - 1) >> kSubpixelBits;
+}
+
+// Sign of x_axis, y_axis and z_axis in each cube corner.
+static const float kCornerSign[3][8] = {
+    { -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f, -1.0f, 1.0f },
+    { -1.0f, -1.0f, 1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f },
+    { -1.0f, -1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f, 1.0f },
+};
+
+#if defined(SOFTRAST_AVX2) || defined(SOFTRAST_SSE2)
+static float hmin(__m128 v)
+{
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(v);
+}
+#endif
+
+static float saturate(float x)
+{
+    return std::min(std::max(x, 0.0f), 1.0f);
+}
+
+// A cube's local coordinate system (same as MakeCubeVert, axes scaled to
+// the cube's size) and its center and axes in clip space; corner k is
+// center +-x_axis +-y_axis +-z_axis.
+struct cube_frame {
+    vec3 axes[3];
+    vec4 clip_center;
+    vec4 clip_axes[3];
+};
+
+// Expands, projects and culls one cube and sets up its polygons. Returns
+// false if nothing of it is visible.
+static bool setup_cube(draw_state const& d, softrast_task* task, cube_frame const& frame)
+{
+    softrast_target const& target = *d.target;
+    softrast_cube_consts const& consts = *d.consts;
+    softrast_cube_mesh const& mesh = *d.mesh;
+
+    vec3 const& x_axis = frame.axes[0];
+    vec3 const& y_axis = frame.axes[1];
+    vec3 const& z_axis = frame.axes[2];
+    vec4 const& clip_center = frame.clip_center;
+    vec4 const* clip_axes = frame.clip_axes;
+
+    float hw = 0.5f * target.vp_w, hh = 0.5f * target.vp_h;
+    float sx[8], sy[8], sz[8];
+    int px[8], py[8];
+    float min_sx, max_sx, min_sy, max_sy, zmin;
+
+#if defined(SOFTRAST_AVX2) || defined(SOFTRAST_SSE2)
+    // two halves of 4 corners
+    __m128 clip[2][4];
+    int all_out = 0xff, any_out = 0; // per plane, bits for the 8 corners
+    for (int h = 0; h < 2; h++) {
+        for (int i = 0; i < 4; i++) {
+            __m128 v = _mm_set1_ps(clip_center[i]);
+            for (int axis = 0; axis < 3; axis++)
+                v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(kCornerSign[axis] + h * 4), _mm_set1_ps(clip_axes[axis][i])));
+            clip[h][i] = v;
+        }
+
+        __m128 x = clip[h][0], y = clip[h][1], z = clip[h][2], w = clip[h][3];
+        __m128 neg_w = _mm_sub_ps(_mm_setzero_ps(), w);
+        int out[6] = {
+            _mm_movemask_ps(_mm_cmplt_ps(x, neg_w)),
+            _mm_movemask_ps(_mm_cmpgt_ps(x, w)),
+            _mm_movemask_ps(_mm_cmplt_ps(y, neg_w)),
+            _mm_movemask_ps(_mm_cmpgt_ps(y, w)),
+            _mm_movemask_ps(_mm_cmplt_ps(z, _mm_setzero_ps())),
+            _mm_movemask_ps(_mm_cmpgt_ps(z, w)),
+        };
+        for (int plane = 0; plane < 6; plane++) {
+            if (out[plane] != 15)
+                all_out &= ~(1 << plane);
+            if (out[plane])
+                any_out |= 1 << plane;
+        }
+    }
+#else
+    float clip[4][8];
+    int all_out = 0x3f, any_out = 0;
+    for (int k = 0; k < 8; k++) {
+        for (int i = 0; i < 4; i++)
+            clip[i][k] = clip_center[i] + kCornerSign[0][k] * clip_axes[0][i] + kCornerSign[1][k] * clip_axes[1][i] + kCornerSign[2][k] * clip_axes[2][i];
+
+        float x = clip[0][k], y = clip[1][k], z = clip[2][k], w = clip[3][k];
+        int out = (x < -w) | ((x > w) << 1) | ((y < -w) << 2) | ((y > w) << 3) | ((z < 0.0f) << 4) | ((z > w) << 5);
+        all_out &= out;
+        any_out |= out;
+    }
+#endif
+
+    if (all_out & 0x3f)
+        return false;
+
+    // no clipping; see softrast.h
+    if (any_out & 0x30) {
+        task->cubes_dropped++;
+        return false;
+    }
+
+    // project; w > 0 now
+#if defined(SOFTRAST_AVX2) || defined(SOFTRAST_SSE2)
+    __m128 vmin_sx = _mm_set1_ps(FLT_MAX), vmax_sx = _mm_set1_ps(-FLT_MAX);
+    __m128 vmin_sy = vmin_sx, vmax_sy = vmax_sx, vmin_sz = vmin_sx;
+    for (int h = 0; h < 2; h++) {
+        __m128 inv_w = _mm_div_ps(_mm_set1_ps(1.0f), clip[h][3]);
+        __m128 vsx = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(clip[h][0], inv_w), _mm_set1_ps(hw)), _mm_set1_ps(target.vp_x + hw));
+        __m128 vsy = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(clip[h][1], inv_w), _mm_set1_ps(-hh)), _mm_set1_ps(target.vp_y + hh));
+        __m128 vsz = _mm_mul_ps(clip[h][2], inv_w);
+        _mm_storeu_ps(sx + h * 4, vsx);
+        _mm_storeu_ps(sy + h * 4, vsy);
+        _mm_storeu_ps(sz + h * 4, vsz);
+        vmin_sx = _mm_min_ps(vmin_sx, vsx);
+        vmax_sx = _mm_max_ps(vmax_sx, vsx);
+        vmin_sy = _mm_min_ps(vmin_sy, vsy);
+        vmax_sy = _mm_max_ps(vmax_sy, vsy);
+        vmin_sz = _mm_min_ps(vmin_sz, vsz);
+    }
+    min_sx = hmin(vmin_sx);
+    max_sx = -hmin(_mm_sub_ps(_mm_setzero_ps(), vmax_sx));
+    min_sy = hmin(vmin_sy);
+    max_sy = -hmin(_mm_sub_ps(_mm_setzero_ps(), vmax_sy));
+    zmin = hmin(vmin_sz);
+#else
+    min_sx = min_sy = zmin = FLT_MAX;
+    max_sx = max_sy = -FLT_MAX;
+    for (int k = 0; k < 8; k++) {
+        float inv_w = 1.0f / clip[3][k];
+        sx[k] = clip[0][k] * inv_w * hw + (target.vp_x + hw);
+        sy[k] = clip[1][k] * inv_w * -hh + (target.vp_y + hh);
+        sz[k] = clip[2][k] * inv_w;
+        min_sx = std::min(min_sx, sx[k]);
+        max_sx = std::max(max_sx, sx[k]);
+        min_sy = std::min(min_sy, sy[k]);
+        max_sy = std::max(max_sy, sy[k]);
+        zmin = std::min(zmin, sz[k]);
+    }
+#endif
+
+    if (max_sx - min_sx > kMaxCubeExtent || max_sy - min_sy > kMaxCubeExtent) {
+        task->cubes_dropped++;
+        return false;
+    }
+
+    // Not culled, so within kMaxCubeExtent of the viewport: fits in fixed
+    // point. Cubes that don't cover any pixel centers are done here.
+    int min_px = (int)floorf(min_sx * kSubpixel + 0.5f), max_px = (int)floorf(max_sx * kSubpixel + 0.5f);
+    int min_py = (int)floorf(min_sy * kSubpixel + 0.5f), max_py = (int)floorf(max_sy * kSubpixel + 0.5f);
+    if (std::max(first_pixel(min_px), d.clip_x0) >= std::min(first_pixel(max_px + 1), d.clip_x1)
+        || std::max(first_pixel(min_py), d.clip_y0) >= std::min(first_pixel(max_py + 1), d.clip_y1))
+        return false;
+
+    for (int k = 0; k < 8; k++) {
+        px[k] = (int)floorf(sx[k] * kSubpixel + 0.5f);
+        py[k] = (int)floorf(sy[k] * kSubpixel + 0.5f);
+    }
+
+    // the polygon normals are combinations of these (see softrast_cube_mesh)
+    vec3 axis_cross[3] = { cross(y_axis, z_axis), cross(z_axis, x_axis), cross(x_axis, y_axis) };
+
+    cube_setup cube;
+    cube.first_poly = task->num_polys;
+    cube.num_polys = 0;
+    cube.x0 = d.clip_x1;
+    cube.y0 = d.clip_y1;
+    cube.x1 = d.clip_x0;
+    cube.y1 = d.clip_y0;
+    cube.zmin = zmin;
+
+    float colors[SOFTRAST_MAX_CUBE_POLYS][4];
+    poly_setup* polys = task->alloc_polys(mesh.num_polys);
+
+    for (int t = 0; t < mesh.num_polys; t++) {
+        int n = mesh.num_corners[t];
+        int corner[4];
+        for (int i = 0; i < n; i++)
+            corner[i] = mesh.corners[t][i];
+
+        // twice the signed area, as a fan around corner 0 (small numbers)
+        int area = 0;
+        for (int i = 1; i < n - 1; i++) {
+            int a = corner[0], b = corner[i], c = corner[i + 1];
+            area += (px[b] - px[a]) * (py[c] - py[a]) - (px[c] - px[a]) * (py[b] - py[a]);
+        }
+        if (area == 0)
+            continue;
+
+        // y points down, so counterclockwise on screen is negative area
+        bool front = (area < 0) == target.front_ccw;
+        if ((target.cull == SOFTRAST_CULL_BACK && !front) || (target.cull == SOFTRAST_CULL_FRONT && front))
+            continue;
+
+        // rasterize with positive area
+        if (area < 0) {
+            for (int i = 1; i < n - i; i++)
+                std::swap(corner[i], corner[n - i]);
+        }
+
+        int vx[4], vy[4];
+        int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+        for (int i = 0; i < n; i++) {
+            vx[i] = px[corner[i]];
+            vy[i] = py[corner[i]];
+            min_x = std::min(min_x, vx[i]);
+            min_y = std::min(min_y, vy[i]);
+            max_x = std::max(max_x, vx[i]);
+            max_y = std::max(max_y, vy[i]);
+        }
+
+        poly_setup* poly = &polys[cube.num_polys];
+        poly->x0 = std::max(first_pixel(min_x), d.clip_x0);
+        poly->y0 = std::max(first_pixel(min_y), d.clip_y0);
+        poly->x1 = std::min(first_pixel(max_x + 1), d.clip_x1);
+        poly->y1 = std::min(first_pixel(max_y + 1), d.clip_y1);
+        if (poly->x0 >= poly->x1 || poly->y0 >= poly->y1)
+            continue;
+
+        // RenderCubePixelShader: cross(ddy(world_pos), ddx(world_pos)) is the
+        // plane normal, pointing the way -cross(e1, e2) * area does.
+        signed char const* cn = mesh.normals[t];
+        vec3 normal = (float)cn[0] * axis_cross[0] + (float)cn[1] * axis_cross[1] + (float)cn[2] * axis_cross[2];
+        if (area > 0)
+            normal = -normal;
+        float normal_len_sq = dot(normal, normal);
+        float NdotL = (normal_len_sq > 0.0f) ? dot(normal, consts.light_dir) / sqrtf(normal_len_sq) : 0.0f;
+
+        vec3 lit = consts.light_color_ambient
+            + saturate(NdotL) * consts.light_color_key
+            + (1.0f - fabsf(NdotL)) * consts.light_color_fill
+            + saturate(-NdotL) * consts.light_color_back;
+        float* color = colors[cube.num_polys];
+        color[0] = lit.x;
+        color[1] = lit.y;
+        color[2] = lit.z;
+        color[3] = 1.0f;
+
+        int center_x = (poly->x0 << kSubpixelBits) + kSubpixel / 2;
+        int center_y = (poly->y0 << kSubpixelBits) + kSubpixel / 2;
+        for (int i = 0; i < n; i++) {
+            int j = (i == n - 1) ? 0 : i + 1;
+            int dx = vx[j] - vx[i];
+            int dy = vy[j] - vy[i];
+
+            // top-left rule: pixel centers on the edge belong to left and top edges
+            bool top_left = dy < 0 || (dy == 0 && dx > 0);
+            poly->e[i] = dx * (center_y - vy[i]) - dy * (center_x - vx[i]) - (top_left ? 0 : 1);
+            poly->dedx[i] = -dy * kSubpixel;
+            poly->dedy[i] = dx * kSubpixel;
+        }
+        if (n == 3) {
+            poly->e[3] = 0;
+            poly->dedx[3] = 0;
+            poly->dedy[3] = 0;
+        }
+
+        // depth plane through corners 0, k-1, k; whichever half of a quad is bigger
+        int k = 2;
+        if (n == 4) {
+            int area0 = (vx[1] - vx[0]) * (vy[2] - vy[0]) - (vx[2] - vx[0]) * (vy[1] - vy[0]);
+            int area1 = (vx[2] - vx[0]) * (vy[3] - vy[0]) - (vx[3] - vx[0]) * (vy[2] - vy[0]);
+            if (abs(area1) > abs(area0))
+                k = 3;
+        }
+        float scale = 1.0f / kSubpixel;
+        float ax = vx[0] * scale, ay = vy[0] * scale, az = sz[corner[0]];
+        float bx = vx[k - 1] * scale - ax, by = vy[k - 1] * scale - ay, bz = sz[corner[k - 1]] - az;
+        float cx = vx[k] * scale - ax, cy = vy[k] * scale - ay, cz = sz[corner[k]] - az;
+        float inv_area = 1.0f / (bx * cy - cx * by);
+        poly->dzdx = (bz * cy - by * cz) * inv_area;
+        poly->dzdy = (bx * cz - bz * cx) * inv_area;
+        poly->z = az + poly->dzdx * (poly->x0 + 0.5f - ax) + poly->dzdy * (poly->y0 + 0.5f - ay);
+
+        cube.x0 = std::min(cube.x0, poly->x0);
+        cube.y0 = std::min(cube.y0, poly->y0);
+        cube.x1 = std::max(cube.x1, poly->x1);
+        cube.y1 = std::max(cube.y1, poly->y1);
+        cube.num_polys++;
+    }
+
+    if (!cube.num_polys)
+        return false;
+    task->num_polys += cube.num_polys;
+
+    // the render target is sRGB
+    uint32_t srgb[SOFTRAST_MAX_CUBE_POLYS];
+    linear_to_srgb8_row((unsigned char*)srgb, colors[0], cube.num_polys);
+    for (int t = 0; t < cube.num_polys; t++)
+        polys[t].color = srgb[t];
+
+    uint32_t index = (uint32_t)task->cubes.size();
+    task->cubes.push_back(cube);
+
+    for (int ty = cube.y0 >> kTileSizeLog2; ty <= (cube.y1 - 1) >> kTileSizeLog2; ty++) {
+        for (int tx = cube.x0 >> kTileSizeLog2; tx <= (cube.x1 - 1) >> kTileSizeLog2; tx++)
+            task->bins[ty * d.tiles_x + tx].push_back(index);
+    }
+
+    return true;
+}
+
+static void setup_cubes(draw_state const& d, softrast_task* task, int begin, int end)
+{
+    softrast_cube_source const& src = *d.src;
+    softrast_cube_consts const& consts = *d.consts;
+    int cubes_per_instance = d.mesh->cubes_per_instance;
+
+    // axes are directions: no translation
+    mat44 clip_from_world_dir = consts.clip_from_world;
+    clip_from_world_dir.w = vec4(0.0f);
+
+    float down[3][kSetupBatch];
+    for (int c = 0; c < 3; c++)
+        std::fill(down[c], down[c] + kSetupBatch, consts.world_down_vector[c]);
+
+    // the live cubes of the range, kSetupBatch at a time, as SoA
+    float center[3][kSetupBatch], size[kSetupBatch];
+    float axes[3][3][kSetupBatch]; // axis, component
+    float clip_center[4][kSetupBatch], clip_axes[3][4][kSetupBatch];
+
+    int i = begin;
+    while (i < end) {
+        int n = 0;
+        for (; i < end && n < kSetupBatch; i++) {
+            int x, y;
+            if (!fetch_coord(src, i / cubes_per_instance, i % cubes_per_instance, &x, &y))
+                continue;
+
+            vec4 const& pos = src.pos[y * src.tex_width + x];
+            if (pos.w == 0.0f) // cube is off
+                continue;
+
+            vec4 const& fwd = src.fwd[y * src.tex_width + x];
+            for (int c = 0; c < 3; c++) {
+                center[c][n] = pos[c];
+                axes[0][c][n] = fwd[c];
+            }
+            size[n] = pos.w;
+            n++;
+        }
+
+        // same as MakeCubeVert: z = normalize(cross(x, down)), y = normalize(cross(z, x))
+        cross_batch(axes[0][0], axes[0][1], axes[0][2], down[0], down[1], down[2], axes[2][0], axes[2][1], axes[2][2], n);
+        normalize_batch(axes[2][0], axes[2][1], axes[2][2], n);
+        cross_batch(axes[2][0], axes[2][1], axes[2][2], axes[0][0], axes[0][1], axes[0][2], axes[1][0], axes[1][1], axes[1][2], n);
+        normalize_batch(axes[1][0], axes[1][1], axes[1][2], n);
+        for (int axis = 1; axis < 3; axis++) {
+            for (int c = 0; c < 3; c++) {
+                for (int k = 0; k < n; k++)
+                    axes[axis][c][k] *= size[k];
+            }
+        }
+
+        transform_points(consts.clip_from_world, center[0], center[1], center[2],
+            clip_center[0], clip_center[1], clip_center[2], clip_center[3], n);
+        for (int axis = 0; axis < 3; axis++) {
+            transform_points(clip_from_world_dir, axes[axis][0], axes[axis][1], axes[axis][2],
+                clip_axes[axis][0], clip_axes[axis][1], clip_axes[axis][2], clip_axes[axis][3], n);
+        }
+
+        for (int k = 0; k < n; k++) {
+            cube_frame frame;
+            for (int axis = 0; axis < 3; axis++) {
+                frame.axes[axis] = vec3(axes[axis][0][k], axes[axis][1][k], axes[axis][2][k]);
+                frame.clip_axes[axis] = vec4(clip_axes[axis][0][k], clip_axes[axis][1][k], clip_axes[axis][2][k], clip_axes[axis][3][k]);
+            }
+            frame.clip_center = vec4(clip_center[0][k], clip_center[1][k], clip_center[2][k], clip_center[3][k]);
+            setup_cube(d, task, frame);
+        }
+    }
+}
+
+// Rasterizes the part of poly within [x0,x1) x [y0,y1). The spans start at
+// multiples of kLanes so they never cross into the next tile. Returns the
+// number of pixels that passed the depth test and adds the number it
+// covered (before the depth test) to *covered.
+static int raster_poly(draw_state const& d, poly_setup const& poly, int x0, int y0, int x1, int y1, uint64_t* covered)
+{
+    softrast_target const& target = *d.target;
+
+    x0 = std::max(x0, poly.x0);
+    y0 = std::max(y0, poly.y0);
+    x1 = std::min(x1, poly.x1);
+    y1 = std::min(y1, poly.y1);
+    if (x0 >= x1 || y0 >= y1)
+        return 0;
+
+    int span_x0 = x0 & ~(kLanes - 1);
+    int e_row[4];
+    for (int i = 0; i < 4; i++)
+        e_row[i] = poly.e[i] + (span_x0 - poly.x0) * poly.dedx[i] + (y0 - poly.y0) * poly.dedy[i];
+    float z_row = poly.z + (span_x0 - poly.x0) * poly.dzdx + (y0 - poly.y0) * poly.dzdy;
+
+    int passed = 0, inside_count = 0;
+
+#if defined(SOFTRAST_AVX2)
+    __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i e_lane[4], e_step[4];
+    for (int i = 0; i < 4; i++) {
+        e_lane[i] = _mm256_mullo_epi32(lane, _mm256_set1_epi32(poly.dedx[i]));
+        e_step[i] = _mm256_set1_epi32(poly.dedx[i] * kLanes);
+    }
+    __m256 z_lane = _mm256_mul_ps(_mm256_cvtepi32_ps(lane), _mm256_set1_ps(poly.dzdx));
+    __m256 z_step = _mm256_set1_ps(poly.dzdx * kLanes);
+    __m256i color = _mm256_set1_epi32((int)poly.color);
+    __m256i lane_x0 = _mm256_set1_epi32(x0 - span_x0 - 1);
+    __m256i lane_x1 = _mm256_set1_epi32(x1 - span_x0);
+#elif defined(SOFTRAST_SSE2)
+    __m128i e_lane[4], e_step[4];
+    for (int i = 0; i < 4; i++) {
+        e_lane[i] = _mm_setr_epi32(0, poly.dedx[i], poly.dedx[i] * 2, poly.dedx[i] * 3);
+        e_step[i] = _mm_set1_epi32(poly.dedx[i] * kLanes);
+    }
+    __m128 z_lane = _mm_mul_ps(_mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f), _mm_set1_ps(poly.dzdx));
+    __m128 z_step = _mm_set1_ps(poly.dzdx * kLanes);
+    __m128i color = _mm_set1_epi32((int)poly.color);
+    __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i lane_x0 = _mm_set1_epi32(x0 - span_x0 - 1);
+    __m128i lane_x1 = _mm_set1_epi32(x1 - span_x0);
+#endif
+
+    for (int y = y0; y < y1; y++) {
+        uint32_t* color_row = (uint32_t*)((char*)target.color + (size_t)y * target.color_pitch);
+        float* depth_row = (float*)((char*)target.depth + (size_t)y * target.depth_pitch);
+
+#if defined(SOFTRAST_AVX2)
+        __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(e_row[0]), e_lane[0]);
+        __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(e_row[1]), e_lane[1]);
+        __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(e_row[2]), e_lane[2]);
+        __m256i e3 = _mm256_add_epi32(_mm256_set1_epi32(e_row[3]), e_lane[3]);
+        __m256 z = _mm256_add_ps(_mm256_set1_ps(z_row), z_lane);
+        __m256i x = lane;
+
+        for (int span_x = span_x0; span_x < x1; span_x += kLanes) {
+            // inside all edges and within [x0,x1)
+            __m256i inside = _mm256_or_si256(_mm256_or_si256(e0, e1), _mm256_or_si256(e2, e3));
+            __m256i in_span = _mm256_and_si256(_mm256_cmpgt_epi32(x, lane_x0), _mm256_cmpgt_epi32(lane_x1, x));
+            __m256 mask = _mm256_castsi256_ps(_mm256_andnot_si256(_mm256_srai_epi32(inside, 31), in_span));
+
+            int inside_bits = _mm256_movemask_ps(mask);
+            if (inside_bits) {
+                inside_count += popcount8(inside_bits);
+                __m256 depth = _mm256_loadu_ps(depth_row + span_x);
+                mask = _mm256_and_ps(mask, _mm256_cmp_ps(z, depth, _CMP_LT_OQ));
+                _mm256_maskstore_ps(depth_row + span_x, _mm256_castps_si256(mask), z);
+                _mm256_maskstore_epi32((int*)color_row + span_x, _mm256_castps_si256(mask), color);
+                passed += popcount8(_mm256_movemask_ps(mask));
+            }
+
+            e0 = _mm256_add_epi32(e0, e_step[0]);
+            e1 = _mm256_add_epi32(e1, e_step[1]);
+            e2 = _mm256_add_epi32(e2, e_step[2]);
+            e3 = _mm256_add_epi32(e3, e_step[3]);
+            z = _mm256_add_ps(z, z_step);
+            x = _mm256_add_epi32(x, _mm256_set1_epi32(kLanes));
+        }
+#elif defined(SOFTRAST_SSE2)
+        __m128i e0 = _mm_add_epi32(_mm_set1_epi32(e_row[0]), e_lane[0]);
+        __m128i e1 = _mm_add_epi32(_mm_set1_epi32(e_row[1]), e_lane[1]);
+        __m128i e2 = _mm_add_epi32(_mm_set1_epi32(e_row[2]), e_lane[2]);
+        __m128i e3 = _mm_add_epi32(_mm_set1_epi32(e_row[3]), e_lane[3]);
+        __m128 z = _mm_add_ps(_mm_set1_ps(z_row), z_lane);
+        __m128i x = lane;
+
+        for (int span_x = span_x0; span_x < x1; span_x += kLanes) {
+            // inside all edges and within [x0,x1)
+            __m128i inside = _mm_or_si128(_mm_or_si128(e0, e1), _mm_or_si128(e2, e3));
+            __m128i in_span = _mm_and_si128(_mm_cmpgt_epi32(x, lane_x0), _mm_cmplt_epi32(x, lane_x1));
+            __m128 mask = _mm_castsi128_ps(_mm_andnot_si128(_mm_srai_epi32(inside, 31), in_span));
+
+            int inside_bits = _mm_movemask_ps(mask);
+            if (inside_bits) {
+                inside_count += popcount8(inside_bits);
+                __m128 depth = _mm_loadu_ps(depth_row + span_x);
+                mask = _mm_and_ps(mask, _mm_cmplt_ps(z, depth));
+                int bits = _mm_movemask_ps(mask);
+                if (bits) {
+                    __m128i maski = _mm_castps_si128(mask);
+                    __m128i old_color = _mm_loadu_si128((__m128i const*)(color_row + span_x));
+                    _mm_storeu_ps(depth_row + span_x, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, depth)));
+                    _mm_storeu_si128((__m128i*)(color_row + span_x), _mm_or_si128(_mm_and_si128(maski, color), _mm_andnot_si128(maski, old_color)));
+                    passed += popcount8(bits);
+                }
+            }
+
+            e0 = _mm_add_epi32(e0, e_step[0]);
+            e1 = _mm_add_epi32(e1, e_step[1]);
+            e2 = _mm_add_epi32(e2, e_step[2]);
+            e3 = _mm_add_epi32(e3, e_step[3]);
+            z = _mm_add_ps(z, z_step);
+            x = _mm_add_epi32(x, _mm_set1_epi32(kLanes));
+        }
+#else
+        int e0 = e_row[0], e1 = e_row[1], e2 = e_row[2], e3 = e_row[3];
+        float z = z_row;
+        for (int span_x = span_x0; span_x < x1; span_x++) {
+            if ((e0 | e1 | e2 | e3) >= 0) {
+                inside_count++;
+                if (z < depth_row[span_x]) {
+                    depth_row[span_x] = z;
+                    color_row[span_x] = poly.color;
+                    passed++;
+                }
+            }
+
+            e0 += poly.dedx[0];
+            e1 += poly.dedx[1];
+            e2 += poly.dedx[2];
+            e3 += poly.dedx[3];
+            z += poly.dzdx;
+        }
+#endif
+
+        for (int i = 0; i < 4; i++)
+            e_row[i] += poly.dedy[i];
+        z_row += poly.dzdy;
+    }
+
+    *covered += inside_count;
+    return passed;
+}
+
+// Max depth of the pixels of a block within [x1,y1).
+static float block_max_depth(softrast_target const& target, int bx, int by, int x1, int y1)
+{
+    static const int kBlockSize = 1 << kBlockSizeLog2;
+    int bx1 = std::min(bx + kBlockSize, x1);
+    int by1 = std::min(by + kBlockSize, y1);
+
+#if defined(SOFTRAST_AVX2) || defined(SOFTRAST_SSE2)
+    if (bx1 - bx == kBlockSize && by1 - by == kBlockSize) {
+        __m128 zmax = _mm_setzero_ps();
+        for (int y = by; y < by1; y++) {
+            float const* depth_row = (float const*)((char const*)target.depth + (size_t)y * target.depth_pitch) + bx;
+            zmax = _mm_max_ps(zmax, _mm_max_ps(_mm_loadu_ps(depth_row), _mm_loadu_ps(depth_row + 4)));
+        }
+        zmax = _mm_max_ps(zmax, _mm_shuffle_ps(zmax, zmax, _MM_SHUFFLE(1, 0, 3, 2)));
+        zmax = _mm_max_ps(zmax, _mm_shuffle_ps(zmax, zmax, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtss_f32(zmax);
+    }
+#endif
+
+    float zmax = 0.0f;
+    for (int y = by; y < by1; y++) {
+        float const* depth_row = (float const*)((char const*)target.depth + (size_t)y * target.depth_pitch);
+        for (int x = bx; x < bx1; x++)
+            zmax = std::max(zmax, depth_row[x]);
+    }
+    return zmax;
+}
+
+static void raster_tile(softrast* rast, draw_state const& d, int tile)
+{
+    // Pixels written to a block before its max depth is worth recomputing;
+    // before that, the old max is still a valid (if loose) bound.
+    static const int kZmaxRefresh = 16;
+
+    softrast_target const& target = *d.target;
+    int tile_x0 = (tile % d.tiles_x) << kTileSizeLog2;
+    int tile_y0 = (tile / d.tiles_x) << kTileSizeLog2;
+    int tile_x1 = std::min(tile_x0 + kTileSize, target.width);
+    int tile_y1 = std::min(tile_y0 + kTileSize, target.height);
+
+    // Max depth per block, computed from the depth buffer when first needed.
+    float zmax[kBlocksPerRow * kBlocksPerRow];
+    int written[kBlocksPerRow * kBlocksPerRow];
+    for (int b = 0; b < kBlocksPerRow * kBlocksPerRow; b++)
+        written[b] = kZmaxRefresh;
+
+    softrast_tile_stats stats = { 0, 0, 0 };
+
+    for (size_t t = 0; t < rast->tasks.size(); t++) {
+        softrast_task const& task = rast->tasks[t];
+        std::vector<uint32_t> const& bin = task.bins[tile];
+
+        for (size_t i = 0; i < bin.size(); i++) {
+#if defined(SOFTRAST_AVX2) || defined(SOFTRAST_SSE2)
+            // bins point all over the task's setup; start fetching ahead
+            if (i + 4 < bin.size())
+                _mm_prefetch((char const*)&task.cubes[bin[i + 4]], _MM_HINT_T0);
+            if (i + 2 < bin.size()) {
+                cube_setup const& next = task.cubes[bin[i + 2]];
+                poly_setup const* polys = task.polys.data() + next.first_poly;
+                for (char const* p = (char const*)polys; p < (char const*)(polys + next.num_polys); p += 64)
+                    _mm_prefetch(p, _MM_HINT_T0);
+            }
+#endif
+            cube_setup const& cube = task.cubes[bin[i]];
+            int x0 = std::max(cube.x0, tile_x0), y0 = std::max(cube.y0, tile_y0);
+            int x1 = std::min(cube.x1, tile_x1), y1 = std::min(cube.y1, tile_y1);
+
+            int bx0 = (x0 - tile_x0) >> kBlockSizeLog2, bx1 = (x1 - 1 - tile_x0) >> kBlockSizeLog2;
+            int by0 = (y0 - tile_y0) >> kBlockSizeLog2, by1 = (y1 - 1 - tile_y0) >> kBlockSizeLog2;
+            bool visible = false;
+            for (int by = by0; by <= by1; by++) {
+                for (int bx = bx0; bx <= bx1; bx++) {
+                    int b = by * kBlocksPerRow + bx;
+                    if (written[b] >= kZmaxRefresh) {
+                        zmax[b] = block_max_depth(target, tile_x0 + (bx << kBlockSizeLog2), tile_y0 + (by << kBlockSizeLog2), tile_x1, tile_y1);
+                        written[b] = 0;
+                    }
+                    visible |= cube.zmin < zmax[b];
+                }
+            }
+
+            if (!visible) {
+                stats.hiz_culled++;
+                continue;
+            }
+
+            int passed = 0;
+            for (int j = 0; j < cube.num_polys; j++)
+                passed += raster_poly(d, task.polys[cube.first_poly + j], x0, y0, x1, y1, &stats.pixels_covered);
+
+            if (passed) {
+                // don't know which blocks they went to; counting them in all is conservative
+                for (int by = by0; by <= by1; by++) {
+                    for (int bx = bx0; bx <= bx1; bx++)
+                        written[by * kBlocksPerRow + bx] += passed;
+                }
+                stats.pixels_passed += passed;
+            }
+        }
+    }
+
+    rast->tile_stats[tile] = stats;
+}
+
+void softrast_draw_cubes(softrast* rast, softrast_target const& target, softrast_cube_source const& src,
+    softrast_cube_consts const& consts, softrast_cube_mesh const& mesh, int num_instances, softrast_stats* stats)
+{
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+
+    draw_state d;
+    d.target = &target;
+    d.src = &src;
+    d.consts = &consts;
+    d.mesh = &mesh;
+    d.clip_x0 = std::max((int)ceilf(target.vp_x), 0);
+    d.clip_y0 = std::max((int)ceilf(target.vp_y), 0);
+    d.clip_x1 = std::min((int)floorf(target.vp_x + target.vp_w), target.width);
+    d.clip_y1 = std::min((int)floorf(target.vp_y + target.vp_h), target.height);
+    d.tiles_x = (target.width + kTileSize - 1) >> kTileSizeLog2;
+    d.tiles_y = (target.height + kTileSize - 1) >> kTileSizeLog2;
+
+    int num_cubes = num_instances * mesh.cubes_per_instance;
+    if (num_cubes <= 0 || mesh.num_polys == 0 || d.clip_x0 >= d.clip_x1 || d.clip_y0 >= d.clip_y1)
+        return;
+
+    // Spans are read and written kLanes pixels at a time.
+    if (target.width % kLanes)
+        panic("softrast: render target width must be a multiple of %d\n", kLanes);
+
+    int num_tasks = (num_cubes + kCubesPerTask - 1) / kCubesPerTask;
+    int num_tiles = d.tiles_x * d.tiles_y;
+    rast->tasks.resize(num_tasks);
+    rast->tile_stats.resize(num_tiles);
+
+    parallel_for(num_tasks, 1, [&](int begin, int end) {
+        for (int t = begin; t < end; t++) {
+            softrast_task* task = &rast->tasks[t];
+            task->num_polys = 0;
+            task->cubes.clear();
+            task->bins.resize(num_tiles);
+            for (int i = 0; i < num_tiles; i++)
+                task->bins[i].clear();
+            task->cubes_dropped = 0;
+
+            setup_cubes(d, task, t * kCubesPerTask, std::min((t + 1) * kCubesPerTask, num_cubes));
+        }
+    });
+
+    parallel_for(num_tiles, 1, [&](int begin, int end) {
+        for (int tile = begin; tile < end; tile++)
+            raster_tile(rast, d, tile);
+    });
+
+    if (stats) {
+        for (int t = 0; t < num_tasks; t++) {
+            stats->cubes_drawn += rast->tasks[t].cubes.size();
+            stats->cubes_dropped += rast->tasks[t].cubes_dropped;
+            stats->polys += rast->tasks[t].num_polys;
+        }
+        for (int i = 0; i < num_tiles; i++) {
+            stats->cubes_hiz_culled += rast->tile_stats[i].hiz_culled;
+            stats->pixels_covered += rast->tile_stats[i].pixels_covered;
+            stats->pixels_passed += rast->tile_stats[i].pixels_passed;
+        }
+    }
+}
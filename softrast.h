@@ -0,0 +1,124 @@
+#ifndef SOFTRAST_H
+#define SOFTRAST_H
+
+#include "math.h"
+#include <stdint.h>
+
+// Software rasterizer for the cube pass, so headless builds (see
+// d3du_null.h) can produce actual frames. Does the work of
+// RenderCubeVertexShader / RenderCubeSortedVertexShader and
+// RenderCubePixelShader in shaders.hlsl, drawn with the strip index buffer
+// from make_cube_inds in main.cpp.
+//
+// Pipeline: cubes are expanded, projected, culled and set up in parallel
+// ranges, each range binning its cubes into 64x64 pixel tiles. Then the tiles
+// are rasterized in parallel, each by one thread, with half-space edge
+// functions evaluated 8 (AVX2) or 4 (SSE2) pixels at a time. Coverage follows
+// the D3D top-left rule with 4 bits of subpixel precision. Depth is tested
+// LESS and written, like the default depth-stencil state; per 8x8 block
+// the tile keeps the max depth, which rejects cubes that are entirely
+// behind what's already there (the cubes usually come front to back).
+//
+// Differences to the GPU: cubes crossing the near or far plane, or more
+// than 1024 pixels across, are dropped instead of clipped. Depth is
+// interpolated in float, so depth ties can go differently, and faces are
+// set up as one quad, not two triangles, so nearly edge-on faces can come
+// out a pixel different.
+
+#define SOFTRAST_TEX_WIDTH_LOG2     10  // TEX_WIDTH_LOG2 in shaders.hlsl
+#define SOFTRAST_MAX_CUBE_TRIS      16
+#define SOFTRAST_MAX_CUBE_POLYS     SOFTRAST_MAX_CUBE_TRIS
+
+struct softrast;
+
+// Where the cubes come from, as bound to the vertex shader.
+enum softrast_fetch {
+    SOFTRAST_FETCH_ROWS,    // RenderCubeVertexShader: cube c of instance i is texel (c, inst[i]) (inst is 1 row)
+    SOFTRAST_FETCH_ORDER,   // RenderCubeSortedVertexShader: texel index inst[c, i], SOFTRAST_TEX_WIDTH_LOG2 bits of x
+};
+
+struct softrast_cube_source {
+    math::vec4 const* pos;      // tex_pos: xyz=center, w=across size (0 = off)
+    math::vec4 const* fwd;      // tex_fwd: xyz=x axis
+    int tex_width;              // size of both, tightly packed
+    int tex_height;
+
+    unsigned int const* inst;   // tex_rows or tex_order, tightly packed
+    int inst_width;
+    int inst_height;
+    softrast_fetch fetch;
+};
+
+// The parts of CubeConstBuf (shaders.hlsl) that get used.
+struct softrast_cube_consts {
+    math::mat44 clip_from_world;
+    math::vec3 world_down_vector;
+    math::vec3 light_color_ambient;
+    math::vec3 light_color_key;
+    math::vec3 light_color_fill;
+    math::vec3 light_color_back;
+    math::vec3 light_dir;
+};
+
+// Polygons of one cube, as corner (vertex_id & 7) lists: the triangles of
+// the strips, with pairs that share an edge and lie in the same plane merged
+// into convex quads (so a cube face is one polygon, not two). normals are
+// cross(e1, e2) of the first three corners in cube space (corners at +-1
+// along each axis); in world space that's normals[0] * cross(y, z) +
+// normals[1] * cross(z, x) + normals[2] * cross(x, y) for the cube's scaled
+// axes x, y, z.
+struct softrast_cube_mesh {
+    int cubes_per_instance;
+    int num_tris;               // per cube, as drawn by the index buffer
+    int num_polys;
+    unsigned char num_corners[SOFTRAST_MAX_CUBE_POLYS]; // 3 or 4
+    unsigned char corners[SOFTRAST_MAX_CUBE_POLYS][4];
+    signed char normals[SOFTRAST_MAX_CUBE_POLYS][3];
+};
+
+enum softrast_cull {
+    SOFTRAST_CULL_NONE,
+    SOFTRAST_CULL_FRONT,
+    SOFTRAST_CULL_BACK,
+};
+
+// Render target: sRGB8 RGBA color and float depth, plus the D3D viewport
+// (depth range 0..1) and rasterizer state.
+struct softrast_target {
+    int width;
+    int height;
+    uint32_t* color;
+    int color_pitch;            // bytes
+    float* depth;
+    int depth_pitch;            // bytes
+
+    float vp_x, vp_y, vp_w, vp_h;
+    softrast_cull cull;
+    bool front_ccw;
+};
+
+struct softrast_stats {
+    uint64_t cubes_drawn;       // survived culling and setup
+    uint64_t cubes_dropped;     // crossed near/far plane or too big
+    uint64_t cubes_hiz_culled;  // per tile, rejected by the max-depth blocks
+    uint64_t polys;             // set up (not backface culled)
+    uint64_t pixels_covered;    // rasterized, before the depth test (not counting hi-Z culled cubes)
+    uint64_t pixels_passed;     // passed the depth test and got written
+};
+
+softrast* softrast_create();
+void softrast_destroy(softrast* rast);
+
+// Builds the cube mesh from a triangle strip index buffer with 0xffff
+// restarts (make_cube_inds layout): the triangles of cube c must be the
+// same as those of cube 0, on vertices 8c..8c+7. Follows the D3D strip
+// winding (odd triangles flipped); degenerate triangles are skipped.
+// Returns false if the indices aren't like that.
+bool softrast_cube_mesh_from_strips(softrast_cube_mesh* mesh, uint16_t const* inds, int count);
+
+// DrawIndexedInstanced(mesh.cubes_per_instance * 15, num_instances) with
+// the cube shaders. stats is optional.
+void softrast_draw_cubes(softrast* rast, softrast_target const& target, softrast_cube_source const& src,
+    softrast_cube_consts const& consts, softrast_cube_mesh const& mesh, int num_instances, softrast_stats* stats);
+
+#endif
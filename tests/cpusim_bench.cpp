@@ -0,0 +1,495 @@
+// Benchmarks for the CPU particle engine, to reproduce the throughput
+// figures quoted for it: the update kernel, the force field layouts, the
+// periodic Morton re-sort and the front-to-back depth order. It's not a
+// pass/fail check. Build from the repo root, once per SIMD path:
+//
+//     g++ -O2 -std=c++11 -mavx2 -mfma tests/cpusim_bench.cpp $(ls *.cpp | grep -v -e main.cpp -e cpusim.cpp) -lpthread
+//     g++ -O2 -std=c++11 -msse2 tests/cpusim_bench.cpp $(ls *.cpp | grep -v -e main.cpp -e cpusim.cpp) -lpthread
+//     g++ -O2 -std=c++11 -U__SSE2__ -U__SSE__ tests/cpusim_bench.cpp $(ls *.cpp | grep -v -e main.cpp -e cpusim.cpp) -lpthread
+//
+// and run "./a.out [update] [layouts] [sort] [depth]" (all of them if none
+// are given). -frames N sets the length of the sort/depth runs (default
+// 4000, averaged from N/4 on); -max_size N skips bigger fields in the
+// layout table (default 256, which needs about 2GB). The overdraw figures
+// (shaded vs depth-passed pixels) come from the headless app itself, which
+// reports them at exit.
+
+#include "../cpusim.cpp"
+
+#include "../forcefield.h"
+#include "../random.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+static int s_frames = 4000;
+static int s_max_size = 256;
+
+static unsigned s_seed = 1;
+
+static float next_randf() // [0,1)
+{
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return ( s_seed >> 8 ) * ( 1.0f / ( 1 << 24 ) );
+}
+
+static double seconds_since( std::chrono::steady_clock::time_point start )
+{
+    return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+}
+
+static char const * path_name()
+{
+#if defined(CPUSIM_AVX2)
+    return "AVX2";
+#elif defined(CPUSIM_SSE2)
+    return "SSE2";
+#else
+    return "scalar";
+#endif
+}
+
+// Same constants as main.cpp.
+static cpusim_consts make_consts( int field_size )
+{
+    cpusim_consts consts;
+    consts.field_scale = vec3( (float)field_size );
+    consts.damping = 0.99f;
+    consts.field_offs = vec3( 0.0f );
+    consts.accel = 0.75f;
+    consts.field_sample_scale = vec3( 1.0f / field_size );
+    consts.vel_scale = 0.001f * 6.0f;
+    consts.field_blend = 0.0f;
+    return consts;
+}
+
+// A force field like main.cpp's in the given format and layout; free with
+// free_field.
+struct bench_field {
+    fieldpack pack;
+    cpusim_field field;
+};
+
+static bench_field make_field( int size, fieldpack_format format, cpusim_layout layout )
+{
+    vec4 * texels = forcefield_make( forcefield_default_desc( size, 1.0f, 0.001f ), NULL );
+
+    bench_field f;
+    fieldpack_encode( &f.pack, texels, size, format );
+    cpusim_field linear = { size, f.pack.texels, format, f.pack.scale, CPUSIM_LAYOUT_LINEAR };
+    f.field = cpusim_convert_field( linear, layout );
+
+    fieldpack_free( &f.pack );
+    delete[] texels;
+    return f;
+}
+
+static void free_field( bench_field * f )
+{
+    cpusim_free_field( &f->field );
+}
+
+static char const * layout_name( cpusim_layout layout )
+{
+    switch ( layout )
+    {
+    case CPUSIM_LAYOUT_MORTON:  return "morton";
+    case CPUSIM_LAYOUT_CORNERS: return "corners";
+    default:                    return "linear";
+    }
+}
+
+// ---- update: raw kernel throughput
+
+// 131072 particles spread over the field with small random velocities, so
+// none die; reports position steps per second for the whole update.
+static void bench_update()
+{
+    printf( "update: %s, %d threads, 131072 particles, 32^3 float32\n", path_name(), parallel_num_threads() );
+
+    const int kCount = 131072;
+    cpusim * sim = cpusim_create( 1024, kCount / 1024 );
+    rand_stream rng;
+    rand_stream_seed( &rng, 1 );
+
+    std::vector<float> px( kCount ), py( kCount ), pz( kCount ), vx( kCount ), vy( kCount ), vz( kCount );
+    rand_ball_batch( &rng, &px[0], &py[0], &pz[0], kCount, 1.0f );
+    rand_ball_batch( &rng, &vx[0], &vy[0], &vz[0], kCount, 0.003f );
+    std::vector<vec4> pos_old( kCount ), pos_new( kCount );
+    for ( int i = 0 ; i < kCount ; i++ )
+    {
+        pos_new[i] = vec4( px[i], py[i], pz[i], 0.001f );
+        pos_old[i] = vec4( px[i] - vx[i], py[i] - vy[i], pz[i] - vz[i], 0.001f );
+    }
+
+    for ( int l = 0 ; l < 3 ; l++ )
+    {
+        cpusim_layout layout = (cpusim_layout)l;
+        bench_field f = make_field( 32, FIELDPACK_FLOAT32, layout );
+        cpusim_consts consts = make_consts( 32 );
+
+        for ( int steps = 1 ; steps <= 4 ; steps *= 4 )
+        {
+            cpusim_spawn( sim, 0, kCount, &pos_old[0], &pos_new[0] );
+            cpusim_update( sim, consts, f.field, NULL, steps ); // warm up
+
+            const int kReps = 50;
+            auto start = std::chrono::steady_clock::now();
+            for ( int rep = 0 ; rep < kReps ; rep++ )
+                cpusim_update( sim, consts, f.field, NULL, steps );
+            double secs = seconds_since( start );
+
+            printf( "  %-7s  %d step%s/update  %7.1f M particle-steps/s  (%d live)\n", layout_name( layout ), steps,
+                steps > 1 ? "s" : " ", (double)sim->num_live * steps * kReps / secs * 1e-6, sim->num_live );
+        }
+
+        // the scalar reference sampler, for scale
+        const int kSamples = 1 << 18;
+        auto start = std::chrono::steady_clock::now();
+        vec3 sum( 0.0f );
+        for ( int i = 0 ; i < kSamples ; i++ )
+            sum += cpusim_sample_force( consts, f.field, vec3( pos_new[i % kCount].x, pos_new[i % kCount].y, pos_new[i % kCount].z ) );
+        double secs = seconds_since( start );
+        printf( "  %-7s  scalar reference sampler %.1f M samples/s (%g)\n", layout_name( layout ), kSamples / secs * 1e-6, sum.x );
+
+        free_field( &f );
+    }
+
+    cpusim_destroy( sim );
+}
+
+// ---- layouts: sampler throughput and memory footprint per layout
+
+// Texel indices of the 8 taps of a sample, as in cpusim_sample_force.
+static void tap_indices( cpusim_consts const & consts, cpusim_field const & field, vec3 const & pos, int * index )
+{
+    int mask = field.size - 1;
+    int field_log2 = log2_pow2( field.size );
+    int off0[3], off1[3];
+    for ( int i = 0 ; i < 3 ; i++ )
+    {
+        float force_pos = pos[i] * consts.field_scale[i] + consts.field_offs[i];
+        float fl = std::floor( force_pos );
+        float frac = force_pos - fl;
+        float t = ( fl + frac * frac * ( 3.0f - 2.0f * frac ) ) * consts.field_sample_scale[i] * field.size - 0.5f;
+        axis_offsets( field, field_log2, i, (int)std::floor( t ) & mask, &off0[i], &off1[i] );
+    }
+
+    for ( int corner = 0 ; corner < 8 ; corner++ )
+        index[corner] = ( ( corner & 1 ) ? off1[0] : off0[0] ) + ( ( corner & 2 ) ? off1[1] : off0[1] ) + ( ( corner & 4 ) ? off1[2] : off0[2] );
+}
+
+// Average number of distinct cache lines and pages a sample's taps touch.
+static void count_footprint( cpusim_consts const & consts, cpusim_field const & field, std::vector<vec4> const & pos,
+    double * lines, double * pages )
+{
+    int bytes = fieldpack_texel_bytes( field.format );
+    size_t total_lines = 0, total_pages = 0;
+    for ( size_t p = 0 ; p < pos.size() ; p++ )
+    {
+        int index[8];
+        tap_indices( consts, field, vec3( pos[p].x, pos[p].y, pos[p].z ), index );
+
+        uintptr_t line[8], page[8];
+        int num_lines = 0, num_pages = 0;
+        for ( int t = 0 ; t < 8 ; t++ )
+        {
+            uintptr_t addr = (uintptr_t)field.texels + (uintptr_t)index[t] * bytes;
+            if ( std::find( line, line + num_lines, addr >> 6 ) == line + num_lines )
+                line[num_lines++] = addr >> 6;
+            if ( std::find( page, page + num_pages, addr >> 12 ) == page + num_pages )
+                page[num_pages++] = addr >> 12;
+        }
+        total_lines += num_lines;
+        total_pages += num_pages;
+    }
+    *lines = (double)total_lines / pos.size();
+    *pages = (double)total_pages / pos.size();
+}
+
+// Particles at rest either uniformly over one period of the field, or in
+// groups of 64 within 2 texels of a random point (like spawn batches).
+static std::vector<vec4> layout_positions( int count, int field_size, bool clustered )
+{
+    rand_stream rng;
+    rand_stream_seed( &rng, 2 );
+
+    std::vector<float> ox( count ), oy( count ), oz( count );
+    rand_ball_batch( &rng, &ox[0], &oy[0], &oz[0], count, 2.0f / field_size );
+
+    s_seed = 1;
+    std::vector<vec4> pos( count );
+    vec3 center( 0.0f );
+    for ( int i = 0 ; i < count ; i++ )
+    {
+        if ( !clustered || i % 64 == 0 )
+            center = vec3( next_randf() - 0.5f, next_randf() - 0.5f, next_randf() - 0.5f );
+        pos[i] = vec4( clustered ? center + vec3( ox[i], oy[i], oz[i] ) : center, 0.001f );
+    }
+    return pos;
+}
+
+static double layout_throughput( cpusim * sim, cpusim_consts const & consts, cpusim_field const & field, std::vector<vec4> const & pos )
+{
+    const int kReps = 10;
+    cpusim_spawn( sim, 0, (int)pos.size(), &pos[0], &pos[0] );
+    cpusim_update( sim, consts, field, NULL, 1 ); // warm up
+
+    auto start = std::chrono::steady_clock::now();
+    for ( int rep = 0 ; rep < kReps ; rep++ )
+        cpusim_update( sim, consts, field, NULL, 1 );
+    return (double)sim->num_live * kReps / seconds_since( start ) * 1e-6;
+}
+
+static void bench_layouts()
+{
+    static const struct { int size; fieldpack_format format; } kFields[] = {
+        { 32, FIELDPACK_FLOAT32 },
+        { 128, FIELDPACK_FLOAT32 },
+        { 128, FIELDPACK_SHAREDEXP },
+        { 256, FIELDPACK_HALF },
+        { 256, FIELDPACK_SHAREDEXP },
+    };
+
+    const int kCount = 131072;
+    printf( "layouts: %s, %d threads, %d particles; M particle-steps/s random / clustered, lines and pages per sample (random)\n",
+        path_name(), parallel_num_threads(), kCount );
+
+    cpusim * sim = cpusim_create( 1024, kCount / 1024 );
+    for ( size_t i = 0 ; i < sizeof( kFields ) / sizeof( kFields[0] ) ; i++ )
+    {
+        int size = kFields[i].size;
+        if ( size > s_max_size )
+            continue;
+
+        cpusim_consts consts = make_consts( size );
+        std::vector<vec4> random = layout_positions( kCount, size, false );
+        std::vector<vec4> clustered = layout_positions( kCount, size, true );
+
+        for ( int l = 0 ; l < 3 ; l++ )
+        {
+            bench_field f = make_field( size, kFields[i].format, (cpusim_layout)l );
+            double lines, pages;
+            count_footprint( consts, f.field, random, &lines, &pages );
+            double t_random = layout_throughput( sim, consts, f.field, random );
+            double t_clustered = layout_throughput( sim, consts, f.field, clustered );
+
+            printf( "  %3d^3 %-9s %-7s  %6.1f / %6.1f   %.1f lines  %.1f pages\n", size, fieldpack_format_name( kFields[i].format ),
+                layout_name( (cpusim_layout)l ), t_random, t_clustered, lines, pages );
+            free_field( &f );
+        }
+    }
+    cpusim_destroy( sim );
+}
+
+// ---- sort / depth: main.cpp's CPU sim loop
+
+// The particle system as main.cpp runs it: a 48K pool, 256 spawns a frame
+// from an emitter that drifts along x, and the same camera.
+struct sim_run {
+    cpusim * sim;
+    cpusim_consts consts;
+    bench_field field;
+    rand_stream rng;
+    vec3 emit_pos;
+    std::vector<unsigned> visible;
+};
+
+static void sim_run_init( sim_run * run, int field_size, cpusim_layout layout )
+{
+    run->sim = cpusim_create( 1024, 48 );
+    run->consts = make_consts( field_size );
+    run->field = make_field( field_size, FIELDPACK_FLOAT32, layout );
+    rand_stream_seed( &run->rng, 1 );
+    run->visible.resize( run->sim->num_rows );
+}
+
+static void sim_run_free( sim_run * run )
+{
+    cpusim_destroy( run->sim );
+    free_field( &run->field );
+}
+
+static void sim_run_spawn( sim_run * run, int frame )
+{
+    static const int kSpawnCount = 256;
+    vec4 pos_old[kSpawnCount], pos_new[kSpawnCount];
+    float ofs_x[kSpawnCount], ofs_y[kSpawnCount], ofs_z[kSpawnCount];
+    float vel_x[kSpawnCount], vel_y[kSpawnCount], vel_z[kSpawnCount];
+    rand_ball_batch( &run->rng, ofs_x, ofs_y, ofs_z, kSpawnCount, 0.002f );
+    rand_ball_batch( &run->rng, vel_x, vel_y, vel_z, kSpawnCount, 0.003f );
+
+    run->emit_pos = vec3( 0.7f * sin( frame * 0.001f ), 0.0f, 0.0f );
+    for ( int i = 0 ; i < kSpawnCount ; i++ )
+    {
+        vec3 pos = run->emit_pos + vec3( ofs_x[i], ofs_y[i], ofs_z[i] );
+        vec3 vel( vel_x[i], vel_y[i], vel_z[i] );
+        pos_old[i] = vec4( pos - vel, 0.001f );
+        pos_new[i] = vec4( pos, 0.001f );
+    }
+    cpusim_spawn_free( run->sim, kSpawnCount, pos_old, pos_new );
+}
+
+static mat44 sim_run_view( sim_run const * run )
+{
+    return mat44::look_at( vec3( 0.0f, 0.0f, -0.9f ), run->emit_pos, vec3( 0.0f, 1.0f, 0.0f ) );
+}
+
+// Rows that pass frustum culling this frame.
+static int sim_run_cull( sim_run * run )
+{
+    mat44 clip_from_world = mat44::perspectiveD3D( 1280.0f / 720.0f, 1.0f, 0.01f, 50.0f ) * sim_run_view( run );
+    int rows = ( run->sim->num_live + run->sim->chunk_size - 1 ) / run->sim->chunk_size;
+    return cull_boxes( clip_from_world, run->sim->row_bounds, rows, &run->visible[0] );
+}
+
+static void bench_sort()
+{
+    static const struct { int size; cpusim_layout layout; } kConfigs[] = {
+        { 32, CPUSIM_LAYOUT_LINEAR },
+        { 64, CPUSIM_LAYOUT_LINEAR },
+        { 128, CPUSIM_LAYOUT_LINEAR },
+        { 128, CPUSIM_LAYOUT_MORTON },
+    };
+    const int kSortInterval = 16;
+    int first = s_frames / 4;
+
+    printf( "sort: %s, %d threads, 48K pool, float32 fields, frames %d-%d; update ms/frame unsorted, sorted every %d, "
+        "sort ms/frame (amortized), visible rows\n", path_name(), parallel_num_threads(), first, s_frames, kSortInterval );
+
+    for ( size_t c = 0 ; c < sizeof( kConfigs ) / sizeof( kConfigs[0] ) ; c++ )
+    {
+        double update_secs[2] = { 0.0, 0.0 }, sort_secs = 0.0, visible[2] = { 0.0, 0.0 }, live = 0.0;
+        for ( int sorted = 0 ; sorted < 2 ; sorted++ )
+        {
+            sim_run run;
+            sim_run_init( &run, kConfigs[c].size, kConfigs[c].layout );
+            for ( int frame = 0 ; frame < s_frames ; frame++ )
+            {
+                sim_run_spawn( &run, frame );
+
+                auto start = std::chrono::steady_clock::now();
+                cpusim_update( run.sim, run.consts, run.field.field, NULL, 1 );
+                double secs = seconds_since( start );
+
+                double sort = 0.0;
+                if ( sorted && frame % kSortInterval == 0 )
+                {
+                    start = std::chrono::steady_clock::now();
+                    cpusim_sort( run.sim, run.consts );
+                    sort = seconds_since( start );
+                }
+
+                if ( frame >= first )
+                {
+                    update_secs[sorted] += secs;
+                    sort_secs += sort;
+                    visible[sorted] += sim_run_cull( &run );
+                    live += sorted ? run.sim->num_live : 0;
+                }
+            }
+            sim_run_free( &run );
+        }
+
+        double n = s_frames - first;
+        printf( "  %3d^3 %-7s  %.2f ms   %.2f ms   %.2f ms   rows %.1f -> %.1f of %.1f\n", kConfigs[c].size,
+            layout_name( kConfigs[c].layout ), update_secs[0] / n * 1e3, update_secs[1] / n * 1e3, sort_secs / n * 1e3,
+            visible[0] / n, visible[1] / n, live / n / 1024.0 );
+    }
+}
+
+static void bench_depth()
+{
+    int first = s_frames / 4;
+    printf( "depth: %s, %d threads, 48K pool, 32^3 float32 linear, sorted every 16, frames %d-%d\n", path_name(),
+        parallel_num_threads(), first, s_frames );
+
+    sim_run run;
+    sim_run_init( &run, 32, CPUSIM_LAYOUT_LINEAR );
+    std::vector<unsigned> order( run.sim->num_particles );
+
+    double secs = 0.0, count = 0.0, max_inversion = 0.0;
+    int incomplete = 0;
+    for ( int frame = 0 ; frame < s_frames ; frame++ )
+    {
+        sim_run_spawn( &run, frame );
+        cpusim_update( run.sim, run.consts, run.field.field, NULL, 1 );
+        if ( frame % 16 == 0 )
+            cpusim_sort( run.sim, run.consts );
+        if ( frame < first )
+            continue;
+
+        int rows = sim_run_cull( &run );
+        mat44 view = sim_run_view( &run );
+        auto start = std::chrono::steady_clock::now();
+        int n = cpusim_depth_order( run.sim, view, &run.visible[0], rows, &order[0] );
+        secs += seconds_since( start );
+        count += n;
+
+        // complete: every live particle in the visible rows, once
+        cpusim_block const * pos = cpusim_pos_buf( run.sim, 0 );
+        int expect = 0;
+        for ( int r = 0 ; r < rows ; r++ )
+        {
+            int begin = run.visible[r] * run.sim->chunk_size;
+            expect += std::max( 0, std::min( begin + run.sim->chunk_size, run.sim->num_live ) - begin );
+        }
+        incomplete += n != expect;
+
+        // sorted, up to the key quantization
+        float prev = 0.0f;
+        for ( int i = 0 ; i < n ; i++ )
+        {
+            cpusim_block const & b = pos[order[i] / CPUSIM_LANES];
+            int lane = order[i] % CPUSIM_LANES;
+            float depth = ( view * vec4( b.x[lane], b.y[lane], b.z[lane], 1.0f ) ).z;
+            if ( i && depth < prev )
+                max_inversion = std::max( max_inversion, (double)( ( prev - depth ) / std::abs( depth ) ) );
+            prev = depth;
+        }
+    }
+    sim_run_free( &run );
+
+    double n = s_frames - first;
+    printf( "  %.2f ms/frame for %.0f cubes (%.2f ns/cube), largest depth inversion %.2f%%, %d incomplete frames\n",
+        secs / n * 1e3, count / n, secs / count * 1e9, max_inversion * 100.0, incomplete );
+}
+
+int main( int argc, char ** argv )
+{
+    bool run_update = false, run_layouts = false, run_sort = false, run_depth = false;
+    for ( int i = 1 ; i < argc ; i++ )
+    {
+        if ( strcmp( argv[i], "-frames" ) == 0 && i + 1 < argc )
+            s_frames = std::max( atoi( argv[++i] ), 4 );
+        else if ( strcmp( argv[i], "-max_size" ) == 0 && i + 1 < argc )
+            s_max_size = atoi( argv[++i] );
+        else if ( strcmp( argv[i], "update" ) == 0 )
+            run_update = true;
+        else if ( strcmp( argv[i], "layouts" ) == 0 )
+            run_layouts = true;
+        else if ( strcmp( argv[i], "sort" ) == 0 )
+            run_sort = true;
+        else if ( strcmp( argv[i], "depth" ) == 0 )
+            run_depth = true;
+        else
+        {
+            fprintf( stderr, "usage: %s [update] [layouts] [sort] [depth] [-frames N] [-max_size N]\n", argv[0] );
+            return 1;
+        }
+    }
+    if ( !run_update && !run_layouts && !run_sort && !run_depth )
+        run_update = run_layouts = run_sort = run_depth = true;
+
+    if ( run_update )
+        bench_update();
+    if ( run_layouts )
+        bench_layouts();
+    if ( run_sort )
+        bench_sort();
+    if ( run_depth )
+        bench_depth();
+    return 0;
+}
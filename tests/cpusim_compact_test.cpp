@@ -0,0 +1,92 @@
+// Checks the live-particle compaction in cpusim.cpp with the parallel_for
+// ranges run back to front, so a range that writes past the end of its
+// part of the output clobbers the next range's (already written) entries.
+// Build from the repo root:
+//
+//     g++ -O2 -std=c++11 tests/cpusim_compact_test.cpp $(ls *.cpp | grep -v -e main.cpp -e cpusim.cpp) -lpthread
+
+#define parallel_for parallel_for_reversed
+#include "../cpusim.cpp"
+#undef parallel_for
+
+#include <stdio.h>
+
+void parallel_for_reversed( int count, int granularity, parallel_func * func, void * user )
+{
+    for ( int end = count ; end > 0 ; end -= granularity )
+        func( user, std::max( end - granularity, 0 ), end );
+}
+
+static unsigned s_seed = 1;
+
+static unsigned next_rand()
+{
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+// Random dead masks, with runs of different densities so range ends land
+// on both sparse and full blocks.
+static bool run_case( int chunk_size, int num_rows, int variant )
+{
+    cpusim * sim = cpusim_create( chunk_size, num_rows );
+    sim->extent = sim->num_particles - ( variant % 3 ) * 5;
+    int used_blocks = ( sim->extent + CPUSIM_LANES - 1 ) / CPUSIM_LANES;
+
+    std::vector<int> live;
+    for ( int blk = 0 ; blk < used_blocks ; blk++ )
+    {
+        int density = ( blk / 97 + variant ) % 4;
+        int mask = 0;
+        for ( int lane = 0 ; lane < CPUSIM_LANES ; lane++ )
+        {
+            int index = blk * CPUSIM_LANES + lane;
+            bool dead = index >= sim->extent || (int)( next_rand() % 4 ) < density;
+            if ( dead )
+                mask |= 1 << lane;
+            for ( int b = 0 ; b < 4 ; b++ )
+            {
+                sim->bufs[b][blk].x[lane] = (float)index;
+                sim->bufs[b][blk].w[lane] = dead ? 0.0f : 1.0f;
+            }
+            if ( !dead )
+                live.push_back( index );
+        }
+        sim->dead_masks[blk] = (unsigned char)mask;
+    }
+
+    pack_live( sim );
+
+    // the live particles end up in [0,num_live), each exactly once
+    bool ok = sim->num_live == (int)live.size();
+    std::vector<char> seen( sim->num_particles, 0 );
+    for ( int i = 0 ; ok && i < sim->num_live ; i++ )
+    {
+        cpusim_block const & blk = sim->bufs[0][i / CPUSIM_LANES];
+        int index = (int)blk.x[i % CPUSIM_LANES];
+        ok = blk.w[i % CPUSIM_LANES] != 0.0f && index >= 0 && index < sim->num_particles && !seen[index];
+        if ( ok )
+            seen[index] = 1;
+    }
+    for ( size_t i = 0 ; ok && i < live.size() ; i++ )
+        ok = seen[live[i]] != 0;
+
+    if ( !ok )
+        printf( "FAILED: chunk_size %d, num_rows %d, variant %d\n", chunk_size, num_rows, variant );
+
+    cpusim_destroy( sim );
+    return ok;
+}
+
+int main()
+{
+    int failed = 0;
+    for ( int variant = 0 ; variant < 12 ; variant++ )
+    {
+        failed += !run_case( 1024, 64, variant );
+        failed += !run_case( 512, 37, variant );
+    }
+
+    printf( failed ? "cpusim_compact_test: %d failed\n" : "cpusim_compact_test: ok\n", failed );
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+// Checks the mat44 inverse and the vec4/mat44 float ops in math.h against
+// the generic templates. Build from the repo root, once per path:
+//
+//     g++ -O2 -std=c++11 -msse2 tests/math_test.cpp math.cpp
+//     g++ -O2 -std=c++11 -U__SSE2__ -U__SSE__ tests/math_test.cpp math.cpp
+
+#include "../math.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+using namespace math;
+
+static unsigned s_seed = 1;
+
+static float next_randf() // [-1,1)
+{
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return (int)(s_seed >> 8) * (2.0f / (1 << 24)) - 1.0f;
+}
+
+static vec4 rand_vec4()
+{
+    return vec4(next_randf(), next_randf(), next_randf(), next_randf());
+}
+
+static float max_abs_diff(const mat44& a, const mat44& b)
+{
+    float err = 0.0f;
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            err = std::max(err, std::abs(a(i, j) - b(i, j)));
+    return err;
+}
+
+static float max_abs_diff(const vec4& a, const vec4& b)
+{
+    return std::max(std::max(std::abs(a.x - b.x), std::abs(a.y - b.y)), std::max(std::abs(a.z - b.z), std::abs(a.w - b.w)));
+}
+
+// m * inverse(m) is the identity, for the matrix kinds the renderer builds
+// and for random well-conditioned ones.
+static int check_inverse()
+{
+    int failed = 0;
+    for (int iter = 0; iter < 1000; iter++)
+    {
+        mat44 m;
+        switch (iter % 3)
+        {
+        case 0: // diagonally dominant
+            m = mat44(rand_vec4(), rand_vec4(), rand_vec4(), rand_vec4());
+            m += mat44::diag(4.0f, 4.0f, 4.0f, 4.0f);
+            break;
+        case 1: // rigid transform
+            m = mat44(mat33::rotation(normalize(vec3(next_randf(), next_randf(), 1.5f)), 3.0f * next_randf()),
+                vec3(5.0f * next_randf(), 5.0f * next_randf(), 5.0f * next_randf()));
+            break;
+        default: // projection * view
+            m = mat44::perspectiveD3D(1.0f + next_randf() * 0.5f, 1.0f, 0.1f, 50.0f);
+            m *= mat44::look_at(vec3(next_randf(), next_randf(), -3.0f), vec3(0.0f), vec3(0.0f, 1.0f, 0.0f));
+            break;
+        }
+
+        mat44 inv = inverse(m);
+        mat44 prod = m;
+        prod *= inv;
+        float err = max_abs_diff(prod, mat44::identity());
+
+        // relative to the largest entry; projection inverses have big ones
+        mat44 zero = mat44::diag(0.0f, 0.0f, 0.0f, 0.0f);
+        float err_generic = max_abs_diff(inv, inverse<float>(m)) / std::max(1.0f, max_abs_diff(inv, zero));
+        if (err > 1e-4f || err_generic > 1e-5f)
+        {
+            printf("FAILED: inverse, iter %d: |m*inv(m) - I| = %g, |inv - generic inv| = %g\n", iter, err, err_generic);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+// The float vec4 ops, mat*vec and mat*mat agree with the generic templates.
+static int check_ops()
+{
+    int failed = 0;
+    for (int iter = 0; iter < 1000; iter++)
+    {
+        vec4 a = rand_vec4(), b = rand_vec4();
+        float s = next_randf();
+        mat44 m(rand_vec4(), rand_vec4(), rand_vec4(), rand_vec4());
+        mat44 n(rand_vec4(), rand_vec4(), rand_vec4(), rand_vec4());
+
+        float err = 0.0f;
+        err = std::max(err, max_abs_diff(a + b, operator+<float>(a, b)));
+        err = std::max(err, max_abs_diff(a - b, operator-<float>(a, b)));
+        err = std::max(err, max_abs_diff(a * b, operator*<float>(a, b)));
+        err = std::max(err, max_abs_diff(a * s, operator*<float>(a, s)));
+        err = std::max(err, max_abs_diff(s * a, operator*<float>(s, a)));
+        err = std::max(err, std::abs(dot(a, b) - dot<float>(a, b)));
+        err = std::max(err, max_abs_diff(m * a, operator*<float>(m, a)));
+
+        mat44 mn = m;
+        mn *= n;
+        mat44 mn_ref(operator*<float>(m, n.x), operator*<float>(m, n.y), operator*<float>(m, n.z), operator*<float>(m, n.w));
+        err = std::max(err, max_abs_diff(mn, mn_ref));
+        err = std::max(err, max_abs_diff(transpose(m), transpose<float>(m)));
+
+        if (err > 1e-5f)
+        {
+            printf("FAILED: ops, iter %d: max error %g\n", iter, err);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+int main()
+{
+    int failed = check_inverse() + check_ops();
+
+    printf(failed ? "math_test: %d failed\n" : "math_test: ok\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+// Checks pixel_compare_tol in util.cpp against a plain per-pixel loop:
+// tolerance, first and worst location, per-channel max/MSE, PSNR and the
+// diff image, on odd widths and padded strides. Build from the repo root,
+// once per path:
+//
+//     g++ -O2 -std=c++11 -msse2 tests/pixel_compare_test.cpp util.cpp parallel.cpp profile.cpp -lpthread
+//     g++ -O2 -std=c++11 -mavx2 -mfma tests/pixel_compare_test.cpp util.cpp parallel.cpp profile.cpp -lpthread
+//     g++ -O2 -std=c++11 -U__SSE2__ -U__SSE__ tests/pixel_compare_test.cpp util.cpp parallel.cpp profile.cpp -lpthread
+
+#include "../util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+static unsigned s_seed = 1;
+
+static unsigned next_rand()
+{
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static void reference_compare( unsigned char const * a, int stride_a, unsigned char const * b, int stride_b, int w, int h,
+    int tolerance, pixel_compare_stats * stats, int * worst )
+{
+    double sq_err[4] = { 0.0, 0.0, 0.0, 0.0 };
+    *worst = 0;
+    for ( int c = 0 ; c < 4 ; c++ )
+        stats->max_diff[c] = 0;
+    stats->num_over = 0;
+    stats->first_x = stats->first_y = -1;
+    stats->worst_x = stats->worst_y = -1;
+
+    for ( int y = 0 ; y < h ; y++ )
+    {
+        for ( int x = 0 ; x < w ; x++ )
+        {
+            bool over = false;
+            for ( int c = 0 ; c < 4 ; c++ )
+            {
+                int d = abs( a[y * stride_a + x * 4 + c] - b[y * stride_b + x * 4 + c] );
+                stats->max_diff[c] = std::max( stats->max_diff[c], d );
+                sq_err[c] += d * d;
+                over |= d > tolerance;
+                if ( d > *worst )
+                {
+                    *worst = d;
+                    stats->worst_x = x;
+                    stats->worst_y = y;
+                }
+            }
+            if ( over && stats->num_over++ == 0 )
+            {
+                stats->first_x = x;
+                stats->first_y = y;
+            }
+        }
+    }
+
+    double num_pixels = std::max( (double)w * h, 1.0 );
+    for ( int c = 0 ; c < 4 ; c++ )
+        stats->mse[c] = sq_err[c] / num_pixels;
+    double mse = ( sq_err[0] + sq_err[1] + sq_err[2] + sq_err[3] ) / ( 4.0 * num_pixels );
+    stats->psnr = ( mse > 0.0 ) ? 10.0 * log10( 255.0 * 255.0 / mse ) : HUGE_VAL;
+}
+
+static bool close( double x, double y )
+{
+    return x == y || fabs( x - y ) <= 1e-9 * std::max( fabs( x ), fabs( y ) );
+}
+
+// b is a with a few pixels off by random amounts (and a few more off by at
+// most 2, so small tolerances matter); some cases are identical.
+static bool run_case( int w, int h, int tolerance, int variant )
+{
+    int stride_a = w * 4 + ( variant % 3 ) * 4;
+    int stride_b = w * 4 + ( variant % 2 ) * 12;
+    int stride_diff = w * 4 + 8;
+    std::vector<unsigned char> a( stride_a * h ), b( stride_b * h );
+    std::vector<unsigned char> diff( stride_diff * h, 0xcd );
+
+    for ( int y = 0 ; y < h ; y++ )
+    {
+        for ( int i = 0 ; i < w * 4 ; i++ )
+            a[y * stride_a + i] = b[y * stride_b + i] = (unsigned char)next_rand();
+    }
+
+    int num_changes = ( variant % 4 == 0 ) ? 0 : 1 + (int)( next_rand() % 20 );
+    for ( int i = 0 ; i < num_changes ; i++ )
+    {
+        int x = next_rand() % w, y = next_rand() % h, c = next_rand() % 4;
+        int delta = ( i % 2 ) ? (int)( next_rand() % 5 ) - 2 : (int)( next_rand() % 511 ) - 255;
+        unsigned char & v = b[y * stride_b + x * 4 + c];
+        v = (unsigned char)std::min( std::max( v + delta, 0 ), 255 );
+    }
+
+    pixel_compare_stats got, want;
+    int worst;
+    int num_over = pixel_compare_tol( &a[0], stride_a, &b[0], stride_b, w, h, tolerance, &got, &diff[0], stride_diff );
+    reference_compare( &a[0], stride_a, &b[0], stride_b, w, h, tolerance, &want, &worst );
+
+    bool ok = num_over == want.num_over && got.num_over == want.num_over
+        && got.first_x == want.first_x && got.first_y == want.first_y
+        && got.worst_x == want.worst_x && got.worst_y == want.worst_y && close( got.psnr, want.psnr );
+    for ( int c = 0 ; c < 4 ; c++ )
+        ok = ok && got.max_diff[c] == want.max_diff[c] && close( got.mse[c], want.mse[c] );
+    if ( !ok )
+    {
+        printf( "FAILED: %dx%d tol %d variant %d: over %d/%d (want %d), first %d,%d (want %d,%d), worst %d,%d (want %d,%d), "
+            "psnr %g (want %g)\n", w, h, tolerance, variant, num_over, got.num_over, want.num_over,
+            got.first_x, got.first_y, want.first_x, want.first_y, got.worst_x, got.worst_y, want.worst_x, want.worst_y,
+            got.psnr, want.psnr );
+        return false;
+    }
+
+    // the diff image is |a - b| with opaque alpha, and nothing past w is touched
+    for ( int y = 0 ; y < h ; y++ )
+    {
+        for ( int i = 0 ; i < stride_diff ; i++ )
+        {
+            int expect = ( i >= w * 4 ) ? 0xcd : ( i % 4 == 3 ) ? 255 : abs( a[y * stride_a + i] - b[y * stride_b + i] );
+            if ( diff[y * stride_diff + i] != expect )
+            {
+                printf( "FAILED: %dx%d tol %d variant %d: diff byte %d of row %d is %d, want %d\n", w, h, tolerance, variant,
+                    i, y, diff[y * stride_diff + i], expect );
+                return false;
+            }
+        }
+    }
+
+    // and the same without the optional outputs
+    if ( pixel_compare_tol( &a[0], stride_a, &b[0], stride_b, w, h, tolerance, NULL, NULL, 0 ) != want.num_over )
+    {
+        printf( "FAILED: %dx%d tol %d variant %d: count differs without stats\n", w, h, tolerance, variant );
+        return false;
+    }
+    return true;
+}
+
+int main()
+{
+    static const int kWidths[] = { 1, 3, 4, 7, 8, 15, 16, 33, 640 };
+    static const int kTolerances[] = { 0, 1, 2, 8, 255 };
+
+    int failed = 0;
+    int variant = 0;
+    for ( int wi = 0 ; wi < (int)( sizeof( kWidths ) / sizeof( kWidths[0] ) ) ; wi++ )
+    {
+        for ( int ti = 0 ; ti < (int)( sizeof( kTolerances ) / sizeof( kTolerances[0] ) ) ; ti++ )
+        {
+            for ( int rep = 0 ; rep < 8 ; rep++ )
+            {
+                int h = 1 + (int)( next_rand() % 80 );
+                if ( !run_case( kWidths[wi], h, kTolerances[ti], variant++ ) )
+                    failed++;
+            }
+        }
+    }
+
+    // a known case: one channel off by 255 in a 10x10 image, the rest equal
+    {
+        std::vector<unsigned char> a( 10 * 10 * 4, 0 ), b( 10 * 10 * 4, 0 );
+        b[( 6 * 10 + 3 ) * 4 + 1] = 255;
+        pixel_compare_stats stats;
+        int n = pixel_compare_tol( &a[0], 40, &b[0], 40, 10, 10, 254, &stats, NULL, 0 );
+        double psnr = 10.0 * log10( 400.0 ); // mse = 255^2 / 400
+        if ( n != 1 || stats.worst_x != 3 || stats.worst_y != 6 || stats.max_diff[1] != 255 || fabs( stats.psnr - psnr ) > 1e-9 )
+        {
+            printf( "FAILED: single pixel: over %d, worst %d,%d, psnr %g (want %g)\n", n, stats.worst_x, stats.worst_y, stats.psnr, psnr );
+            failed++;
+        }
+    }
+
+    // a tie for worst across rows far enough apart to be in different tasks;
+    // the first in row order wins
+    {
+        const int w = 1024, h = 64;
+        std::vector<unsigned char> a( w * h * 4, 100 ), b( w * h * 4, 100 );
+        b[( 3 * w + 900 ) * 4 + 2] = 109;
+        b[( 60 * w + 5 ) * 4 + 0] = 91;
+        pixel_compare_stats stats;
+        pixel_compare_tol( &a[0], w * 4, &b[0], w * 4, w, h, 0, &stats, NULL, 0 );
+        if ( stats.worst_x != 900 || stats.worst_y != 3 || stats.first_x != 900 || stats.first_y != 3 )
+        {
+            printf( "FAILED: worst tie: worst %d,%d first %d,%d (want 900,3)\n", stats.worst_x, stats.worst_y, stats.first_x, stats.first_y );
+            failed++;
+        }
+    }
+
+    printf( failed ? "pixel_compare_test: %d failed\n" : "pixel_compare_test: ok\n", failed );
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+// Checks the streaming run_stats in util.cpp: percentiles against exact
+// stats, and that merging streaming stats (Chan et al.'s pairwise update
+// plus the histograms) matches recording everything into one. util.cpp is
+// included so the mean and M2 can be looked at. Build from the repo root:
+//
+//     g++ -O2 -std=c++11 tests/run_stats_test.cpp parallel.cpp profile.cpp -lpthread
+
+#include "../util.cpp"
+
+static unsigned s_seed = 1;
+
+static unsigned next_rand()
+{
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static float next_randf() // [0,1)
+{
+    return next_rand() * ( 1.0f / ( 1 << 24 ) );
+}
+
+static const float kPercentiles[] = { 0.0f, 0.1f, 1.0f, 10.0f, 25.0f, 50.0f, 75.0f, 90.0f, 99.0f, 99.9f, 100.0f };
+static const int kNumPercentiles = sizeof( kPercentiles ) / sizeof( kPercentiles[0] );
+
+// Series shaped like what gets timed, and some that aren't.
+static std::vector<float> make_values( int kind, int count )
+{
+    std::vector<float> values( count );
+    for ( int i = 0 ; i < count ; i++ )
+    {
+        float u = next_randf();
+        switch ( kind )
+        {
+        case 0: values[i] = 1.0f + 15.0f * u; break;                              // uniform, frame times in ms
+        case 1: values[i] = expf( 3.0f * ( u + next_randf() - 1.0f ) ); break;    // long tail
+        case 2: values[i] = 1e-3f * ( u - 0.5f ); break;                          // both signs, small
+        case 3: values[i] = 4.25f; break;                                         // constant
+        default: values[i] = ( i % 100 ) ? 2.0f + u : 5000.0f + 1000.0f * u; break; // spikes
+        }
+    }
+    return values;
+}
+
+// Streaming percentiles are within 2^-8 (relative) of the value at that rank,
+// and the ends are exact.
+static int check_percentiles()
+{
+    int failed = 0;
+    for ( int kind = 0 ; kind < 5 ; kind++ )
+    {
+        for ( int count = 1 ; count <= 100000 ; count *= 10 )
+        {
+            std::vector<float> values = make_values( kind, count );
+            run_stats * exact = run_stats_create();
+            run_stats * streaming = run_stats_create_streaming();
+            for ( int i = 0 ; i < count ; i++ )
+            {
+                run_stats_record( exact, values[i] );
+                run_stats_record( streaming, values[i] );
+            }
+
+            for ( int p = 0 ; p < kNumPercentiles ; p++ )
+            {
+                float pct = kPercentiles[p];
+                float want = run_stats_percentile( exact, pct );
+                float got = run_stats_percentile( streaming, pct );
+                bool end = pct == 0.0f || pct == 100.0f;
+                if ( end ? got != want : fabsf( got - want ) > fabsf( want ) * ( 1.0f / 256.0f ) )
+                {
+                    printf( "FAILED: percentiles, kind %d count %d: %g%% is %.9g, exact %.9g\n", kind, count, pct, got, want );
+                    failed++;
+                }
+            }
+
+            run_stats_destroy( exact );
+            run_stats_destroy( streaming );
+        }
+    }
+    return failed;
+}
+
+static bool close( double x, double y, double tol )
+{
+    return fabs( x - y ) <= tol * std::max( std::max( fabs( x ), fabs( y ) ), 1e-30 );
+}
+
+// Record a series in random-sized pieces (some empty) into separate stats,
+// mostly streaming, merge them in a random tree order and compare with
+// recording it all into one, and with mean/variance computed in two passes.
+static int check_merge()
+{
+    int failed = 0;
+    for ( int iter = 0 ; iter < 200 ; iter++ )
+    {
+        int kind = iter % 5;
+        int count = 1 + (int)( next_rand() % 20000 );
+        std::vector<float> values = make_values( kind, count );
+
+        run_stats * whole = run_stats_create_streaming();
+        for ( int i = 0 ; i < count ; i++ )
+            run_stats_record( whole, values[i] );
+
+        std::vector<run_stats *> parts;
+        for ( int begin = 0 ; begin < count ; )
+        {
+            int n = std::min( (int)( next_rand() % ( count / 4 + 2 ) ), count - begin );
+            // every few, an exact one, which merges by recording its values
+            run_stats * part = ( next_rand() % 5 ) ? run_stats_create_streaming() : run_stats_create();
+            for ( int i = begin ; i < begin + n ; i++ )
+                run_stats_record( part, values[i] );
+            parts.push_back( part );
+            begin += n;
+        }
+
+        // the first one is streaming, so everything can merge into it
+        parts.insert( parts.begin(), run_stats_create_streaming() );
+        while ( parts.size() > 1 )
+        {
+            size_t i = next_rand() % ( parts.size() - 1 );
+            // an exact dst can't take a streaming src
+            if ( !parts[i]->streaming )
+                std::swap( parts[i], parts[i + 1] );
+            run_stats_merge( parts[i], parts[i + 1] );
+            run_stats_destroy( parts[i + 1] );
+            parts.erase( parts.begin() + i + 1 );
+        }
+        run_stats * merged = parts[0];
+
+        double mean = 0.0;
+        for ( int i = 0 ; i < count ; i++ )
+            mean += values[i];
+        mean /= count;
+        double m2 = 0.0;
+        for ( int i = 0 ; i < count ; i++ )
+            m2 += ( values[i] - mean ) * ( values[i] - mean );
+
+        bool ok = merged->count == (uint64_t)count && merged->min == whole->min && merged->max == whole->max
+            && close( merged->mean, mean, 1e-9 ) && close( merged->mean, whole->mean, 1e-9 )
+            && close( merged->m2, whole->m2, 1e-7 ) && ( m2 == 0.0 ? merged->m2 < 1e-20 : close( merged->m2, m2, 1e-7 ) );
+        for ( int p = 0 ; p < kNumPercentiles ; p++ )
+            ok = ok && run_stats_percentile( merged, kPercentiles[p] ) == run_stats_percentile( whole, kPercentiles[p] );
+        if ( !ok )
+        {
+            printf( "FAILED: merge, iter %d (kind %d, %d values): count %llu, mean %.12g (one %.12g, exact %.12g), "
+                "m2 %.12g (one %.12g, exact %.12g)\n", iter, kind, count, (unsigned long long)merged->count,
+                merged->mean, whole->mean, mean, merged->m2, whole->m2, m2 );
+            failed++;
+        }
+
+        run_stats_destroy( merged );
+        run_stats_destroy( whole );
+    }
+    return failed;
+}
+
+int main()
+{
+    int failed = check_percentiles() + check_merge();
+
+    printf( failed ? "run_stats_test: %d failed\n" : "run_stats_test: ok\n", failed );
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+// Checks the sRGB8 <-> linear image conversion in util.cpp: every code
+// survives a decode/encode round trip, the encoder stays within 0.6 of a
+// code of the exact curve, and clamping. Build from the repo root, once per
+// path:
+//
+//     g++ -O2 -std=c++11 -msse2 tests/srgb_test.cpp util.cpp parallel.cpp profile.cpp -lpthread
+//     g++ -O2 -std=c++11 -mavx2 -mfma tests/srgb_test.cpp util.cpp parallel.cpp profile.cpp -lpthread
+//     g++ -O2 -std=c++11 -U__SSE2__ -U__SSE__ tests/srgb_test.cpp util.cpp parallel.cpp profile.cpp -lpthread
+
+#include "../util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+static unsigned s_seed = 1;
+
+static unsigned next_rand()
+{
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static double decode_exact( int code )
+{
+    double s = code / 255.0;
+    return s <= 0.04045 ? s / 12.92 : pow( ( s + 0.055 ) / 1.055, 2.4 );
+}
+
+// unrounded code for a linear value in [0,1]
+static double encode_exact( double x )
+{
+    return 255.0 * ( x < 0.0031308 ? x * 12.92 : 1.055 * pow( x, 1.0 / 2.4 ) - 0.055 );
+}
+
+// Encodes count linear values as the color channels of an image that's
+// w pixels wide (w not a multiple of the SIMD width, so the tail loop
+// runs too), with alpha = color. Returns the codes in value order.
+static std::vector<unsigned char> encode_values( std::vector<float> const & values, int w )
+{
+    int num_pixels = (int)( values.size() + 2 ) / 3;
+    int h = ( num_pixels + w - 1 ) / w;
+
+    std::vector<float> src( (size_t)w * h * 4, 0.0f );
+    for ( size_t i = 0 ; i < values.size() ; i++ )
+        src[i / 3 * 4 + i % 3] = values[i];
+    for ( int p = 0 ; p < w * h ; p++ )
+        src[p * 4 + 3] = src[p * 4];
+
+    std::vector<unsigned char> dst( (size_t)w * h * 4 );
+    linear_to_srgb8( &dst[0], w * 4, &src[0], w * 4 * sizeof( float ), w, h );
+
+    std::vector<unsigned char> codes( values.size() );
+    for ( size_t i = 0 ; i < values.size() ; i++ )
+        codes[i] = dst[i / 3 * 4 + i % 3];
+    return codes;
+}
+
+// Decoding every code gives the table value, which is the exact value
+// rounded to float; encoding that gives the code back, on all channels.
+static int check_round_trip()
+{
+    int failed = 0;
+    const int w = 37, h = 7; // every code in every channel, several times over
+
+    std::vector<unsigned char> src( w * h * 4 );
+    for ( int i = 0 ; i < w * h * 4 ; i++ )
+        src[i] = (unsigned char)( i % 4 == 3 ? ( i / 4 ) % 256 : ( i / 4 * 3 + i % 4 ) % 256 );
+
+    std::vector<float> lin( w * h * 4 );
+    srgb8_to_linear( &lin[0], w * 4 * sizeof( float ), &src[0], w * 4, w, h );
+
+    std::vector<unsigned char> back( w * h * 4 );
+    linear_to_srgb8( &back[0], w * 4, &lin[0], w * 4 * sizeof( float ), w, h );
+
+    for ( int i = 0 ; i < w * h * 4 ; i++ )
+    {
+        int code = src[i];
+        float expect = ( i % 4 == 3 ) ? code * ( 1.0f / 255.0f ) : (float)decode_exact( code );
+        if ( ( i % 4 != 3 && kSrgbToLinear[code] != expect ) || lin[i] != expect || back[i] != code )
+        {
+            printf( "FAILED: round trip, code %d channel %d: decoded %.9g (want %.9g), encoded back to %d\n",
+                code, i % 4, lin[i], expect, back[i] );
+            failed++;
+        }
+    }
+    return failed;
+}
+
+// Dense sweeps over [0,1] plus random floats; every result is within 0.6 of
+// a code of the exact curve.
+static int check_encode_error()
+{
+    std::vector<float> values;
+    for ( int i = 0 ; i <= ( 1 << 20 ) ; i++ )
+        values.push_back( i / (float)( 1 << 20 ) );
+    for ( int i = 0 ; i < ( 1 << 20 ) ; i++ ) // dark end, where the linear segment joins the curve
+        values.push_back( i / (float)( 1 << 26 ) );
+    for ( int i = 0 ; i < ( 1 << 20 ) ; i++ )
+    {
+        // random bit patterns in (0,1): uniform over exponents, not values
+        uint32_t bits = ( ( 127 - 1 - next_rand() % 24 ) << 23 ) | ( next_rand() & 0x7fffff );
+        float x;
+        memcpy( &x, &bits, sizeof( x ) );
+        values.push_back( x );
+    }
+
+    std::vector<unsigned char> codes = encode_values( values, 29 );
+
+    double max_err = 0.0;
+    size_t worst = 0;
+    for ( size_t i = 0 ; i < values.size() ; i++ )
+    {
+        double err = fabs( codes[i] - encode_exact( values[i] ) );
+        if ( err > max_err )
+        {
+            max_err = err;
+            worst = i;
+        }
+    }
+
+    printf( "max encode error %.4f codes (at %.9g)\n", max_err, values[worst] );
+    if ( max_err >= 0.6 )
+    {
+        printf( "FAILED: encode error %.4f at %.9g -> %d, exact %.4f\n", max_err, values[worst], codes[worst],
+            encode_exact( values[worst] ) );
+        return 1;
+    }
+    return 0;
+}
+
+// Out of range values clamp, NaNs go to 0, both in the SIMD and the tail
+// loop and in linear_to_srgb8_row.
+static int check_clamp()
+{
+    static const float kInputs[] = { -1.0f, -0.0f, 0.0f, 1.0f, 1.5f, 1e30f, -1e30f, HUGE_VALF, -HUGE_VALF, NAN };
+    static const unsigned char kExpect[] = { 0, 0, 0, 255, 255, 255, 0, 255, 0, 0 };
+    const int n = sizeof( kInputs ) / sizeof( kInputs[0] );
+
+    int failed = 0;
+    for ( int path = 0 ; path < 2 ; path++ )
+    {
+        std::vector<float> src( n * 4 );
+        for ( int i = 0 ; i < n * 4 ; i++ )
+            src[i] = kInputs[i / 4];
+
+        std::vector<unsigned char> dst( n * 4 );
+        if ( path == 0 )
+            linear_to_srgb8( &dst[0], n * 4, &src[0], n * 4 * sizeof( float ), n, 1 );
+        else
+            linear_to_srgb8_row( &dst[0], &src[0], n );
+
+        for ( int i = 0 ; i < n * 4 ; i++ )
+        {
+            if ( dst[i] != kExpect[i / 4] )
+            {
+                printf( "FAILED: clamp (%s), %g channel %d -> %d, want %d\n", path ? "row" : "image",
+                    kInputs[i / 4], i % 4, dst[i], kExpect[i / 4] );
+                failed++;
+            }
+        }
+    }
+    return failed;
+}
+
+int main()
+{
+    int failed = check_round_trip() + check_encode_error() + check_clamp();
+
+    printf( failed ? "srgb_test: %d failed\n" : "srgb_test: ok\n", failed );
+    return failed ? 1 : 0;
+}
@@ -5,10 +5,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
+
+#include <stdint.h>
 
 #include <vector>
 #include <algorithm>
 
+#include "parallel.h"
+
+#if defined(__AVX2__)
+#define UTIL_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UTIL_SSE2 1
+#include <emmintrin.h>
+#endif
+
 void panic(char const * fmt, ...)
 {
     va_list arg;
@@ -106,14 +119,603 @@ void print_pixels( unsigned char const * a, int stride_a, unsigned char const *
     }
 }
 
+float const kSrgbToLinear[256] = {
+    0.0f, 0.000303526991f, 0.000607053982f, 0.000910580973f, 0.00121410796f, 0.00151763496f, 0.00182116195f, 0.00212468882f,
+    0.00242821593f, 0.0027317428f, 0.00303526991f, 0.00334653584f, 0.00367650739f, 0.00402471703f, 0.00439144205f, 0.00477695325f,
+    0.00518151652f, 0.00560539169f, 0.00604883302f, 0.00651209056f, 0.00699541019f, 0.00749903219f, 0.00802319311f, 0.00856812578f,
+    0.00913405884f, 0.00972121768f, 0.010329823f, 0.0109600937f, 0.0116122449f, 0.012286488f, 0.0129830325f, 0.0137020834f,
+    0.0144438436f, 0.0152085144f, 0.0159962941f, 0.0168073755f, 0.0176419541f, 0.01850022f, 0.0193823613f, 0.0202885624f,
+    0.0212190095f, 0.0221738853f, 0.0231533665f, 0.0241576321f, 0.0251868591f, 0.0262412224f, 0.0273208916f, 0.02842604f,
+    0.0295568351f, 0.0307134446f, 0.0318960324f, 0.0331047662f, 0.0343398079f, 0.0356013142f, 0.0368894488f, 0.0382043719f,
+    0.0395462364f, 0.0409151986f, 0.0423114114f, 0.043735031f, 0.045186203f, 0.0466650873f, 0.0481718257f, 0.0497065671f,
+    0.0512694567f, 0.0528606474f, 0.054480277f, 0.0561284907f, 0.0578054301f, 0.0595112368f, 0.0612460524f, 0.0630100146f,
+    0.064803265f, 0.0666259378f, 0.0684781671f, 0.0703600943f, 0.0722718537f, 0.0742135718f, 0.0761853829f, 0.078187421f,
+    0.0802198201f, 0.0822827071f, 0.0843762085f, 0.0865004584f, 0.0886555836f, 0.0908417106f, 0.0930589661f, 0.0953074694f,
+    0.097587347f, 0.0998987257f, 0.102241732f, 0.104616486f, 0.107023105f, 0.10946171f, 0.111932427f, 0.114435375f,
+    0.116970666f, 0.119538426f, 0.122138776f, 0.124771819f, 0.127437681f, 0.130136475f, 0.13286832f, 0.135633335f,
+    0.138431609f, 0.141263291f, 0.144128472f, 0.147027269f, 0.149959788f, 0.152926147f, 0.155926466f, 0.158960834f,
+    0.162029371f, 0.165132195f, 0.168269396f, 0.171441108f, 0.174647406f, 0.177888423f, 0.18116425f, 0.18447499f,
+    0.187820777f, 0.191201687f, 0.194617838f, 0.198069319f, 0.20155625f, 0.205078736f, 0.208636865f, 0.212230757f,
+    0.215860501f, 0.219526201f, 0.223227963f, 0.226965874f, 0.230740055f, 0.23455058f, 0.238397568f, 0.242281124f,
+    0.246201321f, 0.25015828f, 0.254152089f, 0.258182853f, 0.262250662f, 0.266355604f, 0.270497799f, 0.274677306f,
+    0.278894275f, 0.283148736f, 0.287440836f, 0.291770637f, 0.296138257f, 0.300543785f, 0.304987311f, 0.309468925f,
+    0.313988715f, 0.318546772f, 0.323143214f, 0.327778101f, 0.332451522f, 0.337163627f, 0.341914415f, 0.346704066f,
+    0.351532608f, 0.356400132f, 0.361306787f, 0.366252601f, 0.371237695f, 0.376262128f, 0.38132602f, 0.386429429f,
+    0.391572475f, 0.396755219f, 0.401977777f, 0.407240212f, 0.412542611f, 0.417885065f, 0.423267663f, 0.428690493f,
+    0.434153646f, 0.439657182f, 0.445201188f, 0.450785786f, 0.456411034f, 0.462076992f, 0.467783809f, 0.473531485f,
+    0.479320168f, 0.48514995f, 0.491020858f, 0.496932983f, 0.502886474f, 0.50888133f, 0.514917672f, 0.520995557f,
+    0.527115107f, 0.533276379f, 0.539479494f, 0.545724452f, 0.55201143f, 0.558340371f, 0.564711511f, 0.571124852f,
+    0.577580452f, 0.584078431f, 0.590618849f, 0.597201765f, 0.603827357f, 0.610495567f, 0.617206573f, 0.623960376f,
+    0.630757153f, 0.637596846f, 0.644479692f, 0.651405632f, 0.658374846f, 0.665387273f, 0.672443151f, 0.679542482f,
+    0.686685324f, 0.693871737f, 0.701101899f, 0.708375752f, 0.715693474f, 0.723055124f, 0.730460763f, 0.73791039f,
+    0.745404184f, 0.752942204f, 0.760524511f, 0.768151164f, 0.775822222f, 0.783537805f, 0.791297913f, 0.799102724f,
+    0.806952238f, 0.814846575f, 0.822785735f, 0.830769897f, 0.838799f, 0.846873224f, 0.854992628f, 0.863157213f,
+    0.871367097f, 0.8796224f, 0.887923121f, 0.896269381f, 0.904661179f, 0.913098633f, 0.921581864f, 0.930110872f,
+    0.938685715f, 0.947306514f, 0.955973327f, 0.964686275f, 0.973445296f, 0.982250571f, 0.991102099f, 1.0f,
+};
+
+// sRGB encode table, built on first use. (Decode is kSrgbToLinear above:
+// 8-bit input only has 256 codes, so it's one table lookup.)
+//
+// Encode: piecewise linear in the float's bit pattern. Inputs are clamped
+// to [2^-13, 1); the exponent and top kSrgbEncBits mantissa bits pick a
+// segment, the next 8 mantissa bits interpolate within it. Each entry packs
+// bias (top 16 bits, <<9 to use) and slope (low 16 bits) in 16.16 fixed
+// point, with the bias already including the +0.5 for rounding.
+static const int kSrgbEncBits = 5;
+static const int kSrgbEncOctaves = 13;
+static const uint32_t kSrgbEncMin = 0x39000000; // 2^-13
+static const uint32_t kSrgbEncMax = 0x3f7fffff; // largest float below 1
+
+struct srgb_tables
+{
+    uint32_t encode[kSrgbEncOctaves << kSrgbEncBits];
+
+    srgb_tables()
+    {
+        for ( int i = 0 ; i < (kSrgbEncOctaves << kSrgbEncBits) ; i++ )
+        {
+            uint32_t bits0 = kSrgbEncMin + ((uint32_t)i << (23 - kSrgbEncBits));
+            uint32_t bits1 = bits0 + (1u << (23 - kSrgbEncBits));
+            float x0, x1;
+            memcpy( &x0, &bits0, sizeof( x0 ) );
+            memcpy( &x1, &bits1, sizeof( x1 ) );
+
+            // the curve is concave; center the chord between it and the
+            // parallel tangent (minimax line)
+            double s0 = encode_exact( x0 ), s1 = encode_exact( x1 );
+            double max_dev = 0.0;
+            for ( int t = 1 ; t < 256 ; t++ )
+            {
+                double dev = encode_exact( x0 + (x1 - x0) * (t / 256.0) ) - (s0 + (s1 - s0) * (t / 256.0));
+                max_dev = std::max( max_dev, dev );
+            }
+
+            uint32_t bias = (uint32_t)((s0 + 0.5 + max_dev * 0.5) * 65536.0 + 0.5) >> 9;
+            uint32_t scale = (uint32_t)((s1 - s0) * 256.0 + 0.5);
+            encode[i] = (bias << 16) | scale;
+        }
+    }
+
+    // linear in [0,1] -> sRGB in [0,255], unrounded
+    static double encode_exact( double x )
+    {
+        return 255.0 * (x < 0.0031308 ? x * 12.92 : 1.055 * pow( x, 1.0 / 2.4 ) - 0.055);
+    }
+};
+
+static srgb_tables const & get_srgb_tables()
+{
+    static srgb_tables tables;
+    return tables;
+}
+
+static inline unsigned char encode_srgb8( srgb_tables const & tab, float x )
+{
+    // written so NaNs end up at the low end
+    if ( !(x > 0.0f) )
+        x = 0.0f;
+
+    uint32_t bits;
+    memcpy( &bits, &x, sizeof( bits ) );
+    bits = std::min( std::max( bits, kSrgbEncMin ), kSrgbEncMax );
+
+    uint32_t entry = tab.encode[(bits - kSrgbEncMin) >> (23 - kSrgbEncBits)];
+    uint32_t t = (bits >> (15 - kSrgbEncBits)) & 0xff;
+    return (unsigned char)((((entry >> 16) << 9) + (entry & 0xffff) * t) >> 16);
+}
+
+static inline unsigned char encode_unorm8( float x )
+{
+    x = (x > 0.0f) ? std::min( x, 1.0f ) : 0.0f;
+    return (unsigned char)(x * 255.0f + 0.5f);
+}
+
+static void decode_row( float * dst, unsigned char const * src, int w )
+{
+    int x = 0;
+
+#if defined(UTIL_AVX2)
+    // two pixels at a time: gather RGB from the table, scale A
+    __m256i lane_is_alpha = _mm256_setr_epi32( 0, 0, 0, -1, 0, 0, 0, -1 );
+    __m256 alpha_scale = _mm256_set1_ps( 1.0f / 255.0f );
+    for ( ; x + 2 <= w ; x += 2 )
+    {
+        __m256i codes = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (__m128i const *)(src + x * 4) ) );
+        __m256 color = _mm256_i32gather_ps( kSrgbToLinear, codes, 4 );
+        __m256 alpha = _mm256_mul_ps( _mm256_cvtepi32_ps( codes ), alpha_scale );
+        _mm256_storeu_ps( dst + x * 4, _mm256_blendv_ps( color, alpha, _mm256_castsi256_ps( lane_is_alpha ) ) );
+    }
+#endif
+
+    for ( ; x < w ; x++ )
+    {
+        unsigned char const * s = src + x * 4;
+        float * d = dst + x * 4;
+        d[0] = kSrgbToLinear[s[0]];
+        d[1] = kSrgbToLinear[s[1]];
+        d[2] = kSrgbToLinear[s[2]];
+        d[3] = s[3] * (1.0f / 255.0f);
+    }
+}
+
+static void encode_row( srgb_tables const & tab, unsigned char * dst, float const * src, int w )
+{
+    int x = 0;
+
+#if defined(UTIL_AVX2) || defined(UTIL_SSE2)
+    // one pixel per 4 lanes; the alpha lane goes through the same math with
+    // its own clamp range, index and slope
+#if defined(UTIL_AVX2)
+    const int kLanes = 8;
+#else
+    const int kLanes = 4;
+#endif
+
+    for ( ; x + kLanes / 4 <= w ; x += kLanes / 4 )
+    {
+#if defined(UTIL_AVX2)
+        __m256 v = _mm256_loadu_ps( src + x * 4 );
+        __m256 alpha_mask = _mm256_castsi256_ps( _mm256_setr_epi32( 0, 0, 0, -1, 0, 0, 0, -1 ) );
+        __m256 one_below = _mm256_castsi256_ps( _mm256_set1_epi32( kSrgbEncMax ) );
+
+        // color: clamp to [2^-13, 1) in the float domain (max first so NaNs go low)
+        __m256 c = _mm256_max_ps( v, _mm256_castsi256_ps( _mm256_set1_epi32( kSrgbEncMin ) ) );
+        c = _mm256_min_ps( c, one_below );
+        __m256i bits = _mm256_castps_si256( c );
+        __m256i index = _mm256_srli_epi32( _mm256_sub_epi32( bits, _mm256_set1_epi32( kSrgbEncMin ) ), 23 - kSrgbEncBits );
+        __m256i entry = _mm256_i32gather_epi32( (int const *)tab.encode, index, 4 );
+        __m256i t = _mm256_and_si256( _mm256_srli_epi32( bits, 15 - kSrgbEncBits ), _mm256_set1_epi32( 0xff ) );
+        __m256i bias = _mm256_slli_epi32( _mm256_srli_epi32( entry, 16 ), 9 );
+        __m256i scale = _mm256_and_si256( entry, _mm256_set1_epi32( 0xffff ) );
+        __m256i color = _mm256_srli_epi32( _mm256_add_epi32( bias, _mm256_madd_epi16( scale, t ) ), 16 );
+
+        // alpha: clamp to [0,1], round
+        __m256 a = _mm256_min_ps( _mm256_max_ps( v, _mm256_setzero_ps() ), _mm256_set1_ps( 1.0f ) );
+        __m256i alpha = _mm256_cvttps_epi32( _mm256_add_ps( _mm256_mul_ps( a, _mm256_set1_ps( 255.0f ) ), _mm256_set1_ps( 0.5f ) ) );
+
+        __m256i res = _mm256_castps_si256( _mm256_blendv_ps( _mm256_castsi256_ps( color ), _mm256_castsi256_ps( alpha ), alpha_mask ) );
+        // 8x u32 -> 8x u8 (values are all in [0,255])
+        __m128i packed = _mm_packs_epi32( _mm256_castsi256_si128( res ), _mm256_extracti128_si256( res, 1 ) );
+        packed = _mm_packus_epi16( packed, packed );
+        _mm_storel_epi64( (__m128i *)(dst + x * 4), packed );
+#else
+        __m128 v = _mm_loadu_ps( src + x * 4 );
+
+        __m128 c = _mm_max_ps( v, _mm_castsi128_ps( _mm_set1_epi32( kSrgbEncMin ) ) );
+        c = _mm_min_ps( c, _mm_castsi128_ps( _mm_set1_epi32( kSrgbEncMax ) ) );
+        __m128i bits = _mm_castps_si128( c );
+        __m128i index = _mm_srli_epi32( _mm_sub_epi32( bits, _mm_set1_epi32( kSrgbEncMin ) ), 23 - kSrgbEncBits );
+
+        // no gather in SSE2
+        uint32_t idx[4];
+        _mm_storeu_si128( (__m128i *)idx, index );
+        __m128i entry = _mm_setr_epi32( (int)tab.encode[idx[0]], (int)tab.encode[idx[1]], (int)tab.encode[idx[2]], 0 );
+
+        __m128i t = _mm_and_si128( _mm_srli_epi32( bits, 15 - kSrgbEncBits ), _mm_set1_epi32( 0xff ) );
+        __m128i bias = _mm_slli_epi32( _mm_srli_epi32( entry, 16 ), 9 );
+        __m128i scale = _mm_and_si128( entry, _mm_set1_epi32( 0xffff ) );
+        __m128i color = _mm_srli_epi32( _mm_add_epi32( bias, _mm_madd_epi16( scale, t ) ), 16 );
+
+        __m128 a = _mm_min_ps( _mm_max_ps( v, _mm_setzero_ps() ), _mm_set1_ps( 1.0f ) );
+        __m128i alpha = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( a, _mm_set1_ps( 255.0f ) ), _mm_set1_ps( 0.5f ) ) );
+
+        // color in lanes 0-2, alpha in lane 3
+        __m128i alpha_mask = _mm_setr_epi32( 0, 0, 0, -1 );
+        __m128i res = _mm_or_si128( _mm_andnot_si128( alpha_mask, color ), _mm_and_si128( alpha_mask, alpha ) );
+        res = _mm_packs_epi32( res, res );
+        res = _mm_packus_epi16( res, res );
+        int out = _mm_cvtsi128_si32( res );
+        memcpy( dst + x * 4, &out, 4 );
+#endif
+    }
+#endif
+
+    for ( ; x < w ; x++ )
+    {
+        float const * s = src + x * 4;
+        unsigned char * d = dst + x * 4;
+        d[0] = encode_srgb8( tab, s[0] );
+        d[1] = encode_srgb8( tab, s[1] );
+        d[2] = encode_srgb8( tab, s[2] );
+        d[3] = encode_unorm8( s[3] );
+    }
+}
+
+// enough rows per task to be worth a thread handoff
+static int rows_per_task( int w )
+{
+    return std::max( 1, 16384 / std::max( w, 1 ) );
+}
+
+void srgb8_to_linear( float * dst, int stride_dst, unsigned char const * src, int stride_src, int w, int h )
+{
+    parallel_for( h, rows_per_task( w ), [&]( int begin, int end ) {
+        for ( int y = begin ; y < end ; y++ )
+            decode_row( (float *)((char *)dst + (size_t)y * stride_dst), src + (size_t)y * stride_src, w );
+    } );
+}
+
+void linear_to_srgb8( unsigned char * dst, int stride_dst, float const * src, int stride_src, int w, int h )
+{
+    srgb_tables const & tab = get_srgb_tables();
+    parallel_for( h, rows_per_task( w ), [&]( int begin, int end ) {
+        for ( int y = begin ; y < end ; y++ )
+            encode_row( tab, dst + (size_t)y * stride_dst, (float const *)((char const *)src + (size_t)y * stride_src), w );
+    } );
+}
+
+void linear_to_srgb8_row( unsigned char * dst, float const * src, int w )
+{
+    encode_row( get_srgb_tables(), dst, src, w );
+}
+
+// Per row range results of pixel_compare_tol, merged in row order.
+struct compare_accum
+{
+    uint64_t sq_err[4];
+    int max_diff[4];
+    int num_over;
+    int first_x, first_y;
+    int worst_x, worst_y, worst;
+};
+
+#if defined(UTIL_AVX2) || defined(UTIL_SSE2)
+static int popcount8( int x )
+{
+    x = x - ((x >> 1) & 0x55);
+    x = (x & 0x33) + ((x >> 2) & 0x33);
+    return (x + (x >> 4)) & 0x0f;
+}
+
+static int lowest_bit( int x )
+{
+    int i = 0;
+    while ( !(x & (1 << i)) )
+        i++;
+    return i;
+}
+#endif
+
+static void compare_row( compare_accum * acc, unsigned char const * a, unsigned char const * b, unsigned char * diff, int w, int y, int tolerance )
+{
+    uint32_t sq_err[4] = { 0, 0, 0, 0 }; // can't overflow within a row for w < 66051
+    int max_diff[4] = { 0, 0, 0, 0 };
+    int x = 0;
+
+#if defined(UTIL_AVX2) || defined(UTIL_SSE2)
+    // kLanes / 4 pixels at a time: |a - b| per byte, then squared and
+    // summed per channel (the channel is the lane mod 4)
+#if defined(UTIL_AVX2)
+    const int kLanes = 32;
+    __m256i vtol = _mm256_set1_epi8( (char)tolerance );
+    __m256i vmax = _mm256_setzero_si256();
+    __m256i vsq = _mm256_setzero_si256();
+    __m256i alpha = _mm256_set1_epi32( (int)0xff000000 );
+#else
+    const int kLanes = 16;
+    __m128i vtol = _mm_set1_epi8( (char)tolerance );
+    __m128i vmax = _mm_setzero_si128();
+    __m128i vsq = _mm_setzero_si128();
+    __m128i alpha = _mm_set1_epi32( (int)0xff000000 );
+#endif
+
+    for ( ; x + kLanes / 4 <= w ; x += kLanes / 4 )
+    {
+#if defined(UTIL_AVX2)
+        __m256i va = _mm256_loadu_si256( (__m256i const *)(a + x * 4) );
+        __m256i vb = _mm256_loadu_si256( (__m256i const *)(b + x * 4) );
+        __m256i d = _mm256_or_si256( _mm256_subs_epu8( va, vb ), _mm256_subs_epu8( vb, va ) );
+        vmax = _mm256_max_epu8( vmax, d );
+
+        __m256i zero = _mm256_setzero_si256();
+        __m256i d_lo = _mm256_unpacklo_epi8( d, zero ), d_hi = _mm256_unpackhi_epi8( d, zero );
+        __m256i sq_lo = _mm256_mullo_epi16( d_lo, d_lo ), sq_hi = _mm256_mullo_epi16( d_hi, d_hi );
+        vsq = _mm256_add_epi32( vsq, _mm256_add_epi32( _mm256_unpacklo_epi16( sq_lo, zero ), _mm256_unpackhi_epi16( sq_lo, zero ) ) );
+        vsq = _mm256_add_epi32( vsq, _mm256_add_epi32( _mm256_unpacklo_epi16( sq_hi, zero ), _mm256_unpackhi_epi16( sq_hi, zero ) ) );
+
+        // pixels with no channel over tolerance have all-zero excess
+        __m256i within = _mm256_cmpeq_epi32( _mm256_subs_epu8( d, vtol ), zero );
+        int over = ~_mm256_movemask_ps( _mm256_castsi256_ps( within ) ) & 0xff;
+
+        if ( diff )
+            _mm256_storeu_si256( (__m256i *)(diff + x * 4), _mm256_or_si256( d, alpha ) );
+#else
+        __m128i va = _mm_loadu_si128( (__m128i const *)(a + x * 4) );
+        __m128i vb = _mm_loadu_si128( (__m128i const *)(b + x * 4) );
+        __m128i d = _mm_or_si128( _mm_subs_epu8( va, vb ), _mm_subs_epu8( vb, va ) );
+        vmax = _mm_max_epu8( vmax, d );
+
+        __m128i zero = _mm_setzero_si128();
+        __m128i d_lo = _mm_unpacklo_epi8( d, zero ), d_hi = _mm_unpackhi_epi8( d, zero );
+        __m128i sq_lo = _mm_mullo_epi16( d_lo, d_lo ), sq_hi = _mm_mullo_epi16( d_hi, d_hi );
+        vsq = _mm_add_epi32( vsq, _mm_add_epi32( _mm_unpacklo_epi16( sq_lo, zero ), _mm_unpackhi_epi16( sq_lo, zero ) ) );
+        vsq = _mm_add_epi32( vsq, _mm_add_epi32( _mm_unpacklo_epi16( sq_hi, zero ), _mm_unpackhi_epi16( sq_hi, zero ) ) );
+
+        // pixels with no channel over tolerance have all-zero excess
+        __m128i within = _mm_cmpeq_epi32( _mm_subs_epu8( d, vtol ), zero );
+        int over = ~_mm_movemask_ps( _mm_castsi128_ps( within ) ) & 0xf;
+
+        if ( diff )
+            _mm_storeu_si128( (__m128i *)(diff + x * 4), _mm_or_si128( d, alpha ) );
+#endif
+
+        if ( over )
+        {
+            if ( acc->first_y < 0 )
+            {
+                acc->first_x = x + lowest_bit( over );
+                acc->first_y = y;
+            }
+            acc->num_over += popcount8( over );
+        }
+    }
+
+    unsigned char lanes[kLanes];
+    uint32_t sq_lanes[4];
+#if defined(UTIL_AVX2)
+    _mm256_storeu_si256( (__m256i *)lanes, vmax );
+    _mm_storeu_si128( (__m128i *)sq_lanes, _mm_add_epi32( _mm256_castsi256_si128( vsq ), _mm256_extracti128_si256( vsq, 1 ) ) );
+#else
+    _mm_storeu_si128( (__m128i *)lanes, vmax );
+    _mm_storeu_si128( (__m128i *)sq_lanes, vsq );
+#endif
+    for ( int i = 0 ; i < kLanes ; i++ )
+        max_diff[i & 3] = std::max( max_diff[i & 3], (int)lanes[i] );
+    for ( int c = 0 ; c < 4 ; c++ )
+        sq_err[c] = sq_lanes[c];
+#endif
+
+    for ( ; x < w ; x++ )
+    {
+        bool over = false;
+        for ( int c = 0 ; c < 4 ; c++ )
+        {
+            int d = abs( a[x * 4 + c] - b[x * 4 + c] );
+            max_diff[c] = std::max( max_diff[c], d );
+            sq_err[c] += d * d;
+            over |= d > tolerance;
+            if ( diff )
+                diff[x * 4 + c] = (unsigned char)((c == 3) ? 255 : d);
+        }
+
+        if ( over )
+        {
+            if ( acc->first_y < 0 )
+            {
+                acc->first_x = x;
+                acc->first_y = y;
+            }
+            acc->num_over++;
+        }
+    }
+
+    int row_worst = 0;
+    for ( int c = 0 ; c < 4 ; c++ )
+    {
+        acc->sq_err[c] += sq_err[c];
+        acc->max_diff[c] = std::max( acc->max_diff[c], max_diff[c] );
+        row_worst = std::max( row_worst, max_diff[c] );
+    }
+
+    // rare (the worst difference only goes up), so just find it again
+    if ( row_worst > acc->worst )
+    {
+        int wx = 0;
+        while ( abs( a[wx * 4 + 0] - b[wx * 4 + 0] ) < row_worst && abs( a[wx * 4 + 1] - b[wx * 4 + 1] ) < row_worst
+            && abs( a[wx * 4 + 2] - b[wx * 4 + 2] ) < row_worst && abs( a[wx * 4 + 3] - b[wx * 4 + 3] ) < row_worst )
+            wx++;
+
+        acc->worst = row_worst;
+        acc->worst_x = wx;
+        acc->worst_y = y;
+    }
+}
+
+int pixel_compare_tol( unsigned char const * a, int stride_a, unsigned char const * b, int stride_b, int w, int h, int tolerance,
+    pixel_compare_stats * stats, unsigned char * diff, int stride_diff )
+{
+    tolerance = std::min( std::max( tolerance, 0 ), 255 );
+
+    int rows_per_range = rows_per_task( w );
+    int num_ranges = ( h + rows_per_range - 1 ) / rows_per_range;
+    std::vector<compare_accum> accums( num_ranges );
+
+    parallel_for( num_ranges, 1, [&]( int begin, int end ) {
+        for ( int r = begin ; r < end ; r++ )
+        {
+            compare_accum * acc = &accums[r];
+            memset( acc, 0, sizeof( *acc ) );
+            acc->first_x = acc->first_y = -1;
+            acc->worst_x = acc->worst_y = -1;
+
+            for ( int y = r * rows_per_range ; y < std::min( ( r + 1 ) * rows_per_range, h ) ; y++ )
+            {
+                unsigned char * diff_row = diff ? diff + (size_t)y * stride_diff : NULL;
+                compare_row( acc, a + (size_t)y * stride_a, b + (size_t)y * stride_b, diff_row, w, y, tolerance );
+            }
+        }
+    } );
+
+    // ranges are in row order, so the first first/worst wins
+    compare_accum total;
+    memset( &total, 0, sizeof( total ) );
+    total.first_x = total.first_y = -1;
+    total.worst_x = total.worst_y = -1;
+    for ( int r = 0 ; r < num_ranges ; r++ )
+    {
+        compare_accum const & acc = accums[r];
+        for ( int c = 0 ; c < 4 ; c++ )
+        {
+            total.sq_err[c] += acc.sq_err[c];
+            total.max_diff[c] = std::max( total.max_diff[c], acc.max_diff[c] );
+        }
+        total.num_over += acc.num_over;
+        if ( total.first_y < 0 && acc.first_y >= 0 )
+        {
+            total.first_x = acc.first_x;
+            total.first_y = acc.first_y;
+        }
+        if ( acc.worst > total.worst )
+        {
+            total.worst = acc.worst;
+            total.worst_x = acc.worst_x;
+            total.worst_y = acc.worst_y;
+        }
+    }
+
+    if ( stats )
+    {
+        double num_pixels = std::max( (double)w * h, 1.0 );
+        double sq_err = 0.0;
+        for ( int c = 0 ; c < 4 ; c++ )
+        {
+            stats->max_diff[c] = total.max_diff[c];
+            stats->mse[c] = total.sq_err[c] / num_pixels;
+            sq_err += (double)total.sq_err[c];
+        }
+        stats->num_over = total.num_over;
+        stats->first_x = total.first_x;
+        stats->first_y = total.first_y;
+        stats->worst_x = total.worst_x;
+        stats->worst_y = total.worst_y;
+
+        double mse = sq_err / (4.0 * num_pixels);
+        stats->psnr = ( mse > 0.0 ) ? 10.0 * log10( 255.0 * 255.0 / mse ) : HUGE_VAL;
+    }
+
+    return total.num_over;
+}
+
+// Streaming mode histogram: buckets are the top kStatsMantBits mantissa bits
+// and the exponent of |value|, for magnitudes in [2^kStatsMinExp, 2^kStatsMaxExp)
+// (clamped), mirrored for negative values. Index 0 is the most negative
+// bucket. Only the range of buckets actually used is stored.
+static const int kStatsMantBits = 7; // bucket midpoints are within 2^-8 of any value in them
+static const int kStatsMinExp = -32;
+static const int kStatsMaxExp = 32;
+static const int kStatsHalfBuckets = ( kStatsMaxExp - kStatsMinExp ) << kStatsMantBits;
+static const int kStatsMaxPercentiles = 16;
+
 struct run_stats
 {
-    std::vector<float> values;
+    bool streaming;
+    std::vector<float> values; // exact mode
+
+    // streaming mode
+    uint64_t count;
+    double mean, m2; // Welford
+    float min, max;
+    int first_bucket;
+    std::vector<uint64_t> buckets; // [first_bucket, first_bucket + size)
+
+    int num_percentiles;
+    float percentiles[kStatsMaxPercentiles];
 };
 
+static uint32_t float_bits( float f )
+{
+    uint32_t u;
+    memcpy( &u, &f, 4 );
+    return u;
+}
+
+static float bits_float( uint32_t u )
+{
+    float f;
+    memcpy( &f, &u, 4 );
+    return f;
+}
+
+static int stats_bucket( float value )
+{
+    const int shift = 23 - kStatsMantBits;
+    int base = (int)( ( 127 + kStatsMinExp ) << kStatsMantBits );
+    int mag = (int)( ( float_bits( value ) & 0x7fffffffu ) >> shift ) - base;
+    mag = std::min( std::max( mag, 0 ), kStatsHalfBuckets - 1 );
+    return ( value < 0.0f ) ? kStatsHalfBuckets - 1 - mag : kStatsHalfBuckets + mag;
+}
+
+// middle of a bucket's value range
+static float stats_bucket_value( int bucket )
+{
+    const int shift = 23 - kStatsMantBits;
+    uint32_t base = (uint32_t)( 127 + kStatsMinExp ) << kStatsMantBits;
+    bool negative = bucket < kStatsHalfBuckets;
+    uint32_t mag = (uint32_t)( negative ? kStatsHalfBuckets - 1 - bucket : bucket - kStatsHalfBuckets );
+    float lo = bits_float( ( base + mag ) << shift );
+    float hi = bits_float( ( base + mag + 1 ) << shift );
+    float mid = lo + 0.5f * ( hi - lo );
+    return negative ? -mid : mid;
+}
+
+static void stats_add_to_bucket( run_stats * stats, int bucket, uint64_t count )
+{
+    if ( stats->buckets.empty() )
+        stats->first_bucket = bucket;
+
+    // grow the stored range to cover bucket (at most 2*kStatsHalfBuckets over a lifetime)
+    if ( bucket < stats->first_bucket )
+    {
+        stats->buckets.insert( stats->buckets.begin(), stats->first_bucket - bucket, 0 );
+        stats->first_bucket = bucket;
+    }
+    else if ( bucket >= stats->first_bucket + (int)stats->buckets.size() )
+        stats->buckets.resize( bucket - stats->first_bucket + 1, 0 );
+
+    stats->buckets[bucket - stats->first_bucket] += count;
+}
+
+static void stats_record_streaming( run_stats * stats, float val )
+{
+    stats->count++;
+    double delta = val - stats->mean;
+    stats->mean += delta / (double)stats->count;
+    stats->m2 += delta * ( val - stats->mean );
+    stats->min = std::min( stats->min, val );
+    stats->max = std::max( stats->max, val );
+    stats_add_to_bucket( stats, stats_bucket( val ), 1 );
+}
+
+static run_stats * stats_create( bool streaming )
+{
+    static const float kDefaultPercentiles[] = { 0.0f, 25.0f, 50.0f, 75.0f, 100.0f };
+
+    run_stats * stats = new run_stats;
+    stats->streaming = streaming;
+    run_stats_clear( stats );
+    run_stats_set_percentiles( stats, kDefaultPercentiles, 5 );
+    return stats;
+}
+
 run_stats * run_stats_create( )
 {
-    return new run_stats;
+    return stats_create( false );
+}
+
+run_stats * run_stats_create_streaming( )
+{
+    return stats_create( true );
 }
 
 void run_stats_destroy( run_stats * stats )
@@ -124,42 +726,146 @@ void run_stats_destroy( run_stats * stats )
 void run_stats_clear( run_stats * stats )
 {
     stats->values.clear();
+    stats->count = 0;
+    stats->mean = 0.0;
+    stats->m2 = 0.0;
+    stats->min = FLT_MAX;
+    stats->max = -FLT_MAX;
+    stats->first_bucket = 0;
+    stats->buckets.clear();
 }
 
 void run_stats_record( run_stats * stats, float val )
 {
-    stats->values.push_back( val );
+    if ( stats->streaming )
+        stats_record_streaming( stats, val );
+    else
+        stats->values.push_back( val );
+}
+
+void run_stats_merge( run_stats * dst, run_stats const * src )
+{
+    if ( !src->streaming )
+    {
+        if ( dst->streaming )
+        {
+            for ( size_t i = 0 ; i < src->values.size() ; i++ )
+                stats_record_streaming( dst, src->values[i] );
+        }
+        else
+            dst->values.insert( dst->values.end(), src->values.begin(), src->values.end() );
+        return;
+    }
+
+    if ( !dst->streaming )
+        panic( "run_stats_merge: can't merge streaming stats into exact ones\n" );
+    if ( !src->count )
+        return;
+
+    // Chan et al.'s pairwise update
+    double n = (double)( dst->count + src->count );
+    double delta = src->mean - dst->mean;
+    dst->m2 += src->m2 + delta * delta * (double)dst->count * (double)src->count / n;
+    dst->mean += delta * (double)src->count / n;
+    dst->count += src->count;
+    dst->min = std::min( dst->min, src->min );
+    dst->max = std::max( dst->max, src->max );
+    for ( size_t i = 0 ; i < src->buckets.size() ; i++ )
+    {
+        if ( src->buckets[i] )
+            stats_add_to_bucket( dst, src->first_bucket + (int)i, src->buckets[i] );
+    }
+}
+
+void run_stats_set_percentiles( run_stats * stats, float const * pcts, int count )
+{
+    stats->num_percentiles = std::min( std::max( count, 0 ), kStatsMaxPercentiles );
+    for ( int i = 0 ; i < stats->num_percentiles ; i++ )
+        stats->percentiles[i] = std::min( std::max( pcts[i], 0.0f ), 100.0f );
+}
+
+static uint64_t stats_count( run_stats const * stats )
+{
+    return stats->streaming ? stats->count : stats->values.size();
+}
+
+// rank of a percentile in count sorted values
+static uint64_t stats_rank( uint64_t count, float pct )
+{
+    return std::min( (uint64_t)( pct / 100.0 * (double)( count - 1 ) ), count - 1 );
+}
+
+// Exact mode needs values sorted.
+static float stats_percentile( run_stats const * stats, float pct )
+{
+    uint64_t count = stats_count( stats );
+    uint64_t rank = stats_rank( count, pct );
+    if ( !stats->streaming )
+        return stats->values[(size_t)rank];
+
+    // the ends are known exactly
+    if ( rank == 0 )
+        return stats->min;
+    if ( rank == count - 1 )
+        return stats->max;
+
+    uint64_t seen = 0;
+    for ( size_t i = 0 ; i < stats->buckets.size() ; i++ )
+    {
+        seen += stats->buckets[i];
+        if ( seen > rank )
+            return std::min( std::max( stats_bucket_value( stats->first_bucket + (int)i ), stats->min ), stats->max );
+    }
+    return stats->max;
+}
+
+float run_stats_percentile( run_stats * stats, float pct )
+{
+    if ( !stats_count( stats ) )
+        return 0.0f;
+
+    pct = std::min( std::max( pct, 0.0f ), 100.0f );
+    if ( !stats->streaming )
+        std::sort( stats->values.begin(), stats->values.end() );
+    return stats_percentile( stats, pct );
 }
 
 void run_stats_report( run_stats * stats, char const * desc )
 {
-    size_t count = stats->values.size();
+    uint64_t count = stats_count( stats );
     if (count < 2)
         return;
 
-    // Print min/max and different percentiles
-    std::sort(stats->values.begin(), stats->values.end());
-
-    // desc, min,25th,med,75th,max, mean,sdev
-    char buffer[512];
-    char *p = buffer;
+    double mean, sdev;
+    if ( stats->streaming )
+    {
+        mean = stats->mean;
+        sdev = sqrt( stats->m2 / ( count - 1.0 ) );
+    }
+    else
+    {
+        std::sort(stats->values.begin(), stats->values.end());
 
-    p += sprintf(p, "%s, ", desc );
+        // Mean and standard deviation
+        mean = 0.0;
+        for (std::vector<float>::const_iterator it = stats->values.begin(); it != stats->values.end(); ++it)
+            mean += *it;
+        mean /= count;
 
-    for (int i=0; i < 5; i++)
-        p += sprintf(p, "%.3f,", stats->values[i * (count - 1) / 4]);
+        double varsum = 0.0;
+        for (std::vector<float>::const_iterator it = stats->values.begin(); it != stats->values.end(); ++it)
+            varsum += (*it - mean) * (*it - mean);
+        sdev = sqrt(varsum / (count - 1.0));
+    }
 
-    // Mean and standard deviation
-    double mean = 0.0;
-    for (std::vector<float>::const_iterator it = stats->values.begin(); it != stats->values.end(); ++it)
-        mean += *it;
-    mean /= count;
+    // desc, percentiles (default min,25th,med,75th,max), mean,sdev
+    char buffer[1024];
+    size_t len = snprintf( buffer, sizeof( buffer ), "%s, ", desc );
 
-    double varsum = 0.0;
-    for (std::vector<float>::const_iterator it = stats->values.begin(); it != stats->values.end(); ++it)
-        varsum += (*it - mean) * (*it - mean);
-    double sdev = sqrt(varsum / (count - 1.0));
+    for (int i=0; i < stats->num_percentiles && len < sizeof( buffer ); i++)
+        len += snprintf( buffer + len, sizeof( buffer ) - len, "%.3f,", stats_percentile( stats, stats->percentiles[i] ) );
 
-    p += sprintf(p, " %.3f,%.3f\n", mean, sdev );
+    if ( len < sizeof( buffer ) )
+        snprintf( buffer + len, sizeof( buffer ) - len, " %.3f,%.3f\n", mean, sdev );
     printf( "%s", buffer );
 }
@@ -19,16 +19,57 @@ int pixel_compare_pos( unsigned char const * a, int stride_a, unsigned char cons
 int pixel_compare( unsigned char const * a, int stride_a, unsigned char const * b, int stride_b, int w, int h );
 void print_pixels( unsigned char const * a, int stride_a, unsigned char const * b, int stride_b, int w, int h );
 
+// Tolerant compare of two RGBA8 images, threaded over rows; w is in pixels,
+// strides in bytes. A pixel is over tolerance if any channel differs by more
+// than tolerance (0 = exact match). Returns the number of pixels over.
+// stats may be NULL; diff, if not NULL, gets |a - b| per channel with
+// alpha set to 255, so it can be looked at.
+typedef struct pixel_compare_stats
+{
+    int max_diff[4];            // per channel
+    int num_over;               // pixels over tolerance
+    int first_x, first_y;       // first pixel over tolerance in row order, -1 if none
+    int worst_x, worst_y;       // first pixel with a max_diff channel difference, -1 if identical
+    double mse[4];              // mean squared error per channel
+    double psnr;                // dB, over all channels; HUGE_VAL if identical
+} pixel_compare_stats;
+
+int pixel_compare_tol( unsigned char const * a, int stride_a, unsigned char const * b, int stride_b, int w, int h, int tolerance,
+    pixel_compare_stats * stats, unsigned char * diff, int stride_diff );
+
+// sRGB <-> linear conversion of whole images, threaded over rows.
+// sRGB images are RGBA8, linear ones 4 floats per pixel; strides are in
+// bytes. Alpha is linear in both (just scaled by 255).
+// The encoder clamps to [0,1] (NaNs become 0), is within 0.6 of a code of
+// the exact result and maps the decoded value of every code back to it.
+void srgb8_to_linear( float * dst, int stride_dst, unsigned char const * src, int stride_src, int w, int h );
+void linear_to_srgb8( unsigned char * dst, int stride_dst, float const * src, int stride_src, int w, int h );
+void linear_to_srgb8_row( unsigned char * dst, float const * src, int w ); // same, one row on the calling thread (e.g. a few colors)
+
+// Summary statistics of a series of measurements. Exact stats keep every
+// value and sort them for percentiles. Streaming stats take constant memory:
+// Welford mean/variance, exact min/max and a log-bucketed histogram, so
+// percentiles are within 0.4% (relative) of the value at that rank.
+// Instances aren't thread safe; record into one per thread, then merge.
 typedef struct run_stats run_stats;
 
 run_stats * run_stats_create( void );
+run_stats * run_stats_create_streaming( void );
 void run_stats_destroy( run_stats * stats );
 void run_stats_clear( run_stats * stats ); // reset all measurements
 void run_stats_record( run_stats * stats, float value ); // record a measurement
-void run_stats_report( run_stats * stats, char const * desc ); // print a report
+void run_stats_merge( run_stats * dst, run_stats const * src ); // add src's measurements; streaming src needs streaming dst
+void run_stats_set_percentiles( run_stats * stats, float const * pcts, int count ); // 0..100, at most 16; default 0,25,50,75,100
+float run_stats_percentile( run_stats * stats, float pct );
+void run_stats_report( run_stats * stats, char const * desc ); // print a report: desc, percentiles, mean,sdev
 
 #ifdef __cplusplus
 }
+
+// sRGB8 -> linear, the exact values rounded to float; srgb8_to_linear
+// uses these too.
+extern float const kSrgbToLinear[256];
+
 #endif
 
 #endif